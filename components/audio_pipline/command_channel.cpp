@@ -0,0 +1,96 @@
+/*  SPSC command ring between the RFID side and the player, see command_channel.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "command_channel.hpp"
+
+bool CommandChannel::push(const PlayerCommand& command){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= CAPACITY){
+        full.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    ring[t % CAPACITY] = command;
+    tail.store(t + 1, std::memory_order_release);
+    pushed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool CommandChannel::wake(){
+    return !woken.exchange(true, std::memory_order_acq_rel);
+}
+
+size_t CommandChannel::take(std::array<PlayerCommand, CAPACITY>& out){
+    // Cleared before reading, a push that misses this round wakes us again.
+    // A read-modify-write, a plain store could move after the load of tail.
+    woken.exchange(false, std::memory_order_acq_rel);
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t count = 0;
+    for (; h != t; h++){
+        out[count++] = ring[h % CAPACITY];
+    }
+    head.store(h, std::memory_order_release);
+    size_t kept = coalesce(out.data(), count);
+    coalesced.fetch_add(count - kept, std::memory_order_relaxed);
+    dispatched.fetch_add(kept, std::memory_order_relaxed);
+    return kept;
+}
+
+size_t CommandChannel::coalesce(PlayerCommand* commands, size_t count){
+    size_t first = 0;
+    int last_pause = -1;
+    int last_seek = -1;
+    for (size_t i = 0; i < count; i++){
+        switch (commands[i].type){
+            case PlayerCommand::START:
+            case PlayerCommand::STOP:
+                first = i;
+                last_pause = -1;
+                last_seek = -1;
+                break;
+            case PlayerCommand::PAUSE:
+            case PlayerCommand::RESUME:
+                last_pause = i;
+                break;
+            case PlayerCommand::NEXT:
+            case PlayerCommand::PREV:
+                last_seek = -1;
+                break;
+            case PlayerCommand::SEEK:
+                last_seek = i;
+                break;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = first; i < count; i++){
+        switch (commands[i].type){
+            case PlayerCommand::PAUSE:
+            case PlayerCommand::RESUME:
+                if ((int)i != last_pause){
+                    continue;
+                }
+                break;
+            case PlayerCommand::SEEK:
+                if ((int)i != last_seek){
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+        commands[kept++] = commands[i];
+    }
+    return kept;
+}
+
+CommandChannel::Stats CommandChannel::stats() const{
+    Stats stats;
+    stats.pushed = pushed.load(std::memory_order_relaxed);
+    stats.dispatched = dispatched.load(std::memory_order_relaxed);
+    stats.coalesced = coalesced.load(std::memory_order_relaxed);
+    stats.full = full.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+}
+
+#include <array>
+#include <atomic>
+
+/// A player command, plain data so it can be copied through the ring
+struct PlayerCommand{
+    enum Type : uint8_t{
+        START,      ///< play the playlist of tag
+        PAUSE,
+        RESUME,
+        STOP,
+        NEXT,
+        PREV,
+        SEEK,       ///< to position_ms in the current track
+    };
+    Type type;
+    uint64_t tag;           ///< START only, tag serial
+    int64_t position_ms;    ///< SEEK only
+    int64_t sent_us;        ///< esp_timer time of the push
+};
+
+/// Bounded single producer, single consumer ring for PlayerCommand.
+///
+/// The producer is the RFID side, the consumer the player loop. Neither
+/// side locks or allocates: the indices are atomics and the commands are
+/// copied into a fixed array. The consumer takes everything pending at once
+/// and coalesces it, so ten tag swaps that piled up while a track was
+/// starting become a single start of the last tag.
+class CommandChannel
+{
+  public:
+    static constexpr size_t CAPACITY = CONFIG_PLAYER_COMMAND_QUEUE_LEN;
+
+    struct Stats{
+        unsigned pushed = 0;
+        unsigned dispatched = 0;
+        unsigned coalesced = 0;     ///< superseded before they were dispatched
+        unsigned full = 0;          ///< rejected, the ring was full
+    };
+
+    /// Producer: queue @p command, false if the ring is full
+    bool push(const PlayerCommand& command);
+    /// Producer, after push(): true if the consumer has to be woken up. Only
+    /// the first push after the consumer emptied the ring asks for it.
+    bool wake();
+    /// Consumer: move all pending commands to @p out, at most CAPACITY, and
+    /// drop the ones a later command makes pointless. Returns how many are left.
+    size_t take(std::array<PlayerCommand, CAPACITY>& out);
+
+    /// Keep only what still matters of @p count commands in @p commands, in order:
+    /// a START or STOP supersedes everything before it, of PAUSE/RESUME
+    /// only the last one counts, a SEEK is dropped by a later SEEK, NEXT or PREV.
+    static size_t coalesce(PlayerCommand* commands, size_t count);
+
+    Stats stats() const;
+
+  private:
+    std::array<PlayerCommand, CAPACITY> ring;
+    std::atomic<size_t> head{0};        ///< next slot the consumer reads, written by the consumer
+    std::atomic<size_t> tail{0};        ///< next slot the producer writes, written by the producer
+    std::atomic<bool> woken{false};     ///< a wake-up is on its way to the consumer
+
+    std::atomic<unsigned> pushed{0};
+    std::atomic<unsigned> dispatched{0};
+    std::atomic<unsigned> coalesced{0};
+    std::atomic<unsigned> full{0};
+};
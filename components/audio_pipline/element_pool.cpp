@@ -0,0 +1,104 @@
+/*  Fixed element pool of the playback pipeline, see element_pool.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "element_pool.hpp"
+extern "C" {
+#include "esp_log.h"
+}
+
+static const char *TAG = "ELEMENT_POOL";
+
+static const char* const element_tags[ElementPool::ELEMENT_COUNT] = {
+    "file_reader",
+    "mp3_decoder",
+    "aac_decoder",
+    "wav_decoder",
+    "filter",
+    "i2s_writer",
+};
+
+ElementPool::ElementPool(){
+    for (int d = 0; d < DECODER_COUNT; d++){
+        for (int resample = 0; resample < 2; resample++){
+            Branch& branch = branches[d][resample];
+            branch.decoder = static_cast<Element>(MP3_DECODER + d);
+            branch.resample = resample;
+            branch.length = 0;
+            branch.tags[branch.length++] = element_tags[READER];
+            branch.tags[branch.length++] = element_tags[branch.decoder];
+            if (resample){
+                branch.tags[branch.length++] = element_tags[FILTER];
+            }
+            branch.tags[branch.length++] = element_tags[I2S_WRITER];
+        }
+    }
+}
+
+const char* ElementPool::tag(Element element){
+    return element_tags[element];
+}
+
+ElementPool::Element ElementPool::find(audio_element_handle_t handle) const{
+    for (int e = 0; e < ELEMENT_COUNT; e++){
+        if (handles[e] == handle){
+            return static_cast<Element>(e);
+        }
+    }
+    return ELEMENT_COUNT;
+}
+
+void ElementPool::attach(audio_pipeline_handle_t pipeline){
+    this->pipeline = pipeline;
+}
+
+void ElementPool::add(Element element, audio_element_handle_t handle){
+    handles[element] = handle;
+    audio_pipeline_register(pipeline, handle, element_tags[element]);
+}
+
+void ElementPool::prime(Element decoder){
+    for (int d = 0; d < DECODER_COUNT; d++){
+        link(static_cast<Element>(MP3_DECODER + d), false);
+        link(static_cast<Element>(MP3_DECODER + d), true);
+    }
+    link(decoder, true);
+    ESP_LOGI(TAG, "%d branches linked once", DECODER_COUNT * 2);
+}
+
+void ElementPool::link(Element decoder, bool resample){
+    Branch* branch = &branches[decoder - MP3_DECODER][resample ? 1 : 0];
+    if (branch == linked){
+        audio_pipeline_link(pipeline, branch->tags, branch->length);
+        return;
+    }
+    if (linked != nullptr){
+        audio_pipeline_breakup_elements(pipeline, handles[linked->decoder]);
+        audio_pipeline_relink(pipeline, branch->tags, branch->length);
+    } else {
+        audio_pipeline_link(pipeline, branch->tags, branch->length);
+    }
+    linked = branch;
+}
+
+void ElementPool::release(){
+    for (auto& handle : handles){
+        if (handle == NULL){
+            continue;
+        }
+        audio_pipeline_unregister(pipeline, handle);
+        audio_element_deinit(handle);
+        handle = NULL;
+    }
+    linked = nullptr;
+}
+
+audio_element_handle_t ElementPool::decoder() const{
+    return linked != nullptr ? handles[linked->decoder] : NULL;
+}
+
+bool ElementPool::resampling() const{
+    return linked != nullptr && linked->resample;
+}
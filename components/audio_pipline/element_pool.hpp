@@ -0,0 +1,74 @@
+#pragma once
+
+extern "C" {
+#include <stddef.h>
+#include "audio_element.h"
+#include "audio_pipeline.h"
+}
+
+#include <array>
+
+/// The fixed set of elements of the playback pipeline, addressed by enum.
+///
+/// Every element is created once and registered with the pipeline. The
+/// chains reader -> decoder [-> filter] -> i2s writer are built up front as
+/// constant tag lists, one per decoder with and without the resampler, so
+/// switching between them neither looks up names nor builds vectors.
+/// esp-adf keeps the output ring buffer of an element once it was linked and
+/// reuses it on every relink; prime() links each branch once at start-up, so
+/// all ring buffers exist, sized by their decoder, before the first track and
+/// a decoder switch afterwards does not touch the heap.
+class ElementPool
+{
+  public:
+    enum Element{
+        READER,
+        MP3_DECODER,
+        AAC_DECODER,
+        WAV_DECODER,
+        FILTER,
+        I2S_WRITER,
+        ELEMENT_COUNT
+    };
+
+    ElementPool();
+    ElementPool(const ElementPool&) = delete;
+    ElementPool& operator=(const ElementPool&) = delete;
+
+    /// Elements are registered with @p pipeline, call before add()
+    void attach(audio_pipeline_handle_t pipeline);
+    void add(Element element, audio_element_handle_t handle);
+    /// Link every branch once so the pipeline allocates all ring buffers now.
+    /// Leaves @p decoder with the resampler linked.
+    void prime(Element decoder);
+    /// Link reader -> @p decoder [-> filter] -> i2s writer
+    void link(Element decoder, bool resample);
+    /// Unregister and free all elements
+    void release();
+
+    audio_element_handle_t operator[](Element element) const{
+        return handles[element];
+    }
+    /// Decoder of the linked branch
+    audio_element_handle_t decoder() const;
+    bool resampling() const;
+    static const char* tag(Element element);
+    /// Element of @p handle, ELEMENT_COUNT if it is not in the pool
+    Element find(audio_element_handle_t handle) const;
+
+  private:
+    static constexpr int DECODER_COUNT = WAV_DECODER - MP3_DECODER + 1;
+    static constexpr int BRANCH_MAX = 4;
+    struct Branch{
+        Element decoder;
+        bool resample;
+        const char* tags[BRANCH_MAX];
+        int length;
+    };
+
+    audio_pipeline_handle_t pipeline = NULL;
+    std::array<audio_element_handle_t, ELEMENT_COUNT> handles{};
+    /// [decoder - MP3_DECODER][resample]
+    Branch branches[DECODER_COUNT][2];
+    Branch* linked = nullptr;
+};
@@ -15,6 +15,7 @@ extern "C" {
 #include "fcntl.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 #include "esp_wifi.h"
 #include "audio_element.h"
@@ -60,11 +61,30 @@ static const char *TAG = "FLEXIBLE_PIPELINE";
 #define PLAYBACK_CHANNEL    2
 #define PLAYBACK_BITS       16
 
-// Define your own event ID for starting and stopping the pipeline
-#define MY_APP_START_EVENT_ID 100
-#define MY_APP_PAUSE_EVENT_ID 101
-#define MY_APP_RESUME_EVENT_ID 102
-#define MY_APP_STOP_EVENT_ID 103
+#define PLAYLIST_ROOT       CONFIG_PLAYLIST_MOUNT_POINT "/"
+#define PLAYLIST_INDEX_FILE PLAYLIST_ROOT "playlists.idx"
+/// Probed formats kept in memory, the least recently used one goes first.
+/// Files played through the index do not count
+#define FORMAT_CACHE_ENTRIES 256
+/// Seek tables kept in memory, about 4 bytes per second of audio each
+#define FRAME_INDEX_FILES   8
+
+// Define your own event ID for the player commands. The commands themselves
+// travel through the CommandChannel, the event only wakes loop() up.
+#define MY_APP_COMMAND_EVENT_ID 100
+#define MY_APP_TRACK_CHANGED_EVENT_ID 104
+
+#ifdef CONFIG_RESUME_POSITION
+#define RESUME_NAMESPACE        "resume"
+#define RESUME_CHECKPOINT_MS    1000
+/// loop() wakes up at least this often to checkpoint the position
+#define LOOP_LISTEN_TICKS       pdMS_TO_TICKS(RESUME_CHECKPOINT_MS)
+#elif CONFIG_PIPELINE_HEALTH_DUMP_S > 0
+/// loop() wakes up at least this often to log the pipeline health
+#define LOOP_LISTEN_TICKS       pdMS_TO_TICKS(CONFIG_PIPELINE_HEALTH_DUMP_S * 1000)
+#else
+#define LOOP_LISTEN_TICKS       portMAX_DELAY
+#endif
 
 #define RESAMPLE_FILTER_CONFIG() {          \
         .src_rate = 44100,                          \
@@ -113,6 +133,29 @@ audio_element_handle_t FlexiblePipeline::create_fatfs_stream(int sample_rates, i
     return fatfs_stream;
 }
 
+audio_element_handle_t FlexiblePipeline::create_playlist_stream(playlist_stream_track_cb on_track_change, playlist_stream_head_cb on_head, playlist_stream_data_cb on_data, void *ctx)
+{
+    playlist_stream_cfg_t playlist_cfg = PLAYLIST_STREAM_CFG_DEFAULT();
+    playlist_cfg.on_track_change = on_track_change;
+    playlist_cfg.on_head = on_head;
+    playlist_cfg.on_data = on_data;
+    playlist_cfg.ctx = ctx;
+#ifdef CONFIG_PLAYLIST_READ_AHEAD
+    playlist_cfg.read_ahead_block = CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE;
+    playlist_cfg.read_ahead_size = CONFIG_PLAYLIST_READ_AHEAD_KB * 1024 / CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE * CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE;
+    playlist_cfg.read_ahead_refill = playlist_cfg.read_ahead_size * CONFIG_PLAYLIST_READ_AHEAD_REFILL_PERCENT / 100;
+#endif
+    audio_element_handle_t playlist_stream = playlist_stream_init(&playlist_cfg);
+    mem_assert(playlist_stream);
+    audio_element_info_t reader_info = {0};
+    audio_element_getinfo(playlist_stream, &reader_info);
+    reader_info.bits = SAVE_FILE_BITS;
+    reader_info.channels = SAVE_FILE_CHANNEL;
+    reader_info.sample_rates = SAVE_FILE_RATE;
+    audio_element_setinfo(playlist_stream, &reader_info);
+    return playlist_stream;
+}
+
 audio_element_handle_t FlexiblePipeline::create_i2s_stream_writer(int sample_rates, int bits, int channels, audio_stream_type_t type)
 {
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
@@ -164,48 +207,58 @@ audio_element_handle_t FlexiblePipeline::create_aac_decoder()
 //    return raw_stream;
 //}
 
-void FlexiblePipeline::add_element(const char* name, audio_element_handle_t handle, bool link ){
-    if(link){
-        link_tags.push_back(name);
-    }
-    handle_elements[name] = handle;
-    audio_pipeline_register(pipeline_play, handle_elements[name], name);
-}
-
-
-void FlexiblePipeline::link_pipeline(FlexiblePipeline::DecoderType type){
-    auto old_decoder = link_tags[1];
+ElementPool::Element FlexiblePipeline::decoder_element(FlexiblePipeline::DecoderType type){
     switch(type){
-        case DecoderType::MP3:
-            link_tags[1] = "mp3_decoder";
-            break;
         case DecoderType::ACC:
-            link_tags[1] = "acc_decoder";
-            break;
+            return ElementPool::AAC_DECODER;
         case DecoderType::WAV:
-            link_tags[1] = "wav_decoder";
-            break;
-    }
-    if(old_decoder != link_tags[1]){
-        audio_pipeline_breakup_elements(pipeline_play, handle_elements[old_decoder]);
-        audio_pipeline_relink(pipeline_play, link_tags.data(), link_tags.size());
-    }
-    else{
-        audio_pipeline_link(pipeline_play, link_tags.data(), link_tags.size());
+            return ElementPool::WAV_DECODER;
+        default:
+            return ElementPool::MP3_DECODER;
     }
 }
 
-FlexiblePipeline::FlexiblePipeline(){
+void FlexiblePipeline::link_pipeline(FlexiblePipeline::DecoderType type, bool resample){
+    int64_t start = esp_timer_get_time();
+    // The branches are prebuilt by the pool, switching does not allocate
+    elements.link(decoder_element(type), resample);
+    trace_ring_record(TRACE_PIPELINE_LINK, decoder_element(type), resample, esp_timer_get_time() - start);
+}
+
+FlexiblePipeline::FlexiblePipeline()
+#ifdef CONFIG_FLEXIBLE_PIPELINE_GAPLESS
+    : gapless(true),
+#else
+    : gapless(false),
+#endif
+#ifdef CONFIG_FLEXIBLE_PIPELINE_RESAMPLE_BYPASS
+    resample_bypass(true),
+#else
+    resample_bypass(false),
+#endif
+    tag_cache(CONFIG_TAG_CACHE_ENTRIES, CONFIG_TAG_CACHE_HEAD_SIZE),
+    playlists(CONFIG_PLAYLIST_MOUNT_POINT, PLAYLIST_INDEX_FILE),
+#ifdef CONFIG_FRAME_INDEX_SAVE
+    frames(FRAME_INDEX_FILES, true)
+#else
+    frames(FRAME_INDEX_FILES, false)
+#endif
+    , health_stats(CONFIG_PIPELINE_HEALTH_SAMPLE_MS, CONFIG_PIPELINE_HEALTH_DUMP_S * 1000000LL)
+#ifdef CONFIG_RESUME_POSITION
+    , positions(RESUME_NAMESPACE, CONFIG_RESUME_TAGS, CONFIG_RESUME_SAVE_INTERVAL_S * 1000000LL)
+#endif
+{
     pipeline_play = audio_pipeline_init(&pipeline_cfg);
-    add_element("file_reader", create_fatfs_stream(SAVE_FILE_RATE, SAVE_FILE_BITS, SAVE_FILE_CHANNEL, AUDIO_STREAM_READER));
-    add_element("mp3_decoder", create_mp3_decoder());
-    add_element("acc_decoder", create_aac_decoder(), false);
-    add_element("wav_decoder", create_wav_decoder(), false);
-    add_element("filter", create_filter_upsample(SAVE_FILE_RATE, SAVE_FILE_CHANNEL, PLAYBACK_RATE, PLAYBACK_CHANNEL));
-    add_element("i2s_writer", create_i2s_stream_writer(PLAYBACK_RATE, PLAYBACK_BITS, PLAYBACK_CHANNEL, AUDIO_STREAM_WRITER));
+    elements.attach(pipeline_play);
+    elements.add(ElementPool::READER, create_playlist_stream(&FlexiblePipeline::on_track_change, &FlexiblePipeline::on_track_head, &FlexiblePipeline::on_track_data, this));
+    elements.add(ElementPool::MP3_DECODER, create_mp3_decoder());
+    elements.add(ElementPool::AAC_DECODER, create_aac_decoder());
+    elements.add(ElementPool::WAV_DECODER, create_wav_decoder());
+    elements.add(ElementPool::FILTER, create_filter_upsample(SAVE_FILE_RATE, SAVE_FILE_CHANNEL, PLAYBACK_RATE, PLAYBACK_CHANNEL));
+    elements.add(ElementPool::I2S_WRITER, create_i2s_stream_writer(PLAYBACK_RATE, PLAYBACK_BITS, PLAYBACK_CHANNEL, AUDIO_STREAM_WRITER));
 
     ESP_LOGI(TAG, "Set up  i2s clock");
-    i2s_stream_set_clk(handle_elements["i2s_writer"], PLAYBACK_RATE, PLAYBACK_BITS, PLAYBACK_CHANNEL);
+    set_output_clock(PLAYBACK_RATE, PLAYBACK_BITS, PLAYBACK_CHANNEL);
     
     audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
     evt = audio_event_iface_init(&evt_cfg);
@@ -213,19 +266,22 @@ FlexiblePipeline::FlexiblePipeline(){
     evt_cmd = audio_event_iface_init(&evt_cfg);
     audio_event_iface_set_listener(evt_cmd, evt);
 
+#ifdef CONFIG_PLAYLIST_INDEX
+    // Only playlists that changed since the last boot are parsed
+    playlists.refresh();
+#endif
+
     ESP_LOGI(TAG, "Start playback pipeline");
-    link_pipeline(DecoderType::MP3);
-    //audio_pipeline_link(pipeline_play, link_tags, 4);
+    // All ring buffers are allocated here, before the heap gets fragmented
+    elements.prime(ElementPool::MP3_DECODER);
 
 }
 FlexiblePipeline::~FlexiblePipeline(){
+    save_position(true, true);
     audio_pipeline_stop(pipeline_play);
     audio_pipeline_wait_for_stop(pipeline_play);
     audio_pipeline_terminate(pipeline_play);
-    for (auto& it : handle_elements){
-        audio_pipeline_unregister(pipeline_play, it.second);
-        audio_element_deinit(it.second);
-    }
+    elements.release();
     audio_pipeline_remove_listener(pipeline_play);
     audio_event_iface_destroy(evt);
 
@@ -235,12 +291,20 @@ FlexiblePipeline::~FlexiblePipeline(){
 }
 
 void FlexiblePipeline::stop_pipeline(){
+    if (!running){
+        // A STOP followed by a START would otherwise tear it down twice
+        return;
+    }
+    running = false;
+    health_stats.set_active(false);
     ESP_LOGW(TAG, "[ * ] Stop pipeline");
+    int64_t start = esp_timer_get_time();
     audio_pipeline_stop(pipeline_play);
     audio_pipeline_wait_for_stop(pipeline_play);
     audio_pipeline_terminate(pipeline_play);
     audio_pipeline_reset_ringbuffer(pipeline_play);
     audio_pipeline_reset_elements(pipeline_play);
+    trace_ring_record(TRACE_PIPELINE_STOP, 0, 0, esp_timer_get_time() - start);
 }
 
 FlexiblePipeline::DecoderType FlexiblePipeline::getFileType(const char* filename){
@@ -261,66 +325,318 @@ FlexiblePipeline::DecoderType FlexiblePipeline::getFileType(const char* filename
     }
 }
 
-void FlexiblePipeline::play_file(const char* filename){
-    ESP_LOGI(TAG, "Play file %s", filename);
+FlexiblePipeline::DecoderType FlexiblePipeline::decoder_for(const format_probe_info_t& format, const char* filename){
+    switch(format.codec){
+        case FORMAT_PROBE_MP3:
+            return DecoderType::MP3;
+        case FORMAT_PROBE_AAC:
+            return DecoderType::ACC;
+        case FORMAT_PROBE_WAV:
+            return DecoderType::WAV;
+        default:
+            ESP_LOGW(TAG, "Unknown format of %s, going by the extension", filename);
+            return getFileType(filename);
+    }
+}
+
+bool FlexiblePipeline::needs_resample(const format_probe_info_t& format){
+    return !resample_bypass
+        || format.sample_rate != PLAYBACK_RATE || format.channels != PLAYBACK_CHANNEL || format.bits != PLAYBACK_BITS;
+}
+
+void FlexiblePipeline::set_filter_source(int rate, int channels){
+    if (rate == filter_rate && channels == filter_channels){
+        return;
+    }
+    ESP_LOGI(TAG, "Resample %d Hz %d ch to %d Hz", rate, channels, PLAYBACK_RATE);
+    rsp_filter_set_src_info(elements[ElementPool::FILTER], rate, channels);
+    filter_rate = rate;
+    filter_channels = channels;
+}
+
+void FlexiblePipeline::set_output_clock(int rate, int bits, int channels){
+    if (rate == output_rate && bits == output_bits && channels == output_channels){
+        return;
+    }
+    ESP_LOGI(TAG, "Set up i2s clock %d Hz %d bit %d ch", rate, bits, channels);
+    i2s_stream_set_clk(elements[ElementPool::I2S_WRITER], rate, bits, channels);
+    output_rate = rate;
+    output_bits = bits;
+    output_channels = channels;
+}
+
+void FlexiblePipeline::on_music_info(audio_element_handle_t decoder){
+    audio_element_info_t info = {0};
+    audio_element_getinfo(decoder, &info);
+    if (info.sample_rates <= 0 || info.channels <= 0){
+        return;
+    }
+    if (info.sample_rates != curr_format.sample_rate || info.channels != curr_format.channels
+        || info.bits != curr_format.bits){
+        ESP_LOGW(TAG, "%s is %d Hz %d ch %d bit, probe said %d Hz %d ch %d bit", curr_file.c_str(),
+            info.sample_rates, info.channels, info.bits,
+            curr_format.sample_rate, curr_format.channels, curr_format.bits);
+        curr_format.sample_rate = info.sample_rates;
+        curr_format.channels = info.channels;
+        curr_format.bits = info.bits;
+        // Next time the file is linked right from the start
+        remember_format(curr_file, curr_format);
+    }
+    if (elements.resampling()){
+        set_filter_source(info.sample_rates, info.channels);
+    } else {
+        // Linked without the resampler, the I2S clock follows the track
+        set_output_clock(info.sample_rates, info.bits, info.channels);
+    }
+}
+
+format_probe_info_t FlexiblePipeline::file_format(const std::string& path){
+    {
+        const std::lock_guard<std::mutex> lock(formats_mutex);
+        auto it = format_index.find(path);
+        if (it != format_index.end()){
+            formats.splice(formats.begin(), formats, it->second);
+            return it->second->second;
+        }
+    }
+    format_probe_info_t format;
+    format_probe_file(path.c_str(), &format);
+    remember_format(path, format);
+    return format;
+}
 
-    auto codec_type = getFileType(filename);
+void FlexiblePipeline::remember_format(const std::string& path, const format_probe_info_t& format){
+    const std::lock_guard<std::mutex> lock(formats_mutex);
+    auto it = format_index.find(path);
+    if (it != format_index.end()){
+        it->second->second = format;
+        formats.splice(formats.begin(), formats, it->second);
+        return;
+    }
+    if (formats.size() >= FORMAT_CACHE_ENTRIES){
+        format_index.erase(formats.back().first);
+        formats.pop_back();
+    }
+    formats.emplace_front(path, format);
+    format_index.emplace(path, formats.begin());
+}
 
-    audio_element_set_uri(handle_elements["file_reader"], filename);
+void FlexiblePipeline::play_file(const char* filename, int64_t byte_pos){
+    ESP_LOGI(TAG, "Play file %s", filename);
 
-    link_pipeline(codec_type);
+    const std::string& tag = curr_playlist_name;
+    audio_element_handle_t reader = elements[ElementPool::READER];
+    audio_element_set_uri(reader, filename);
+    format_probe_info_t format = file_format(filename);
+    int cached_type;
+    DecoderType codec_type;
+    // Cached opening bytes are no use in the middle of a track
+    if (byte_pos == 0 && tag_cache.preload(tag, filename, reader, cached_type)){
+        codec_type = static_cast<DecoderType>(cached_type);
+    } else {
+        codec_type = decoder_for(format, filename);
+    }
+    curr_type = codec_type;
+    curr_format = format;
+    curr_file = filename;
+    next_armed = false;
+    // The reader is stopped, whatever it chained into before is stale now
+    run_id++;
+    frames.track(curr_file, format);
+    if (byte_pos > 0){
+        byte_pos = frames.align(curr_file, byte_pos);
+    }
+    if (byte_pos > 0 && codec_type == DecoderType::WAV){
+        // MP3 and AAC decoders sync to the next frame, the WAV decoder
+        // wants to see the header first
+        if (frames.wav_header(curr_file, wav_header)){
+            playlist_stream_splice_header(reader, (const char *)wav_header.data(), wav_header.size());
+        } else {
+            byte_pos = 0;
+        }
+    }
+    if (byte_pos > 0){
+        ESP_LOGI(TAG, "Continue at byte %lld", (long long)byte_pos);
+    }
+    audio_element_set_byte_pos(reader, byte_pos);
+
+    bool resample = needs_resample(format);
+    link_pipeline(codec_type, resample);
+    health_stats.link(reader, elements.decoder(), elements[ElementPool::I2S_WRITER]);
+    health_stats.count(PipelineHealth::TRACKS);
+    if (resample && format.sample_rate > 0 && format.channels > 0){
+        // Until the decoder reports the real music info, trust the probe
+        set_filter_source(format.sample_rate, format.channels);
+    }
+    set_output_clock(PLAYBACK_RATE, PLAYBACK_BITS, PLAYBACK_CHANNEL);
     audio_pipeline_set_listener(pipeline_play, evt);
 
     ESP_LOGW(TAG, "[ * ] Start pipeline");
+    int64_t start = esp_timer_get_time();
     audio_pipeline_run(pipeline_play);
+    trace_ring_record(TRACE_PIPELINE_RUN, 0, 0, esp_timer_get_time() - start);
+    running = true;
+    health_stats.set_active(true);
+}
+
+void FlexiblePipeline::arm_next_track(){
+    if (!gapless || next_armed){
+        return;
+    }
+    next_armed = true;
+    std::string next = playlist_peek_next();
+    if (next == ""){
+        return;
+    }
+    format_probe_info_t format = file_format(next);
+    if (decoder_for(format, next.c_str()) != curr_type){
+        ESP_LOGI(TAG, "%s needs another decoder, no gapless switch", next.c_str());
+        return;
+    }
+    if (format.sample_rate != curr_format.sample_rate || format.channels != curr_format.channels){
+        ESP_LOGI(TAG, "%s has another sample format, no gapless switch", next.c_str());
+        return;
+    }
+    frames.track(next, format);
+    playlist_stream_arm_next(elements[ElementPool::READER], next.c_str());
+}
+
+void FlexiblePipeline::on_track_change(audio_element_handle_t self, const char *uri, void *ctx){
+    // Runs on the reader task, hand over to loop() with the run it belongs to
+    auto pipeline = static_cast<FlexiblePipeline *>(ctx);
+    audio_event_iface_msg_t msg = {
+        .cmd = MY_APP_TRACK_CHANGED_EVENT_ID,
+        .data = (void *)(uintptr_t)pipeline->run_id.load(),
+        .data_len = 0,
+        .source = ctx,
+        .source_type = 0,
+        .need_free_data = false,
+    };
+    audio_event_iface_sendout(pipeline->evt_cmd, &msg);
+}
+
+void FlexiblePipeline::on_track_head(audio_element_handle_t self, const char *uri, const char *data, int len, int64_t size, void *ctx){
+    // Runs on the reader task, the tag cache keeps what it needs
+    static_cast<FlexiblePipeline *>(ctx)->tag_cache.store_head(uri, data, len, size);
+}
+
+void FlexiblePipeline::on_track_data(audio_element_handle_t self, const char *uri, int64_t offset, const char *data, int len, void *ctx){
+    // Runs on the reader task, everything read extends the seek table
+    static_cast<FlexiblePipeline *>(ctx)->frames.feed(uri, offset, (const uint8_t *)data, len);
+}
+
+void FlexiblePipeline::set_gapless(bool enable){
+    gapless = enable;
+}
+
+void FlexiblePipeline::set_resample_bypass(bool enable){
+    resample_bypass = enable;
+}
+
+TagCache::Stats FlexiblePipeline::tag_cache_stats(){
+    return tag_cache.stats();
+}
+
+PipelineHealth::Snapshot FlexiblePipeline::health(){
+    return health_stats.snapshot();
 }
 
 void FlexiblePipeline::loop(){
 
     ESP_LOGI(TAG, "Plan music!");
     audio_event_iface_msg_t msg;
+    // Messages taken since loop() last found the queue empty
+    uint32_t backlog = 0;
     while(1){
-        ESP_LOGI(TAG, "LOOP");
-        esp_err_t ret = audio_event_iface_listen(evt, &msg, portMAX_DELAY);
+        // After a message, look for more without blocking to see how many piled up
+        esp_err_t ret = audio_event_iface_listen(evt, &msg, backlog > 0 ? 0 : LOOP_LISTEN_TICKS);
+        // Seek tables that reached the end of their track
+        frames.save();
+        health_stats.dump(false);
         if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "[ * ] Event interface error : %d", ret);
+            // Timed out, nothing to handle
+            if (backlog > 0){
+                health_stats.record(PipelineHealth::EVENT_BACKLOG, backlog);
+                backlog = 0;
+            } else {
+                health_stats.count(PipelineHealth::WAKEUPS);
+            }
+            save_position(false);
             continue;
         }
-        ESP_LOGI(TAG, "Receive event : %d %d", msg.cmd, (int)msg.data);
+        backlog++;
+        health_stats.count(PipelineHealth::EVENTS);
+        ESP_LOGD(TAG, "Receive event : %d %d", msg.cmd, (int)(intptr_t)msg.data);
+        if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.cmd == AEL_MSG_CMD_REPORT_STATUS){
+            trace_ring_record(TRACE_ELEMENT_STATUS, elements.find((audio_element_handle_t)msg.source),
+                (int)(intptr_t)msg.data, 0);
+        }
 
-        if (msg.cmd == MY_APP_START_EVENT_ID) {
-            ESP_LOGI(TAG, "Changing music to %s", (char *)msg.data);
-            play_file((char *)msg.data);
-        } else if (msg.cmd == MY_APP_RESUME_EVENT_ID) {
-            ESP_LOGI(TAG, "Resume music");
-            audio_pipeline_resume(pipeline_play);
-        } else if(msg.cmd == MY_APP_PAUSE_EVENT_ID){
-            audio_pipeline_pause(pipeline_play);
-        } else if(msg.cmd == MY_APP_STOP_EVENT_ID){
-            //stop_pipeline(); 
+        if (msg.cmd == MY_APP_COMMAND_EVENT_ID) {
+            size_t count = commands.take(pending);
+            for (size_t i = 0; i < count; i++){
+                dispatch(pending[i]);
+            }
+        } else if(msg.cmd == MY_APP_TRACK_CHANGED_EVENT_ID && (uint32_t)(uintptr_t)msg.data != run_id.load()){
+            // Chained just before a command restarted the pipeline
+            ESP_LOGI(TAG, "Dropped the track change of an earlier run");
+        } else if(msg.cmd == MY_APP_TRACK_CHANGED_EVENT_ID){
+            std::string music = playlist_next();
+            ESP_LOGI(TAG, "Chained into %s", music.c_str());
+            trace_ring_record(TRACE_TRACK_CHAINED, 0, playlist_index, 0);
+            health_stats.count(PipelineHealth::TRACKS);
+            // Same decoder and sample format, only the bookkeeping moves on
+            curr_file = music;
+            curr_format = file_format(music);
+            next_armed = false;
+            arm_next_track();
+        } else if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT
+            && msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO
+            ){
+            trace_ring_record(TRACE_MUSIC_INFO, elements.find((audio_element_handle_t)msg.source), 0, 0);
+            if (msg.source == (void *)elements.decoder()){
+                on_music_info((audio_element_handle_t)msg.source);
+            }
+            // The decoder produced its first frame, the SD card is free to
+            // read ahead into the next track now.
+            int64_t started = start_us.exchange(0);
+            if (started != 0){
+                int64_t latency_us = esp_timer_get_time() - started;
+                trace_ring_record(TRACE_FIRST_FRAME, 0, 0, latency_us);
+                health_stats.record(PipelineHealth::START_MS, (uint32_t)(latency_us / 1000));
+                auto stats = tag_cache_stats();
+                ESP_LOGI(TAG, "First frame %lld ms after start, tag cache %u hits %u misses",
+                    (long long)latency_us / 1000, stats.hits, stats.misses);
+#ifdef CONFIG_TRACE_RING_PRINT_ON_START
+                trace_ring_print(stdout, &trace_seq);
+#endif
+            }
+            arm_next_track();
         } else if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT 
+            && msg.source == (void *)elements[ElementPool::I2S_WRITER]
             && msg.cmd == AEL_MSG_CMD_REPORT_STATUS
             ){
-            if ((int)msg.data == AEL_STATUS_STATE_STOPPED) {
-                const char * music = playlist_next().c_str();
-                ESP_LOGI(TAG, "Changing music to %s", music);
-                play_file(music);
-            }
-            else if ((int)msg.data == AEL_STATUS_STATE_FINISHED) {
+            // Only the last element finishing means the track is over, the
+            // reader reports FINISHED while the decoder is still draining.
+            if ((int)(intptr_t)msg.data == AEL_STATUS_STATE_FINISHED) {
                 stop_pipeline();
-                const char * music = playlist_next().c_str();
-                ESP_LOGI(TAG, "Changing music to %s", music);
-                play_file(music);
+                std::string music = playlist_next();
+                ESP_LOGI(TAG, "Changing music to %s", music.c_str());
+                play_file(music.c_str());
             }
         }
         if (msg.need_free_data) {
             free(msg.data);
         }
+        // After the message, a chained track has moved playlist_index on by now
+        save_position(false);
     }
 }
 
 std::string FlexiblePipeline::playlist_next(){
-    const std::lock_guard<std::mutex> lock(playlist_mutex);
+    if (playlist.empty()){
+        return "";
+    }
     playlist_index++;
     if (playlist_index >= playlist.size()){
         playlist_index = 0;
@@ -328,64 +644,101 @@ std::string FlexiblePipeline::playlist_next(){
     return playlist[playlist_index];
 }
 
+std::string FlexiblePipeline::playlist_prev(){
+    if (playlist.empty()){
+        return "";
+    }
+    playlist_index = playlist_index > 0 ? playlist_index - 1 : playlist.size() - 1;
+    return playlist[playlist_index];
+}
+
+void FlexiblePipeline::playlist_load(std::string& playlist_name){
+    int64_t start = esp_timer_get_time();
+    playlist_index = 0;
+    curr_playlist_name = playlist_name;
+    // Both fill the playlist in place, the strings of the last one are reused
+    int decoder;
+#ifdef CONFIG_PLAYLIST_INDEX
+    // A cached playlist is only as good as the text file it came from
+    if (playlists.check(playlist_name)){
+        tag_cache.invalidate(playlist_name);
+    }
+#endif
+    if (tag_cache.lookup(playlist_name, playlist, decoder)){
+        ESP_LOGI(TAG, "Playlist %s from tag cache", playlist_name.c_str());
+        trace_ring_record(TRACE_PLAYLIST_LOAD, TRACE_PLAYLIST_CACHE, playlist.size(), esp_timer_get_time() - start);
+        return;
+    }
+#ifdef CONFIG_PLAYLIST_INDEX
+    if (playlists.lookup(playlist_name, playlist, playlist_formats)){
+        ESP_LOGI(TAG, "Playlist %s from index", playlist_name.c_str());
+        for (size_t i = 0; i < playlist.size(); i++){
+            remember_format(playlist[i], playlist_formats[i]);
+        }
+        if (!playlist.empty()){
+            decoder = static_cast<int>(decoder_for(playlist_formats.front(), playlist.front().c_str()));
+            tag_cache.put(playlist_name, playlist, decoder);
+        }
+        trace_ring_record(TRACE_PLAYLIST_LOAD, TRACE_PLAYLIST_INDEX, playlist.size(), esp_timer_get_time() - start);
+        return;
+    }
+#endif
+    playlist.clear();
+    playlist_read(playlist_name);
+    if (!playlist.empty()){
+        const std::string& first = playlist.front();
+        tag_cache.put(playlist_name, playlist, static_cast<int>(decoder_for(file_format(first), first.c_str())));
+    }
+    trace_ring_record(TRACE_PLAYLIST_LOAD, TRACE_PLAYLIST_TEXT, playlist.size(), esp_timer_get_time() - start);
+}
+
 void FlexiblePipeline::playlist_read(std::string& playlist_name){
-    const std::lock_guard<std::mutex> lock(playlist_mutex);
-    ESP_LOGI(TAG, "Read playlist %s", playlist_name.c_str());
     std::string line;
-    std::ifstream playlist_file ("/sdcard/" + playlist_name + ".txt");
+    std::ifstream playlist_file (PLAYLIST_ROOT + playlist_name + ".txt");
     if (playlist_file.is_open())
     {
         while ( getline (playlist_file,line) )
         {
-            ESP_LOGI(TAG, "Read line %s", line.c_str());
-            playlist.push_back("/sdcard/"+line);
+            playlist.push_back(PLAYLIST_ROOT+line);
         }
         playlist_file.close();
+        ESP_LOGI(TAG, "Read playlist %s, %u tracks", playlist_name.c_str(), (unsigned)playlist.size());
     }
     else ESP_LOGE(TAG, "Unable to open file");
 }
 
+std::string FlexiblePipeline::playlist_peek_next(){
+    if (playlist.empty()){
+        return "";
+    }
+    return playlist[(playlist_index + 1) % playlist.size()];
+}
+
 std::string FlexiblePipeline::playlist_current_song(){
-    const std::lock_guard<std::mutex> lock(playlist_mutex);
     if(playlist_index >= playlist.size()){
         return "";
     }
     return playlist[playlist_index];
 }
 
-void FlexiblePipeline::start(std::string&& playlist_name){
-    void * data = NULL;
-    int data_size = 0;
-    ESP_LOGI(TAG, "Start %s", playlist_name.c_str());
-    if (curr_playlist_name != playlist_name){
-        playlist.clear();
-        playlist_index = 0;
-        curr_playlist_name = playlist_name;
-        playlist_read(playlist_name);
+void FlexiblePipeline::send(PlayerCommand::Type type, uint64_t tag, int64_t position_ms){
+    PlayerCommand command = {
+        .type = type,
+        .tag = tag,
+        .position_ms = position_ms,
+        .sent_us = esp_timer_get_time(),
+    };
+    if (!commands.push(command)){
+        ESP_LOGE(TAG, "Command queue full, dropped command %d", type);
+        return;
     }
-    auto filename = playlist_current_song();
-    if(filename == "") {
-        ESP_LOGE(TAG, "Playlist %s ended", playlist_name.c_str());
+    trace_ring_record(TRACE_COMMAND_SENT, type, 0, (uint32_t)tag);
+    if (!commands.wake()){
+        // loop() has not taken the last batch yet, it picks this one up too
         return;
     }
-    data_size = filename.length()+1;
-    data = malloc(data_size);
-    strcpy((char *)data, filename.c_str());
     audio_event_iface_msg_t msg = {
-        .cmd = MY_APP_START_EVENT_ID,
-        .data = data,
-        .data_len = data_size,
-        .source = (void *)this,
-        .source_type = 0,
-        .need_free_data = data_size>0,
-    };
-    audio_event_iface_sendout(evt_cmd, &msg);
-}
-
-void FlexiblePipeline::pause(){
-
-    audio_event_iface_msg_t msg = {
-        .cmd = MY_APP_PAUSE_EVENT_ID,
+        .cmd = MY_APP_COMMAND_EVENT_ID,
         .data = NULL,
         .data_len = 0,
         .source = (void *)this,
@@ -395,28 +748,166 @@ void FlexiblePipeline::pause(){
     audio_event_iface_sendout(evt_cmd, &msg);
 }
 
-void FlexiblePipeline::resume(){
+void FlexiblePipeline::dispatch(const PlayerCommand& command){
+    trace_ring_record(TRACE_COMMAND_DISPATCHED, command.type, 0, esp_timer_get_time() - command.sent_us);
+    switch (command.type){
+        case PlayerCommand::START:
+            play_tag(command.tag);
+            break;
+        case PlayerCommand::PAUSE:
+            // A paused pipeline drains its rings on purpose
+            health_stats.set_active(false);
+            audio_pipeline_pause(pipeline_play);
+            // Every tag taken off pauses, the checkpoint waits for the next save
+            save_position(true);
+            break;
+        case PlayerCommand::RESUME:
+            ESP_LOGI(TAG, "Resume music");
+            audio_pipeline_resume(pipeline_play);
+            health_stats.set_active(running);
+            break;
+        case PlayerCommand::STOP:
+            save_position(true, true);
+            stop_pipeline();
+            break;
+        case PlayerCommand::NEXT:
+        case PlayerCommand::PREV: {
+            std::string music = command.type == PlayerCommand::NEXT ? playlist_next() : playlist_prev();
+            if (music == ""){
+                break;
+            }
+            stop_pipeline();
+            ESP_LOGI(TAG, "Changing music to %s", music.c_str());
+            play_file(music.c_str());
+            break;
+        }
+        case PlayerCommand::SEEK:
+            seek_to(command.position_ms);
+            break;
+    }
+}
 
-    audio_event_iface_msg_t msg = {
-        .cmd = MY_APP_RESUME_EVENT_ID,
-        .data = NULL,
-        .data_len = 0,
-        .source = (void *)this,
-        .source_type = 0,
-        .need_free_data = false,
-    };
-    audio_event_iface_sendout(evt_cmd, &msg);
+void FlexiblePipeline::play_tag(uint64_t tag){
+    // RDM6300 serials have 48 bits, the name fits the small string buffer
+    char name[24];
+    snprintf(name, sizeof(name), "%llu", (unsigned long long)tag);
+    save_position(true);
+    stop_pipeline();
+    if (curr_playlist_name != name){
+        std::string playlist_name(name);
+        playlist_load(playlist_name);
+    }
+    int64_t byte_pos = 0;
+#ifdef CONFIG_RESUME_POSITION
+    curr_tag = tag;
+    ResumePosition position;
+    if (resume_enabled && positions.lookup(tag, position) && position.track < playlist.size()){
+        playlist_index = position.track;
+        byte_pos = position.byte_pos;
+    }
+#endif
+    auto filename = playlist_current_song();
+    if(filename == "") {
+        ESP_LOGE(TAG, "Playlist %s ended", name);
+        return;
+    }
+    ESP_LOGI(TAG, "Changing music to %s", filename.c_str());
+    play_file(filename.c_str(), byte_pos);
+}
+
+void FlexiblePipeline::save_position(bool force, bool flush){
+#ifdef CONFIG_RESUME_POSITION
+    int64_t now = esp_timer_get_time();
+    if (!force && now - checkpoint_us < RESUME_CHECKPOINT_MS * 1000LL){
+        return;
+    }
+    checkpoint_us = now;
+    if (running && curr_tag != 0 && resume_enabled){
+        // The reader is ahead of the speaker by the ring buffers, a resumed
+        // tag skips that fraction of a second
+        audio_element_handle_t reader = elements[ElementPool::READER];
+        // The reader chains into the next track before TRACK_CHANGED gets
+        // here, its byte_pos doesn't belong to playlist_index until then
+        const char *uri = audio_element_get_uri(reader);
+        if (uri != NULL && curr_file == uri){
+            audio_element_info_t info = {0};
+            audio_element_getinfo(reader, &info);
+            ResumePosition position = {(uint32_t)playlist_index, 0, info.byte_pos};
+            positions.checkpoint(curr_tag, position);
+        }
+    }
+    positions.flush(flush);
+#endif
+}
+
+void FlexiblePipeline::seek_to(int64_t position_ms){
+    auto filename = playlist_current_song();
+    if (filename == ""){
+        return;
+    }
+    // Before stopping, the track keeps playing if the position does not exist
+    int64_t landed_ms = 0;
+    int64_t byte_pos = frames.seek(filename, position_ms, landed_ms);
+    if (byte_pos < 0){
+        ESP_LOGW(TAG, "%s has no position %lld ms", filename.c_str(), (long long)position_ms);
+        return;
+    }
+    ESP_LOGI(TAG, "Seek %s to %lld ms, byte %lld", filename.c_str(), (long long)landed_ms, (long long)byte_pos);
+    stop_pipeline();
+    play_file(filename.c_str(), byte_pos);
+}
+
+void FlexiblePipeline::start(uint64_t tag){
+    start_us = esp_timer_get_time();
+    send(PlayerCommand::START, tag);
+}
+
+void FlexiblePipeline::pause(){
+    send(PlayerCommand::PAUSE);
+}
+
+void FlexiblePipeline::resume(){
+    send(PlayerCommand::RESUME);
 }
 
 void FlexiblePipeline::stop(){
+    send(PlayerCommand::STOP);
+}
 
-    audio_event_iface_msg_t msg = {
-        .cmd = MY_APP_STOP_EVENT_ID,
-        .data = NULL,
-        .data_len = 0,
-        .source = (void *)this,
-        .source_type = 0,
-        .need_free_data = false,
-    };
-    audio_event_iface_sendout(evt_cmd, &msg);
+void FlexiblePipeline::next(){
+    send(PlayerCommand::NEXT);
 }
+
+void FlexiblePipeline::prev(){
+    send(PlayerCommand::PREV);
+}
+
+void FlexiblePipeline::seek(int64_t position_ms){
+    send(PlayerCommand::SEEK, 0, position_ms);
+}
+
+CommandChannel::Stats FlexiblePipeline::command_stats(){
+    return commands.stats();
+}
+
+FrameIndex::Stats FlexiblePipeline::frame_index_stats(){
+    return frames.stats();
+}
+
+#ifdef CONFIG_PLAYLIST_READ_AHEAD
+read_ahead_stats_t FlexiblePipeline::read_ahead_stats(){
+    read_ahead_stats_t stats = {};
+    playlist_stream_get_read_stats(elements[ElementPool::READER], &stats);
+    return stats;
+}
+#endif
+
+#ifdef CONFIG_RESUME_POSITION
+void FlexiblePipeline::set_resume(bool enable){
+    resume_enabled = enable;
+}
+
+ResumeStore::Stats FlexiblePipeline::resume_stats(){
+    return positions.stats();
+}
+#endif
@@ -5,12 +5,24 @@ extern "C" {
 #include <stddef.h>
 #include "esp_peripherals.h"
 #include "audio_pipeline.h"
+#include "playlist_stream.h"
+#include "format_probe.h"
+#include "trace_ring.h"
 }
+#include "tag_cache.hpp"
+#include "playlist_index.hpp"
+#include "element_pool.hpp"
+#include "command_channel.hpp"
+#include "resume_store.hpp"
+#include "frame_index.hpp"
+#include "pipeline_health.hpp"
 
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
 #include <mutex>
+#include <atomic>
 
 class FlexiblePipeline
 {
@@ -19,12 +31,39 @@ class FlexiblePipeline
     ~FlexiblePipeline();
 
     void loop();
-    void start(std::string&& filename);
+    /// Commands for loop(). They are queued without locking or allocating
+    /// and must all be sent from the same task.
+    void start(uint64_t tag);
     void stop();
     void pause();
     void resume();
+    void next();
+    void prev();
+    /// Continue the current track at @p position_ms, to the second
+    void seek(int64_t position_ms);
+    /// Chain consecutive playlist entries that share a decoder without
+    /// stopping the pipeline. Defaults to CONFIG_FLEXIBLE_PIPELINE_GAPLESS.
+    void set_gapless(bool enable);
+    /// Link tracks that already match the I2S output without the resampler.
+    /// Defaults to CONFIG_FLEXIBLE_PIPELINE_RESAMPLE_BYPASS.
+    void set_resample_bypass(bool enable);
+#ifdef CONFIG_RESUME_POSITION
+    /// Continue tags where they were taken off. On by default.
+    void set_resume(bool enable);
+    ResumeStore::Stats resume_stats();
+#endif
+    TagCache::Stats tag_cache_stats();
+    CommandChannel::Stats command_stats();
+    FrameIndex::Stats frame_index_stats();
+    /// Counters and histograms of the pipeline, cheap enough to poll
+    PipelineHealth::Snapshot health();
+#ifdef CONFIG_PLAYLIST_READ_AHEAD
+    /// Throughput, refills and underruns of the SD card read-ahead
+    read_ahead_stats_t read_ahead_stats();
+#endif
 
     static audio_element_handle_t create_fatfs_stream(int sample_rates, int bits, int channels, audio_stream_type_t type);
+    static audio_element_handle_t create_playlist_stream(playlist_stream_track_cb on_track_change, playlist_stream_head_cb on_head, playlist_stream_data_cb on_data, void *ctx);
     static audio_element_handle_t create_mp3_decoder();
     static audio_element_handle_t create_aac_decoder();
     static audio_element_handle_t create_wav_decoder();
@@ -37,28 +76,97 @@ class FlexiblePipeline
         ACC,
         WAV
     };
-    void link_pipeline(DecoderType type);
+    /// Link the reader through @p type, skip the resampler unless @p resample
+    void link_pipeline(DecoderType type, bool resample);
+    static ElementPool::Element decoder_element(DecoderType type);
     void stop_pipeline();
-    void play_file(const char* filename);
-    DecoderType getFileType(const char* filename);
-    void add_element(const char* name, audio_element_handle_t handle, bool link = true);
+    void send(PlayerCommand::Type type, uint64_t tag = 0, int64_t position_ms = 0);
+    void dispatch(const PlayerCommand& command);
+    void play_tag(uint64_t tag);
+    void seek_to(int64_t position_ms);
+    /// Start @p filename at @p byte_pos, moved back to a frame boundary
+    void play_file(const char* filename, int64_t byte_pos = 0);
+    /// Checkpoint where the current tag is, at most once a second unless
+    /// @p force, and let the resume store save what is due, or all that
+    /// changed with @p flush
+    void save_position(bool force, bool flush = false);
+    static DecoderType getFileType(const char* filename);
+    /// Decoder for a probed format, by the extension if the probe failed
+    static DecoderType decoder_for(const format_probe_info_t& format, const char* filename);
+    bool needs_resample(const format_probe_info_t& format);
+    /// Apply the music info the decoder found in the stream
+    void on_music_info(audio_element_handle_t decoder);
+    void set_filter_source(int rate, int channels);
+    void set_output_clock(int rate, int bits, int channels);
+    /// Probed format of @p path, each file is only probed once
+    format_probe_info_t file_format(const std::string& path);
+    void remember_format(const std::string& path, const format_probe_info_t& format);
+    void arm_next_track();
+    static void on_track_change(audio_element_handle_t self, const char *uri, void *ctx);
+    static void on_track_head(audio_element_handle_t self, const char *uri, const char *data, int len, int64_t size, void *ctx);
+    static void on_track_data(audio_element_handle_t self, const char *uri, int64_t offset, const char *data, int len, void *ctx);
 
+    /// Playlist of a tag from the tag cache, the playlist index or the text
+    /// playlist on the SD card, whichever has it first
+    void playlist_load(std::string& playlist_name);
+    /// Parse the text playlist into playlist
     void playlist_read(std::string& playlist_name);
     std::string playlist_next();
+    std::string playlist_prev();
+    /// Entry after the current one without advancing, empty if there is none
+    std::string playlist_peek_next();
     /// Empty string if playlist is empty or ended
     std::string playlist_current_song();
 
     audio_pipeline_handle_t pipeline_play = NULL;
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
-    std::map<const std::string, audio_element_handle_t> handle_elements;
-    std::vector<const char*> link_tags;
+    ElementPool elements;
     audio_event_iface_handle_t evt = NULL;
     audio_event_iface_handle_t evt_cmd = NULL;
+    CommandChannel commands;
+    std::array<PlayerCommand, CommandChannel::CAPACITY> pending;
 
+    /// The playlist is only touched by loop()
     std::vector <std::string> playlist;
     int playlist_index = 0;
     std::string curr_playlist_name = "";
-    std::mutex playlist_mutex;
 
-    
+    /// Run since the last stop_pipeline()
+    bool running = false;
+    std::atomic<bool> gapless;
+    std::atomic<bool> resample_bypass;
+    int filter_rate = 0;
+    int filter_channels = 0;
+    int output_rate = 0;
+    int output_bits = 0;
+    int output_channels = 0;
+    std::string curr_file;
+    bool next_armed = false;
+    /// Bumped by every play_file(), a TRACK_CHANGED of an older run is dropped
+    std::atomic<uint32_t> run_id{0};
+    DecoderType curr_type = DecoderType::MP3;
+    format_probe_info_t curr_format = {};
+    std::vector<format_probe_info_t> playlist_formats;
+    /// Probed formats, most recently used first, and where each path is in it
+    std::list<std::pair<std::string, format_probe_info_t>> formats;
+    std::map<std::string, std::list<std::pair<std::string, format_probe_info_t>>::iterator> format_index;
+    std::mutex formats_mutex;
+
+    TagCache tag_cache;
+    PlaylistIndex playlists;
+    FrameIndex frames;
+    std::vector<uint8_t> wav_header;
+    /// esp_timer time of the last start(), 0 once its first frame was decoded
+    std::atomic<int64_t> start_us{0};
+    PipelineHealth health_stats;
+#ifdef CONFIG_TRACE_RING_PRINT_ON_START
+    /// First trace record not printed yet
+    uint32_t trace_seq = 0;
+#endif
+#ifdef CONFIG_RESUME_POSITION
+    ResumeStore positions;
+    std::atomic<bool> resume_enabled{true};
+    uint64_t curr_tag = 0;
+    int64_t checkpoint_us = 0;
+#endif
 };
@@ -0,0 +1,263 @@
+/*  Format probe for the files on the SD card, see format_probe.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "format_probe.h"
+
+static const char *TAG = "FORMAT_PROBE";
+
+/* Frames of the same stream have to follow within this many bytes of garbage */
+#define FORMAT_PROBE_MAX_SKIP   (FORMAT_PROBE_BYTES / 2)
+
+typedef struct {
+    int sample_rate;
+    int channels;
+    int frame_len;
+    int samples;            /* per channel */
+    uint8_t id;             /* header bits that stay the same for every frame */
+} frame_header_t;
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+size_t format_probe_id3_size(const uint8_t *data, size_t length)
+{
+    if (length < 10 || memcmp(data, "ID3", 3) != 0) {
+        return 0;
+    }
+    size_t size = ((data[6] & 0x7f) << 21) | ((data[7] & 0x7f) << 14) | ((data[8] & 0x7f) << 7) | (data[9] & 0x7f);
+    bool footer = data[5] & 0x10;
+    return 10 + size + (footer ? 10 : 0);
+}
+
+/* MPEG audio frame header, layer I to III of MPEG 1, 2 and 2.5 */
+static bool mpeg_header(const uint8_t *p, frame_header_t *header)
+{
+    static const int rates[] = {44100, 48000, 32000};
+    /* kbit/s by [MPEG 1][layer - 1][index] and [MPEG 2/2.5][layer - 1][index] */
+    static const short bitrates[2][3][15] = {
+        {
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+        },
+        {
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        },
+    };
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) {
+        return false;
+    }
+    int version = (p[1] >> 3) & 3;      /* 0 MPEG 2.5, 1 reserved, 2 MPEG 2, 3 MPEG 1 */
+    int layer = 4 - ((p[1] >> 1) & 3);  /* 4 is reserved, used by ADTS */
+    int bitrate_index = p[2] >> 4;
+    int rate_index = (p[2] >> 2) & 3;
+    if (version == 1 || layer == 4 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) {
+        return false;
+    }
+    bool mpeg1 = version == 3;
+    int bitrate = bitrates[mpeg1 ? 0 : 1][layer - 1][bitrate_index] * 1000;
+    int padding = (p[2] >> 1) & 1;
+    header->sample_rate = rates[rate_index] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    header->channels = (p[3] >> 6) == 3 ? 1 : 2;
+    if (layer == 1) {
+        header->frame_len = (12 * bitrate / header->sample_rate + padding) * 4;
+        header->samples = 384;
+    } else if (layer == 3 && !mpeg1) {
+        header->frame_len = 72 * bitrate / header->sample_rate + padding;
+        header->samples = 576;
+    } else {
+        header->frame_len = 144 * bitrate / header->sample_rate + padding;
+        header->samples = 1152;
+    }
+    header->id = (p[1] & 0x1e) | (rate_index << 6);
+    return true;
+}
+
+/* AAC ADTS frame header */
+static bool adts_header(const uint8_t *p, frame_header_t *header)
+{
+    static const int rates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350,
+    };
+    if (p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+        return false;
+    }
+    int rate_index = (p[2] >> 2) & 0xf;
+    int channel_config = ((p[2] & 1) << 2) | (p[3] >> 6);
+    int frame_len = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+    int header_len = (p[1] & 1) ? 7 : 9;
+    if (rate_index >= sizeof(rates) / sizeof(rates[0]) || frame_len < header_len) {
+        return false;
+    }
+    header->sample_rate = rates[rate_index];
+    /* 0 means the configuration is in the stream, 7 is 7.1 */
+    header->channels = channel_config == 7 ? 8 : channel_config;
+    header->frame_len = frame_len;
+    header->samples = 1024 * ((p[6] & 3) + 1);
+    header->id = (rate_index << 4) | channel_config;
+    return true;
+}
+
+/* Two frames in a row that agree, or one frame that fills the buffer */
+static bool frames_line_up(const uint8_t *data, size_t length, size_t pos,
+                           bool (*parse)(const uint8_t *, frame_header_t *), frame_header_t *header)
+{
+    if (pos + FORMAT_PROBE_HEADER_BYTES > length || !parse(data + pos, header)) {
+        return false;
+    }
+    size_t next = pos + header->frame_len;
+    if (next + FORMAT_PROBE_HEADER_BYTES > length) {
+        return pos == 0;
+    }
+    frame_header_t second;
+    return parse(data + next, &second) && second.id == header->id;
+}
+
+static bool wav_format(const uint8_t *data, size_t length, format_probe_info_t *info)
+{
+    if (length < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+    size_t pos = 12;
+    while (pos + 8 <= length) {
+        uint32_t chunk_size = read_le32(data + pos + 4);
+        if (memcmp(data + pos, "fmt ", 4) == 0 && pos + 8 + 16 <= length) {
+            const uint8_t *fmt = data + pos + 8;
+            info->channels = read_le16(fmt + 2);
+            info->sample_rate = read_le32(fmt + 4);
+            info->bits = read_le16(fmt + 14);
+            return true;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    /* A RIFF/WAVE file without a readable fmt chunk still wants the WAV decoder */
+    return true;
+}
+
+format_probe_codec_t format_probe_buffer(const uint8_t *data, size_t length, format_probe_info_t *info)
+{
+    memset(info, 0, sizeof(*info));
+    if (wav_format(data, length, info)) {
+        info->codec = FORMAT_PROBE_WAV;
+        return info->codec;
+    }
+    size_t limit = length < FORMAT_PROBE_MAX_SKIP ? length : FORMAT_PROBE_MAX_SKIP;
+    for (size_t pos = 0; pos < limit; pos++) {
+        if (data[pos] != 0xff) {
+            continue;
+        }
+        frame_header_t header;
+        format_probe_codec_t codec = FORMAT_PROBE_UNKNOWN;
+        if (frames_line_up(data, length, pos, adts_header, &header)) {
+            codec = FORMAT_PROBE_AAC;
+        } else if (frames_line_up(data, length, pos, mpeg_header, &header)) {
+            codec = FORMAT_PROBE_MP3;
+        } else {
+            continue;
+        }
+        info->codec = codec;
+        info->sample_rate = header.sample_rate;
+        info->channels = header.channels;
+        info->bits = 16;
+        return codec;
+    }
+    return FORMAT_PROBE_UNKNOWN;
+}
+
+bool format_probe_frame(format_probe_codec_t codec, const uint8_t *data, format_probe_frame_t *frame)
+{
+    frame_header_t header;
+    bool valid = false;
+    if (codec == FORMAT_PROBE_MP3) {
+        valid = mpeg_header(data, &header);
+    } else if (codec == FORMAT_PROBE_AAC) {
+        valid = adts_header(data, &header);
+    }
+    /* A corrupt header must not stall a scan */
+    if (!valid || header.frame_len < FORMAT_PROBE_HEADER_BYTES) {
+        return false;
+    }
+    frame->length = header.frame_len;
+    frame->samples = header.samples;
+    frame->sample_rate = header.sample_rate;
+    return true;
+}
+
+bool format_probe_wav_layout(const uint8_t *data, size_t length, format_probe_wav_t *wav)
+{
+    if (length < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+    memset(wav, 0, sizeof(*wav));
+    size_t pos = 12;
+    while (pos + 8 <= length) {
+        uint32_t chunk_size = read_le32(data + pos + 4);
+        if (memcmp(data + pos, "fmt ", 4) == 0 && pos + 8 + 16 <= length) {
+            const uint8_t *fmt = data + pos + 8;
+            wav->byte_rate = read_le32(fmt + 8);
+            wav->block_align = read_le16(fmt + 12);
+        } else if (memcmp(data + pos, "data", 4) == 0) {
+            wav->data_offset = pos + 8;
+            return wav->byte_rate > 0 && wav->block_align > 0;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    return false;
+}
+
+esp_err_t format_probe_file(const char *path, format_probe_info_t *info)
+{
+    uint8_t data[FORMAT_PROBE_BYTES];
+    memset(info, 0, sizeof(*info));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Unable to open %s", path);
+        return ESP_FAIL;
+    }
+    size_t length = fread(data, 1, sizeof(data), file);
+    size_t skip = format_probe_id3_size(data, length);
+    if (skip >= length && skip > 0) {
+        /* Cover art makes for tags larger than the buffer */
+        length = fseek(file, skip, SEEK_SET) == 0 ? fread(data, 1, sizeof(data), file) : 0;
+        skip = 0;
+    }
+    fclose(file);
+    if (format_probe_buffer(data + skip, length - skip, info) == FORMAT_PROBE_UNKNOWN) {
+        ESP_LOGW(TAG, "%s: unknown format", path);
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "%s: %s %d Hz %d ch %d bit", path, format_probe_codec_name(info->codec),
+             info->sample_rate, info->channels, info->bits);
+    return ESP_OK;
+}
+
+const char *format_probe_codec_name(format_probe_codec_t codec)
+{
+    switch (codec) {
+        case FORMAT_PROBE_MP3:
+            return "mp3";
+        case FORMAT_PROBE_AAC:
+            return "aac";
+        case FORMAT_PROBE_WAV:
+            return "wav";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/*  Identify the codec of an audio file from its first bytes.
+
+    Knows the formats the player has decoders for: MP3 (MPEG audio frames),
+    AAC in ADTS frames and WAV. A leading ID3v2 tag is skipped. Frame based
+    formats are only accepted if the frame after the first one lines up as
+    well, so a stray 0xFF in a tag does not count as a sync word.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Bytes read from the start of a file (after an ID3v2 tag)
+#define FORMAT_PROBE_BYTES      (2048)
+/// Bytes format_probe_frame() looks at, the longest frame header (ADTS)
+#define FORMAT_PROBE_HEADER_BYTES (7)
+
+typedef enum {
+    FORMAT_PROBE_UNKNOWN = 0,
+    FORMAT_PROBE_MP3,
+    FORMAT_PROBE_AAC,
+    FORMAT_PROBE_WAV,
+} format_probe_codec_t;
+
+typedef struct {
+    format_probe_codec_t codec;
+    int sample_rate;
+    int channels;
+    int bits;
+} format_probe_info_t;
+
+/// One MP3 or ADTS frame
+typedef struct {
+    int length;             ///< bytes, header included
+    int samples;            ///< per channel
+    int sample_rate;
+} format_probe_frame_t;
+
+/// Where the PCM data of a WAV file starts and how it is laid out
+typedef struct {
+    size_t data_offset;     ///< first byte of the data chunk's payload
+    int byte_rate;
+    int block_align;        ///< bytes per sample frame, seeks keep to multiples
+} format_probe_wav_t;
+
+/// Size of the ID3v2 tag at the start of @p data, 0 if there is none
+size_t format_probe_id3_size(const uint8_t *data, size_t length);
+
+/// Identify the format from the first @p length bytes after any ID3v2 tag.
+/// returns the codec, also stored in @p info together with what the header tells
+format_probe_codec_t format_probe_buffer(const uint8_t *data, size_t length, format_probe_info_t *info);
+
+/// Parse the frame header at @p data, FORMAT_PROBE_HEADER_BYTES long, as a
+/// frame of @p codec (MP3 or AAC). returns false if it is not a frame header
+bool format_probe_frame(format_probe_codec_t codec, const uint8_t *data, format_probe_frame_t *frame);
+
+/// Find the data chunk in the first @p length bytes of a WAV file.
+/// returns false if it is not a WAV file or the data chunk is not in the buffer
+bool format_probe_wav_layout(const uint8_t *data, size_t length, format_probe_wav_t *wav);
+
+/// Read the start of @p path and identify it.
+/// returns ESP_OK if the format is known, ESP_FAIL otherwise (codec FORMAT_PROBE_UNKNOWN)
+esp_err_t format_probe_file(const char *path, format_probe_info_t *info);
+
+const char *format_probe_codec_name(format_probe_codec_t codec);
+
+#ifdef __cplusplus
+}
+#endif
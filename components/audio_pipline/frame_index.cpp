@@ -0,0 +1,440 @@
+/*  Seek tables for the tracks on the SD card, see frame_index.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "frame_index.hpp"
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "io_arbiter.h"
+}
+
+#include <algorithm>
+
+static const char *TAG = "FRAME_INDEX";
+
+#define FRAME_INDEX_MAGIC       0x58444946  // "FIDX"
+#define FRAME_INDEX_VERSION     1
+/// Read at once when a seek has to extend a table
+#define FRAME_INDEX_SCAN_CHUNK  (16 * 1024)
+/// The data chunk of a WAV file has to start within this many bytes
+#define FRAME_INDEX_WAV_HEADER  (4096)
+
+FrameIndex::FrameIndex(size_t files, bool save)
+    : files(files), save_files(save)
+{
+    // Never reallocated, fed points into it
+    tables.reserve(files);
+}
+
+std::string FrameIndex::index_path(const std::string& path){
+    return path + ".idx";
+}
+
+FrameIndex::Table* FrameIndex::find(const std::string& path){
+    for (auto& table : tables){
+        if (table.path == path){
+            table.used = ++clock;
+            return &table;
+        }
+    }
+    return nullptr;
+}
+
+void FrameIndex::track(const std::string& path, const format_probe_info_t& format){
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (find(path) != nullptr){
+        return;
+    }
+    Table* table;
+    if (tables.size() < files){
+        tables.emplace_back();
+        table = &tables.back();
+    } else {
+        table = &*std::min_element(tables.begin(), tables.end(),
+            [](const Table& a, const Table& b){ return a.used < b.used; });
+        *table = Table();
+        fed = nullptr;
+    }
+    table->path = path;
+    table->codec = format.codec;
+    // Only frame based formats are scanned
+    table->complete = format.codec != FORMAT_PROBE_MP3 && format.codec != FORMAT_PROBE_AAC;
+    table->used = ++clock;
+}
+
+void FrameIndex::scan(Table& table, int64_t offset, const uint8_t *data, size_t length){
+    if (table.complete){
+        return;
+    }
+    int64_t end = offset + length;
+    if (length == 0){
+        // End of the file, complete if every byte before it was scanned
+        if (table.scan_pos + (int64_t)table.carry_len >= offset && !table.points.empty()){
+            table.complete = true;
+            table.dirty = save_files;
+            ESP_LOGI(TAG, "%s: %u seek points", table.path.c_str(), (unsigned)table.points.size());
+        }
+        return;
+    }
+    if (table.scan_pos == 0 && offset == 0){
+        table.scan_pos = format_probe_id3_size(data, length);
+    }
+    if (table.carry_len > 0){
+        if (offset != table.scan_pos + (int64_t)table.carry_len){
+            // Not the bytes after the carried ones, wait for the reader to come back
+            return;
+        }
+        // The carried bytes and the start of this chunk, from scan_pos on
+        uint8_t joined[2 * FORMAT_PROBE_HEADER_BYTES];
+        size_t n = std::min((size_t)FORMAT_PROBE_HEADER_BYTES, length);
+        memcpy(joined, table.carry, table.carry_len);
+        memcpy(joined + table.carry_len, data, n);
+        int64_t base = table.scan_pos;
+        int64_t joined_end = offset + n;
+        table.carry_len = 0;
+        while (table.scan_pos < offset && table.scan_pos + FORMAT_PROBE_HEADER_BYTES <= joined_end){
+            step(table, joined + (table.scan_pos - base));
+        }
+        if (table.scan_pos < offset){
+            // A chunk shorter than a header
+            table.carry_len = joined_end - table.scan_pos;
+            memcpy(table.carry, joined + (table.scan_pos - base), table.carry_len);
+            return;
+        }
+    }
+    if (table.scan_pos < offset || table.scan_pos >= end){
+        return;
+    }
+    while (table.scan_pos + FORMAT_PROBE_HEADER_BYTES <= end){
+        step(table, data + (table.scan_pos - offset));
+    }
+    if (table.scan_pos < end){
+        // Header cut in two by the end of the chunk
+        table.carry_len = end - table.scan_pos;
+        memcpy(table.carry, data + (table.scan_pos - offset), table.carry_len);
+    }
+}
+
+void FrameIndex::step(Table& table, const uint8_t *header){
+    format_probe_frame_t frame;
+    if (header[0] == 0xff && format_probe_frame(table.codec, header, &frame)){
+        if (table.sample_rate == 0){
+            table.sample_rate = frame.sample_rate;
+        }
+        int64_t ms = (int64_t)(table.samples * 1000 / table.sample_rate);
+        while ((int64_t)table.points.size() * STEP_MS <= ms){
+            table.points.push_back((uint32_t)table.scan_pos);
+        }
+        table.samples += frame.samples;
+        table.scan_pos += frame.length;
+    } else {
+        // Lost sync, tags and junk between frames
+        table.scan_pos++;
+    }
+}
+
+void FrameIndex::feed(const char *path, int64_t offset, const uint8_t *data, size_t length){
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (fed == nullptr || fed->path != path){
+        fed = nullptr;
+        for (auto& table : tables){
+            if (table.path == path){
+                fed = &table;
+                break;
+            }
+        }
+        if (fed == nullptr){
+            return;
+        }
+    }
+    scan(*fed, offset, data, length);
+}
+
+uint64_t FrameIndex::extend(Table& table, int64_t position_ms){
+    size_t wanted = position_ms / STEP_MS + 1;
+    FILE *file = fopen(table.path.c_str(), "rb");
+    if (file == NULL){
+        ESP_LOGE(TAG, "Unable to open %s", table.path.c_str());
+        return 0;
+    }
+    // Start over at the last complete frame, a carried header is read again
+    table.carry_len = 0;
+    int64_t offset = table.scan_pos;
+    fseek(file, offset, SEEK_SET);
+    int64_t start_pos = offset;
+    std::vector<uint8_t> chunk(FRAME_INDEX_SCAN_CHUNK);
+    while (!table.complete && table.points.size() < wanted){
+        // The player waits for the seek, the card is its
+        int64_t start = io_arbiter_begin(IO_ARBITER_AUDIO);
+        size_t n = fread(chunk.data(), 1, chunk.size(), file);
+        io_arbiter_end(IO_ARBITER_AUDIO, start, n);
+        scan(table, offset, chunk.data(), n);
+        offset += n;
+        if (n == 0){
+            break;
+        }
+    }
+    fclose(file);
+    return offset - start_pos;
+}
+
+bool FrameIndex::load(const std::string& path, format_probe_codec_t codec, std::vector<uint32_t>& points){
+    std::string idx = index_path(path);
+    FILE *file = fopen(idx.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    FileHeader header;
+    struct stat st;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == FRAME_INDEX_MAGIC && header.version == FRAME_INDEX_VERSION
+        && header.codec == codec && header.step_ms == STEP_MS && header.points > 0
+        && stat(path.c_str(), &st) == 0
+        && header.file_size == (int64_t)st.st_size && header.file_mtime == (int64_t)st.st_mtime;
+    if (valid){
+        points.resize(header.points);
+        valid = fread(points.data(), sizeof(uint32_t), header.points, file) == header.points;
+    }
+    fclose(file);
+    if (!valid){
+        // Stale or cut short, rebuilt and saved again at the end of the file
+        ESP_LOGW(TAG, "%s is out of date", idx.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FrameIndex::store(Table& table){
+    struct stat st;
+    if (stat(table.path.c_str(), &st) != 0){
+        return false;
+    }
+    FileHeader header = {
+        .magic = FRAME_INDEX_MAGIC,
+        .version = FRAME_INDEX_VERSION,
+        .codec = (uint8_t)table.codec,
+        .reserved = 0,
+        .step_ms = STEP_MS,
+        .points = (uint32_t)table.points.size(),
+        .file_size = (int64_t)st.st_size,
+        .file_mtime = (int64_t)st.st_mtime,
+    };
+    std::string idx = index_path(table.path);
+    FILE *file = fopen(idx.c_str(), "wb");
+    if (file == NULL){
+        ESP_LOGE(TAG, "Unable to write %s", idx.c_str());
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(table.points.data(), sizeof(uint32_t), table.points.size(), file) == table.points.size();
+    fclose(file);
+    if (!written){
+        remove(idx.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FrameIndex::read_wav_header(const std::string& path, format_probe_wav_t& wav, std::vector<uint8_t>& header){
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL){
+        ESP_LOGE(TAG, "Unable to open %s", path.c_str());
+        return false;
+    }
+    std::vector<uint8_t> data(FRAME_INDEX_WAV_HEADER);
+    int64_t start = io_arbiter_begin(IO_ARBITER_AUDIO);
+    size_t n = fread(data.data(), 1, data.size(), file);
+    io_arbiter_end(IO_ARBITER_AUDIO, start, n);
+    fclose(file);
+    if (!format_probe_wav_layout(data.data(), n, &wav) || wav.data_offset > n){
+        ESP_LOGW(TAG, "%s: no data chunk in the first %d bytes", path.c_str(), FRAME_INDEX_WAV_HEADER);
+        return false;
+    }
+    header.assign(data.begin(), data.begin() + wav.data_offset);
+    return true;
+}
+
+FrameIndex::Table* FrameIndex::loaded(std::unique_lock<std::mutex>& lock, Table* table){
+    if (table->complete || table->load_tried){
+        return table;
+    }
+    table->load_tried = true;
+    if (!save_files){
+        return table;
+    }
+    std::string path = table->path;
+    format_probe_codec_t codec = table->codec;
+    std::vector<uint32_t> points;
+    lock.unlock();
+    bool valid = load(path, codec, points);
+    lock.lock();
+    table = find(path);
+    if (valid && table != nullptr && !table->complete){
+        table->points.swap(points);
+        table->complete = true;
+        table->dirty = false;
+        counters.loaded++;
+    }
+    return table;
+}
+
+FrameIndex::Table* FrameIndex::extended(std::unique_lock<std::mutex>& lock, Table* table, int64_t position_ms){
+    // Scanned on a copy, the reader goes on feeding the table meanwhile
+    Table copy;
+    copy.path = table->path;
+    copy.codec = table->codec;
+    copy.points = table->points;
+    copy.scan_pos = table->scan_pos;
+    copy.samples = table->samples;
+    copy.sample_rate = table->sample_rate;
+    lock.unlock();
+    uint64_t scanned = extend(copy, position_ms);
+    lock.lock();
+    counters.scanned_bytes += scanned;
+    table = find(copy.path);
+    // Unless the reader got further in the meantime
+    if (table != nullptr && !table->complete && copy.scan_pos > table->scan_pos){
+        table->points.swap(copy.points);
+        table->scan_pos = copy.scan_pos;
+        table->samples = copy.samples;
+        table->sample_rate = copy.sample_rate;
+        memcpy(table->carry, copy.carry, copy.carry_len);
+        table->carry_len = copy.carry_len;
+        table->complete = copy.complete;
+        table->dirty = copy.dirty;
+    }
+    return table;
+}
+
+FrameIndex::Table* FrameIndex::with_wav_header(std::unique_lock<std::mutex>& lock, Table* table){
+    if (!table->header.empty()){
+        return table;
+    }
+    std::string path = table->path;
+    format_probe_wav_t wav;
+    std::vector<uint8_t> header;
+    lock.unlock();
+    bool valid = read_wav_header(path, wav, header);
+    lock.lock();
+    table = find(path);
+    if (table == nullptr || !valid){
+        return nullptr;
+    }
+    if (table->header.empty()){
+        table->wav = wav;
+        table->header.swap(header);
+    }
+    return table;
+}
+
+int64_t FrameIndex::seek(const std::string& path, int64_t position_ms, int64_t& landed_ms){
+    std::unique_lock<std::mutex> lock(mutex);
+    Table* table = find(path);
+    if (table == nullptr || position_ms < 0){
+        return -1;
+    }
+    counters.seeks++;
+    if (table->codec == FORMAT_PROBE_WAV){
+        table = with_wav_header(lock, table);
+        if (table == nullptr){
+            return -1;
+        }
+        int64_t bytes = position_ms * table->wav.byte_rate / 1000;
+        bytes -= bytes % table->wav.block_align;
+        landed_ms = bytes * 1000 / table->wav.byte_rate;
+        return table->wav.data_offset + bytes;
+    }
+    size_t point = position_ms / STEP_MS;
+    if (point >= table->points.size()){
+        table = loaded(lock, table);
+    }
+    if (table != nullptr && !table->complete && point >= table->points.size()){
+        table = extended(lock, table, position_ms);
+    }
+    if (table == nullptr || point >= table->points.size()){
+        return -1;
+    }
+    landed_ms = (int64_t)point * STEP_MS;
+    return table->points[point];
+}
+
+int64_t FrameIndex::align(const std::string& path, int64_t byte_pos){
+    std::unique_lock<std::mutex> lock(mutex);
+    Table* table = find(path);
+    if (table == nullptr){
+        return byte_pos;
+    }
+    if (table->codec == FORMAT_PROBE_WAV){
+        table = with_wav_header(lock, table);
+        if (table == nullptr){
+            return 0;
+        }
+        if (byte_pos < (int64_t)table->wav.data_offset){
+            return 0;
+        }
+        int64_t bytes = byte_pos - table->wav.data_offset;
+        return table->wav.data_offset + bytes - bytes % table->wav.block_align;
+    }
+    if (byte_pos >= table->scan_pos){
+        table = loaded(lock, table);
+    }
+    if (table == nullptr){
+        return byte_pos;
+    }
+    if (!table->complete && byte_pos >= table->scan_pos){
+        return byte_pos;
+    }
+    auto it = std::upper_bound(table->points.begin(), table->points.end(), (uint32_t)byte_pos);
+    if (it == table->points.begin()){
+        return byte_pos;
+    }
+    return *(it - 1);
+}
+
+bool FrameIndex::wav_header(const std::string& path, std::vector<uint8_t>& header){
+    std::unique_lock<std::mutex> lock(mutex);
+    Table* table = find(path);
+    if (table == nullptr || table->codec != FORMAT_PROBE_WAV){
+        return false;
+    }
+    table = with_wav_header(lock, table);
+    if (table == nullptr){
+        return false;
+    }
+    header = table->header;
+    return true;
+}
+
+void FrameIndex::save(){
+    if (!save_files){
+        return;
+    }
+    for (size_t i = 0; i < files; i++){
+        // Written without the lock, feed() must not wait for the SD card
+        Table copy;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (i >= tables.size() || !tables[i].dirty){
+                continue;
+            }
+            tables[i].dirty = false;
+            copy.path = tables[i].path;
+            copy.codec = tables[i].codec;
+            copy.points = tables[i].points;
+        }
+        if (store(copy)){
+            const std::lock_guard<std::mutex> lock(mutex);
+            counters.saved++;
+        }
+    }
+}
+
+FrameIndex::Stats FrameIndex::stats(){
+    const std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "format_probe.h"
+}
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+/// Seek tables of the tracks that were played last.
+///
+/// For MP3 and AAC (ADTS) a table holds the byte offset of the first frame
+/// at or after every second of audio. Tables grow while a track plays: the
+/// reader feeds everything it reads, so the played part is indexed without
+/// touching the SD card again. A seek past the indexed part scans only the
+/// rest up to the target. Once a table reaches the end of its file it is
+/// saved next to it as <file>.idx and loaded from there on later plays, so
+/// a seek costs one read of the table and one fseek, however long the file.
+/// WAV files need no table, their offsets follow from the byte rate; only
+/// their header is kept, the decoder needs it before data from the middle.
+class FrameIndex
+{
+  public:
+    static constexpr int STEP_MS = 1000;
+
+    struct Stats{
+        unsigned loaded = 0;            ///< tables read from a .idx file
+        unsigned saved = 0;
+        unsigned seeks = 0;
+        uint64_t scanned_bytes = 0;     ///< read from the SD card only to extend a table
+    };
+
+    /// Keep the tables of @p files tracks, save them next to the tracks if @p save
+    FrameIndex(size_t files, bool save);
+    FrameIndex(const FrameIndex&) = delete;
+    FrameIndex& operator=(const FrameIndex&) = delete;
+
+    /// @p path is about to be played, start or find its table. From loop() only.
+    void track(const std::string& path, const format_probe_info_t& format);
+    /// Reader task: @p length bytes of @p path read at @p offset, length 0 at
+    /// the end of the file. Only extends a table they continue. Neither
+    /// allocates nor touches the SD card unless the table has to grow.
+    void feed(const char *path, int64_t offset, const uint8_t *data, size_t length);
+    /// Byte offset to read @p path from to play it from @p position_ms, the
+    /// seek point at or before. @p landed_ms is where playback starts then.
+    /// Scans the file up to there if needed. -1 if there is no such position.
+    int64_t seek(const std::string& path, int64_t position_ms, int64_t& landed_ms);
+    /// Move @p byte_pos back to the closest known seek point, for resuming
+    /// at a frame boundary. Unchanged if the table does not reach that far.
+    int64_t align(const std::string& path, int64_t byte_pos);
+    /// Copy the header of the WAV file @p path to @p header
+    bool wav_header(const std::string& path, std::vector<uint8_t>& header);
+    /// Write the tables that reached the end of their file since they were loaded
+    void save();
+
+    Stats stats();
+
+  private:
+    struct Table{
+        std::string path;
+        format_probe_codec_t codec;
+        std::vector<uint32_t> points;   ///< offset of the first frame at or after i * STEP_MS
+        int64_t scan_pos = 0;           ///< next frame header expected here
+        uint64_t samples = 0;           ///< per channel, before scan_pos
+        int sample_rate = 0;
+        uint8_t carry[FORMAT_PROBE_HEADER_BYTES];
+        size_t carry_len = 0;           ///< start of a header cut off by the end of a chunk, from scan_pos
+        bool complete = false;
+        bool dirty = false;             ///< complete and not on the SD card
+        bool load_tried = false;
+        format_probe_wav_t wav = {};
+        std::vector<uint8_t> header;    ///< WAV only
+        uint32_t used = 0;
+    };
+    struct FileHeader{
+        uint32_t magic;
+        uint16_t version;
+        uint8_t codec;
+        uint8_t reserved;
+        uint32_t step_ms;
+        uint32_t points;
+        int64_t file_size;
+        int64_t file_mtime;
+    };
+
+    Table* find(const std::string& path);
+    /// Scan @p length bytes at @p offset into @p table
+    void scan(Table& table, int64_t offset, const uint8_t *data, size_t length);
+    /// Index the frame whose header is at scan_pos, or skip a byte if there is none
+    void step(Table& table, const uint8_t *header);
+    /// Read the file until @p table covers @p position_ms or the file ends.
+    /// Returns the bytes read.
+    uint64_t extend(Table& table, int64_t position_ms);
+    static bool load(const std::string& path, format_probe_codec_t codec, std::vector<uint32_t>& points);
+    bool store(Table& table);
+    static bool read_wav_header(const std::string& path, format_probe_wav_t& wav, std::vector<uint8_t>& header);
+    static std::string index_path(const std::string& path);
+
+    // With @p lock held. They touch the SD card without it, so feed() never
+    // waits for the card, and return the table of @p table's path found
+    // again afterwards, nullptr if it was replaced meanwhile.
+    /// Load the .idx file once
+    Table* loaded(std::unique_lock<std::mutex>& lock, Table* table);
+    /// Scan from scan_pos on, see extend()
+    Table* extended(std::unique_lock<std::mutex>& lock, Table* table, int64_t position_ms);
+    /// Read the header of a WAV file once
+    Table* with_wav_header(std::unique_lock<std::mutex>& lock, Table* table);
+
+    size_t files;
+    bool save_files;
+    std::vector<Table> tables;
+    Table* fed = nullptr;               ///< table of the last feed(), saves the lookup
+    uint32_t clock = 0;
+    Stats counters;
+    std::mutex mutex;
+};
@@ -0,0 +1,237 @@
+/*  Counters and histograms of the playback pipeline, see pipeline_health.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "pipeline_health.hpp"
+extern "C" {
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+}
+
+static const char *TAG = "PIPELINE_HEALTH";
+
+PipelineHealth::PipelineHealth(int sample_ms, int64_t dump_interval_us)
+    : created_us(esp_timer_get_time()),
+    dump_interval_us(dump_interval_us),
+    dumped_us(created_us)
+{
+    for (auto& min : mins){
+        min.store(UINT32_MAX, std::memory_order_relaxed);
+    }
+    if (sample_ms <= 0){
+        return;
+    }
+    esp_timer_create_args_t args = {
+        .callback = &PipelineHealth::on_sample,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pipeline_health",
+        .skip_unhandled_events = true,
+    };
+    if (esp_timer_create(&args, &timer) != ESP_OK){
+        ESP_LOGE(TAG, "Unable to create the sampling timer");
+        timer = nullptr;
+        return;
+    }
+    esp_timer_start_periodic(timer, sample_ms * 1000ULL);
+}
+
+PipelineHealth::~PipelineHealth(){
+    if (timer){
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+    }
+}
+
+bool PipelineHealth::linear(Histogram histogram){
+    return histogram == READ_FILL || histogram == DECODE_FILL || histogram == OUTPUT_FILL;
+}
+
+int PipelineHealth::bucket(Histogram histogram, uint32_t value){
+    if (linear(histogram)){
+        // 10% steps, 100% gets a bucket of its own
+        return value >= 100 ? 10 : value / 10;
+    }
+    // 0, 1, 2-3, 4-7, ...
+    int b = value == 0 ? 0 : 32 - __builtin_clz(value);
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+uint32_t PipelineHealth::bucket_value(Histogram histogram, int bucket){
+    if (linear(histogram)){
+        return bucket * 10;
+    }
+    return bucket == 0 ? 0 : (uint32_t)((1ULL << bucket) - 1);
+}
+
+void PipelineHealth::record(Histogram histogram, uint32_t value){
+    buckets[histogram][bucket(histogram, value)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t min = mins[histogram].load(std::memory_order_relaxed);
+    while (value < min && !mins[histogram].compare_exchange_weak(min, value, std::memory_order_relaxed)){
+    }
+    uint32_t max = maxs[histogram].load(std::memory_order_relaxed);
+    while (value > max && !maxs[histogram].compare_exchange_weak(max, value, std::memory_order_relaxed)){
+    }
+}
+
+void PipelineHealth::link(audio_element_handle_t reader, audio_element_handle_t decoder, audio_element_handle_t writer){
+    rings[READ_LINK].store(audio_element_get_output_ringbuf(reader), std::memory_order_relaxed);
+    rings[DECODE_LINK].store(audio_element_get_output_ringbuf(decoder), std::memory_order_relaxed);
+    rings[OUTPUT_LINK].store(audio_element_get_input_ringbuf(writer), std::memory_order_relaxed);
+    this->reader.store(reader, std::memory_order_relaxed);
+    this->decoder.store(decoder, std::memory_order_relaxed);
+}
+
+void PipelineHealth::set_active(bool active){
+    int64_t now = esp_timer_get_time();
+    if (active && !this->active.load(std::memory_order_relaxed)){
+        active_since_us.store(now, std::memory_order_relaxed);
+    } else if (!active && this->active.load(std::memory_order_relaxed)){
+        active_us.fetch_add(now - active_since_us.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    if (active){
+        runs.fetch_add(1, std::memory_order_relaxed);
+    }
+    this->active.store(active, std::memory_order_release);
+}
+
+void PipelineHealth::on_sample(void *arg){
+    static_cast<PipelineHealth *>(arg)->sample();
+}
+
+void PipelineHealth::sample(){
+    if (!active.load(std::memory_order_acquire)){
+        return;
+    }
+    uint32_t run = runs.load(std::memory_order_relaxed);
+    if (run != sampled_run){
+        sampled_run = run;
+        primed = false;
+        dry = false;
+    }
+    ringbuf_handle_t output = rings[OUTPUT_LINK].load(std::memory_order_relaxed);
+    if (output == NULL){
+        return;
+    }
+    if (rb_bytes_filled(output) > 0){
+        primed = true;
+        dry = false;
+    } else if (primed && !dry){
+        // At the end of the last track the ring drains after the reader
+        // finished, that is no underrun. Every dry spell counts once.
+        audio_element_handle_t el = reader.load(std::memory_order_relaxed);
+        if (el && audio_element_get_state(el) == AEL_STATE_RUNNING){
+            count(UNDERRUNS);
+        }
+        dry = true;
+    }
+    if (!primed){
+        // Until the first frame of a run arrives the rings are empty anyway
+        return;
+    }
+    count(SAMPLES);
+    for (int link = 0; link < LINK_COUNT; link++){
+        ringbuf_handle_t rb = rings[link].load(std::memory_order_relaxed);
+        int size = rb ? rb_get_size(rb) : 0;
+        if (size > 0){
+            record(static_cast<Histogram>(READ_FILL + link), (uint32_t)rb_bytes_filled(rb) * 100 / size);
+        }
+    }
+}
+
+PipelineHealth::Snapshot PipelineHealth::snapshot() const{
+    Snapshot snapshot;
+    snapshot.uptime_us = esp_timer_get_time() - created_us;
+    for (int c = 0; c < COUNTER_COUNT; c++){
+        snapshot.counters[c] = counters[c].load(std::memory_order_relaxed);
+    }
+    for (int h = 0; h < HISTOGRAM_COUNT; h++){
+        Histogram histogram = static_cast<Histogram>(h);
+        std::array<uint32_t, BUCKETS> counts;
+        uint32_t total = 0;
+        for (int b = 0; b < BUCKETS; b++){
+            counts[b] = buckets[h][b].load(std::memory_order_relaxed);
+            total += counts[b];
+        }
+        Summary& summary = snapshot.histograms[h];
+        summary.count = total;
+        if (total == 0){
+            continue;
+        }
+        summary.min = mins[h].load(std::memory_order_relaxed);
+        summary.max = maxs[h].load(std::memory_order_relaxed);
+        // Fill levels are worst at the low end, counts and times at the high end
+        bool low = linear(histogram);
+        uint64_t p50 = ((uint64_t)total * 50 + 99) / 100;
+        uint64_t p99 = low ? ((uint64_t)total + 99) / 100 : ((uint64_t)total * 99 + 99) / 100;
+        uint64_t seen = 0;
+        bool p50_set = false;
+        bool p99_set = false;
+        for (int b = 0; b < BUCKETS; b++){
+            seen += counts[b];
+            if (!p50_set && seen >= p50){
+                summary.p50 = bucket_value(histogram, b);
+                p50_set = true;
+            }
+            if (!p99_set && seen >= p99){
+                summary.p99 = bucket_value(histogram, b);
+                p99_set = true;
+            }
+        }
+        if (!low){
+            summary.p50 = summary.p50 < summary.max ? summary.p50 : summary.max;
+            summary.p99 = summary.p99 < summary.max ? summary.p99 : summary.max;
+        }
+    }
+    snapshot.internal_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    snapshot.internal_min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    snapshot.psram_free = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    snapshot.psram_min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    snapshot.decoder_us_per_s = decoder_us_per_s.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void PipelineHealth::dump(bool force){
+    int64_t now = esp_timer_get_time();
+    if (!force && (dump_interval_us <= 0 || now - dumped_us < dump_interval_us)){
+        return;
+    }
+    dumped_us = now;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_USE_TRACE_FACILITY
+    // The element task carries the tag of its element
+    audio_element_handle_t el = decoder.load(std::memory_order_relaxed);
+    TaskHandle_t task = el ? xTaskGetHandle(audio_element_get_tag(el)) : NULL;
+    int64_t played = active_us.load(std::memory_order_relaxed);
+    if (active.load(std::memory_order_relaxed)){
+        played += now - active_since_us.load(std::memory_order_relaxed);
+    }
+    if (task){
+        TaskStatus_t status;
+        vTaskGetInfo(task, &status, pdFALSE, eInvalid);
+        int64_t runtime = status.ulRunTimeCounter;
+        if (played > played_us && runtime >= decoder_runtime && decoder_runtime > 0){
+            decoder_us_per_s = (int32_t)((runtime - decoder_runtime) * 1000000 / (played - played_us));
+        }
+        decoder_runtime = runtime;
+    }
+    played_us = played;
+#endif
+    Snapshot s = snapshot();
+    const Summary& read = s.histograms[READ_FILL];
+    const Summary& decode = s.histograms[DECODE_FILL];
+    const Summary& output = s.histograms[OUTPUT_FILL];
+    const Summary& backlog = s.histograms[EVENT_BACKLOG];
+    const Summary& start = s.histograms[START_MS];
+    ESP_LOGI(TAG, "up %lld s, %u events %u wakeups %u tracks %u underruns, "
+        "fill %% p1/p50 read %u/%u decode %u/%u out %u/%u, backlog p99 %u max %u, "
+        "start ms p50 %u p99 %u max %u, heap KB %u min %u, psram KB %u min %u, decoder %d us/s",
+        (long long)(s.uptime_us / 1000000), s.counters[EVENTS], s.counters[WAKEUPS], s.counters[TRACKS],
+        s.counters[UNDERRUNS], read.p99, read.p50, decode.p99, decode.p50, output.p99, output.p50,
+        backlog.p99, backlog.max, start.p50, start.p99, start.max,
+        (unsigned)(s.internal_free / 1024), (unsigned)(s.internal_min_free / 1024),
+        (unsigned)(s.psram_free / 1024), (unsigned)(s.psram_min_free / 1024), (int)s.decoder_us_per_s);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "audio_element.h"
+}
+
+#include <array>
+#include <atomic>
+
+/// Counters and histograms of the playback pipeline.
+///
+/// Recording is a relaxed atomic add, so the audio tasks, the player loop
+/// and the sampling timer never lock, allocate or log for it. A periodic
+/// esp_timer samples how full the ring buffers between the elements are;
+/// the ring in front of the i2s writer running dry while the reader still
+/// has data counts as an underrun, the i2s driver itself does not report
+/// them. snapshot() copies everything at any time, dump() writes it as one
+/// log line.
+class PipelineHealth
+{
+  public:
+    enum Counter{
+        EVENTS,         ///< messages handled by the player loop
+        WAKEUPS,        ///< the player loop woke up without a message
+        TRACKS,         ///< tracks started, chained ones included
+        UNDERRUNS,      ///< the i2s writer found its ring empty while playing
+        SAMPLES,        ///< ring buffer samples taken while playing
+        COUNTER_COUNT
+    };
+    enum Histogram{
+        READ_FILL,      ///< % of the reader -> decoder ring in use
+        DECODE_FILL,    ///< % of the decoder output ring in use
+        OUTPUT_FILL,    ///< % of the ring in front of the i2s writer in use
+        EVENT_BACKLOG,  ///< messages the player loop found waiting at once
+        START_MS,       ///< from start(tag) to the first decoded frame
+        HISTOGRAM_COUNT
+    };
+    static constexpr int BUCKETS = 16;
+
+    /// p99 is the worst percent: the 99th percentile of counts and times,
+    /// the 1st of fill levels. Percentiles are rounded to the pessimistic
+    /// end of their bucket.
+    struct Summary{
+        uint32_t count = 0;
+        uint32_t min = 0;
+        uint32_t p50 = 0;
+        uint32_t p99 = 0;
+        uint32_t max = 0;
+    };
+    struct Snapshot{
+        int64_t uptime_us = 0;
+        std::array<uint32_t, COUNTER_COUNT> counters = {};
+        std::array<Summary, HISTOGRAM_COUNT> histograms = {};
+        size_t internal_free = 0;
+        size_t internal_min_free = 0;   ///< low watermark since boot
+        size_t psram_free = 0;
+        size_t psram_min_free = 0;
+        /// Decoder task CPU time per second of playback between the last two
+        /// dumps, -1 without CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        int32_t decoder_us_per_s = -1;
+    };
+
+    /// Sample the rings every @p sample_ms, 0 never. dump(false) logs at
+    /// most every @p dump_interval_us, 0 never.
+    PipelineHealth(int sample_ms, int64_t dump_interval_us);
+    ~PipelineHealth();
+
+    void count(Counter counter, uint32_t n = 1){
+        counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+    void record(Histogram histogram, uint32_t value);
+
+    /// Watch the rings of the linked branch. @p decoder feeds @p writer
+    /// directly or through the resampler.
+    void link(audio_element_handle_t reader, audio_element_handle_t decoder, audio_element_handle_t writer);
+    /// Between run and stop, false while paused. Rings of a stopped or
+    /// paused pipeline are empty on purpose and not sampled.
+    void set_active(bool active);
+
+    Snapshot snapshot() const;
+    /// Log the snapshot in one line if @p force or the dump interval passed
+    void dump(bool force);
+
+  private:
+    enum Link{
+        READ_LINK,
+        DECODE_LINK,
+        OUTPUT_LINK,
+        LINK_COUNT
+    };
+    static void on_sample(void *arg);
+    void sample();
+    static bool linear(Histogram histogram);
+    static int bucket(Histogram histogram, uint32_t value);
+    static uint32_t bucket_value(Histogram histogram, int bucket);
+
+    std::array<std::atomic<uint32_t>, COUNTER_COUNT> counters{};
+    std::array<std::array<std::atomic<uint32_t>, BUCKETS>, HISTOGRAM_COUNT> buckets{};
+    std::array<std::atomic<uint32_t>, HISTOGRAM_COUNT> mins{};
+    std::array<std::atomic<uint32_t>, HISTOGRAM_COUNT> maxs{};
+
+    std::array<std::atomic<ringbuf_handle_t>, LINK_COUNT> rings{};
+    std::atomic<audio_element_handle_t> reader{nullptr};
+    std::atomic<audio_element_handle_t> decoder{nullptr};
+    std::atomic<bool> active{false};
+    /// Bumped by every set_active(true)
+    std::atomic<uint32_t> runs{0};
+    /// Only touched by the timer: the output ring had data since run
+    /// sampled_run started, empty before that is no underrun
+    uint32_t sampled_run = 0;
+    bool primed = false;
+    bool dry = false;
+
+    esp_timer_handle_t timer = nullptr;
+    int64_t created_us;
+    int64_t dump_interval_us;
+    /// Only touched by dump()
+    int64_t dumped_us;
+    int64_t decoder_runtime = 0;
+    int64_t played_us = 0;
+    std::atomic<int64_t> active_since_us{0};
+    std::atomic<int64_t> active_us{0};
+    std::atomic<int32_t> decoder_us_per_s{-1};
+};
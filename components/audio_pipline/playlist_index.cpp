@@ -0,0 +1,330 @@
+/*  Binary playlist index, see playlist_index.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "playlist_index.hpp"
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+}
+
+#include <algorithm>
+
+static const char *TAG = "PLAYLIST_INDEX";
+
+#define PLAYLIST_INDEX_MAGIC    0x58444950  // "PIDX"
+#define PLAYLIST_INDEX_VERSION  2
+#define PLAYLIST_LINE_MAX       256
+
+/// Playlists are named after the decimal tag serial, anything else is not indexed
+static bool parse_serial(const char *name, size_t len, uint64_t& serial){
+    if (len == 0 || len > 20){
+        return false;
+    }
+    serial = 0;
+    for (size_t i = 0; i < len; i++){
+        if (name[i] < '0' || name[i] > '9'){
+            return false;
+        }
+        serial = serial * 10 + (name[i] - '0');
+    }
+    return true;
+}
+
+PlaylistIndex::PlaylistIndex(const std::string& root, const std::string& index_path)
+    : root(root), index_path(index_path)
+{
+}
+
+std::string PlaylistIndex::txt_path(uint64_t serial) const{
+    return root + "/" + std::to_string(serial) + ".txt";
+}
+
+std::vector<PlaylistIndex::TagRecord>::iterator PlaylistIndex::find(uint64_t serial){
+    auto it = std::lower_bound(tags.begin(), tags.end(), serial,
+        [](const TagRecord& record, uint64_t serial){ return record.serial < serial; });
+    if (it != tags.end() && it->serial == serial){
+        return it;
+    }
+    return tags.end();
+}
+
+bool PlaylistIndex::load(){
+    tags.clear();
+    tracks.clear();
+    strings.clear();
+    garbage = 0;
+    FILE *file = fopen(index_path.c_str(), "rb");
+    if (file == NULL){
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    std::vector<char> blob(length > 0 ? length : 0);
+    bool read = length >= (long)sizeof(Header) && fread(blob.data(), 1, blob.size(), file) == blob.size();
+    fclose(file);
+    if (!read){
+        ESP_LOGW(TAG, "%s is truncated", index_path.c_str());
+        return false;
+    }
+
+    Header header;
+    memcpy(&header, blob.data(), sizeof(header));
+    size_t tags_at = sizeof(Header);
+    size_t tracks_at = tags_at + (size_t)header.tags * sizeof(TagRecord);
+    size_t strings_at = tracks_at + (size_t)header.tracks * sizeof(TrackRecord);
+    if (header.magic != PLAYLIST_INDEX_MAGIC || header.version != PLAYLIST_INDEX_VERSION
+        || strings_at + header.strings != blob.size()
+        || (header.strings > 0 && blob.back() != '\0')){
+        ESP_LOGW(TAG, "%s is invalid, rebuilding", index_path.c_str());
+        return false;
+    }
+    tags.resize(header.tags);
+    tracks.resize(header.tracks);
+    memcpy(tags.data(), blob.data() + tags_at, tags.size() * sizeof(TagRecord));
+    memcpy(tracks.data(), blob.data() + tracks_at, tracks.size() * sizeof(TrackRecord));
+    strings.assign(blob.begin() + strings_at, blob.end());
+    for (auto& tag : tags){
+        if ((size_t)tag.first_track + tag.tracks > tracks.size()){
+            ESP_LOGW(TAG, "%s is invalid, rebuilding", index_path.c_str());
+            tags.clear();
+            return false;
+        }
+    }
+    for (auto& track : tracks){
+        if (track.path >= strings.size()){
+            ESP_LOGW(TAG, "%s is invalid, rebuilding", index_path.c_str());
+            tags.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void PlaylistIndex::compact(){
+    std::vector<TrackRecord> live_tracks;
+    std::vector<char> live_strings;
+    live_tracks.reserve(tracks.size() - garbage);
+    for (auto& tag : tags){
+        uint32_t first = live_tracks.size();
+        for (uint32_t i = 0; i < tag.tracks; i++){
+            TrackRecord track = tracks[tag.first_track + i];
+            const char *path = &strings[track.path];
+            track.path = live_strings.size();
+            live_strings.insert(live_strings.end(), path, path + strlen(path) + 1);
+            live_tracks.push_back(track);
+        }
+        tag.first_track = first;
+    }
+    tracks.swap(live_tracks);
+    strings.swap(live_strings);
+    garbage = 0;
+}
+
+bool PlaylistIndex::save(){
+    if (garbage > 0){
+        compact();
+    }
+    // Written next to the old one and renamed, so a reset never leaves half an index
+    std::string tmp_path = index_path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL){
+        ESP_LOGE(TAG, "Unable to write %s", tmp_path.c_str());
+        return false;
+    }
+    Header header = {
+        .magic = PLAYLIST_INDEX_MAGIC,
+        .version = PLAYLIST_INDEX_VERSION,
+        .reserved = 0,
+        .tags = (uint32_t)tags.size(),
+        .tracks = (uint32_t)tracks.size(),
+        .strings = (uint32_t)strings.size(),
+    };
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(tags.data(), sizeof(TagRecord), tags.size(), file) == tags.size()
+        && fwrite(tracks.data(), sizeof(TrackRecord), tracks.size(), file) == tracks.size()
+        && fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+    written = (fclose(file) == 0) && written;
+    if (!written){
+        ESP_LOGE(TAG, "Unable to write %s", tmp_path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    // FAT does not replace an existing file on rename
+    unlink(index_path.c_str());
+    if (rename(tmp_path.c_str(), index_path.c_str()) != 0){
+        ESP_LOGE(TAG, "Unable to rename %s", tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PlaylistIndex::parse(uint64_t serial, TagRecord& record){
+    FILE *file = fopen(txt_path(serial).c_str(), "r");
+    if (file == NULL){
+        return false;
+    }
+    record.first_track = tracks.size();
+    record.tracks = 0;
+    char line[PLAYLIST_LINE_MAX];
+    std::string path;
+    while (fgets(line, sizeof(line), file) != NULL){
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0'){
+            continue;
+        }
+        path = root + "/" + line;
+        struct stat st;
+        TrackRecord track = {
+            .path = (uint32_t)strings.size(),
+            .size = stat(path.c_str(), &st) == 0 ? (uint32_t)st.st_size : 0,
+        };
+        if (track.size == 0){
+            ESP_LOGW(TAG, "%" PRIu64 ": %s is missing", serial, path.c_str());
+        } else {
+            // Probed once here, the index is the cache
+            format_probe_file(path.c_str(), &track.format);
+        }
+        strings.insert(strings.end(), line, line + strlen(line) + 1);
+        tracks.push_back(track);
+        record.tracks++;
+    }
+    fclose(file);
+    return true;
+}
+
+bool PlaylistIndex::update(uint64_t serial, bool& exists){
+    struct stat st;
+    exists = stat(txt_path(serial).c_str(), &st) == 0;
+    auto it = find(serial);
+    if (!exists){
+        if (it == tags.end()){
+            return false;
+        }
+        garbage += it->tracks;
+        tags.erase(it);
+        return true;
+    }
+    if (it != tags.end() && it->txt_mtime == (int64_t)st.st_mtime && it->txt_size == (uint32_t)st.st_size){
+        return false;
+    }
+    TagRecord record = {
+        .serial = serial,
+        .txt_mtime = (int64_t)st.st_mtime,
+        .txt_size = (uint32_t)st.st_size,
+        .first_track = 0,
+        .tracks = 0,
+        .reserved = 0,
+    };
+    if (!parse(serial, record)){
+        exists = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Indexed playlist %" PRIu64 ", %u tracks", serial, (unsigned)record.tracks);
+    it = find(serial);
+    if (it != tags.end()){
+        garbage += it->tracks;
+        *it = record;
+    } else {
+        tags.insert(std::upper_bound(tags.begin(), tags.end(), serial,
+            [](uint64_t serial, const TagRecord& record){ return serial < record.serial; }), record);
+    }
+    return true;
+}
+
+int PlaylistIndex::refresh(){
+    const std::lock_guard<std::mutex> lock(mutex);
+    load();
+    std::vector<uint64_t> found;
+    DIR *dir = opendir(root.c_str());
+    if (dir == NULL){
+        ESP_LOGE(TAG, "Unable to open %s", root.c_str());
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL){
+        size_t len = strlen(entry->d_name);
+        uint64_t serial;
+        if (len > 4 && strcasecmp(entry->d_name + len - 4, ".txt") == 0
+            && parse_serial(entry->d_name, len - 4, serial)){
+            found.push_back(serial);
+        }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+
+    int parsed = 0;
+    bool changed = false;
+    for (auto serial : found){
+        bool exists;
+        if (update(serial, exists)){
+            parsed++;
+        }
+    }
+    for (auto it = tags.begin(); it != tags.end(); ){
+        if (std::binary_search(found.begin(), found.end(), it->serial)){
+            ++it;
+            continue;
+        }
+        garbage += it->tracks;
+        it = tags.erase(it);
+        changed = true;
+    }
+    if (parsed > 0 || changed){
+        save();
+    }
+    ESP_LOGI(TAG, "%u playlists, %d parsed", (unsigned)tags.size(), parsed);
+    return parsed;
+}
+
+bool PlaylistIndex::lookup(const std::string& tag, std::vector<std::string>& playlist, std::vector<format_probe_info_t>& formats){
+    uint64_t serial;
+    if (!parse_serial(tag.c_str(), tag.size(), serial)){
+        return false;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    bool exists;
+    if (update(serial, exists)){
+        save();
+    }
+    auto it = find(serial);
+    if (!exists || it == tags.end()){
+        return false;
+    }
+    // Assigning to the strings already in the vector reuses their buffers,
+    // after the first few tags a swap hardly allocates at all
+    playlist.resize(it->tracks);
+    formats.resize(it->tracks);
+    for (uint32_t i = 0; i < it->tracks; i++){
+        const TrackRecord& track = tracks[it->first_track + i];
+        playlist[i].assign(root).append(1, '/').append(&strings[track.path]);
+        formats[i] = track.format;
+    }
+    return true;
+}
+
+bool PlaylistIndex::check(const std::string& tag){
+    uint64_t serial;
+    if (!parse_serial(tag.c_str(), tag.size(), serial)){
+        return false;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    bool exists;
+    bool changed = update(serial, exists);
+    if (changed){
+        save();
+    }
+    return changed || !exists;
+}
+
+size_t PlaylistIndex::size(){
+    const std::lock_guard<std::mutex> lock(mutex);
+    return tags.size();
+}
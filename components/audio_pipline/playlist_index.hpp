@@ -0,0 +1,87 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "format_probe.h"
+}
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+/// Binary index of the <tag serial>.txt playlists on the SD card.
+///
+/// Maps a tag to its playlist with the path, probed format and file size of
+/// every entry resolved when the index is built, so a tag swap neither
+/// parses text nor touches the tracks. The index file is read back with a single
+/// read at start-up. Every playlist remembers the size and modification time
+/// of its text file; refresh() and lookup() only re-parse the ones that
+/// changed and write the index back if anything did.
+///
+/// File layout, native byte order:
+///   Header, TagRecord[tags] sorted by serial, TrackRecord[tracks], strings
+class PlaylistIndex
+{
+  public:
+    /// Playlists live in @p root, the index is written to @p index_path.
+    PlaylistIndex(const std::string& root, const std::string& index_path);
+    PlaylistIndex(const PlaylistIndex&) = delete;
+    PlaylistIndex& operator=(const PlaylistIndex&) = delete;
+
+    /// Load the index file and bring it up to date with the text playlists.
+    /// returns the number of playlists that had to be parsed
+    int refresh();
+    /// Playlist of @p tag and the format of every entry. Re-parses the text
+    /// playlist first if it changed since it was indexed. Both vectors are
+    /// overwritten in place, pass the same ones every time.
+    bool lookup(const std::string& tag, std::vector<std::string>& playlist, std::vector<format_probe_info_t>& formats);
+    /// Re-parse the text playlist of @p tag if it changed since it was
+    /// indexed, true if it did or it is gone. Copies of the playlist kept
+    /// elsewhere are out of date then.
+    bool check(const std::string& tag);
+
+    size_t size();
+
+  private:
+    struct Header{
+        uint32_t magic;
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t tags;
+        uint32_t tracks;
+        uint32_t strings;
+    };
+    struct TagRecord{
+        uint64_t serial;
+        int64_t txt_mtime;
+        uint32_t txt_size;
+        uint32_t first_track;
+        uint32_t tracks;
+        uint32_t reserved;
+    };
+    struct TrackRecord{
+        uint32_t path;          ///< offset into the string table, relative to the root
+        uint32_t size;          ///< file size in bytes, 0 if it is missing
+        format_probe_info_t format;
+    };
+
+    bool load();
+    bool save();
+    std::string txt_path(uint64_t serial) const;
+    std::vector<TagRecord>::iterator find(uint64_t serial);
+    /// Parse the text playlist of @p serial into the tables, false if it is gone
+    bool parse(uint64_t serial, TagRecord& record);
+    /// Make sure the record of @p serial matches its text file, returns true if it had to change
+    bool update(uint64_t serial, bool& exists);
+    /// Drop tracks and strings no record refers to any more
+    void compact();
+
+    std::string root;
+    std::string index_path;
+    std::vector<TagRecord> tags;      ///< sorted by serial
+    std::vector<TrackRecord> tracks;
+    std::vector<char> strings;
+    size_t garbage = 0;               ///< tracks left behind by re-parsed playlists
+    std::mutex mutex;
+};
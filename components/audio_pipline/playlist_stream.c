@@ -0,0 +1,489 @@
+/*  SD card reader element with gapless chaining into an armed next track.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_mutex.h"
+#include "audio_element.h"
+#include "io_arbiter.h"
+#include "format_probe.h"
+#include "read_ahead.h"
+#include "playlist_stream.h"
+
+static const char *TAG = "PLAYLIST_STREAM";
+
+typedef struct {
+    FILE *file;
+    char *uri;
+    int64_t size;
+    char *head;                 /* read-ahead, served before the file */
+    int head_len;
+    int head_pos;
+    int64_t file_pos;           /* offset of the next byte taken from the file */
+} playlist_track_t;
+
+typedef struct {
+    playlist_track_t cur;
+    playlist_track_t next;      /* guarded by lock */
+    char *preload_uri;          /* cur.head holds the opening bytes of this file */
+    bool open_deferred;         /* cur is served from cur.head, file not open yet */
+    bool spliced;               /* cur.head holds a header to serve before byte_pos */
+    int captured;               /* opening bytes of cur copied to cur.head, -1 when done */
+    volatile bool pending;      /* next.uri is armed but not opened yet */
+    int generation;             /* bumped whenever next is replaced */
+    char *prefetch_head;        /* filled without the lock, then swapped with next.head */
+    int prefetch_size;
+    void *lock;
+    read_ahead_handle_t read_ahead; /* reads cur.file on its own task, NULL to read it here */
+    playlist_stream_track_cb on_track_change;
+    playlist_stream_head_cb on_head;
+    playlist_stream_data_cb on_data;
+    void *ctx;
+} playlist_stream_t;
+
+static void track_close(playlist_track_t *track)
+{
+    if (track->file) {
+        fclose(track->file);
+        track->file = NULL;
+    }
+    if (track->uri) {
+        audio_free(track->uri);
+        track->uri = NULL;
+    }
+    track->size = 0;
+    track->head_len = 0;
+    track->head_pos = 0;
+    track->file_pos = 0;
+}
+
+/* -1 on a read error */
+static int track_read(playlist_track_t *track, read_ahead_handle_t read_ahead, char *buffer, int len)
+{
+    if (track->head_pos < track->head_len) {
+        int rlen = track->head_len - track->head_pos;
+        if (rlen > len) {
+            rlen = len;
+        }
+        memcpy(buffer, track->head + track->head_pos, rlen);
+        track->head_pos += rlen;
+        return rlen;
+    }
+    if (track->file == NULL) {
+        return 0;
+    }
+    int rlen;
+    if (read_ahead) {
+        rlen = read_ahead_read(read_ahead, buffer, len, portMAX_DELAY);
+    } else {
+        int64_t start = io_arbiter_begin(IO_ARBITER_AUDIO);
+        rlen = fread(buffer, 1, len, track->file);
+        io_arbiter_end(IO_ARBITER_AUDIO, start, rlen);
+    }
+    if (rlen > 0) {
+        track->file_pos += rlen;
+    }
+    return rlen;
+}
+
+/* Hand cur.file from file_pos on to the read-ahead task */
+static void playlist_stream_read_ahead(playlist_stream_t *stream)
+{
+    if (stream->read_ahead && stream->cur.file) {
+        read_ahead_start(stream->read_ahead, stream->cur.file, stream->cur.file_pos);
+    }
+}
+
+static bool playlist_stream_swap(audio_element_handle_t self, playlist_stream_t *stream)
+{
+    mutex_lock(stream->lock);
+    if (stream->next.file == NULL) {
+        mutex_unlock(stream->lock);
+        return false;
+    }
+    stream->generation++;
+    stream->captured = -1;
+    if (stream->read_ahead) {
+        read_ahead_stop(stream->read_ahead);
+    }
+    track_close(&stream->cur);
+    playlist_track_t done = stream->cur;
+    stream->cur = stream->next;
+    stream->next = done;
+    mutex_unlock(stream->lock);
+
+    audio_element_set_uri(self, stream->cur.uri);
+    audio_free(stream->cur.uri);
+    stream->cur.uri = NULL;
+    /* The skipped header counts, byte_pos stays the offset in the file */
+    audio_element_set_byte_pos(self, stream->cur.head_pos);
+    audio_element_set_total_bytes(self, stream->cur.size);
+    playlist_stream_read_ahead(stream);
+    ESP_LOGI(TAG, "Chained into %s", audio_element_get_uri(self));
+    if (stream->on_track_change) {
+        stream->on_track_change(self, audio_element_get_uri(self), stream->ctx);
+    }
+    return true;
+}
+
+/* Runs on the reader task so the SD card is only ever read from one task
+ * and the caller of playlist_stream_arm_next() never blocks on file I/O.
+ * The head is read into prefetch_head without the lock, arm and disarm
+ * only ever wait for the swap. */
+static void playlist_stream_prefetch(playlist_stream_t *stream)
+{
+    mutex_lock(stream->lock);
+    char *uri = stream->next.uri;
+    int generation = stream->generation;
+    stream->next.uri = NULL;
+    stream->pending = false;
+    mutex_unlock(stream->lock);
+    if (uri == NULL) {
+        return;
+    }
+
+    playlist_track_t track = { 0 };
+    track.uri = uri;
+    track.file = fopen(uri, "rb");
+    if (track.file == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s", uri);
+        audio_free(uri);
+        return;
+    }
+    fseek(track.file, 0, SEEK_END);
+    track.size = ftell(track.file);
+    fseek(track.file, 0, SEEK_SET);
+
+    track.head = stream->prefetch_head;
+    int64_t start = io_arbiter_begin(IO_ARBITER_AUDIO);
+    track.head_len = fread(track.head, 1, stream->prefetch_size, track.file);
+    track.file_pos = track.head_len;
+    int read = track.head_len;
+    /* An ID3v2 tag or the RIFF/WAVE header up to the PCM data is skipped,
+     * the decoder is already running */
+    size_t skip = format_probe_id3_size((const uint8_t *)track.head, track.head_len);
+    format_probe_wav_t wav;
+    if (skip == 0 && format_probe_wav_layout((const uint8_t *)track.head, track.head_len, &wav)) {
+        skip = wav.data_offset;
+    }
+    if (skip >= (size_t)track.head_len && skip > 0) {
+        fseek(track.file, skip, SEEK_SET);
+        track.head_len = fread(track.head, 1, stream->prefetch_size, track.file);
+        track.file_pos = skip + track.head_len;
+        read += track.head_len;
+    } else if (skip > 0) {
+        track.head_pos = skip;
+    }
+    io_arbiter_end(IO_ARBITER_AUDIO, start, read);
+
+    mutex_lock(stream->lock);
+    if (generation != stream->generation) {
+        /* Re-armed or disarmed meanwhile */
+        mutex_unlock(stream->lock);
+        track_close(&track);
+        return;
+    }
+    stream->prefetch_head = stream->next.head;
+    stream->next = track;
+    mutex_unlock(stream->lock);
+    ESP_LOGD(TAG, "Armed %s, %d bytes ahead", track.uri, track.head_len - track.head_pos);
+}
+
+static esp_err_t _playlist_open(audio_element_handle_t self)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    char *uri = audio_element_get_uri(self);
+    if (uri == NULL) {
+        ESP_LOGE(TAG, "Error, uri is not set");
+        return ESP_FAIL;
+    }
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    char *preload_uri = stream->preload_uri;
+    stream->preload_uri = NULL;
+    if (preload_uri && info.byte_pos == 0 && !stream->spliced && strcmp(preload_uri, uri) == 0) {
+        audio_free(preload_uri);
+        stream->open_deferred = true;
+        stream->captured = -1;
+        audio_element_set_total_bytes(self, stream->cur.size);
+        ESP_LOGI(TAG, "Start from %d preloaded bytes", stream->cur.head_len);
+        return ESP_OK;
+    }
+    audio_free(preload_uri);
+    stream->cur.file = fopen(uri, "rb");
+    if (stream->cur.file == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s", uri);
+        return ESP_FAIL;
+    }
+    fseek(stream->cur.file, 0, SEEK_END);
+    stream->cur.size = ftell(stream->cur.file);
+    fseek(stream->cur.file, info.byte_pos, SEEK_SET);
+    if (!stream->spliced) {
+        stream->cur.head_len = 0;
+    }
+    stream->cur.head_pos = 0;
+    stream->cur.file_pos = info.byte_pos;
+    stream->captured = (stream->on_head && info.byte_pos == 0) ? 0 : -1;
+    audio_element_set_total_bytes(self, stream->cur.size);
+    playlist_stream_read_ahead(stream);
+    ESP_LOGI(TAG, "File size: %lld byte, file position: %lld%s", (long long)stream->cur.size, (long long)info.byte_pos,
+             stream->spliced ? ", header spliced" : "");
+    return ESP_OK;
+}
+
+/* The preloaded bytes are used up, continue from the file behind them. */
+static esp_err_t playlist_stream_open_deferred(audio_element_handle_t self, playlist_stream_t *stream)
+{
+    stream->open_deferred = false;
+    char *uri = audio_element_get_uri(self);
+    stream->cur.file = fopen(uri, "rb");
+    if (stream->cur.file == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s", uri);
+        return ESP_FAIL;
+    }
+    fseek(stream->cur.file, stream->cur.head_len, SEEK_SET);
+    stream->cur.file_pos = stream->cur.head_len;
+    playlist_stream_read_ahead(stream);
+    return ESP_OK;
+}
+
+/* Copy what was just read from the start of the file, cur.head is unused
+ * while cur is read straight from the file. */
+static void playlist_stream_capture(audio_element_handle_t self, playlist_stream_t *stream, const char *buffer, int len)
+{
+    int room = stream->prefetch_size - stream->captured;
+    if (len > room) {
+        len = room;
+    }
+    memcpy(stream->cur.head + stream->captured, buffer, len);
+    stream->captured += len;
+    if (len == 0 || stream->captured == stream->prefetch_size) {
+        stream->on_head(self, audio_element_get_uri(self), stream->cur.head, stream->captured, stream->cur.size, stream->ctx);
+        stream->captured = -1;
+    }
+}
+
+static int _playlist_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    if (stream->open_deferred && stream->cur.head_pos >= stream->cur.head_len
+        && playlist_stream_open_deferred(self, stream) != ESP_OK) {
+        return AEL_IO_FAIL;
+    }
+    /* A spliced header is not part of the file at byte_pos */
+    bool header = stream->spliced && stream->cur.head_pos < stream->cur.head_len;
+    int rlen = track_read(&stream->cur, stream->read_ahead, buffer, len);
+    if (rlen < 0) {
+        ESP_LOGE(TAG, "Read error in %s", audio_element_get_uri(self));
+        return AEL_IO_FAIL;
+    }
+    if (stream->captured >= 0) {
+        playlist_stream_capture(self, stream, buffer, rlen);
+    }
+    if (rlen == 0) {
+        if (stream->on_data) {
+            audio_element_info_t info;
+            audio_element_getinfo(self, &info);
+            stream->on_data(self, audio_element_get_uri(self), info.byte_pos, buffer, 0, stream->ctx);
+        }
+        playlist_stream_prefetch(stream);
+        if (playlist_stream_swap(self, stream)) {
+            rlen = track_read(&stream->cur, stream->read_ahead, buffer, len);
+            if (rlen < 0) {
+                return AEL_IO_FAIL;
+            }
+        }
+    } else if (stream->pending && stream->cur.file && stream->cur.file_pos >= stream->prefetch_size) {
+        /* Not right after open, the pipeline is still filling up then */
+        playlist_stream_prefetch(stream);
+    }
+    if (rlen > 0 && !header) {
+        if (stream->on_data) {
+            audio_element_info_t info;
+            audio_element_getinfo(self, &info);
+            stream->on_data(self, audio_element_get_uri(self), info.byte_pos, buffer, rlen, stream->ctx);
+        }
+        audio_element_update_byte_pos(self, rlen);
+    }
+    return rlen;
+}
+
+static int _playlist_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+    if (r_size > 0) {
+        w_size = audio_element_output(self, in_buffer, r_size);
+    } else {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _playlist_close(audio_element_handle_t self)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
+        audio_element_set_byte_pos(self, 0);
+    }
+    if (stream->read_ahead) {
+        read_ahead_stop(stream->read_ahead);
+    }
+    track_close(&stream->cur);
+    stream->open_deferred = false;
+    stream->spliced = false;
+    stream->captured = -1;
+    playlist_stream_disarm(self);
+    return ESP_OK;
+}
+
+static esp_err_t _playlist_destroy(audio_element_handle_t self)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    if (stream->read_ahead) {
+        read_ahead_destroy(stream->read_ahead);
+    }
+    track_close(&stream->cur);
+    track_close(&stream->next);
+    audio_free(stream->preload_uri);
+    audio_free(stream->cur.head);
+    audio_free(stream->next.head);
+    audio_free(stream->prefetch_head);
+    mutex_destroy(stream->lock);
+    audio_free(stream);
+    return ESP_OK;
+}
+
+esp_err_t playlist_stream_arm_next(audio_element_handle_t self, const char *uri)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    char *copy = audio_strdup(uri);
+    AUDIO_MEM_CHECK(TAG, copy, return ESP_ERR_NO_MEM);
+    mutex_lock(stream->lock);
+    track_close(&stream->next);
+    stream->next.uri = copy;
+    stream->pending = true;
+    stream->generation++;
+    mutex_unlock(stream->lock);
+    return ESP_OK;
+}
+
+void playlist_stream_disarm(audio_element_handle_t self)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    mutex_lock(stream->lock);
+    track_close(&stream->next);
+    stream->pending = false;
+    stream->generation++;
+    mutex_unlock(stream->lock);
+}
+
+esp_err_t playlist_stream_preload(audio_element_handle_t self, const char *uri, const char *data, int len, int64_t size)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    char *copy = audio_strdup(uri);
+    AUDIO_MEM_CHECK(TAG, copy, return ESP_ERR_NO_MEM);
+    if (len > stream->prefetch_size) {
+        len = stream->prefetch_size;
+    }
+    audio_free(stream->preload_uri);
+    stream->preload_uri = copy;
+    memcpy(stream->cur.head, data, len);
+    stream->cur.head_len = len;
+    stream->cur.head_pos = 0;
+    stream->cur.size = size;
+    return ESP_OK;
+}
+
+esp_err_t playlist_stream_splice_header(audio_element_handle_t self, const char *header, int len)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    if (len > stream->prefetch_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(stream->cur.head, header, len);
+    stream->cur.head_len = len;
+    stream->cur.head_pos = 0;
+    stream->spliced = true;
+    return ESP_OK;
+}
+
+esp_err_t playlist_stream_get_read_stats(audio_element_handle_t self, read_ahead_stats_t *stats)
+{
+    playlist_stream_t *stream = (playlist_stream_t *)audio_element_getdata(self);
+    if (stream->read_ahead == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    read_ahead_get_stats(stream->read_ahead, stats);
+    return ESP_OK;
+}
+
+audio_element_handle_t playlist_stream_init(playlist_stream_cfg_t *config)
+{
+    audio_element_handle_t el = NULL;
+    playlist_stream_t *stream = audio_calloc(1, sizeof(playlist_stream_t));
+    AUDIO_MEM_CHECK(TAG, stream, return NULL);
+
+    stream->prefetch_size = config->prefetch_size;
+    stream->on_track_change = config->on_track_change;
+    stream->on_head = config->on_head;
+    stream->on_data = config->on_data;
+    stream->captured = -1;
+    stream->ctx = config->ctx;
+    stream->lock = mutex_create();
+    stream->cur.head = audio_calloc(1, config->prefetch_size);
+    stream->next.head = audio_calloc(1, config->prefetch_size);
+    stream->prefetch_head = audio_calloc(1, config->prefetch_size);
+    AUDIO_MEM_CHECK(TAG, stream->lock && stream->cur.head && stream->next.head && stream->prefetch_head,
+                    goto _playlist_init_exit);
+    if (config->read_ahead_size > 0) {
+        read_ahead_cfg_t read_ahead_cfg = READ_AHEAD_CFG_DEFAULT();
+        read_ahead_cfg.ring_size = config->read_ahead_size;
+        read_ahead_cfg.block_size = config->read_ahead_block;
+        read_ahead_cfg.refill_level = config->read_ahead_refill;
+        read_ahead_cfg.task_core = config->task_core;
+        /* Above the reader, it only ever waits for the card */
+        read_ahead_cfg.task_prio = config->task_prio + 1;
+        stream->read_ahead = read_ahead_create(&read_ahead_cfg);
+        AUDIO_MEM_CHECK(TAG, stream->read_ahead, goto _playlist_init_exit);
+    }
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _playlist_open;
+    cfg.close = _playlist_close;
+    cfg.process = _playlist_process;
+    cfg.destroy = _playlist_destroy;
+    cfg.read = _playlist_read;
+    cfg.task_stack = config->task_stack;
+    cfg.task_prio = config->task_prio;
+    cfg.task_core = config->task_core;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.buffer_len = config->buf_sz;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.tag = "file";
+
+    el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _playlist_init_exit);
+    audio_element_setdata(el, stream);
+    return el;
+
+_playlist_init_exit:
+    if (stream->read_ahead) {
+        read_ahead_destroy(stream->read_ahead);
+    }
+    if (stream->lock) {
+        mutex_destroy(stream->lock);
+    }
+    audio_free(stream->cur.head);
+    audio_free(stream->next.head);
+    audio_free(stream->prefetch_head);
+    audio_free(stream);
+    return NULL;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+/*  SD card reader element that can chain into a pre-armed next track.
+
+    Behaves like the esp-adf fatfs_stream reader. On top of that the next
+    track can be armed while the current one plays: its file is opened and
+    the first bytes are read ahead. When the current file hits end of file
+    the reader swaps to the armed one and keeps feeding the same output ring
+    buffer, so the decoder, resampler and i2s writer never see the end of a
+    track. Container headers of the armed track (ID3v2, RIFF/WAVE) are
+    skipped because the decoder is already past its own header parsing.
+
+    The opening bytes of a track can be handed out (on_head) and later handed
+    back in from memory (playlist_stream_preload), playback then starts
+    before the file is open.
+
+    The byte position of the element is always the offset in the current
+    file, also for chained tracks whose header was skipped.
+
+    With read_ahead_size set the current file is read on a task of its own
+    (read_ahead.h): in large aligned blocks into a ring buffer that is
+    refilled once it drained below read_ahead_refill bytes, so a busy SD
+    card stalls that task instead of the pipeline.
+*/
+
+#include "audio_element.h"
+#include "audio_common.h"
+#include "read_ahead.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Called from the reader task right after it switched to the armed track
+typedef void (*playlist_stream_track_cb)(audio_element_handle_t self, const char *uri, void *ctx);
+
+/// Called from the reader task with the first bytes of a file it opened from
+/// the start, @p size is the file size. @p data is only valid during the call.
+typedef void (*playlist_stream_head_cb)(audio_element_handle_t self, const char *uri,
+                                        const char *data, int len, int64_t size, void *ctx);
+
+/// Called from the reader task with every chunk read from the current file,
+/// @p offset is where it starts in the file. @p len is 0 at the end of the file.
+typedef void (*playlist_stream_data_cb)(audio_element_handle_t self, const char *uri,
+                                        int64_t offset, const char *data, int len, void *ctx);
+
+typedef struct {
+    int buf_sz;                                 /*!< Read buffer size */
+    int out_rb_size;                            /*!< Size of output ringbuffer */
+    int task_stack;                             /*!< Task stack size */
+    int task_core;                              /*!< Task running in core (0 or 1) */
+    int task_prio;                              /*!< Task priority */
+    bool ext_stack;                             /*!< Allocate stack on extern ram */
+    int prefetch_size;                          /*!< Bytes of an armed track read ahead */
+    int read_ahead_size;                        /*!< Bytes of the current track read ahead, 0 to read it on the reader task */
+    int read_ahead_block;                       /*!< Bytes per read ahead, a power of two */
+    int read_ahead_refill;                      /*!< Read ahead again below this many buffered bytes */
+    playlist_stream_track_cb on_track_change;   /*!< Track switch notification, may be NULL */
+    playlist_stream_head_cb on_head;            /*!< First prefetch_size bytes of a track, may be NULL */
+    playlist_stream_data_cb on_data;            /*!< Everything read from a track, may be NULL */
+    void *ctx;                                  /*!< Passed to the callbacks */
+} playlist_stream_cfg_t;
+
+#define PLAYLIST_STREAM_BUF_SIZE            (2048)
+#define PLAYLIST_STREAM_TASK_STACK          (3072)
+#define PLAYLIST_STREAM_TASK_CORE           (0)
+#define PLAYLIST_STREAM_TASK_PRIO           (4)
+#define PLAYLIST_STREAM_RINGBUFFER_SIZE     (8 * 1024)
+#define PLAYLIST_STREAM_PREFETCH_SIZE       (16 * 1024)
+
+#define PLAYLIST_STREAM_CFG_DEFAULT() {                 \
+    .buf_sz = PLAYLIST_STREAM_BUF_SIZE,                 \
+    .out_rb_size = PLAYLIST_STREAM_RINGBUFFER_SIZE,     \
+    .task_stack = PLAYLIST_STREAM_TASK_STACK,           \
+    .task_core = PLAYLIST_STREAM_TASK_CORE,             \
+    .task_prio = PLAYLIST_STREAM_TASK_PRIO,             \
+    .ext_stack = false,                                 \
+    .prefetch_size = PLAYLIST_STREAM_PREFETCH_SIZE,     \
+    .read_ahead_size = 0,                               \
+    .read_ahead_block = READ_AHEAD_BLOCK_SIZE,          \
+    .read_ahead_refill = READ_AHEAD_RING_SIZE / 2,      \
+    .on_track_change = NULL,                            \
+    .on_head = NULL,                                    \
+    .on_data = NULL,                                    \
+    .ctx = NULL,                                        \
+}
+
+audio_element_handle_t playlist_stream_init(playlist_stream_cfg_t *config);
+
+/// Arm @p uri as the next track. The reader task opens it and reads its first
+/// bytes between two reads of the current track. Replaces a previously armed
+/// track. Safe to call while the reader runs, never blocks on file I/O.
+esp_err_t playlist_stream_arm_next(audio_element_handle_t self, const char *uri);
+
+/// Drop the armed track, the reader will finish at the end of the current one.
+void playlist_stream_disarm(audio_element_handle_t self);
+
+/// Serve the first @p len bytes of @p uri (whose file is @p size bytes long)
+/// from memory on the next open. The file itself is only opened once they
+/// have been consumed. Call before running the pipeline with @p uri set,
+/// at most prefetch_size bytes are kept.
+esp_err_t playlist_stream_preload(audio_element_handle_t self, const char *uri, const char *data, int len, int64_t size);
+
+/// Serve the @p len bytes of @p header before the file on the next open,
+/// which then continues at the byte position of the element. For decoders
+/// that need the header of a file before data from its middle (WAV). Call
+/// before running the pipeline, after playlist_stream_preload(). At most
+/// prefetch_size bytes.
+esp_err_t playlist_stream_splice_header(audio_element_handle_t self, const char *header, int len);
+
+/// Counters of the read-ahead task, ESP_ERR_NOT_SUPPORTED without read-ahead
+esp_err_t playlist_stream_get_read_stats(audio_element_handle_t self, read_ahead_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,312 @@
+/*  Read-ahead of one file on the SD card, see read_ahead.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_mutex.h"
+#include "io_arbiter.h"
+#include "read_ahead.h"
+
+static const char *TAG = "READ_AHEAD";
+
+struct read_ahead {
+    char *ring;                 /* PSRAM when available */
+    char *block;                /* internal, DMA capable */
+    int ring_size;
+    int block_size;
+    int refill_level;
+    void *lock;                 /* guards everything below */
+    void *io_lock;              /* held by the task while it reads a block */
+    SemaphoreHandle_t wake;     /* task: fill the ring */
+    SemaphoreHandle_t data;     /* consumer: a block arrived or the file ended */
+    SemaphoreHandle_t done;     /* destroy: the task has quit */
+    FILE *file;                 /* NULL while stopped */
+    int64_t file_pos;           /* offset of the next block */
+    int generation;             /* bumped by every start and stop */
+    int head;                   /* next byte for the consumer */
+    int filled;
+    bool eof;
+    bool error;
+    bool filling;               /* the task is awake */
+    bool waiting;               /* the consumer waits for data */
+    bool quit;
+    bool primed;                /* a block arrived since start, waiting before is no underrun */
+    int64_t wake_us;            /* refill requested, -1 once the first block is in */
+    read_ahead_stats_t stats;
+};
+
+/* Read blocks until the ring is full or the file ends. Only the task writes
+ * into the ring and only behind head + filled, so the copies need no lock. */
+static void read_ahead_fill(read_ahead_handle_t ra)
+{
+    while (true) {
+        mutex_lock(ra->io_lock);
+        mutex_lock(ra->lock);
+        FILE *file = ra->file;
+        int generation = ra->generation;
+        /* Up to the next multiple of the block size */
+        int len = ra->block_size - (int)(ra->file_pos & (ra->block_size - 1));
+        if (file == NULL || ra->quit || ra->eof || ra->error || ra->ring_size - ra->filled < len) {
+            ra->filling = false;
+            mutex_unlock(ra->lock);
+            mutex_unlock(ra->io_lock);
+            return;
+        }
+        int tail = (ra->head + ra->filled) % ra->ring_size;
+        mutex_unlock(ra->lock);
+
+        int64_t start = io_arbiter_begin(IO_ARBITER_AUDIO);
+        int n = fread(ra->block, 1, len, file);
+        int64_t end = esp_timer_get_time();
+        io_arbiter_end(IO_ARBITER_AUDIO, start, n > 0 ? n : 0);
+        bool failed = n < len && ferror(file);
+        int first = n < ra->ring_size - tail ? n : ra->ring_size - tail;
+        memcpy(ra->ring + tail, ra->block, first);
+        memcpy(ra->ring, ra->block + first, n - first);
+
+        mutex_lock(ra->lock);
+        if (generation == ra->generation) {
+            ra->filled += n;
+            ra->file_pos += n;
+            ra->primed = true;
+            ra->eof = n < len && !failed;
+            ra->error = failed;
+            ra->stats.bytes += n;
+            ra->stats.blocks++;
+            ra->stats.read_us += end - start;
+            if (ra->wake_us >= 0) {
+                int64_t refill_us = end - ra->wake_us;
+                ra->stats.refill_us += refill_us;
+                if (refill_us > ra->stats.refill_max_us) {
+                    ra->stats.refill_max_us = refill_us;
+                }
+                ra->wake_us = -1;
+            }
+            /* The rest of the file is in the ring, the card is free */
+            io_arbiter_audio_level(ra->filled, (ra->eof || ra->error) ? 0 : ra->ring_size);
+            if (ra->waiting) {
+                ra->waiting = false;
+                xSemaphoreGive(ra->data);
+            }
+            if (failed) {
+                ESP_LOGE(TAG, "Read error at %lld", (long long)ra->file_pos);
+            }
+        }
+        mutex_unlock(ra->lock);
+        mutex_unlock(ra->io_lock);
+    }
+}
+
+static void read_ahead_task(void *arg)
+{
+    read_ahead_handle_t ra = (read_ahead_handle_t)arg;
+    while (true) {
+        xSemaphoreTake(ra->wake, portMAX_DELAY);
+        mutex_lock(ra->lock);
+        bool quit = ra->quit;
+        mutex_unlock(ra->lock);
+        if (quit) {
+            break;
+        }
+        read_ahead_fill(ra);
+    }
+    xSemaphoreGive(ra->done);
+    vTaskDelete(NULL);
+}
+
+/* Wake the task, with the lock held. Only counted as a refill if it was
+ * asked for because the consumer drained the ring. */
+static void read_ahead_wake(read_ahead_handle_t ra, bool refill)
+{
+    if (ra->filling || ra->file == NULL || ra->eof || ra->error) {
+        return;
+    }
+    ra->filling = true;
+    if (refill) {
+        ra->wake_us = esp_timer_get_time();
+        ra->stats.refills++;
+    }
+    xSemaphoreGive(ra->wake);
+}
+
+esp_err_t read_ahead_start(read_ahead_handle_t ra, FILE *file, int64_t offset)
+{
+    read_ahead_stop(ra);
+    mutex_lock(ra->lock);
+    ra->file = file;
+    ra->file_pos = offset;
+    ra->generation++;
+    ra->wake_us = -1;
+    read_ahead_wake(ra, false);
+    io_arbiter_audio_level(0, ra->ring_size);
+    mutex_unlock(ra->lock);
+    return ESP_OK;
+}
+
+void read_ahead_stop(read_ahead_handle_t ra)
+{
+    mutex_lock(ra->lock);
+    ra->file = NULL;
+    ra->generation++;
+    ra->head = 0;
+    ra->filled = 0;
+    ra->eof = false;
+    ra->error = false;
+    ra->waiting = false;
+    ra->primed = false;
+    ra->wake_us = -1;
+    io_arbiter_audio_level(0, 0);
+    mutex_unlock(ra->lock);
+    /* A block in flight is dropped, but the file must not be closed under it */
+    mutex_lock(ra->io_lock);
+    mutex_unlock(ra->io_lock);
+}
+
+int read_ahead_read(read_ahead_handle_t ra, char *buffer, int len, TickType_t ticks)
+{
+    mutex_lock(ra->lock);
+    if (ra->filled == 0 && ra->file && !ra->eof && !ra->error) {
+        bool underrun = ra->primed;
+        int64_t start = esp_timer_get_time();
+        if (underrun) {
+            io_arbiter_audio_dry();
+        }
+        while (ra->filled == 0 && ra->file && !ra->eof && !ra->error) {
+            ra->waiting = true;
+            read_ahead_wake(ra, true);
+            mutex_unlock(ra->lock);
+            bool woken = xSemaphoreTake(ra->data, ticks) == pdTRUE;
+            mutex_lock(ra->lock);
+            if (!woken) {
+                ESP_LOGW(TAG, "No data from the card after %d ms", (int)(ticks * portTICK_PERIOD_MS));
+                break;
+            }
+        }
+        if (underrun) {
+            ra->stats.underruns++;
+            ra->stats.underrun_us += esp_timer_get_time() - start;
+        }
+    }
+    int n = len < ra->filled ? len : ra->filled;
+    if (n == 0) {
+        int ret = (ra->eof && ra->file) ? 0 : -1;
+        mutex_unlock(ra->lock);
+        return ret;
+    }
+    int head = ra->head;
+    mutex_unlock(ra->lock);
+
+    int first = n < ra->ring_size - head ? n : ra->ring_size - head;
+    memcpy(buffer, ra->ring + head, first);
+    memcpy(buffer + first, ra->ring, n - first);
+
+    mutex_lock(ra->lock);
+    ra->head = (head + n) % ra->ring_size;
+    ra->filled -= n;
+    if (ra->filled < ra->refill_level) {
+        read_ahead_wake(ra, true);
+    }
+    if (!ra->eof && !ra->error) {
+        io_arbiter_audio_level(ra->filled, ra->ring_size);
+    }
+    mutex_unlock(ra->lock);
+    return n;
+}
+
+void read_ahead_get_stats(read_ahead_handle_t ra, read_ahead_stats_t *stats)
+{
+    mutex_lock(ra->lock);
+    *stats = ra->stats;
+    mutex_unlock(ra->lock);
+}
+
+void read_ahead_reset_stats(read_ahead_handle_t ra)
+{
+    mutex_lock(ra->lock);
+    memset(&ra->stats, 0, sizeof(ra->stats));
+    mutex_unlock(ra->lock);
+}
+
+read_ahead_handle_t read_ahead_create(const read_ahead_cfg_t *config)
+{
+    if (config->block_size <= 0 || (config->block_size & (config->block_size - 1)) != 0
+        || config->ring_size < config->block_size || config->ring_size % config->block_size != 0) {
+        ESP_LOGE(TAG, "Block size %d does not fit a ring of %d", config->block_size, config->ring_size);
+        return NULL;
+    }
+    read_ahead_handle_t ra = audio_calloc(1, sizeof(struct read_ahead));
+    AUDIO_MEM_CHECK(TAG, ra, return NULL);
+    ra->ring_size = config->ring_size;
+    ra->block_size = config->block_size;
+    /* The task stops with less than a block free, refilling above that would wake it for nothing */
+    ra->refill_level = config->refill_level < config->ring_size - config->block_size
+        ? config->refill_level : config->ring_size - config->block_size;
+    ra->wake_us = -1;
+    ra->ring = audio_malloc(config->ring_size);
+    ra->block = heap_caps_malloc(config->block_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    ra->lock = mutex_create();
+    ra->io_lock = mutex_create();
+    ra->wake = xSemaphoreCreateBinary();
+    ra->data = xSemaphoreCreateBinary();
+    ra->done = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, ra->ring && ra->block && ra->lock && ra->io_lock && ra->wake && ra->data && ra->done,
+                    goto _read_ahead_create_exit);
+    if (xTaskCreatePinnedToCore(read_ahead_task, "read_ahead", config->task_stack, ra, config->task_prio, NULL,
+                                config->task_core) != pdPASS) {
+        ESP_LOGE(TAG, "Unable to start the task");
+        goto _read_ahead_create_exit;
+    }
+    return ra;
+
+_read_ahead_create_exit:
+    if (ra->lock) {
+        mutex_destroy(ra->lock);
+    }
+    if (ra->io_lock) {
+        mutex_destroy(ra->io_lock);
+    }
+    if (ra->wake) {
+        vSemaphoreDelete(ra->wake);
+    }
+    if (ra->data) {
+        vSemaphoreDelete(ra->data);
+    }
+    if (ra->done) {
+        vSemaphoreDelete(ra->done);
+    }
+    audio_free(ra->ring);
+    heap_caps_free(ra->block);
+    audio_free(ra);
+    return NULL;
+}
+
+void read_ahead_destroy(read_ahead_handle_t ra)
+{
+    read_ahead_stop(ra);
+    mutex_lock(ra->lock);
+    ra->quit = true;
+    mutex_unlock(ra->lock);
+    xSemaphoreGive(ra->wake);
+    xSemaphoreTake(ra->done, portMAX_DELAY);
+    mutex_destroy(ra->lock);
+    mutex_destroy(ra->io_lock);
+    vSemaphoreDelete(ra->wake);
+    vSemaphoreDelete(ra->data);
+    vSemaphoreDelete(ra->done);
+    audio_free(ra->ring);
+    heap_caps_free(ra->block);
+    audio_free(ra);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+/*  Read-ahead of one file on the SD card, on a task of its own.
+
+    A task reads the file in large blocks into a ring buffer and stays
+    ahead of the consumer by up to the size of the ring. Reads start at
+    file offsets that are multiples of the block size, so with the usual
+    cluster sizes (32 KB on cards up to 32 GB) a block never spans two
+    clusters and FATFS reads it in one multi-sector transfer. Blocks are
+    read into an internal DMA capable buffer and copied into the ring,
+    which lives in PSRAM when there is any; the SD host cannot read into
+    PSRAM directly and would fall back to single sectors.
+
+    The task does not keep the card busy all the time. It fills the ring,
+    sleeps, and refills once the consumer drained it below the refill
+    watermark, so other users of the card (file server, Wi-Fi uploads)
+    get longer idle stretches and the reader rides out theirs. Its reads
+    and the fill level of the ring go to the I/O arbiter (io_arbiter.h),
+    which holds the file server back while the ring is low.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct read_ahead *read_ahead_handle_t;
+
+typedef struct {
+    int ring_size;          /*!< Bytes read ahead at most, a multiple of block_size */
+    int block_size;         /*!< Bytes per read, a power of two */
+    int refill_level;       /*!< Refill once fewer bytes than this are buffered */
+    int task_stack;         /*!< Task stack size */
+    int task_core;          /*!< Task running in core (0 or 1) */
+    int task_prio;          /*!< Task priority */
+} read_ahead_cfg_t;
+
+#define READ_AHEAD_RING_SIZE        (128 * 1024)
+#define READ_AHEAD_BLOCK_SIZE       (16 * 1024)
+#define READ_AHEAD_TASK_STACK       (3072)
+#define READ_AHEAD_TASK_CORE        (0)
+#define READ_AHEAD_TASK_PRIO        (5)
+
+#define READ_AHEAD_CFG_DEFAULT() {                      \
+    .ring_size = READ_AHEAD_RING_SIZE,                  \
+    .block_size = READ_AHEAD_BLOCK_SIZE,                \
+    .refill_level = READ_AHEAD_RING_SIZE / 2,           \
+    .task_stack = READ_AHEAD_TASK_STACK,                \
+    .task_core = READ_AHEAD_TASK_CORE,                  \
+    .task_prio = READ_AHEAD_TASK_PRIO,                  \
+}
+
+/// Counters since read_ahead_create() or the last read_ahead_reset_stats()
+typedef struct {
+    uint64_t bytes;         /*!< Read from the card */
+    uint32_t blocks;        /*!< fread calls */
+    int64_t read_us;        /*!< Time spent in fread, bytes / read_us is the card throughput */
+    uint32_t refills;       /*!< Times the ring dropped below the refill level */
+    int64_t refill_us;      /*!< Sum over refills, from the wake-up to the first block in the ring */
+    int64_t refill_max_us;
+    uint32_t underruns;     /*!< Reads that found the ring drained and had to wait for the card */
+    int64_t underrun_us;    /*!< Time the consumer waited */
+} read_ahead_stats_t;
+
+read_ahead_handle_t read_ahead_create(const read_ahead_cfg_t *config);
+void read_ahead_destroy(read_ahead_handle_t ra);
+
+/// Read @p file ahead from @p offset on, where it is positioned. The file
+/// belongs to the task until read_ahead_stop(), only close it after that.
+esp_err_t read_ahead_start(read_ahead_handle_t ra, FILE *file, int64_t offset);
+
+/// Stop reading ahead and drop what is buffered. Waits for a read in flight.
+void read_ahead_stop(read_ahead_handle_t ra);
+
+/// Copy up to @p len buffered bytes to @p buffer, waiting at most @p ticks
+/// for the card if there are none. 0 at the end of the file, -1 on a read
+/// error or timeout.
+int read_ahead_read(read_ahead_handle_t ra, char *buffer, int len, TickType_t ticks);
+
+void read_ahead_get_stats(read_ahead_handle_t ra, read_ahead_stats_t *stats);
+void read_ahead_reset_stats(read_ahead_handle_t ra);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,148 @@
+/*  Per tag resume positions in NVS, see resume_store.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "resume_store.hpp"
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+}
+
+static const char *TAG = "RESUME_STORE";
+
+ResumeStore::ResumeStore(const char *name, size_t capacity, int64_t save_interval_us)
+    : name(name), capacity(capacity), save_interval_us(save_interval_us)
+{
+    entries.reserve(capacity);
+}
+
+ResumeStore::~ResumeStore(){
+    flush(true);
+    if (opened){
+        nvs_close(handle);
+    }
+}
+
+void ResumeStore::key(uint64_t tag, char (&out)[16]){
+    // NVS keys have at most 15 characters, RDM6300 serials 48 bits
+    snprintf(out, sizeof(out), "%llx", (unsigned long long)(tag & 0xffffffffffffULL));
+}
+
+bool ResumeStore::open(){
+    if (opened){
+        return true;
+    }
+    // Opened on first use, without NVS the player only loses the positions
+    esp_err_t err = nvs_open(name, NVS_READWRITE, &handle);
+    if (err != ESP_OK){
+        ESP_LOGE(TAG, "Unable to open NVS namespace %s: %d", name, err);
+        return false;
+    }
+    opened = true;
+    return true;
+}
+
+ResumeStore::Entry* ResumeStore::find(uint64_t tag){
+    for (auto& entry : entries){
+        if (entry.tag == tag){
+            entry.used = ++clock;
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+ResumeStore::Entry& ResumeStore::insert(uint64_t tag){
+    if (entries.size() < capacity){
+        entries.push_back(Entry{tag, {}, false, ++clock});
+        return entries.back();
+    }
+    Entry* oldest = &entries.front();
+    for (auto& entry : entries){
+        if (entry.used < oldest->used){
+            oldest = &entry;
+        }
+    }
+    if (oldest->dirty && open()){
+        // Evicted tags keep their last position
+        char nvs_key[16];
+        key(oldest->tag, nvs_key);
+        nvs_set_blob(handle, nvs_key, &oldest->position, sizeof(oldest->position));
+        counters.writes++;
+        uncommitted = true;
+    }
+    *oldest = Entry{tag, {}, false, ++clock};
+    return *oldest;
+}
+
+bool ResumeStore::lookup(uint64_t tag, ResumePosition& position){
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (Entry* entry = find(tag)){
+        position = entry->position;
+        return true;
+    }
+    if (!open()){
+        return false;
+    }
+    char nvs_key[16];
+    key(tag, nvs_key);
+    size_t length = sizeof(position);
+    if (nvs_get_blob(handle, nvs_key, &position, &length) != ESP_OK || length != sizeof(position)){
+        return false;
+    }
+    insert(tag).position = position;
+    return true;
+}
+
+void ResumeStore::checkpoint(uint64_t tag, const ResumePosition& position){
+    const std::lock_guard<std::mutex> lock(mutex);
+    Entry* entry = find(tag);
+    if (entry == nullptr){
+        entry = &insert(tag);
+    } else if (entry->position.track == position.track && entry->position.byte_pos == position.byte_pos){
+        return;
+    }
+    entry->position = position;
+    entry->dirty = true;
+    counters.checkpoints++;
+}
+
+int ResumeStore::flush(bool force){
+    const std::lock_guard<std::mutex> lock(mutex);
+    int64_t now = esp_timer_get_time();
+    if (!force && now - saved_us < save_interval_us){
+        return 0;
+    }
+    int written = 0;
+    for (auto& entry : entries){
+        if (!entry.dirty || !open()){
+            continue;
+        }
+        char nvs_key[16];
+        key(entry.tag, nvs_key);
+        if (nvs_set_blob(handle, nvs_key, &entry.position, sizeof(entry.position)) != ESP_OK){
+            ESP_LOGW(TAG, "Unable to save position of %llu", (unsigned long long)entry.tag);
+            continue;
+        }
+        entry.dirty = false;
+        counters.writes++;
+        written++;
+    }
+    saved_us = now;
+    if (written > 0 || uncommitted){
+        nvs_commit(handle);
+        counters.commits++;
+        uncommitted = false;
+        ESP_LOGD(TAG, "Saved %d positions", written);
+    }
+    return written;
+}
+
+ResumeStore::Stats ResumeStore::stats(){
+    const std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "nvs.h"
+}
+
+#include <vector>
+#include <mutex>
+
+/// Where playback of a tag stopped
+struct ResumePosition{
+    uint32_t track;         ///< index into the playlist
+    uint32_t reserved;
+    int64_t byte_pos;       ///< reader position in that track
+};
+
+/// Per tag resume positions, kept in RAM and written to NVS in batches.
+///
+/// The player checkpoints the position of the playing tag every second.
+/// Checkpoints only touch RAM; flush() writes the entries that changed
+/// since they were last saved, all of them under one nvs_commit(), and at
+/// most once per save interval unless forced. One blob per tag, the key is
+/// the serial in hex. The least recently used tag is dropped from RAM when
+/// the capacity is reached, its saved position stays in NVS.
+class ResumeStore
+{
+  public:
+    struct Stats{
+        unsigned checkpoints = 0;
+        unsigned writes = 0;        ///< nvs_set_blob calls
+        unsigned commits = 0;
+    };
+
+    /// Positions live in the NVS namespace @p name. flush() writes at most
+    /// every @p save_interval_us unless forced.
+    ResumeStore(const char *name, size_t capacity, int64_t save_interval_us);
+    ~ResumeStore();
+    ResumeStore(const ResumeStore&) = delete;
+    ResumeStore& operator=(const ResumeStore&) = delete;
+
+    /// Last position of @p tag, from RAM or NVS
+    bool lookup(uint64_t tag, ResumePosition& position);
+    /// Remember where @p tag is now, RAM only
+    void checkpoint(uint64_t tag, const ResumePosition& position);
+    /// Write what changed to NVS if the save interval elapsed or @p force.
+    /// returns the number of positions written
+    int flush(bool force = false);
+
+    Stats stats();
+
+  private:
+    struct Entry{
+        uint64_t tag;
+        ResumePosition position;
+        bool dirty;
+        uint32_t used;
+    };
+    bool open();
+    Entry* find(uint64_t tag);
+    Entry& insert(uint64_t tag);
+    static void key(uint64_t tag, char (&out)[16]);
+
+    const char *name;
+    size_t capacity;
+    int64_t save_interval_us;
+    int64_t saved_us = 0;
+    nvs_handle_t handle = 0;
+    bool opened = false;
+    bool uncommitted = false;       ///< an evicted tag was written without a commit
+    std::vector<Entry> entries;
+    uint32_t clock = 0;
+    Stats counters;
+    std::mutex mutex;
+};
@@ -0,0 +1,145 @@
+/*  Warm cache of recently used tags, see tag_cache.hpp
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include "tag_cache.hpp"
+extern "C" {
+#include <string.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "playlist_stream.h"
+}
+
+static const char *TAG = "TAG_CACHE";
+
+TagCache::TagCache(size_t capacity, size_t head_size)
+    : capacity(capacity), head_size(head_size)
+{
+}
+
+TagCache::~TagCache(){
+    for (auto& entry : entries){
+        release(entry);
+    }
+}
+
+void TagCache::release(Entry& entry){
+    audio_free(entry.head);
+    entry.head = NULL;
+    entry.head_len = 0;
+}
+
+std::list<TagCache::Entry>::iterator TagCache::find(const std::string& tag){
+    for (auto it = entries.begin(); it != entries.end(); ++it){
+        if (it->tag == tag){
+            return it;
+        }
+    }
+    return entries.end();
+}
+
+bool TagCache::lookup(const std::string& tag, std::vector<std::string>& playlist, int& decoder){
+    const std::lock_guard<std::mutex> lock(mutex);
+    auto it = find(tag);
+    if (it == entries.end()){
+        counters.misses++;
+        return false;
+    }
+    counters.hits++;
+    entries.splice(entries.begin(), entries, it);
+    playlist = it->playlist;
+    decoder = it->decoder;
+    return true;
+}
+
+void TagCache::put(const std::string& tag, const std::vector<std::string>& playlist, int decoder){
+    if (capacity == 0 || playlist.empty()){
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    auto it = find(tag);
+    if (it != entries.end()){
+        if (it->playlist.front() != playlist.front()){
+            release(*it);
+        }
+        entries.splice(entries.begin(), entries, it);
+    } else {
+        if (entries.size() >= capacity){
+            ESP_LOGD(TAG, "Evict %s", entries.back().tag.c_str());
+            release(entries.back());
+            entries.pop_back();
+        }
+        entries.emplace_front();
+        entries.front().tag = tag;
+    }
+    entries.front().playlist = playlist;
+    entries.front().decoder = decoder;
+}
+
+void TagCache::invalidate(const std::string& tag){
+    const std::lock_guard<std::mutex> lock(mutex);
+    auto it = find(tag);
+    if (it == entries.end()){
+        return;
+    }
+    ESP_LOGD(TAG, "Invalidate %s", tag.c_str());
+    release(*it);
+    entries.erase(it);
+}
+
+void TagCache::store_head(const char *uri, const char *data, int len, int64_t file_size){
+    if (len > (int)head_size){
+        len = head_size;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    bool stated = false;
+    struct stat st;
+    for (auto& entry : entries){
+        if (entry.head != NULL || entry.playlist.front() != uri){
+            continue;
+        }
+        // Only for an entry that takes the bytes, the reader rarely waits for it
+        if (!stated){
+            if (stat(uri, &st) != 0 || (int64_t)st.st_size != file_size){
+                return;
+            }
+            stated = true;
+        }
+        entry.head = (char *)audio_malloc(len);
+        if (entry.head == NULL){
+            ESP_LOGW(TAG, "No memory for %d bytes of %s", len, uri);
+            return;
+        }
+        memcpy(entry.head, data, len);
+        entry.head_len = len;
+        entry.file_size = file_size;
+        entry.file_mtime = (int64_t)st.st_mtime;
+        ESP_LOGI(TAG, "Cached %d bytes of %s for tag %s", len, uri, entry.tag.c_str());
+    }
+}
+
+bool TagCache::preload(const std::string& tag, const std::string& uri, audio_element_handle_t reader, int& decoder){
+    const std::lock_guard<std::mutex> lock(mutex);
+    auto it = find(tag);
+    if (it == entries.end() || it->head == NULL || it->playlist.front() != uri){
+        return false;
+    }
+    struct stat st;
+    if (stat(uri.c_str(), &st) != 0 || (int64_t)st.st_size != it->file_size
+        || (int64_t)st.st_mtime != it->file_mtime){
+        // Replaced since, the reader caches the new head again
+        ESP_LOGI(TAG, "%s changed, cached bytes dropped", uri.c_str());
+        release(*it);
+        return false;
+    }
+    decoder = it->decoder;
+    return playlist_stream_preload(reader, uri.c_str(), it->head, it->head_len, it->file_size) == ESP_OK;
+}
+
+TagCache::Stats TagCache::stats(){
+    const std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
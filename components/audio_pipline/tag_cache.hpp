@@ -0,0 +1,70 @@
+#pragma once
+
+extern "C" {
+#include <stdint.h>
+#include <stddef.h>
+#include "audio_element.h"
+}
+
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+
+/// Warm cache for the most recently used tags.
+///
+/// Keeps what a tag needs to start playing without waiting for the SD card:
+/// the parsed playlist, the decoder of its first track and the opening bytes
+/// of that track. The bytes are allocated with audio_malloc, i.e. in PSRAM
+/// on boards that have it. Least recently used tags are evicted first.
+class TagCache
+{
+  public:
+    struct Stats{
+        unsigned hits = 0;
+        unsigned misses = 0;
+    };
+
+    /// @p capacity tags, @p head_size opening bytes per tag. A capacity of 0
+    /// disables the cache.
+    TagCache(size_t capacity, size_t head_size);
+    ~TagCache();
+    TagCache(const TagCache&) = delete;
+    TagCache& operator=(const TagCache&) = delete;
+
+    /// Copy the cached playlist of @p tag and the decoder of its first track.
+    /// Counts as a hit or a miss.
+    bool lookup(const std::string& tag, std::vector<std::string>& playlist, int& decoder);
+    /// Remember the playlist of @p tag, it becomes the most recently used one.
+    void put(const std::string& tag, const std::vector<std::string>& playlist, int decoder);
+    /// Forget @p tag, its playlist changed
+    void invalidate(const std::string& tag);
+    /// Keep the opening bytes of @p uri for every cached tag that starts with
+    /// it and has none yet. Called by the reader, which reads them anyway.
+    void store_head(const char *uri, const char *data, int len, int64_t file_size);
+    /// If @p uri is the cached first track of @p tag hand its opening bytes
+    /// to a playlist_stream reader and report the decoder it needs. Bytes
+    /// of a file that changed size or mtime since are dropped instead.
+    bool preload(const std::string& tag, const std::string& uri, audio_element_handle_t reader, int& decoder);
+
+    Stats stats();
+
+  private:
+    struct Entry{
+        std::string tag;
+        std::vector<std::string> playlist;
+        int decoder = 0;
+        char *head = NULL;
+        int head_len = 0;
+        int64_t file_size = 0;
+        int64_t file_mtime = 0;     ///< of the file the head came from
+    };
+    std::list<Entry>::iterator find(const std::string& tag);
+    static void release(Entry& entry);
+
+    size_t capacity;
+    size_t head_size;
+    std::list<Entry> entries;     ///< most recently used first
+    Stats counters;
+    std::mutex mutex;
+};
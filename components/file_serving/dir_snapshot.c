@@ -0,0 +1,345 @@
+/*  Cached listings of directories on the SD card, see dir_snapshot.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "dir_snapshot.h"
+
+/* Unfinished uploads of the file server */
+#define PART_SUFFIX     ".part"
+
+static const char *TAG = "DIR_SNAPSHOT";
+
+struct entry {
+    uint32_t name_at;           /* offset into names */
+    uint32_t size;
+    time_t mtime;
+    bool is_dir;
+};
+
+struct snapshot {
+    char *path;                 /* without the trailing '/', NULL while unused */
+    struct entry *entries;      /* sorted by name, ignoring case */
+    size_t count;
+    size_t entries_size;        /* bytes allocated */
+    char *names;                /* 0-terminated, one after the other */
+    size_t names_len;
+    size_t names_size;
+    size_t names_garbage;       /* bytes of names of removed entries */
+    int64_t built_us;
+    uint32_t used;              /* cache tick of the last visit */
+};
+
+struct dir_snapshot_cache {
+    SemaphoreHandle_t lock;     /* guards everything below */
+    struct snapshot *dirs;
+    int count;
+    int64_t max_age_us;
+    uint32_t tick;
+    dir_snapshot_stats_t stats;
+};
+
+/* PSRAM when there is any, only the CPU reads snapshots */
+static void *snapshot_alloc(size_t size)
+{
+    void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    return p ? p : heap_caps_malloc(size, MALLOC_CAP_8BIT);
+}
+
+/* Make room for @need more bytes behind the @len used ones of *@buf */
+static bool grow(void **buf, size_t *size, size_t len, size_t need)
+{
+    if (len + need <= *size) {
+        return true;
+    }
+    size_t new_size = *size ? *size * 2 : 1024;
+    while (new_size < len + need) {
+        new_size *= 2;
+    }
+    void *p = snapshot_alloc(new_size);
+    if (!p) {
+        return false;
+    }
+    if (len > 0) {
+        memcpy(p, *buf, len);
+    }
+    heap_caps_free(*buf);
+    *buf = p;
+    *size = new_size;
+    return true;
+}
+
+static bool listed(const char *name)
+{
+    size_t len = strlen(name);
+    return name[0] != '.' && name[0] != '\0' &&
+           !(len > strlen(PART_SUFFIX) && strcmp(name + len - strlen(PART_SUFFIX), PART_SUFFIX) == 0);
+}
+
+/* Length of @dirpath without trailing '/' */
+static size_t dir_len(const char *dirpath)
+{
+    size_t len = strlen(dirpath);
+    while (len > 1 && dirpath[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+static void snapshot_free(struct snapshot *s)
+{
+    free(s->path);
+    heap_caps_free(s->entries);
+    heap_caps_free(s->names);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Index of @name, or where it goes if @found is false */
+static size_t snapshot_find(const struct snapshot *s, const char *name, bool *found)
+{
+    size_t lo = 0;
+    size_t hi = s->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcasecmp(s->names + s->entries[mid].name_at, name);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = false;
+    return lo;
+}
+
+/* Update or insert the entry of @name */
+static bool snapshot_put(struct snapshot *s, const char *name, const struct stat *st)
+{
+    bool found;
+    size_t at = snapshot_find(s, name, &found);
+    if (!found) {
+        size_t len = strlen(name) + 1;
+        if (!grow((void **)&s->entries, &s->entries_size, s->count * sizeof(struct entry), sizeof(struct entry)) ||
+                !grow((void **)&s->names, &s->names_size, s->names_len, len)) {
+            return false;
+        }
+        memmove(&s->entries[at + 1], &s->entries[at], (s->count - at) * sizeof(struct entry));
+        s->entries[at].name_at = s->names_len;
+        memcpy(s->names + s->names_len, name, len);
+        s->names_len += len;
+        s->count++;
+    }
+    s->entries[at].is_dir = S_ISDIR(st->st_mode);
+    s->entries[at].size = st->st_size;
+    s->entries[at].mtime = st->st_mtime;
+    return true;
+}
+
+/* Drop the names of removed entries, if there is memory for a copy */
+static void snapshot_compact(struct snapshot *s)
+{
+    size_t size = s->names_len - s->names_garbage;
+    char *names = snapshot_alloc(size > 0 ? size : 1);
+    if (!names) {
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        const char *name = s->names + s->entries[i].name_at;
+        size_t n = strlen(name) + 1;
+        memcpy(names + len, name, n);
+        s->entries[i].name_at = len;
+        len += n;
+    }
+    heap_caps_free(s->names);
+    s->names = names;
+    s->names_len = len;
+    s->names_size = size;
+    s->names_garbage = 0;
+}
+
+static void snapshot_remove(struct snapshot *s, const char *name)
+{
+    bool found;
+    size_t at = snapshot_find(s, name, &found);
+    if (!found) {
+        return;
+    }
+    s->names_garbage += strlen(s->names + s->entries[at].name_at) + 1;
+    memmove(&s->entries[at], &s->entries[at + 1], (s->count - at - 1) * sizeof(struct entry));
+    s->count--;
+    if (s->names_garbage > s->names_len / 2) {
+        snapshot_compact(s);
+    }
+}
+
+/* Read the directory at s->path, a readdir and a stat per entry */
+static esp_err_t snapshot_build(struct snapshot *s)
+{
+    DIR *dir = opendir(s->path);
+    if (!dir) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t path_size = strlen(s->path) + 2 + sizeof(((struct dirent *)NULL)->d_name);
+    char *path = malloc(path_size);
+    esp_err_t err = path ? ESP_OK : ESP_ERR_NO_MEM;
+    struct dirent *entry;
+    while (err == ESP_OK && (entry = readdir(dir)) != NULL) {
+        if (!listed(entry->d_name)) {
+            continue;
+        }
+        snprintf(path, path_size, "%s/%s", s->path, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (!snapshot_put(s, entry->d_name, &st)) {
+            ESP_LOGE(TAG, "No memory for %s", s->path);
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    closedir(dir);
+    free(path);
+    return err;
+}
+
+static struct snapshot *cache_find(dir_snapshot_cache_handle_t cache, const char *dirpath, size_t len)
+{
+    for (int i = 0; i < cache->count; i++) {
+        struct snapshot *s = &cache->dirs[i];
+        if (s->path && strncmp(s->path, dirpath, len) == 0 && s->path[len] == '\0') {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+dir_snapshot_cache_handle_t dir_snapshot_cache_create(int dirs, int max_age_s)
+{
+    dir_snapshot_cache_handle_t cache = calloc(1, sizeof(struct dir_snapshot_cache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->dirs = calloc(dirs, sizeof(struct snapshot));
+    cache->lock = xSemaphoreCreateMutex();
+    if (!cache->dirs || !cache->lock) {
+        free(cache->dirs);
+        if (cache->lock) {
+            vSemaphoreDelete(cache->lock);
+        }
+        free(cache);
+        return NULL;
+    }
+    cache->count = dirs;
+    cache->max_age_us = (int64_t)max_age_s * 1000000;
+    return cache;
+}
+
+void dir_snapshot_cache_destroy(dir_snapshot_cache_handle_t cache)
+{
+    for (int i = 0; i < cache->count; i++) {
+        snapshot_free(&cache->dirs[i]);
+    }
+    vSemaphoreDelete(cache->lock);
+    free(cache->dirs);
+    free(cache);
+}
+
+esp_err_t dir_snapshot_visit(dir_snapshot_cache_handle_t cache, const char *dirpath, size_t *index, size_t *count,
+                             dir_snapshot_visit_t visit, void *ctx)
+{
+    size_t len = dir_len(dirpath);
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    struct snapshot *s = cache_find(cache, dirpath, len);
+    if (s && cache->max_age_us > 0 && now - s->built_us > cache->max_age_us) {
+        snapshot_free(s);
+        s = NULL;
+    }
+    if (s) {
+        cache->stats.hits++;
+    } else {
+        /* A free slot or the least recently used one */
+        s = &cache->dirs[0];
+        for (int i = 1; i < cache->count && s->path; i++) {
+            if (!cache->dirs[i].path || cache->dirs[i].used < s->used) {
+                s = &cache->dirs[i];
+            }
+        }
+        snapshot_free(s);
+        s->path = strndup(dirpath, len);
+        esp_err_t err = s->path ? snapshot_build(s) : ESP_ERR_NO_MEM;
+        if (err != ESP_OK) {
+            snapshot_free(s);
+            xSemaphoreGive(cache->lock);
+            return err;
+        }
+        s->built_us = now;
+        cache->stats.builds++;
+        cache->stats.build_us += esp_timer_get_time() - now;
+    }
+    s->used = ++cache->tick;
+
+    while (*index < s->count) {
+        const struct entry *e = &s->entries[*index];
+        dir_snapshot_entry_t entry = {
+            .name = s->names + e->name_at,
+            .is_dir = e->is_dir,
+            .size = e->size,
+            .mtime = e->mtime,
+        };
+        if (!visit(&entry, ctx)) {
+            break;
+        }
+        (*index)++;
+    }
+    *count = s->count;
+    xSemaphoreGive(cache->lock);
+    return ESP_OK;
+}
+
+void dir_snapshot_note(dir_snapshot_cache_handle_t cache, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash || !listed(slash + 1)) {
+        return;
+    }
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    struct snapshot *s = cache_find(cache, path, slash - path);
+    if (s) {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            snapshot_remove(s, slash + 1);
+        } else if (!snapshot_put(s, slash + 1, &st)) {
+            /* Read again next time */
+            snapshot_free(s);
+        }
+        cache->stats.notes++;
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+void dir_snapshot_get_stats(dir_snapshot_cache_handle_t cache, dir_snapshot_stats_t *stats)
+{
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    *stats = cache->stats;
+    xSemaphoreGive(cache->lock);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+/*  Cached listings of directories on the SD card, for the file server.
+
+    Listing a FAT directory takes a readdir and a stat per entry, and
+    every stat looks the name up in the directory again, so a folder of a
+    few hundred tracks takes seconds. A snapshot keeps name, type, size
+    and mtime of every entry of one directory, sorted by name without
+    regard to case, in PSRAM when there is any. The cache holds the
+    snapshots of the directories listed last; a new one replaces the
+    least recently used.
+
+    Changes made through the file server are noted path by path with
+    dir_snapshot_note(), which updates that one entry of a cached
+    snapshot instead of dropping it. Writers the server doesn't see, like
+    the frame index of the player, show up once a snapshot is older than
+    max_age_s and is read again. Hidden entries and the .part files of
+    unfinished uploads are left out.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dir_snapshot_cache *dir_snapshot_cache_handle_t;
+
+typedef struct {
+    const char *name;
+    bool is_dir;
+    uint32_t size;
+    time_t mtime;
+} dir_snapshot_entry_t;
+
+/// Called for one entry after the other. Return false to stop before
+/// @p entry, the next dir_snapshot_visit() starts with it again.
+typedef bool (*dir_snapshot_visit_t)(const dir_snapshot_entry_t *entry, void *ctx);
+
+/// Counters since dir_snapshot_cache_create()
+typedef struct {
+    uint32_t hits;          /*!< Visits served from a cached snapshot */
+    uint32_t builds;        /*!< Directories read, on a miss or when too old */
+    int64_t build_us;       /*!< Time spent reading them */
+    uint32_t notes;         /*!< Entries updated in place */
+} dir_snapshot_stats_t;
+
+/// A cache of @p dirs snapshots, each read again after @p max_age_s, 0 never
+dir_snapshot_cache_handle_t dir_snapshot_cache_create(int dirs, int max_age_s);
+void dir_snapshot_cache_destroy(dir_snapshot_cache_handle_t cache);
+
+/// Visit the entries of directory @p dirpath from @p *index on, in name
+/// order, under the lock of the cache. The directory is read if it isn't
+/// cached. Advances @p *index past the visited entries and sets @p *count
+/// to the number of entries. Between two calls noted changes may shift
+/// the entries by one. ESP_ERR_NOT_FOUND if the directory can't be opened,
+/// ESP_ERR_NO_MEM if it doesn't fit into memory.
+esp_err_t dir_snapshot_visit(dir_snapshot_cache_handle_t cache, const char *dirpath, size_t *index, size_t *count,
+                             dir_snapshot_visit_t visit, void *ctx);
+
+/// File or directory @p path was created, changed or removed. Updates its
+/// entry in the snapshot of its directory, if that is cached.
+void dir_snapshot_note(dir_snapshot_cache_handle_t cache, const char *path);
+
+void dir_snapshot_get_stats(dir_snapshot_cache_handle_t cache, dir_snapshot_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -13,40 +13,129 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <time.h>
+#include <utime.h>
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 #include "esp_vfs.h"
 #include "fcntl.h"
 #include "esp_http_server.h"
+#include "trace_ring.h"
+#include "io_arbiter.h"
+#include "dir_snapshot.h"
 
 /* Max length a file path can have on storage */
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
 
-/* Max size of an individual file. Make sure this
- * value is same as that set in upload_script.html */
-#define MAX_FILE_SIZE   (200*1024) // 200 KB
-#define MAX_FILE_SIZE_STR "200KB"
+/* Uploads are received into one buffer while the other one is written */
+#define UPLOAD_BUFSIZE   (CONFIG_FILE_SERVER_UPLOAD_BUFFER_KB * 1024)
 
-/* Scratch buffer size */
-#define SCRATCH_BUFSIZE  8192
+/* Uploads go to this file next to the target, renamed when complete */
+#define UPLOAD_PART_SUFFIX ".part"
+
+/* Downloads read ahead into one buffer of the pool while the other one
+ * is sent, reads are aligned to the buffer size within the file */
+#define DOWNLOAD_BUFSIZE (CONFIG_FILE_SERVER_DOWNLOAD_BUFFER_KB * 1024)
+
+/* Requests check out a transfer buffer of the pool for their own use */
+#define TRANSFER_BUFSIZE (CONFIG_FILE_SERVER_TRANSFER_BUFFER_KB * 1024)
+
+/* Socket timeouts in a row a transfer sits out before it gives up on a
+ * client that stopped reading or sending, each one is send_wait_timeout
+ * or recv_wait_timeout long */
+#define TRANSFER_TIMEOUT_RETRIES 3
+
+/* Longest If-None-Match, If-Modified-Since, If-Range or Range header
+ * value looked at, longer ones are ignored */
+#define COND_HDR_MAX     128
 
 struct file_server_data {
     /* Base path of file storage */
     char base_path[ESP_VFS_PATH_MAX + 1];
 
-    /* Scratch buffer for temporary storage during file transfer */
-    char scratch[SCRATCH_BUFSIZE];
+    /* Transfer buffers of TRANSFER_BUFSIZE, passed around as pointers.
+     * A request that needs one takes it for its duration, so requests
+     * served at the same time never share a buffer */
+    QueueHandle_t transfer_pool;
+
+    /* Download readers, each with two buffers of DOWNLOAD_BUFSIZE and its
+     * task, passed around as pointers. A download takes one for its
+     * duration */
+    QueueHandle_t download_readers;
+
+    /* The upload writer, with two buffers of UPLOAD_BUFSIZE and its task,
+     * passed around as a pointer. An upload takes it for its duration */
+    QueueHandle_t upload_writers;
+
+    /* Held while .manifest is read and rewritten, or appended to */
+    SemaphoreHandle_t manifest_lock;
+
+    /* Snapshots of the directories listed last, every change the server
+     * makes to the card is noted there */
+    dir_snapshot_cache_handle_t listings;
 };
 
 static const char *TAG = "file_server";
 
+/* The running server, NULL while stopped */
+static struct file_server_data *server_data;
+static httpd_handle_t server;
+
+/* Time of the last request or transfer block, see example_file_server_last_active_us() */
+static portMUX_TYPE activity_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t active_us;
+
+/* On every request, every block a transfer moves and when a handler
+ * hands its buffer back, so a transfer longer than the idle time of the
+ * file service does not look idle */
+static void mark_active(void)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&activity_lock);
+    active_us = now;
+    portEXIT_CRITICAL(&activity_lock);
+}
+
+/* Check out a transfer buffer for the request. With all of them in use
+ * it waits for one to be handed back. If none comes the request is
+ * answered 503 with Retry-After and NULL is returned */
+static char *transfer_get(httpd_req_t *req)
+{
+    struct file_server_data *data = req->user_ctx;
+    char *buf = NULL;
+    if (xQueueReceive(data->transfer_pool, &buf, pdMS_TO_TICKS(CONFIG_FILE_SERVER_TRANSFER_WAIT_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "No transfer buffer for %s", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        httpd_resp_sendstr(req, "Server busy, try again");
+        return NULL;
+    }
+    return buf;
+}
+
+static void transfer_put(httpd_req_t *req, char *buf)
+{
+    mark_active();
+    xQueueSend(((struct file_server_data *)req->user_ctx)->transfer_pool, &buf, 0);
+}
+
 /* Handler to redirect incoming GET request for /index.html to /
  * This can be overridden by uploading file with same name */
 static esp_err_t index_html_get_handler(httpd_req_t *req)
@@ -70,29 +159,65 @@ static esp_err_t favicon_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-/* Send HTTP response with a run-time generated html consisting of
- * a list of all files and folders under the requested path.
- * In case of SPIFFS this returns empty list when path is any
- * string other than '/', since SPIFFS doesn't support directories */
-static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
+/* Visitor that stops right away, for reading a directory before the
+ * response starts */
+static bool dir_stop(const dir_snapshot_entry_t *entry, void *ctx)
 {
-    char entrypath[FILE_PATH_MAX];
-    char entrysize[16];
-    const char *entrytype;
-
-    struct dirent *entry;
-    struct stat entry_stat;
+    return false;
+}
 
-    DIR *dir = opendir(dirpath);
-    const size_t dirpath_len = strlen(dirpath);
+/* Rows of the HTML listing are collected in the transfer buffer, which
+ * goes out as one chunk once it is full */
+struct dir_html {
+    httpd_req_t *req;
+    char *buf;
+    size_t len;
+};
 
-    /* Retrieve the base path of file storage to construct the full path */
-    strlcpy(entrypath, dirpath, sizeof(entrypath));
+static bool dir_html_row(const dir_snapshot_entry_t *entry, void *ctx)
+{
+    struct dir_html *h = ctx;
+    size_t room = TRANSFER_BUFSIZE - h->len;
+    int n = snprintf(h->buf + h->len, room,
+                     "<tr><td><a href=\"%s%s%s\">%s</a></td><td>%s</td><td>%lu</td><td>"
+                     "<form method=\"post\" action=\"/delete%s%s\"><button type=\"submit\">Delete</button></form>"
+                     "</td></tr>\n",
+                     h->req->uri, entry->name, entry->is_dir ? "/" : "", entry->name,
+                     entry->is_dir ? "directory" : "file", (unsigned long)entry->size, h->req->uri, entry->name);
+    if (n >= room) {
+        /* Sent first, then this row again. One that never fits is left out */
+        return h->len == 0;
+    }
+    h->len += n;
+    return true;
+}
 
-    if (!dir) {
-        ESP_LOGE(TAG, "Failed to stat dir : %s", dirpath);
-        /* Respond with 404 Not Found */
-        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+/* Send HTTP response with a run-time generated html consisting of
+ * a list of all files and folders under the requested path.
+ * The entries come from the snapshot of the directory, read once and
+ * kept up to date by the handlers that change the card */
+static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
+{
+    struct file_server_data *data = req->user_ctx;
+    struct dir_html html = { .req = req };
+    size_t index = 0;
+    size_t count = 0;
+    int64_t start = esp_timer_get_time();
+
+    html.buf = transfer_get(req);
+    if (!html.buf) {
+        return ESP_FAIL;
+    }
+    esp_err_t err = dir_snapshot_visit(data->listings, dirpath, &index, &count, dir_stop, NULL);
+    if (err != ESP_OK) {
+        transfer_put(req, html.buf);
+        ESP_LOGE(TAG, "Failed to list dir : %s", dirpath);
+        if (err == ESP_ERR_NOT_FOUND) {
+            /* Respond with 404 Not Found */
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+        } else {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        }
         return ESP_FAIL;
     }
 
@@ -115,39 +240,23 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
         "<th style=\"text-align: left\">Size (Bytes)</th><th style=\"text-align: left\">Action</th></tr></thead>"
         "<tbody>");
 
-    /* Iterate over all files / folders and fetch their names and sizes */
-    while ((entry = readdir(dir)) != NULL) {
-        entrytype = (entry->d_type == DT_DIR ? "directory" : "file");
-
-        strlcpy(entrypath + dirpath_len, entry->d_name, sizeof(entrypath) - dirpath_len);
-        if (stat(entrypath, &entry_stat) == -1) {
-            ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, entry->d_name);
-            continue;
+    /* Table rows, a transfer buffer full at a time */
+    bool ok = true;
+    while (ok && err == ESP_OK && index < count) {
+        html.len = 0;
+        err = dir_snapshot_visit(data->listings, dirpath, &index, &count, dir_html_row, &html);
+        if (html.len > 0) {
+            ok = httpd_resp_send_chunk(req, html.buf, html.len) == ESP_OK;
         }
-        sprintf(entrysize, "%ld", entry_stat.st_size);
-        ESP_LOGI(TAG, "Found %s : %s (%s bytes)", entrytype, entry->d_name, entrysize);
-
-        /* Send chunk of HTML file containing table entries with file name and size */
-        httpd_resp_sendstr_chunk(req, "<tr><td><a href=\"");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        if (entry->d_type == DT_DIR) {
-            httpd_resp_sendstr_chunk(req, "/");
-        }
-        httpd_resp_sendstr_chunk(req, "\">");
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "</a></td><td>");
-        httpd_resp_sendstr_chunk(req, entrytype);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, entrysize);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/delete");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Delete</button></form>");
-        httpd_resp_sendstr_chunk(req, "</td></tr>\n");
     }
-    closedir(dir);
+    transfer_put(req, html.buf);
+    if (!ok) {
+        ESP_LOGE(TAG, "Listing sending failed!");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Listed %s : %u entries in %lld ms", dirpath, (unsigned)count,
+             (long long)((esp_timer_get_time() - start) / 1000));
 
     /* Finish the file list table */
     httpd_resp_sendstr_chunk(req, "</tbody></table>");
@@ -163,21 +272,21 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
-/* Set HTTP response content type according to file extension */
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename)
+/* HTTP content type according to file extension */
+static const char *content_type_from_file(const char *filename)
 {
     if (IS_FILE_EXT(filename, ".pdf")) {
-        return httpd_resp_set_type(req, "application/pdf");
+        return "application/pdf";
     } else if (IS_FILE_EXT(filename, ".html")) {
-        return httpd_resp_set_type(req, "text/html");
+        return "text/html";
     } else if (IS_FILE_EXT(filename, ".jpeg")) {
-        return httpd_resp_set_type(req, "image/jpeg");
+        return "image/jpeg";
     } else if (IS_FILE_EXT(filename, ".ico")) {
-        return httpd_resp_set_type(req, "image/x-icon");
+        return "image/x-icon";
     }
     /* This is a limited set only */
     /* For any other type always set as plain text */
-    return httpd_resp_set_type(req, "text/plain");
+    return "text/plain";
 }
 
 /* Copies the full path into destination buffer and returns
@@ -209,12 +318,311 @@ static const char* get_path_from_uri(char *dest, const char *base_path, const ch
     return dest + base_pathlen;
 }
 
-/* Handler to download a file kept on the server */
+/* Validators of a file: the ETag from its size and modification time,
+ * the same Last-Modified as an HTTP date. Both change on every upload */
+struct file_validators {
+    char etag[40];
+    char last_modified[32];
+};
+
+static void file_validators_get(const struct stat *file_stat, struct file_validators *v)
+{
+    struct tm tm;
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx\"",
+             (unsigned long long)file_stat->st_mtime, (unsigned long long)file_stat->st_size);
+    gmtime_r(&file_stat->st_mtime, &tm);
+    strftime(v->last_modified, sizeof(v->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Copy the value of request header @field into @buf, false if it is
+ * missing or too long */
+static bool get_hdr(httpd_req_t *req, const char *field, char *buf, size_t size)
+{
+    size_t len = httpd_req_get_hdr_value_len(req, field);
+    if (len == 0 || len >= size) {
+        return false;
+    }
+    return httpd_req_get_hdr_value_str(req, field, buf, size) == ESP_OK;
+}
+
+/* True if the If-None-Match list @list names @etag, or is "*".
+ * W/ prefixes are ignored, as the weak comparison asks for */
+static bool etag_list_matches(const char *list, const char *etag)
+{
+    const size_t etag_len = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        if (strncmp(p, etag, etag_len) == 0 && (p[etag_len] == '\0' || p[etag_len] == ',' || p[etag_len] == ' ')) {
+            return true;
+        }
+        while (*p && *p != ',') {
+            p++;
+        }
+    }
+    return false;
+}
+
+/* True if the client copy is current: If-None-Match names the ETag or,
+ * without If-None-Match, If-Modified-Since repeats Last-Modified. Clients
+ * send back the date they got, so it is compared as is */
+static bool not_modified(httpd_req_t *req, const struct file_validators *v)
+{
+    char value[COND_HDR_MAX];
+    if (get_hdr(req, "If-None-Match", value, sizeof(value))) {
+        return etag_list_matches(value, v->etag);
+    }
+    if (get_hdr(req, "If-Modified-Since", value, sizeof(value))) {
+        return strcmp(value, v->last_modified) == 0;
+    }
+    return false;
+}
+
+/* Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+ * range of a @size bytes file into [*first, *last].
+ * Returns 1 for a range, 0 to send the whole file (no or an unsupported
+ * Range header, several ranges) and -1 if it is unsatisfiable */
+static int parse_range(const char *range, long size, long *first, long *last)
+{
+    char *end;
+    if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ',')) {
+        return 0;
+    }
+    range += 6;
+    if (*range == '-') {
+        long suffix = strtol(range + 1, &end, 10);
+        if (end == range + 1 || *end != '\0' || suffix < 0) {
+            return 0;
+        }
+        if (suffix == 0 || size == 0) {
+            return -1;
+        }
+        *first = suffix < size ? size - suffix : 0;
+        *last = size - 1;
+        return 1;
+    }
+    *first = strtol(range, &end, 10);
+    if (end == range || *end != '-' || *first < 0) {
+        return 0;
+    }
+    range = end + 1;
+    if (*range == '\0') {
+        *last = size - 1;
+    } else {
+        *last = strtol(range, &end, 10);
+        if (*end != '\0' || *last < *first) {
+            return 0;
+        }
+        if (*last >= size) {
+            *last = size - 1;
+        }
+    }
+    return *first < size ? 1 : -1;
+}
+
+static bool send_exact(httpd_req_t *req, const char *buf, size_t len)
+{
+    int timeouts = 0;
+    while (len > 0) {
+        int sent = httpd_send(req, buf, len);
+        if (sent == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts <= TRANSFER_TIMEOUT_RETRIES) {
+            continue;
+        }
+        if (sent <= 0) {
+            ESP_LOGW(TAG, "Client stopped reading %s", req->uri);
+            return false;
+        }
+        mark_active();
+        timeouts = 0;
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+/* Reader of downloads, created at start with its two buffers. Reads the
+ * next block into the buffer it is handed while the previous one is
+ * sent. A block without buffer ends the task */
+struct download_reader {
+    char *bufs[2];
+    QueueHandle_t jobs;             /* struct download_job, one at a time */
+    SemaphoreHandle_t done;
+    size_t got;
+    int64_t read_us;
+};
+
+struct download_job {
+    FILE *fd;
+    char *buf;
+    size_t len;
+};
+
+static void download_reader_task(void *arg)
+{
+    struct download_reader *r = arg;
+    struct download_job job;
+    while (true) {
+        xQueueReceive(r->jobs, &job, portMAX_DELAY);
+        if (job.buf == NULL) {
+            xSemaphoreGive(r->done);
+            vTaskDelete(NULL);
+            return;
+        }
+        int64_t start = io_arbiter_begin(IO_ARBITER_DOWNLOAD);
+        r->got = fread(job.buf, 1, job.len, job.fd);
+        r->read_us += esp_timer_get_time() - start;
+        io_arbiter_end(IO_ARBITER_DOWNLOAD, start, r->got);
+        xSemaphoreGive(r->done);
+    }
+}
+
+static void download_reader_put(struct download_reader *r, FILE *fd, char *buf, size_t len)
+{
+    struct download_job job = { .fd = fd, .buf = buf, .len = len };
+    xQueueSend(r->jobs, &job, portMAX_DELAY);
+}
+
+/* Reader with its buffers in internal RAM, the SD driver copies other
+ * buffers sector by sector. NULL if it could not be created */
+static struct download_reader *download_reader_create(void)
+{
+    struct download_reader *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->bufs[0] = heap_caps_malloc(DOWNLOAD_BUFSIZE, MALLOC_CAP_DMA);
+    r->bufs[1] = heap_caps_malloc(DOWNLOAD_BUFSIZE, MALLOC_CAP_DMA);
+    r->jobs = xQueueCreate(1, sizeof(struct download_job));
+    r->done = xSemaphoreCreateBinary();
+    if (r->bufs[0] && r->bufs[1] && r->jobs && r->done &&
+            xTaskCreatePinnedToCore(download_reader_task, "download_reader", 4096, r, 5, NULL,
+                                    CONFIG_FILE_SERVER_TASK_CORE) == pdPASS) {
+        return r;
+    }
+    heap_caps_free(r->bufs[0]);
+    heap_caps_free(r->bufs[1]);
+    if (r->jobs) {
+        vQueueDelete(r->jobs);
+    }
+    if (r->done) {
+        vSemaphoreDelete(r->done);
+    }
+    free(r);
+    return NULL;
+}
+
+static void download_reader_destroy(struct download_reader *r)
+{
+    download_reader_put(r, NULL, NULL, 0);
+    xSemaphoreTake(r->done, portMAX_DELAY);
+    heap_caps_free(r->bufs[0]);
+    heap_caps_free(r->bufs[1]);
+    vQueueDelete(r->jobs);
+    vSemaphoreDelete(r->done);
+    free(r);
+}
+
+struct download_stats {
+    int64_t elapsed_us;
+    int64_t read_us;
+    int64_t wait_us;                /* the socket waited for the card */
+};
+
+/* Send @len bytes of @fd, which is at @offset, as raw body. With a reader
+ * from the pool it reads the next block while this one is sent. Without,
+ * blocks are read and sent in turn from the transfer buffer @buf.
+ * Returns NULL, or what went wrong */
+static const char *download_send(httpd_req_t *req, FILE *fd, long offset, long len, char *buf,
+                                 struct download_stats *stats)
+{
+    struct file_server_data *data = req->user_ctx;
+    struct download_reader *reader = NULL;
+    char *bufs[2] = { buf, buf };
+    size_t bufsize = TRANSFER_BUFSIZE;
+    const char *error = NULL;
+    int64_t start = esp_timer_get_time();
+
+    memset(stats, 0, sizeof(*stats));
+    if (data->download_readers && xQueueReceive(data->download_readers, &reader, 0) == pdTRUE) {
+        reader->read_us = 0;
+        bufs[0] = reader->bufs[0];
+        bufs[1] = reader->bufs[1];
+        bufsize = DOWNLOAD_BUFSIZE;
+    }
+
+    /* The first block ends on a multiple of the buffer size, the card
+     * then reads whole aligned blocks */
+    size_t want = MIN(len, (long)(bufsize - offset % bufsize));
+    long remaining = len;
+    int index = 0;
+    if (reader && remaining > 0) {
+        download_reader_put(reader, fd, bufs[index], want);
+    }
+    while (remaining > 0) {
+        size_t got;
+        if (reader) {
+            int64_t wait_start = esp_timer_get_time();
+            xSemaphoreTake(reader->done, portMAX_DELAY);
+            stats->wait_us += esp_timer_get_time() - wait_start;
+            got = reader->got;
+        } else {
+            int64_t read_start = io_arbiter_begin(IO_ARBITER_DOWNLOAD);
+            got = fread(bufs[index], 1, want, fd);
+            stats->read_us += esp_timer_get_time() - read_start;
+            io_arbiter_end(IO_ARBITER_DOWNLOAD, read_start, got);
+        }
+        if (got != want) {
+            error = "Failed to read file";
+            break;
+        }
+        remaining -= got;
+        want = MIN(remaining, (long)bufsize);
+        if (reader && remaining > 0) {
+            /* Read the next block while this one is sent */
+            download_reader_put(reader, fd, bufs[index ^ 1], want);
+        }
+        if (!send_exact(req, bufs[index], got)) {
+            error = "Failed to send file";
+            if (reader && remaining > 0) {
+                xSemaphoreTake(reader->done, portMAX_DELAY);
+            }
+            break;
+        }
+        index ^= 1;
+    }
+
+    if (reader) {
+        /* Idle again, back to the pool */
+        stats->read_us = reader->read_us;
+        xQueueSend(data->download_readers, &reader, 0);
+    }
+    stats->elapsed_us = esp_timer_get_time() - start;
+    return error;
+}
+
+/* Handler to download a file kept on the server.
+ * Answers conditional requests with 304 Not Modified and a single byte
+ * range with 206 Partial Content, so interrupted downloads resume and
+ * files the client already has are not sent again */
 static esp_err_t download_get_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
     FILE *fd = NULL;
     struct stat file_stat;
+    struct file_validators validators;
+    char range_hdr[COND_HDR_MAX];
+    char content_range[64];
+    long first = 0;
+    long last = 0;
+    int ranged = 0;
 
     const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
                                              req->uri, sizeof(filepath));
@@ -244,58 +652,300 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    /* Header values are only referenced by the response, they live on
+     * this stack frame until it is sent */
+    file_validators_get(&file_stat, &validators);
+    httpd_resp_set_hdr(req, "ETag", validators.etag);
+    httpd_resp_set_hdr(req, "Last-Modified", validators.last_modified);
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+
+    if (not_modified(req, &validators)) {
+        ESP_LOGI(TAG, "Not modified : %s", filename);
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    if (get_hdr(req, "Range", range_hdr, sizeof(range_hdr))) {
+        char if_range[COND_HDR_MAX];
+        /* A range of a file that changed since would mix two versions */
+        if (!get_hdr(req, "If-Range", if_range, sizeof(if_range)) ||
+                strcmp(if_range, validators.etag) == 0 || strcmp(if_range, validators.last_modified) == 0) {
+            ranged = parse_range(range_hdr, file_stat.st_size, &first, &last);
+        }
+    }
+    if (ranged < 0) {
+        ESP_LOGW(TAG, "Range not satisfiable : %s %s", filename, range_hdr);
+        snprintf(content_range, sizeof(content_range), "bytes */%ld", (long)file_stat.st_size);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+    if (!ranged) {
+        first = 0;
+        last = file_stat.st_size - 1;
+    }
+
+    char *buf = transfer_get(req);
+    if (!buf) {
+        return ESP_FAIL;
+    }
     fd = fopen(filepath, "r");
     if (!fd) {
+        transfer_put(req, buf);
         ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
         return ESP_FAIL;
     }
+    if (first > 0 && fseek(fd, first, SEEK_SET) != 0) {
+        fclose(fd);
+        transfer_put(req, buf);
+        ESP_LOGE(TAG, "Failed to seek to %ld : %s", first, filepath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+        return ESP_FAIL;
+    }
+    /* Whole blocks go to the card, stdio would only split them */
+    setvbuf(fd, NULL, _IONBF, 0);
+
+    if (ranged) {
+        ESP_LOGI(TAG, "Sending file : %s (bytes %ld-%ld of %ld)...", filename, first, last, file_stat.st_size);
+        snprintf(content_range, sizeof(content_range), "bytes %ld-%ld/%ld", first, last, (long)file_stat.st_size);
+    } else {
+        ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
+    }
 
-    ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
-    set_content_type_from_file(req, filename);
-
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *chunk = ((struct file_server_data *)req->user_ctx)->scratch;
-    size_t chunksize;
-    do {
-        /* Read file in chunks into the scratch buffer */
-        chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd);
-
-        if (chunksize > 0) {
-            /* Send the buffer contents as HTTP response chunk */
-            if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
-                fclose(fd);
-                ESP_LOGE(TAG, "File sending failed!");
-                /* Abort sending file */
-                httpd_resp_sendstr_chunk(req, NULL);
-                /* Respond with 500 Internal Server Error */
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-               return ESP_FAIL;
-           }
-        }
-
-        /* Keep looping till the whole file is sent */
-    } while (chunksize != 0);
-
-    /* Close file after sending complete */
-    fclose(fd);
-    ESP_LOGI(TAG, "File sending complete");
-
-    /* Respond with an empty chunk to signal HTTP response completion */
+    /* The size is known, so the body goes out raw with a Content-Length
+     * instead of chunked: one send per block instead of three */
+    char *head = buf;
+    int head_len = snprintf(head, TRANSFER_BUFSIZE,
+                            "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %ld\r\n"
+                            "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+                            ranged ? "206 Partial Content" : "200 OK", content_type_from_file(filename),
+                            last - first + 1, validators.etag, validators.last_modified);
+    if (ranged) {
+        head_len += snprintf(head + head_len, TRANSFER_BUFSIZE - head_len, "Content-Range: %s\r\n", content_range);
+    }
 #ifdef CONFIG_EXAMPLE_HTTPD_CONN_CLOSE_HEADER
-    httpd_resp_set_hdr(req, "Connection", "close");
+    head_len += snprintf(head + head_len, TRANSFER_BUFSIZE - head_len, "Connection: close\r\n");
 #endif
-    httpd_resp_send_chunk(req, NULL, 0);
+    head_len += snprintf(head + head_len, TRANSFER_BUFSIZE - head_len, "\r\n");
+    if (!send_exact(req, head, head_len)) {
+        fclose(fd);
+        transfer_put(req, buf);
+        ESP_LOGE(TAG, "File sending failed!");
+        return ESP_FAIL;
+    }
+
+    struct download_stats stats;
+    const char *error = download_send(req, fd, first, last - first + 1, buf, &stats);
+    fclose(fd);
+    transfer_put(req, buf);
+    if (error) {
+        /* Too late for an error response, closing the connection tells
+         * the client the body is incomplete */
+        ESP_LOGE(TAG, "File sending failed! %s", error);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "File sending complete : %ld KB in %lld ms, SD reads %lld ms, waited %lld ms",
+             (last - first + 1) / 1024, (long long)(stats.elapsed_us / 1000), (long long)(stats.read_us / 1000),
+             (long long)(stats.wait_us / 1000));
     return ESP_OK;
 }
 
-/* Handler to upload a file onto the server */
+/* Writer of uploads, created at start with its two buffers. Takes a
+ * filled buffer, writes it to the file of the upload and hands it back,
+ * so that the next one is received while this one is written. Stopped
+ * by server_data_free() */
+struct upload_writer {
+    char *bufs[2];
+    FILE *fd;
+    size_t len;
+    int index;
+    bool failed;
+    bool stop;
+    int64_t write_us;
+    SemaphoreHandle_t filled;
+    SemaphoreHandle_t written;      /* given while the writer is idle */
+};
+
+static void upload_writer_task(void *arg)
+{
+    struct upload_writer *w = arg;
+    while (true) {
+        xSemaphoreTake(w->filled, portMAX_DELAY);
+        if (w->stop) {
+            xSemaphoreGive(w->written);
+            vTaskDelete(NULL);
+            return;
+        }
+        if (!w->failed) {
+            int64_t start = io_arbiter_begin(IO_ARBITER_UPLOAD);
+            w->failed = fwrite(w->bufs[w->index], 1, w->len, w->fd) != w->len;
+            w->write_us += esp_timer_get_time() - start;
+            io_arbiter_end(IO_ARBITER_UPLOAD, start, w->len);
+        }
+        xSemaphoreGive(w->written);
+    }
+}
+
+/* Wait until the writer finished the previous buffer */
+static void upload_writer_wait(struct upload_writer *w, int64_t *wait_us)
+{
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(w->written, portMAX_DELAY);
+    *wait_us += esp_timer_get_time() - start;
+}
+
+/* Hand buffer @index with @len bytes to the writer once it finished the
+ * previous one. Returns false if a write failed */
+static bool upload_writer_put(struct upload_writer *w, int index, size_t len, int64_t *wait_us)
+{
+    upload_writer_wait(w, wait_us);
+    /* Set by the writer before it gave the buffer back */
+    bool ok = !w->failed;
+    w->index = index;
+    w->len = len;
+    xSemaphoreGive(w->filled);
+    return ok;
+}
+
+/* Writer with its buffers in internal RAM, the SD driver copies other
+ * buffers sector by sector. NULL if it could not be created */
+static struct upload_writer *upload_writer_create(void)
+{
+    struct upload_writer *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    w->bufs[0] = heap_caps_malloc(UPLOAD_BUFSIZE, MALLOC_CAP_DMA);
+    w->bufs[1] = heap_caps_malloc(UPLOAD_BUFSIZE, MALLOC_CAP_DMA);
+    w->filled = xSemaphoreCreateBinary();
+    w->written = xSemaphoreCreateBinary();
+    if (w->bufs[0] && w->bufs[1] && w->filled && w->written &&
+            xTaskCreatePinnedToCore(upload_writer_task, "upload_writer", 4096, w, 5, NULL,
+                                    CONFIG_FILE_SERVER_TASK_CORE) == pdPASS) {
+        /* The writer starts out idle */
+        xSemaphoreGive(w->written);
+        return w;
+    }
+    heap_caps_free(w->bufs[0]);
+    heap_caps_free(w->bufs[1]);
+    if (w->filled) {
+        vSemaphoreDelete(w->filled);
+    }
+    if (w->written) {
+        vSemaphoreDelete(w->written);
+    }
+    free(w);
+    return NULL;
+}
+
+static void upload_writer_destroy(struct upload_writer *w)
+{
+    xSemaphoreTake(w->written, portMAX_DELAY);
+    w->stop = true;
+    xSemaphoreGive(w->filled);
+    xSemaphoreTake(w->written, portMAX_DELAY);
+    heap_caps_free(w->bufs[0]);
+    heap_caps_free(w->bufs[1]);
+    vSemaphoreDelete(w->filled);
+    vSemaphoreDelete(w->written);
+    free(w);
+}
+
+struct receive_stats {
+    int64_t elapsed_us;
+    int64_t write_us;
+    int64_t wait_us;                /* the socket waited for the card */
+};
+
+/* Receive @len bytes of the request body and write them to @fd.
+ * The body is received into the two buffers of the upload writer in turn
+ * while it puts the other one on the card, so the socket is read during
+ * SD writes. If @crc is given, the CRC-32 of the bytes is accumulated in
+ * it. Returns NULL, or the error to answer with. Bytes may have been
+ * written when it fails */
+static const char *receive_to_file(httpd_req_t *req, FILE *fd, size_t len, uint32_t *crc,
+                                   struct receive_stats *stats)
+{
+    struct file_server_data *data = req->user_ctx;
+    struct upload_writer *writer = NULL;
+    const char *error = NULL;
+    int64_t start = esp_timer_get_time();
+
+    memset(stats, 0, sizeof(*stats));
+    if (!data->upload_writers ||
+            xQueueReceive(data->upload_writers, &writer, pdMS_TO_TICKS(CONFIG_FILE_SERVER_TRANSFER_WAIT_MS)) != pdTRUE) {
+        ESP_LOGE(TAG, "No upload writer for %s", req->uri);
+        stats->elapsed_us = esp_timer_get_time() - start;
+        return "Server busy, try again";
+    }
+    writer->fd = fd;
+    writer->failed = false;
+    writer->write_us = 0;
+
+    int index = 0;
+    size_t fill = 0;
+    size_t remaining = len;
+    int timeouts = 0;
+    while (remaining > 0) {
+        /* Receive the file part by part into the current buffer */
+        int received = httpd_req_recv(req, writer->bufs[index] + fill, MIN(remaining, UPLOAD_BUFSIZE - fill));
+        if (received == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts <= TRANSFER_TIMEOUT_RETRIES) {
+            /* Retry if timeout occurred */
+            continue;
+        }
+        if (received <= 0) {
+            ESP_LOGE(TAG, "File reception failed!");
+            error = "Failed to receive file";
+            break;
+        }
+        mark_active();
+        timeouts = 0;
+        if (crc) {
+            *crc = esp_rom_crc32_le(*crc, (const uint8_t *)writer->bufs[index] + fill, received);
+        }
+        fill += received;
+        remaining -= received;
+
+        /* Hand over full buffers only, the writes stay cluster aligned */
+        if (fill == UPLOAD_BUFSIZE || remaining == 0) {
+            if (!upload_writer_put(writer, index, fill, &stats->wait_us)) {
+                break;
+            }
+            index ^= 1;
+            fill = 0;
+        }
+    }
+    /* Wait for the last buffer, the writer is idle again after it */
+    upload_writer_wait(writer, &stats->wait_us);
+    if (!error && writer->failed) {
+        /* Couldn't write everything to file!
+         * Storage may be full? */
+        ESP_LOGE(TAG, "File write failed!");
+        error = "Failed to write file to storage";
+    }
+    stats->write_us = writer->write_us;
+    writer->fd = NULL;
+    xSemaphoreGive(writer->written);
+    xQueueSend(data->upload_writers, &writer, 0);
+
+    stats->elapsed_us = esp_timer_get_time() - start;
+    return error;
+}
+
+/* Handler to upload a file onto the server.
+ * The file goes to <name>.part first and is renamed once complete, a
+ * broken upload never leaves a truncated file under the real name */
 static esp_err_t upload_post_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
-    FILE *fd = NULL;
+    char partpath[FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX)];
     struct stat file_stat;
+    struct receive_stats stats;
+    FILE *fd = NULL;
 
     /* Skip leading "/upload" from URI to get filename */
     /* Note sizeof() counts NULL termination hence the -1 */
@@ -321,78 +971,40 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    /* File cannot be larger than a limit */
-    if (req->content_len > MAX_FILE_SIZE) {
-        ESP_LOGE(TAG, "File too large : %d bytes", req->content_len);
-        /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
-                            "File size must be less than "
-                            MAX_FILE_SIZE_STR "!");
-        /* Return failure to close underlying connection else the
-         * incoming file content will keep the socket busy */
-        return ESP_FAIL;
-    }
-
-    fd = fopen(filepath, "w");
+    snprintf(partpath, sizeof(partpath), "%s" UPLOAD_PART_SUFFIX, filepath);
+    fd = fopen(partpath, "w");
     if (!fd) {
-        ESP_LOGE(TAG, "Failed to create file : %s", filepath);
+        ESP_LOGE(TAG, "Failed to create file : %s", partpath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
         return ESP_FAIL;
     }
+    /* Whole buffers go to the card, stdio would only split them */
+    setvbuf(fd, NULL, _IONBF, 0);
 
-    ESP_LOGI(TAG, "Receiving file : %s...", filename);
-
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
-    int received;
-
-    /* Content length of the request gives
-     * the size of the file being uploaded */
-    int remaining = req->content_len;
-
-    while (remaining > 0) {
-
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
-        /* Receive the file part by part into a buffer */
-        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Retry if timeout occurred */
-                continue;
-            }
-
-            /* In case of unrecoverable error,
-             * close and delete the unfinished file*/
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File reception failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
-            return ESP_FAIL;
-        }
-
-        /* Write buffer content to file on storage */
-        if (received && (received != fwrite(buf, 1, received, fd))) {
-            /* Couldn't write everything to file!
-             * Storage may be full? */
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File write failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
-            return ESP_FAIL;
-        }
-
-        /* Keep track of remaining size of
-         * the file left to be uploaded */
-        remaining -= received;
+    ESP_LOGI(TAG, "Receiving file : %s (%u bytes)...", filename, (unsigned)req->content_len);
+    const char *error = receive_to_file(req, fd, req->content_len, NULL, &stats);
+    if (fclose(fd) != 0 && !error) {
+        error = "Failed to write file to storage";
+    }
+    if (!error && rename(partpath, filepath) != 0) {
+        ESP_LOGE(TAG, "Failed to rename %s", partpath);
+        error = "Failed to write file to storage";
+    }
+    if (error) {
+        /* In case of unrecoverable error,
+         * delete the unfinished file */
+        unlink(partpath);
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, error);
+        return ESP_FAIL;
     }
+    dir_snapshot_note(((struct file_server_data *)req->user_ctx)->listings, filepath);
 
-    /* Close file upon upload completion */
-    fclose(fd);
-    ESP_LOGI(TAG, "File reception complete");
+    ESP_LOGI(TAG, "File reception complete : %u KB in %lld ms, %u KB/s, SD writes %lld ms, waited %lld ms",
+             (unsigned)(req->content_len / 1024), (long long)(stats.elapsed_us / 1000),
+             (unsigned)(stats.elapsed_us > 0 ? req->content_len * 1000000 / 1024 / stats.elapsed_us : 0),
+             (long long)(stats.write_us / 1000), (long long)(stats.wait_us / 1000));
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
@@ -404,39 +1016,1092 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-/* Handler to delete a file from the server */
-static esp_err_t delete_post_handler(httpd_req_t *req)
+/* Library sync, for a host tool that pushes only what changed.
+ *   GET  /manifest   one line per file: <crc32> <size> <mtime> <path>
+ *   GET  /manifest/<dir>  the same for the files below <dir>
+ *   POST /batch      a tar stream of files to store, as `tar -c` writes it
+ * Computing the CRC-32 of a file means reading all of it, so it is kept
+ * in <base>/.manifest with the size and mtime it was computed for, in
+ * the same line format. Files stored by /batch or /resume are noted as
+ * they arrive. Other files are read when a manifest lists them the first
+ * time. With ?hash=0 those are listed with "-" instead of being read.
+ * /batch sets the mtime from the tar header, so a tool can compare size
+ * and mtime first and the CRC-32 to be sure. Hidden files and .part
+ * files are not listed */
+#define MANIFEST_FILE       ".manifest"
+#define MANIFEST_LINE_MAX   (FILE_PATH_MAX + 48)
+#define MANIFEST_SEND_MAX   2048
+
+/* Tar streams come in blocks of this size */
+#define TAR_BLOCK           512
+/* A ustar prefix, '/', name and NUL. Longer GNU or pax names are cut, at
+ * a length the path length check then rejects */
+#define TAR_NAME_MAX        MAX(155 + 1 + 100 + 1, FILE_PATH_MAX + 1)
+
+struct manifest_entry {
+    uint32_t path_crc;
+    uint32_t seq;                   /* line in the file, later lines win */
+    uint32_t crc;
+    uint32_t size;
+    int64_t mtime;
+};
+
+static void manifest_path(char *dest, size_t size, const char *base_path, const char *suffix)
 {
-    char filepath[FILE_PATH_MAX];
-    struct stat file_stat;
+    snprintf(dest, size, "%s/" MANIFEST_FILE "%s", base_path, suffix);
+}
 
-    /* Skip leading "/delete" from URI to get filename */
-    /* Note sizeof() counts NULL termination hence the -1 */
-    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
-                                             req->uri  + sizeof("/delete") - 1, sizeof(filepath));
-    if (!filename) {
-        /* Respond with 500 Internal Server Error */
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
-        return ESP_FAIL;
+static void manifest_line(char *line, size_t size, const char *path, const struct stat *st, const uint32_t *crc)
+{
+    char crc_hex[9] = "-";
+    if (crc) {
+        snprintf(crc_hex, sizeof(crc_hex), "%08x", (unsigned)*crc);
     }
+    snprintf(line, size, "%s %lu %lld %s\n", crc_hex, (unsigned long)st->st_size, (long long)st->st_mtime, path);
+}
 
-    /* Filename cannot have a trailing '/' */
-    if (filename[strlen(filename) - 1] == '/') {
-        ESP_LOGE(TAG, "Invalid filename : %s", filename);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filename");
-        return ESP_FAIL;
+/* Open .manifest to note CRC-32s, once for all files of a batch. Holds
+ * the manifest lock until manifest_close_notes(), even without a file */
+static FILE *manifest_open_notes(struct file_server_data *data)
+{
+    char filepath[FILE_PATH_MAX];
+    manifest_path(filepath, sizeof(filepath), data->base_path, "");
+    xSemaphoreTake(data->manifest_lock, portMAX_DELAY);
+    FILE *notes = fopen(filepath, "a");
+    if (!notes) {
+        ESP_LOGW(TAG, "Failed to open %s", filepath);
     }
+    return notes;
+}
 
-    if (stat(filepath, &file_stat) == -1) {
-        ESP_LOGE(TAG, "File does not exist : %s", filename);
-        /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File does not exist");
-        return ESP_FAIL;
+static void manifest_close_notes(struct file_server_data *data, FILE *notes)
+{
+    if (notes) {
+        fclose(notes);
+    }
+    xSemaphoreGive(data->manifest_lock);
+}
+
+/* Note the CRC-32 of the file at @path, relative to @base_path */
+static void manifest_note(FILE *notes, const char *base_path, const char *path, uint32_t crc)
+{
+    char filepath[FILE_PATH_MAX];
+    char line[MANIFEST_LINE_MAX];
+    struct stat st;
+
+    snprintf(filepath, sizeof(filepath), "%s%s", base_path, path);
+    if (notes && stat(filepath, &st) == 0) {
+        manifest_line(line, sizeof(line), path, &st, &crc);
+        fputs(line, notes);
+    }
+}
+
+static int manifest_entry_cmp(const void *a, const void *b)
+{
+    const struct manifest_entry *x = a;
+    const struct manifest_entry *y = b;
+    if (x->path_crc != y->path_crc) {
+        return x->path_crc < y->path_crc ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Read the noted CRC-32s, sorted for manifest_find(). Lines without one
+ * are skipped. Returns NULL if there are none */
+static struct manifest_entry *manifest_load(const char *base_path, size_t *count)
+{
+    char line[MANIFEST_LINE_MAX];
+    size_t lines = 0;
+
+    *count = 0;
+    manifest_path(line, sizeof(line), base_path, "");
+    FILE *fd = fopen(line, "r");
+    if (!fd) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        lines++;
+    }
+    /* Thousands of files, PSRAM is fine for a lookup per file */
+    struct manifest_entry *entries = lines ? heap_caps_malloc(lines * sizeof(*entries), MALLOC_CAP_SPIRAM) : NULL;
+    if (!entries) {
+        fclose(fd);
+        return NULL;
+    }
+    rewind(fd);
+    while (*count < lines && fgets(line, sizeof(line), fd)) {
+        struct manifest_entry *e = &entries[*count];
+        unsigned crc;
+        unsigned long size;
+        long long mtime;
+        int path_at = 0;
+        if (sscanf(line, "%x %lu %lld %n", &crc, &size, &mtime, &path_at) != 3 || line[path_at] != '/') {
+            continue;
+        }
+        size_t len = strcspn(line + path_at, "\n");
+        e->path_crc = esp_rom_crc32_le(0, (const uint8_t *)line + path_at, len);
+        e->seq = *count;
+        e->crc = crc;
+        e->size = size;
+        e->mtime = mtime;
+        (*count)++;
+    }
+    fclose(fd);
+    qsort(entries, *count, sizeof(*entries), manifest_entry_cmp);
+    return entries;
+}
+
+/* The CRC-32 noted last for @path, if size and mtime still match */
+static bool manifest_find(const struct manifest_entry *entries, size_t count, const char *path,
+                          const struct stat *st, uint32_t *crc)
+{
+    uint32_t path_crc = esp_rom_crc32_le(0, (const uint8_t *)path, strlen(path));
+    /* Past the last entry of the path */
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (entries[mid].path_crc <= path_crc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || entries[lo - 1].path_crc != path_crc ||
+            entries[lo - 1].size != (uint32_t)st->st_size || entries[lo - 1].mtime != st->st_mtime) {
+        return false;
+    }
+    *crc = entries[lo - 1].crc;
+    return true;
+}
+
+struct manifest_walk {
+    httpd_req_t *req;
+    const struct manifest_entry *entries;
+    size_t count;
+    FILE *out;                      /* scratch file the CRC-32s are noted in */
+    bool compact;                   /* all of them, into a new .manifest */
+    bool hash;
+    size_t base_len;
+    unsigned files;
+    unsigned hashed;
+    size_t len;
+    char *buf;                      /* transfer buffer, for reading files */
+    char send[MANIFEST_SEND_MAX];
+    char path[FILE_PATH_MAX];
+};
+
+static bool manifest_hash_file(const char *filepath, char *buf, uint32_t *crc)
+{
+    FILE *fd = fopen(filepath, "r");
+    if (!fd) {
+        return false;
+    }
+    size_t n;
+    *crc = 0;
+    do {
+        int64_t start = io_arbiter_begin(IO_ARBITER_SYNC);
+        n = fread(buf, 1, TRANSFER_BUFSIZE, fd);
+        io_arbiter_end(IO_ARBITER_SYNC, start, n);
+        if (n > 0) {
+            *crc = esp_rom_crc32_le(*crc, (const uint8_t *)buf, n);
+        }
+    } while (n > 0);
+    bool ok = !ferror(fd);
+    fclose(fd);
+    return ok;
+}
+
+/* List the directory in w->path, which ends with '/', and everything
+ * below it. Returns false once sending failed */
+static bool manifest_walk_dir(struct manifest_walk *w)
+{
+    size_t len = strlen(w->path);
+    DIR *dir = opendir(w->path);
+    if (!dir) {
+        ESP_LOGW(TAG, "Failed to open dir : %s", w->path);
+        return true;
+    }
+    struct dirent *entry;
+    bool ok = true;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || (name_len > strlen(UPLOAD_PART_SUFFIX) &&
+                strcmp(entry->d_name + name_len - strlen(UPLOAD_PART_SUFFIX), UPLOAD_PART_SUFFIX) == 0)) {
+            continue;
+        }
+        if (len + name_len + 2 > sizeof(w->path)) {
+            ESP_LOGW(TAG, "Path too long : %s%s", w->path, entry->d_name);
+            continue;
+        }
+        strcpy(w->path + len, entry->d_name);
+        struct stat st;
+        if (stat(w->path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            strcat(w->path, "/");
+            ok = manifest_walk_dir(w);
+            continue;
+        }
+
+        const char *path = w->path + w->base_len;
+        uint32_t crc;
+        bool noted = manifest_find(w->entries, w->count, path, &st, &crc);
+        bool known = noted;
+        if (!known && w->hash) {
+            known = manifest_hash_file(w->path, w->buf, &crc);
+            w->hashed += known;
+        }
+        char *line = w->send + w->len;
+        manifest_line(line, MANIFEST_LINE_MAX, path, &st, known ? &crc : NULL);
+        if (known && w->out && (w->compact || !noted)) {
+            fputs(line, w->out);
+        }
+        w->len += strlen(line);
+        w->files++;
+        if (w->len + MANIFEST_LINE_MAX > sizeof(w->send)) {
+            ok = httpd_resp_send_chunk(w->req, w->send, w->len) == ESP_OK;
+            w->len = 0;
+        }
+    }
+    closedir(dir);
+    w->path[len] = '\0';
+    return ok;
+}
+
+/* Append @from from byte @offset on to @to, through @buf */
+static bool manifest_copy(FILE *to, const char *from, long offset, char *buf)
+{
+    FILE *fd = fopen(from, "r");
+    if (!fd) {
+        return false;
+    }
+    bool ok = fseek(fd, offset, SEEK_SET) == 0;
+    size_t n;
+    while (ok && (n = fread(buf, 1, TRANSFER_BUFSIZE, fd)) > 0) {
+        ok = fwrite(buf, 1, n, to) == n;
+    }
+    ok = ok && !ferror(fd);
+    fclose(fd);
+    return ok;
+}
+
+/* Bring the lines noted in @scratch into .manifest, with the manifest
+ * lock held. A compacting walk replaces .manifest with them plus what
+ * batches noted after byte @noted_len meanwhile, otherwise they are
+ * appended */
+static void manifest_merge(const char *cache, const char *scratch, bool compact, long noted_len, char *buf)
+{
+    if (!compact) {
+        FILE *out = fopen(cache, "a");
+        if (out) {
+            manifest_copy(out, scratch, 0, buf);
+            fclose(out);
+        }
+        return;
+    }
+    FILE *out = fopen(scratch, "a");
+    if (!out) {
+        return;
+    }
+    struct stat st;
+    bool ok = true;
+    if (stat(cache, &st) == 0 && st.st_size > noted_len) {
+        ok = manifest_copy(out, cache, noted_len, buf);
+    }
+    ok = fclose(out) == 0 && ok;
+    if (ok) {
+        unlink(cache);
+        rename(scratch, cache);
+    }
+}
+
+static esp_err_t manifest_get_handler(httpd_req_t *req)
+{
+    struct file_server_data *data = req->user_ctx;
+    const char *base_path = data->base_path;
+    const char *dir = req->uri + sizeof("/manifest") - 1;
+    char cache[FILE_PATH_MAX];
+    char tmp[FILE_PATH_MAX];
+    char query[32];
+    char suffix[16];
+    char hash[4];
+    int64_t start = esp_timer_get_time();
+
+    if (*dir != '\0' && *dir != '/' && *dir != '?') {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Nothing matches the given URI");
+        return ESP_FAIL;
+    }
+    struct manifest_walk *w = calloc(1, sizeof(*w));
+    if (!w) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    if (!get_path_from_uri(w->path, base_path, dir, sizeof(w->path) - 1)) {
+        free(w);
+        httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Path too long");
+        return ESP_FAIL;
+    }
+    if (w->path[strlen(w->path) - 1] != '/') {
+        strcat(w->path, "/");
+    }
+    w->buf = transfer_get(req);
+    if (!w->buf) {
+        free(w);
+        return ESP_FAIL;
+    }
+    w->req = req;
+    w->base_len = strlen(base_path);
+    w->hash = !(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+                httpd_query_key_value(query, "hash", hash, sizeof(hash)) == ESP_OK && strcmp(hash, "0") == 0);
+    /* The lock is only held on the card, never while the client is sent
+     * to: the walk notes its lines in a scratch file of its own, merged
+     * into .manifest once it is done */
+    static unsigned scratch_seq;
+    struct stat st;
+    xSemaphoreTake(data->manifest_lock, portMAX_DELAY);
+    w->entries = manifest_load(base_path, &w->count);
+    manifest_path(cache, sizeof(cache), base_path, "");
+    long noted_len = stat(cache, &st) == 0 ? (long)st.st_size : 0;
+    snprintf(suffix, sizeof(suffix), ".%u.tmp", scratch_seq++);
+    xSemaphoreGive(data->manifest_lock);
+    manifest_path(tmp, sizeof(tmp), base_path, suffix);
+    /* The whole library rewrites .manifest with what is still there, the
+     * lines of gone files drop out. A directory only adds its new lines */
+    w->compact = w->path[w->base_len + 1] == '\0';
+    w->out = fopen(tmp, "w");
+
+    httpd_resp_set_type(req, "text/plain");
+    bool ok = manifest_walk_dir(w);
+    if (ok && w->len > 0) {
+        ok = httpd_resp_send_chunk(req, w->send, w->len) == ESP_OK;
+    }
+    if (w->out) {
+        fclose(w->out);
+        /* A compacting walk cut short misses lines, the old file stays */
+        if (ok || !w->compact) {
+            xSemaphoreTake(data->manifest_lock, portMAX_DELAY);
+            manifest_merge(cache, tmp, w->compact, noted_len, w->buf);
+            xSemaphoreGive(data->manifest_lock);
+        }
+        unlink(tmp);
+    }
+    transfer_put(req, w->buf);
+    ESP_LOGI(TAG, "Manifest : %u files, %u read for their CRC-32, in %lld ms", w->files, w->hashed,
+             (long long)((esp_timer_get_time() - start) / 1000));
+    heap_caps_free((void *)w->entries);
+    free(w);
+    if (!ok) {
+        ESP_LOGE(TAG, "Manifest sending failed!");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static bool recv_exact(httpd_req_t *req, char *buf, size_t len)
+{
+    int timeouts = 0;
+    while (len > 0) {
+        int received = httpd_req_recv(req, buf, len);
+        if (received == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts <= TRANSFER_TIMEOUT_RETRIES) {
+            continue;
+        }
+        if (received <= 0) {
+            ESP_LOGW(TAG, "Client stopped sending %s", req->uri);
+            return false;
+        }
+        mark_active();
+        timeouts = 0;
+        buf += received;
+        len -= received;
+    }
+    return true;
+}
+
+/* Octal number of a tar header field, NUL or space terminated */
+static unsigned long long tar_number(const char *field, size_t size)
+{
+    unsigned long long value = 0;
+    size_t i = 0;
+    while (i < size && field[i] == ' ') {
+        i++;
+    }
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static bool tar_checksum_ok(const char *block)
+{
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        /* The checksum field counts as spaces */
+        sum += i >= 148 && i < 156 ? ' ' : (unsigned char)block[i];
+    }
+    return sum == tar_number(block + 148, 8);
+}
+
+/* Name of a tar entry relative to the base path, NULL if it is unsafe */
+static const char *tar_relative_name(char *name)
+{
+    while (name[0] == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += name[0] == '/' ? 1 : 2;
+    }
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/') {
+        name[--len] = '\0';
+    }
+    for (const char *p = name; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == name || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            return NULL;
+        }
+    }
+    return len > 0 ? name : NULL;
+}
+
+/* The "path" and "mtime" records of a pax extended header */
+static void tar_pax_records(char *data, size_t size, char *name, size_t name_size, long long *mtime)
+{
+    char *p = data;
+    while (p < data + size) {
+        char *end;
+        unsigned long len = strtoul(p, &end, 10);
+        if (len == 0 || *end != ' ' || p + len > data + size || p[len - 1] != '\n') {
+            return;
+        }
+        char *key = end + 1;
+        p[len - 1] = '\0';
+        if (strncmp(key, "path=", 5) == 0) {
+            strlcpy(name, key + 5, name_size);
+        } else if (strncmp(key, "mtime=", 6) == 0) {
+            *mtime = strtoll(key + 6, NULL, 10);
+        }
+        p += len;
+    }
+}
+
+/* Create the directories leading to @filepath, below @base_len */
+static void make_parents(struct file_server_data *data, char *filepath, size_t base_len)
+{
+    for (char *slash = strchr(filepath + base_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(filepath, 0775) == 0) {
+            dir_snapshot_note(data->listings, filepath);
+        }
+        *slash = '/';
+    }
+}
+
+/* Handler to store the files of a tar stream. Files are written as
+ * .part and renamed like single uploads, one that breaks off is deleted.
+ * The ones complete by then are kept */
+static esp_err_t batch_post_handler(httpd_req_t *req)
+{
+    struct file_server_data *data = req->user_ctx;
+    const char *base_path = data->base_path;
+    char *block = transfer_get(req);
+    if (!block) {
+        return ESP_FAIL;
+    }
+    /* Extended headers go behind the header block */
+    char *ext = block + TAR_BLOCK;
+    const size_t ext_max = TRANSFER_BUFSIZE - TAR_BLOCK - 1;
+    char name[TAR_NAME_MAX];
+    char filepath[FILE_PATH_MAX];
+    char partpath[FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX)];
+    const size_t base_len = strlen(base_path);
+    const char *error = NULL;
+    const char *path = "";
+    unsigned files = 0;
+    unsigned skipped = 0;
+    unsigned long long bytes = 0;
+    long long ext_mtime = -1;
+    int64_t start = esp_timer_get_time();
+
+    name[0] = '\0';
+    while (!error) {
+        if (!recv_exact(req, block, TAR_BLOCK)) {
+            error = "Failed to receive batch";
+            break;
+        }
+        if (block[0] == '\0') {
+            /* End of archive */
+            break;
+        }
+        if (!tar_checksum_ok(block)) {
+            error = "Not a tar stream";
+            break;
+        }
+        unsigned long long size = tar_number(block + 124, 12);
+        long long mtime = ext_mtime >= 0 ? ext_mtime : (long long)tar_number(block + 136, 12);
+        char type = block[156];
+        size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (type == 'x' || type == 'L') {
+            /* pax or GNU extended header for the next entry */
+            if (size > ext_max) {
+                error = "Extended header too large";
+                break;
+            }
+            if (!recv_exact(req, ext, size + padding)) {
+                error = "Failed to receive batch";
+                break;
+            }
+            ext[size] = '\0';
+            if (type == 'L') {
+                strlcpy(name, ext, sizeof(name));
+            } else {
+                tar_pax_records(ext, size, name, sizeof(name), &ext_mtime);
+            }
+            continue;
+        }
+        if (name[0] == '\0') {
+            /* ustar splits long names into prefix and name */
+            if (memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0') {
+                snprintf(name, sizeof(name), "%.155s/%.100s", block + 345, block);
+            } else {
+                snprintf(name, sizeof(name), "%.100s", block);
+            }
+        }
+        const char *rel = tar_relative_name(name);
+        if (rel && base_len + 1 + strlen(rel) + 1 <= sizeof(filepath)) {
+            snprintf(filepath, sizeof(filepath), "%s/%s", base_path, rel);
+            path = filepath + base_len;
+        } else {
+            rel = NULL;
+        }
+        name[0] = '\0';
+        ext_mtime = -1;
+
+        if (type == '5') {
+            if (rel) {
+                make_parents(data, filepath, base_len);
+                if (mkdir(filepath, 0775) == 0) {
+                    dir_snapshot_note(data->listings, filepath);
+                }
+            }
+            continue;
+        }
+        bool regular = type == '0' || type == '\0' || type == '7';
+        if (!rel || !regular) {
+            /* Links, devices and names we can't store */
+            if (regular) {
+                ESP_LOGW(TAG, "Skipping %.100s, name too long or unsafe", block);
+                skipped++;
+            } else {
+                ESP_LOGW(TAG, "Skipping tar entry of type '%c'", type);
+            }
+            for (size_t left = size + padding; left > 0 && !error; ) {
+                size_t n = MIN(left, TRANSFER_BUFSIZE);
+                if (!recv_exact(req, block, n)) {
+                    error = "Failed to receive batch";
+                }
+                left -= n;
+            }
+            continue;
+        }
+
+        make_parents(data, filepath, base_len);
+        snprintf(partpath, sizeof(partpath), "%s" UPLOAD_PART_SUFFIX, filepath);
+        FILE *fd = fopen(partpath, "w");
+        if (!fd) {
+            ESP_LOGE(TAG, "Failed to create file : %s", partpath);
+            error = "Failed to create file";
+            break;
+        }
+        setvbuf(fd, NULL, _IONBF, 0);
+        struct receive_stats stats;
+        uint32_t crc = 0;
+        error = receive_to_file(req, fd, size, &crc, &stats);
+        if (fclose(fd) != 0 && !error) {
+            error = "Failed to write file to storage";
+        }
+        if (!error && !recv_exact(req, block, padding)) {
+            error = "Failed to receive batch";
+        }
+        if (!error) {
+            /* Replaces the file, FAT renames only onto free names */
+            unlink(filepath);
+            if (rename(partpath, filepath) != 0) {
+                ESP_LOGE(TAG, "Failed to rename %s", partpath);
+                error = "Failed to write file to storage";
+            }
+        }
+        if (error) {
+            unlink(partpath);
+            /* The old file may be gone */
+            dir_snapshot_note(data->listings, filepath);
+            break;
+        }
+        struct utimbuf times = { .actime = mtime, .modtime = mtime };
+        utime(filepath, &times);
+        dir_snapshot_note(data->listings, filepath);
+        /* Locked per file, not while the next one is received */
+        FILE *notes = manifest_open_notes(data);
+        manifest_note(notes, base_path, path, crc);
+        manifest_close_notes(data, notes);
+        files++;
+        bytes += size;
+    }
+
+    /* The answer goes to the transfer buffer */
+    char *msg = ext;
+    if (error) {
+        ESP_LOGE(TAG, "Batch failed after %u files : %s %s", files, error, path);
+        snprintf(msg, ext_max, "%s %s", error, path);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, msg);
+        transfer_put(req, block);
+        return ESP_FAIL;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Batch complete : %u files, %llu KB in %lld ms, %u skipped", files, bytes / 1024,
+             (long long)(elapsed_us / 1000), skipped);
+    snprintf(msg, ext_max, "Stored %u files, %llu bytes, skipped %u\n", files, bytes, skipped);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, msg);
+    transfer_put(req, block);
+    return ESP_OK;
+}
+
+/* Resumable uploads, for large files over flaky Wi-Fi.
+ *   GET  /resume/<path>                          how much of <path> arrived
+ *   PUT  /resume/<path>?offset=<n>&crc32=<hex>   append a chunk at byte n
+ *   POST /resume/<path>?size=<n>&crc32=<hex>     check the whole file, finish
+ * Every answer carries Upload-Offset, the bytes kept so far in
+ * <path>.part. A chunk that breaks off or fails its CRC-32 is cut off
+ * again, so a dropped connection only costs the chunk in flight. The
+ * client asks for the offset and continues from there. Finishing reads
+ * the file back, checks its size and CRC-32 and renames it. */
+
+/* Paths of a resumable upload. Returns the file name or NULL after
+ * answering the request */
+static const char *resume_paths(httpd_req_t *req, char *filepath, char *partpath)
+{
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri + sizeof("/resume") - 1, FILE_PATH_MAX);
+    if (!filename) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return NULL;
+    }
+    if (filename[strlen(filename) - 1] == '/') {
+        ESP_LOGE(TAG, "Invalid filename : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid filename");
+        return NULL;
+    }
+    snprintf(partpath, FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX), "%s" UPLOAD_PART_SUFFIX, filepath);
+    return filename;
+}
+
+/* Unsigned number @key of the query string, in @base */
+static bool query_number(httpd_req_t *req, const char *key, int base, unsigned long long *value)
+{
+    char query[96];
+    char buf[24];
+    char *end;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+            httpd_query_key_value(query, key, buf, sizeof(buf)) != ESP_OK || buf[0] == '\0') {
+        return false;
+    }
+    *value = strtoull(buf, &end, base);
+    return *end == '\0';
+}
+
+static long part_size(const char *partpath)
+{
+    struct stat part_stat;
+    return stat(partpath, &part_stat) == 0 ? (long)part_stat.st_size : 0;
+}
+
+/* Answer with @status and the current offset in @offset_buf, which lives
+ * on the caller's stack until the response is sent */
+static esp_err_t resume_reply(httpd_req_t *req, const char *status, long offset, char *offset_buf,
+                              size_t offset_size, const char *msg)
+{
+    snprintf(offset_buf, offset_size, "%ld", offset);
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_hdr(req, "Upload-Offset", offset_buf);
+    httpd_resp_set_type(req, "text/plain");
+    return httpd_resp_sendstr(req, msg);
+}
+
+static esp_err_t resume_get_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    char partpath[FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX)];
+    char offset[24];
+
+    if (!resume_paths(req, filepath, partpath)) {
+        return ESP_FAIL;
+    }
+    long size = part_size(partpath);
+    snprintf(offset, sizeof(offset), "%ld", size);
+    httpd_resp_set_hdr(req, "Upload-Offset", offset);
+    httpd_resp_set_type(req, "text/plain");
+    return httpd_resp_sendstr(req, offset);
+}
+
+static esp_err_t resume_put_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    char partpath[FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX)];
+    char offset_buf[24];
+    struct stat file_stat;
+    struct receive_stats stats;
+    unsigned long long offset;
+    unsigned long long expected_crc;
+
+    const char *filename = resume_paths(req, filepath, partpath);
+    if (!filename) {
+        return ESP_FAIL;
+    }
+    if (!query_number(req, "offset", 10, &offset) || !query_number(req, "crc32", 16, &expected_crc)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "offset and crc32 are required");
+        return ESP_FAIL;
+    }
+    if (stat(filepath, &file_stat) == 0) {
+        ESP_LOGE(TAG, "File already exists : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
+        return ESP_FAIL;
+    }
+    long kept = part_size(partpath);
+    if (offset != (unsigned long long)kept) {
+        /* The client lost track, it continues from what is here */
+        ESP_LOGW(TAG, "Chunk of %s at %llu, have %ld", filename, offset, kept);
+        resume_reply(req, "409 Conflict", kept, offset_buf, sizeof(offset_buf), "Offset mismatch");
+        /* The chunk is still on the socket */
+        return ESP_FAIL;
+    }
+
+    FILE *fd = fopen(partpath, offset == 0 ? "w" : "a");
+    if (!fd) {
+        ESP_LOGE(TAG, "Failed to open file : %s", partpath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
+        return ESP_FAIL;
+    }
+    setvbuf(fd, NULL, _IONBF, 0);
+    uint32_t crc = 0;
+    const char *error = receive_to_file(req, fd, req->content_len, &crc, &stats);
+    if (fclose(fd) != 0 && !error) {
+        error = "Failed to write file to storage";
+    }
+    if (!error && crc != (uint32_t)expected_crc) {
+        ESP_LOGW(TAG, "Chunk of %s at %llu: CRC-32 %08x, expected %08x", filename, offset,
+                 (unsigned)crc, (unsigned)expected_crc);
+        truncate(partpath, kept);
+        resume_reply(req, "400 Bad Request", kept, offset_buf, sizeof(offset_buf), "Checksum mismatch");
+        return ESP_OK;
+    }
+    if (error) {
+        /* Only the chunk in flight is lost */
+        truncate(partpath, kept);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, error);
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "Chunk of %s at %llu, %u bytes in %lld ms", filename, offset, (unsigned)req->content_len,
+             (long long)(stats.elapsed_us / 1000));
+    return resume_reply(req, "204 No Content", kept + (long)req->content_len, offset_buf, sizeof(offset_buf), NULL);
+}
+
+static esp_err_t resume_post_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    char partpath[FILE_PATH_MAX + sizeof(UPLOAD_PART_SUFFIX)];
+    char offset_buf[24];
+    struct stat file_stat;
+    unsigned long long size;
+    unsigned long long expected_crc;
+
+    const char *filename = resume_paths(req, filepath, partpath);
+    if (!filename) {
+        return ESP_FAIL;
+    }
+    if (!query_number(req, "size", 10, &size) || !query_number(req, "crc32", 16, &expected_crc)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "size and crc32 are required");
+        return ESP_FAIL;
+    }
+    long kept = part_size(partpath);
+    if (size != (unsigned long long)kept) {
+        ESP_LOGW(TAG, "Finishing %s at %llu bytes, have %ld", filename, size, kept);
+        return resume_reply(req, "409 Conflict", kept, offset_buf, sizeof(offset_buf), "Size mismatch");
+    }
+
+    /* Check what is on the card, not what was received */
+    char *buf = transfer_get(req);
+    if (!buf) {
+        return ESP_FAIL;
+    }
+    uint32_t crc = 0;
+    bool read = manifest_hash_file(partpath, buf, &crc);
+    transfer_put(req, buf);
+    if (!read) {
+        ESP_LOGE(TAG, "Failed to read file : %s", partpath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+        return ESP_FAIL;
+    }
+    if (crc != (uint32_t)expected_crc) {
+        /* No telling which chunk went wrong, start over */
+        ESP_LOGE(TAG, "%s: CRC-32 %08x, expected %08x", filename, (unsigned)crc, (unsigned)expected_crc);
+        unlink(partpath);
+        return resume_reply(req, "400 Bad Request", 0, offset_buf, sizeof(offset_buf), "Checksum mismatch");
+    }
+    if (stat(filepath, &file_stat) == 0 || rename(partpath, filepath) != 0) {
+        ESP_LOGE(TAG, "Failed to rename %s", partpath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
+        return ESP_FAIL;
+    }
+    struct file_server_data *data = req->user_ctx;
+    dir_snapshot_note(data->listings, filepath);
+    FILE *notes = manifest_open_notes(data);
+    manifest_note(notes, data->base_path, filename, crc);
+    manifest_close_notes(data, notes);
+    ESP_LOGI(TAG, "Resumable upload complete : %s (%ld bytes)", filename, kept);
+    return resume_reply(req, "200 OK", kept, offset_buf, sizeof(offset_buf), "File uploaded successfully");
+}
+
+/* Append @s to @dst as the content of a JSON string, false if it
+ * doesn't fit into @room */
+static bool json_escape(char *dst, size_t room, size_t *len, const char *s)
+{
+    size_t n = *len;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        size_t need = c == '"' || c == '\\' ? 2 : c < 0x20 ? 6 : 1;
+        if (n + need >= room) {
+            return false;
+        }
+        if (need == 2) {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (need == 6) {
+            n += snprintf(dst + n, room - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+    dst[n] = '\0';
+    *len = n;
+    return true;
+}
+
+/* Decode a query string value in place, '+' and %XX */
+static void url_decode(char *s)
+{
+    char *out = s;
+    for (; *s; s++) {
+        if (*s == '+') {
+            *out++ = ' ';
+        } else if (s[0] == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/* Does @name contain @filter, ignoring case */
+static bool name_matches(const char *name, const char *filter)
+{
+    size_t len = strlen(filter);
+    for (; *name; name++) {
+        if (strncasecmp(name, filter, len) == 0) {
+            return true;
+        }
+    }
+    return len == 0;
+}
+
+/* Entries of the JSON listing are collected in the transfer buffer like
+ * the rows of the HTML one. All entries are visited to count the ones
+ * that match, only those of the page are written */
+struct dir_json {
+    char *buf;
+    size_t len;
+    const char *filter;
+    int type;                   /* 0 any, 1 files, 2 directories */
+    size_t offset;
+    size_t limit;
+    size_t matched;             /* entries matching so far */
+    size_t sent;                /* of them written */
+};
+
+static bool dir_json_entry(const dir_snapshot_entry_t *entry, void *ctx)
+{
+    struct dir_json *j = ctx;
+    if ((j->type == 1 && entry->is_dir) || (j->type == 2 && !entry->is_dir) ||
+            !name_matches(entry->name, j->filter)) {
+        return true;
+    }
+    if (j->matched < j->offset || j->sent >= j->limit) {
+        j->matched++;
+        return true;
+    }
+    size_t len = j->len;
+    int n = snprintf(j->buf + len, TRANSFER_BUFSIZE - len, "%s{\"name\":\"", j->sent > 0 ? "," : "");
+    if (n >= TRANSFER_BUFSIZE - len) {
+        return false;
+    }
+    len += n;
+    if (!json_escape(j->buf, TRANSFER_BUFSIZE, &len, entry->name)) {
+        return false;
+    }
+    n = snprintf(j->buf + len, TRANSFER_BUFSIZE - len, "\",\"type\":\"%s\",\"size\":%lu,\"mtime\":%lld}",
+                 entry->is_dir ? "dir" : "file", (unsigned long)entry->size, (long long)entry->mtime);
+    if (n >= TRANSFER_BUFSIZE - len) {
+        return false;
+    }
+    j->len = len + n;
+    j->matched++;
+    j->sent++;
+    return true;
+}
+
+/* Handler to list a directory as JSON, a page at a time:
+ *   GET /list/path/to/dir/?offset=0&limit=100&filter=abc&type=file
+ * answers
+ *   {"path":"/path/to/dir/","entries":[{"name":"a.mp3","type":"file",
+ *    "size":123,"mtime":1700000000},...],"total":250,"offset":0,"next":100}
+ * where total counts the entries matching filter (part of the name,
+ * ignoring case) and type (file or dir), and next is the offset of the
+ * following page or null after the last one */
+static esp_err_t list_get_handler(httpd_req_t *req)
+{
+    struct file_server_data *data = req->user_ctx;
+    const char *dir = req->uri + sizeof("/list") - 1;
+    char dirpath[FILE_PATH_MAX + 1];
+    char query[200];
+    char filter[64] = "";
+    char value[24];
+    struct dir_json json = { .filter = filter, .limit = 100 };
+    size_t index = 0;
+    size_t count = 0;
+    int64_t start = esp_timer_get_time();
+
+    if (*dir != '\0' && *dir != '/' && *dir != '?') {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Nothing matches the given URI");
+        return ESP_FAIL;
+    }
+    const char *path = get_path_from_uri(dirpath, data->base_path, *dir == '/' ? dir : "/", sizeof(dirpath) - 1);
+    if (!path) {
+        httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Path too long");
+        return ESP_FAIL;
+    }
+    if (dirpath[strlen(dirpath) - 1] != '/') {
+        strcat(dirpath, "/");
+    }
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+            json.offset = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+            /* At least one, or next would never move past offset */
+            json.limit = MAX(MIN(strtoul(value, NULL, 10), 1000), 1);
+        }
+        if (httpd_query_key_value(query, "type", value, sizeof(value)) == ESP_OK) {
+            json.type = strcmp(value, "file") == 0 ? 1 : strcmp(value, "dir") == 0 ? 2 : 0;
+        }
+        if (httpd_query_key_value(query, "filter", filter, sizeof(filter)) == ESP_OK) {
+            url_decode(filter);
+        }
+    }
+
+    json.buf = transfer_get(req);
+    if (!json.buf) {
+        return ESP_FAIL;
+    }
+    strcpy(json.buf, "{\"path\":\"");
+    json.len = strlen(json.buf);
+    json_escape(json.buf, TRANSFER_BUFSIZE, &json.len, path);
+    json.len += snprintf(json.buf + json.len, TRANSFER_BUFSIZE - json.len, "\",\"entries\":[");
+
+    esp_err_t err = dir_snapshot_visit(data->listings, dirpath, &index, &count, dir_json_entry, &json);
+    if (err != ESP_OK) {
+        transfer_put(req, json.buf);
+        ESP_LOGE(TAG, "Failed to list dir : %s", dirpath);
+        if (err == ESP_ERR_NOT_FOUND) {
+            httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+        } else {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        }
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+
+    /* The visit stops early only when the buffer is full */
+    bool ok = true;
+    while (ok && err == ESP_OK && index < count) {
+        ok = httpd_resp_send_chunk(req, json.buf, json.len) == ESP_OK;
+        json.len = 0;
+        if (ok) {
+            err = dir_snapshot_visit(data->listings, dirpath, &index, &count, dir_json_entry, &json);
+        }
+    }
+    if (ok) {
+        char next[24] = "null";
+        if (json.offset + json.sent < json.matched) {
+            snprintf(next, sizeof(next), "%u", (unsigned)(json.offset + json.sent));
+        }
+        if (json.len + 80 > TRANSFER_BUFSIZE) {
+            ok = httpd_resp_send_chunk(req, json.buf, json.len) == ESP_OK;
+            json.len = 0;
+        }
+        json.len += snprintf(json.buf + json.len, TRANSFER_BUFSIZE - json.len,
+                             "],\"total\":%u,\"offset\":%u,\"next\":%s}",
+                             (unsigned)json.matched, (unsigned)json.offset, next);
+        ok = ok && httpd_resp_send_chunk(req, json.buf, json.len) == ESP_OK;
+    }
+    transfer_put(req, json.buf);
+    if (!ok) {
+        ESP_LOGE(TAG, "Listing sending failed!");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Listed %s : %u of %u entries in %lld ms", dirpath, (unsigned)json.sent, (unsigned)count,
+             (long long)((esp_timer_get_time() - start) / 1000));
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+/* Handler to delete a file from the server */
+static esp_err_t delete_post_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    struct stat file_stat;
+
+    /* Skip leading "/delete" from URI to get filename */
+    /* Note sizeof() counts NULL termination hence the -1 */
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri  + sizeof("/delete") - 1, sizeof(filepath));
+    if (!filename) {
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return ESP_FAIL;
+    }
+
+    /* Filename cannot have a trailing '/' */
+    if (filename[strlen(filename) - 1] == '/') {
+        ESP_LOGE(TAG, "Invalid filename : %s", filename);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filename");
+        return ESP_FAIL;
+    }
+
+    if (stat(filepath, &file_stat) == -1) {
+        ESP_LOGE(TAG, "File does not exist : %s", filename);
+        /* Respond with 400 Bad Request */
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File does not exist");
+        return ESP_FAIL;
     }
 
     ESP_LOGI(TAG, "Deleting file : %s", filename);
     /* Delete file */
     unlink(filepath);
+    dir_snapshot_note(((struct file_server_data *)req->user_ctx)->listings, filepath);
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
@@ -448,11 +2113,105 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+#ifdef CONFIG_TRACE_RING
+/* Handler to send the player trace as TRACE lines, see trace_ring.h */
+static esp_err_t trace_get_handler(httpd_req_t *req)
+{
+    trace_record_t records[TRACE_RING_READ_BATCH];
+    uint32_t seq = 0;
+    int n;
+
+    char *buf = transfer_get(req);
+    if (!buf) {
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    while ((n = trace_ring_read(&seq, records, TRACE_RING_READ_BATCH)) > 0) {
+        /* One batch, overwritten records leave a gap only between batches */
+        uint32_t first = seq - n;
+        int len = 0;
+        for (int i = 0; i < n; i++) {
+            len += snprintf(buf + len, TRANSFER_BUFSIZE - len, "TRACE %u %lld %u %u %u %u\n",
+                            (unsigned)(first + i), (long long)records[i].time_us, records[i].event,
+                            records[i].arg8, records[i].arg16, (unsigned)records[i].arg);
+        }
+        if (httpd_resp_send_chunk(req, buf, len) != ESP_OK) {
+            transfer_put(req, buf);
+            ESP_LOGE(TAG, "Trace sending failed!");
+            httpd_resp_sendstr_chunk(req, NULL);
+            return ESP_FAIL;
+        }
+    }
+    transfer_put(req, buf);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_IO_ARBITER
+/* Handler to send the SD card use per client, see io_arbiter.h.
+ * ?reset=1 starts the counters over after sending them */
+static esp_err_t io_get_handler(httpd_req_t *req)
+{
+    unsigned long long reset = 0;
+    char *buf = transfer_get(req);
+    if (!buf) {
+        return ESP_FAIL;
+    }
+    size_t len = io_arbiter_format(buf, TRANSFER_BUFSIZE);
+    httpd_resp_set_type(req, "text/plain");
+    esp_err_t err = httpd_resp_send(req, buf, len);
+    transfer_put(req, buf);
+    if (query_number(req, "reset", 10, &reset) && reset) {
+        io_arbiter_reset_stats();
+    }
+    return err;
+}
+#endif
+
+/* The wildcard matcher, every request passes here before its handler */
+static bool uri_match(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    mark_active();
+    return httpd_uri_match_wildcard(uri_template, uri_to_match, match_upto);
+}
+
+/* Free what example_start_file_server() allocated, once no request runs */
+static void server_data_free(struct file_server_data *data)
+{
+    char *buf;
+    if (data->transfer_pool) {
+        while (xQueueReceive(data->transfer_pool, &buf, 0) == pdTRUE) {
+            heap_caps_free(buf);
+        }
+        vQueueDelete(data->transfer_pool);
+    }
+    if (data->download_readers) {
+        struct download_reader *reader;
+        while (xQueueReceive(data->download_readers, &reader, 0) == pdTRUE) {
+            download_reader_destroy(reader);
+        }
+        vQueueDelete(data->download_readers);
+    }
+    if (data->upload_writers) {
+        struct upload_writer *writer;
+        while (xQueueReceive(data->upload_writers, &writer, 0) == pdTRUE) {
+            upload_writer_destroy(writer);
+        }
+        vQueueDelete(data->upload_writers);
+    }
+    if (data->manifest_lock) {
+        vSemaphoreDelete(data->manifest_lock);
+    }
+    if (data->listings) {
+        dir_snapshot_cache_destroy(data->listings);
+    }
+    free(data);
+}
+
 /* Function to start the file server */
 esp_err_t example_start_file_server(const char *base_path)
 {
-    static struct file_server_data *server_data = NULL;
-
     if (server_data) {
         ESP_LOGE(TAG, "File server already started");
         return ESP_ERR_INVALID_STATE;
@@ -467,19 +2226,164 @@ esp_err_t example_start_file_server(const char *base_path)
     strlcpy(server_data->base_path, base_path,
             sizeof(server_data->base_path));
 
-    httpd_handle_t server = NULL;
+    /* PSRAM for the transfer buffers, they see little of the SD card */
+    server_data->transfer_pool = xQueueCreate(CONFIG_FILE_SERVER_TRANSFER_BUFFERS, sizeof(char *));
+    server_data->manifest_lock = xSemaphoreCreateMutex();
+    server_data->listings = dir_snapshot_cache_create(CONFIG_FILE_SERVER_LIST_CACHE_DIRS,
+                                                      CONFIG_FILE_SERVER_LIST_MAX_AGE_S);
+    if (!server_data->transfer_pool || !server_data->manifest_lock || !server_data->listings) {
+        ESP_LOGE(TAG, "Failed to allocate memory for server data");
+        server_data_free(server_data);
+        server_data = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < CONFIG_FILE_SERVER_TRANSFER_BUFFERS; i++) {
+        char *buf = heap_caps_malloc(TRANSFER_BUFSIZE, MALLOC_CAP_SPIRAM);
+        if (!buf) {
+            buf = heap_caps_malloc(TRANSFER_BUFSIZE, MALLOC_CAP_8BIT);
+        }
+        if (!buf) {
+            if (i == 0) {
+                ESP_LOGE(TAG, "Failed to allocate transfer buffers");
+                server_data_free(server_data);
+                server_data = NULL;
+                return ESP_ERR_NO_MEM;
+            }
+            ESP_LOGW(TAG, "Transfer pool has %d buffers", i);
+            break;
+        }
+        xQueueSend(server_data->transfer_pool, &buf, 0);
+    }
+
+    /* Two buffers per reader, created once so a download never allocates */
+    const int readers = CONFIG_FILE_SERVER_DOWNLOAD_BUFFERS / 2;
+    server_data->download_readers = xQueueCreate(readers, sizeof(struct download_reader *));
+    for (int i = 0; server_data->download_readers && i < readers; i++) {
+        struct download_reader *reader = download_reader_create();
+        if (!reader) {
+            ESP_LOGW(TAG, "%d download readers, the others read in turn", i);
+            break;
+        }
+        xQueueSend(server_data->download_readers, &reader, 0);
+    }
+
+    /* The server task handles one request at a time, so one writer serves
+     * all uploads. Created once so an upload never allocates */
+    server_data->upload_writers = xQueueCreate(1, sizeof(struct upload_writer *));
+    struct upload_writer *writer = server_data->upload_writers ? upload_writer_create() : NULL;
+    if (writer) {
+        xQueueSend(server_data->upload_writers, &writer, 0);
+    } else {
+        ESP_LOGW(TAG, "No memory for the upload writer, uploads fail");
+    }
+
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
     /* Use the URI wildcard matching function in order to
      * allow the same handler to respond to multiple different
      * target URIs which match the wildcard scheme */
-    config.uri_match_fn = httpd_uri_match_wildcard;
+    config.uri_match_fn = uri_match;
+    config.max_uri_handlers = 14;
+    /* Away from the core of the audio tasks */
+    config.core_id = CONFIG_FILE_SERVER_TASK_CORE;
+    /* Browsers keep their sockets open, the oldest one makes room for a new one */
+    config.lru_purge_enable = true;
 
     ESP_LOGI(TAG, "Starting HTTP Server on port: '%d'", config.server_port);
     if (httpd_start(&server, &config) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to start file server!");
+        server_data_free(server_data);
+        server_data = NULL;
         return ESP_FAIL;
     }
+    mark_active();
+
+    /* URI handlers for library sync, ahead of the files. The library and
+     * a directory of it, "/manifest*" would take root files named
+     * manifest<anything> from the download handler */
+    httpd_uri_t manifest = {
+        .uri       = "/manifest",
+        .method    = HTTP_GET,
+        .handler   = manifest_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &manifest);
+    httpd_uri_t manifest_dir = {
+        .uri       = "/manifest/*",
+        .method    = HTTP_GET,
+        .handler   = manifest_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &manifest_dir);
+    httpd_uri_t batch = {
+        .uri       = "/batch",
+        .method    = HTTP_POST,
+        .handler   = batch_post_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &batch);
+
+    /* URI handlers for listing directories as JSON, ahead of the files.
+     * The root and a directory, as for /manifest */
+    httpd_uri_t list = {
+        .uri       = "/list",
+        .method    = HTTP_GET,
+        .handler   = list_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &list);
+    httpd_uri_t list_dir = {
+        .uri       = "/list/*",
+        .method    = HTTP_GET,
+        .handler   = list_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &list_dir);
+
+    /* URI handlers for resumable uploads, ahead of the files */
+    httpd_uri_t resume_get = {
+        .uri       = "/resume/*",
+        .method    = HTTP_GET,
+        .handler   = resume_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &resume_get);
+    httpd_uri_t resume_put = {
+        .uri       = "/resume/*",
+        .method    = HTTP_PUT,
+        .handler   = resume_put_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &resume_put);
+    httpd_uri_t resume_post = {
+        .uri       = "/resume/*",
+        .method    = HTTP_POST,
+        .handler   = resume_post_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &resume_post);
+
+#ifdef CONFIG_TRACE_RING
+    /* URI handler for the player trace, ahead of the files */
+    httpd_uri_t trace_download = {
+        .uri       = "/trace",
+        .method    = HTTP_GET,
+        .handler   = trace_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &trace_download);
+#endif
+
+#ifdef CONFIG_IO_ARBITER
+    /* URI handler for the SD card use per client, ahead of the files */
+    httpd_uri_t io_stats = {
+        .uri       = "/io",
+        .method    = HTTP_GET,
+        .handler   = io_get_handler,
+        .user_ctx  = server_data
+    };
+    httpd_register_uri_handler(server, &io_stats);
+#endif
 
     /* URI handler for getting uploaded files */
     httpd_uri_t file_download = {
@@ -510,3 +2414,32 @@ esp_err_t example_start_file_server(const char *base_path)
 
     return ESP_OK;
 }
+
+esp_err_t example_stop_file_server(void)
+{
+    if (!server_data) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* Returns once the request being served is finished */
+    esp_err_t err = httpd_stop(server);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to stop file server!");
+        return err;
+    }
+    server = NULL;
+    server_data_free(server_data);
+    server_data = NULL;
+    portENTER_CRITICAL(&activity_lock);
+    active_us = 0;
+    portEXIT_CRITICAL(&activity_lock);
+    ESP_LOGI(TAG, "Stopped HTTP Server");
+    return ESP_OK;
+}
+
+int64_t example_file_server_last_active_us(void)
+{
+    portENTER_CRITICAL(&activity_lock);
+    int64_t last = active_us;
+    portEXIT_CRITICAL(&activity_lock);
+    return last;
+}
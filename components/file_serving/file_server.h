@@ -15,6 +15,7 @@
 #pragma once
 
 #include "sdkconfig.h"
+#include <stdint.h>
 #include "esp_err.h"
 
 #ifdef __cplusplus
@@ -23,6 +24,14 @@ extern "C" {
 
 esp_err_t example_start_file_server(const char *base_path);
 
+/* Stop the server once the request being served is finished, and free
+ * its buffers. ESP_ERR_INVALID_STATE if it isn't running */
+esp_err_t example_stop_file_server(void);
+
+/* esp_timer_get_time() of the last request or of the start, 0 while the
+ * server is stopped. A running transfer keeps it current block by block */
+int64_t example_file_server_last_active_us(void);
+
 #ifdef __cplusplus
 }
 #endif
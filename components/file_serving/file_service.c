@@ -0,0 +1,227 @@
+/*  Wi-Fi and the file server on demand, see file_service.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_event.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "protocol_examples_common.h"
+#include "example_common_private.h"
+#include "file_server.h"
+#include "file_service.h"
+
+#ifdef CONFIG_FILE_SERVICE
+
+/* The running service looks at the idle time and the free RAM this often */
+#define FILE_SERVICE_POLL_MS    1000
+
+static const char *TAG = "FILE_SERVICE";
+
+struct file_service {
+    file_service_cfg_t cfg;
+    bool running;               /* the task exists */
+    TaskHandle_t task;          /* once the task set it */
+    bool up;                    /* serving */
+    bool stop;                  /* file_service_stop() was called */
+    int64_t requested_us;       /* last file_service_request() */
+    int64_t up_since_us;
+    file_service_stats_t stats;
+};
+
+/* Guards everything in the service, only held for a few assignments */
+static portMUX_TYPE service_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct file_service service;
+static bool initialized;
+
+/* Connect and start the server, false if that failed and was undone */
+static bool service_up(void)
+{
+    int64_t start = esp_timer_get_time();
+    size_t internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+
+    esp_err_t err = example_connect();
+    if (err != ESP_OK) {
+        /* example_connect() registers its shutdown handler only on success */
+        example_wifi_shutdown();
+    } else if ((err = example_start_file_server(service.cfg.base_path)) != ESP_OK) {
+        example_disconnect();
+    }
+    int64_t now = esp_timer_get_time();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Not up after %lld ms: %s", (long long)(now - start) / 1000, esp_err_to_name(err));
+        portENTER_CRITICAL(&service_lock);
+        service.stats.failures++;
+        portEXIT_CRITICAL(&service_lock);
+        return false;
+    }
+
+    int32_t internal_used = (int32_t)internal - (int32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    int32_t psram_used = (int32_t)psram - (int32_t)heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    ESP_LOGI(TAG, "Up in %lld ms on core %d, took %d KB internal RAM, %d KB PSRAM",
+             (long long)(now - start) / 1000, service.cfg.task_core, internal_used / 1024, psram_used / 1024);
+    portENTER_CRITICAL(&service_lock);
+    service.up = true;
+    service.up_since_us = now;
+    service.stats.starts++;
+    service.stats.start_us = now - start;
+    service.stats.internal_used = internal_used;
+    service.stats.psram_used = psram_used;
+    portEXIT_CRITICAL(&service_lock);
+    if (service.cfg.on_change) {
+        service.cfg.on_change(true, service.cfg.ctx);
+    }
+    return true;
+}
+
+static void service_down(void)
+{
+    int64_t start = esp_timer_get_time();
+    size_t internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    example_stop_file_server();
+    example_disconnect();
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&service_lock);
+    int64_t up_us = now - service.up_since_us;
+    service.up = false;
+    service.stats.up_us += up_us;
+    portEXIT_CRITICAL(&service_lock);
+    int32_t internal_freed = (int32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL) - (int32_t)internal;
+    ESP_LOGI(TAG, "Down after %lld s in %lld ms, gave back %d KB internal RAM", (long long)up_us / 1000000,
+             (long long)(now - start) / 1000, internal_freed / 1024);
+    if (service.cfg.on_change) {
+        service.cfg.on_change(false, service.cfg.ctx);
+    }
+}
+
+/* True once the service should go down */
+static bool service_idle(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t last = example_file_server_last_active_us();
+    size_t internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    portENTER_CRITICAL(&service_lock);
+    if (internal < service.stats.internal_min_free || service.stats.internal_min_free == 0) {
+        service.stats.internal_min_free = internal;
+    }
+    if (service.requested_us > last) {
+        last = service.requested_us;
+    }
+    bool idle = service.stop || (service.cfg.idle_s > 0 && now - last > service.cfg.idle_s * 1000000LL);
+    portEXIT_CRITICAL(&service_lock);
+    return idle;
+}
+
+static void service_task(void *arg)
+{
+    portENTER_CRITICAL(&service_lock);
+    service.task = xTaskGetCurrentTaskHandle();
+    portEXIT_CRITICAL(&service_lock);
+
+    bool again = true;
+    while (again) {
+        int64_t start = esp_timer_get_time();
+        if (service_up()) {
+            while (!service_idle()) {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(FILE_SERVICE_POLL_MS));
+            }
+            service_down();
+        }
+        /* A request that came while going down brings the service up again */
+        portENTER_CRITICAL(&service_lock);
+        again = !service.stop && service.requested_us > start && service.cfg.idle_s > 0 &&
+                esp_timer_get_time() - service.requested_us < service.cfg.idle_s * 1000000LL;
+        if (!again) {
+            service.running = false;
+            service.task = NULL;
+        }
+        portEXIT_CRITICAL(&service_lock);
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t file_service_init(const file_service_cfg_t *config)
+{
+    if (initialized) {
+        return ESP_OK;
+    }
+    /* example_connect() needs it, the application may have created it */
+    esp_err_t err = esp_event_loop_create_default();
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        return err;
+    }
+    service.cfg = *config;
+    initialized = true;
+    return ESP_OK;
+}
+
+void file_service_request(void)
+{
+    if (!initialized) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&service_lock);
+    service.requested_us = now;
+    service.stop = false;
+    bool start = !service.running;
+    service.running = true;
+    portEXIT_CRITICAL(&service_lock);
+    if (!start) {
+        return;
+    }
+
+    /* Internal stack, see file_service.h */
+    if (xTaskCreatePinnedToCore(service_task, "file_service", service.cfg.task_stack, NULL,
+                                service.cfg.task_prio, NULL, service.cfg.task_core) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start the service task");
+        portENTER_CRITICAL(&service_lock);
+        service.running = false;
+        portEXIT_CRITICAL(&service_lock);
+    }
+}
+
+void file_service_stop(void)
+{
+    if (!initialized) {
+        return;
+    }
+    portENTER_CRITICAL(&service_lock);
+    service.stop = true;
+    TaskHandle_t task = service.task;
+    portEXIT_CRITICAL(&service_lock);
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+bool file_service_is_up(void)
+{
+    portENTER_CRITICAL(&service_lock);
+    bool up = service.up;
+    portEXIT_CRITICAL(&service_lock);
+    return up;
+}
+
+void file_service_get_stats(file_service_stats_t *stats)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&service_lock);
+    *stats = service.stats;
+    if (service.up) {
+        stats->up_us += now - service.up_since_us;
+    }
+    portEXIT_CRITICAL(&service_lock);
+}
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+/*  Wi-Fi and the file server as a service that runs on demand.
+
+    Wi-Fi and the HTTP server take tens of KB of internal RAM, and their
+    tasks compete with the audio tasks, so the box doesn't run them while
+    nobody uses them. file_service_request(), on the admin tag, brings
+    Wi-Fi up and starts the file server from a task pinned to the core
+    the audio tasks don't use. The file server pins its own tasks there
+    too (CONFIG_FILE_SERVER_TASK_CORE), and Wi-Fi and lwIP are pinned
+    there by sdkconfig. The service goes down again once no request came
+    for idle_s. A transfer running by then is finished first.
+
+    The buffers of the server live in PSRAM, and lwIP and Wi-Fi allocate
+    theirs there first with CONFIG_SPIRAM_TRY_ALLOCATE_WIFI_LWIP. The task
+    stacks stay in internal RAM: bringing Wi-Fi up reads the PHY
+    calibration from flash, which needs the cache and an internal stack,
+    and esp_http_server creates its task itself. They only exist while the
+    service is up.
+
+    Every start and stop is logged with the time it took and the RAM it
+    took or gave back. The on_change callback lets the application log
+    how the player fared with the service up and down.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Called on the service task after it came up and after it went down
+typedef void (*file_service_change_cb)(bool up, void *ctx);
+
+typedef struct {
+    const char *base_path;              /*!< Served directory, kept by pointer */
+    int idle_s;                         /*!< Go down after this long without a request, 0 never */
+    int task_stack;                     /*!< Task stack size */
+    int task_core;                      /*!< Task running in core (0 or 1) */
+    int task_prio;                      /*!< Task priority */
+    file_service_change_cb on_change;   /*!< Optional */
+    void *ctx;                          /*!< Passed to on_change */
+} file_service_cfg_t;
+
+/// Counters since file_service_init()
+typedef struct {
+    uint32_t starts;            /*!< Times the service came up */
+    uint32_t failures;          /*!< Times Wi-Fi or the server didn't come up */
+    int64_t up_us;              /*!< Time up, the current run included */
+    int64_t start_us;           /*!< From the request to serving, last start */
+    int32_t internal_used;      /*!< Internal RAM taken by Wi-Fi and the server, last start */
+    int32_t psram_used;         /*!< PSRAM taken by them, last start */
+    size_t internal_min_free;   /*!< Least internal RAM free while up, once a second */
+} file_service_stats_t;
+
+#ifdef CONFIG_FILE_SERVICE
+
+#define FILE_SERVICE_TASK_PRIO      (5)
+
+#define FILE_SERVICE_CFG_DEFAULT() {                    \
+    .base_path = "/sdcard",                             \
+    .idle_s = CONFIG_FILE_SERVICE_IDLE_S,               \
+    .task_stack = CONFIG_FILE_SERVICE_TASK_STACK,       \
+    .task_core = CONFIG_FILE_SERVER_TASK_CORE,          \
+    .task_prio = FILE_SERVICE_TASK_PRIO,                \
+    .on_change = NULL,                                  \
+    .ctx = NULL,                                        \
+}
+
+/// Takes the configuration, starts nothing yet. Needs esp_netif_init().
+esp_err_t file_service_init(const file_service_cfg_t *config);
+
+/// Bring the service up, or keep it up for another idle_s
+void file_service_request(void);
+
+/// Take the service down now, after the running transfer
+void file_service_stop(void);
+
+bool file_service_is_up(void);
+
+void file_service_get_stats(file_service_stats_t *stats);
+
+#else
+
+#define file_service_init(config)       (ESP_OK)
+#define file_service_request()
+#define file_service_stop()
+#define file_service_is_up()            (false)
+#define file_service_get_stats(stats)   memset((stats), 0, sizeof(file_service_stats_t))
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
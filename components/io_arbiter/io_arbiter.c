@@ -0,0 +1,254 @@
+/*  Playback-aware scheduling of the SD card, see io_arbiter.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "io_arbiter.h"
+
+#ifdef CONFIG_IO_ARBITER
+
+/* A held transfer looks again at least this often, a wake-up may be
+ * taken by another one */
+#define IO_ARBITER_POLL_MS  10
+
+static const char *TAG = "IO_ARBITER";
+
+static const char *client_names[IO_ARBITER_CLIENTS] = {
+    "audio", "upload", "download", "sync",
+};
+
+struct io_arbiter {
+    io_arbiter_cfg_t cfg;
+    SemaphoreHandle_t wake;     /* held transfers may look again */
+    int audio_pending;          /* reads of the player between begin and end */
+    int audio_size;             /* ring size, 0 while the player doesn't need the card */
+    int64_t audio_us;           /* last report of the player */
+    bool throttled;             /* below the low watermark, until above the high one */
+    bool held;                  /* a transfer was held in this throttle */
+    bool dry;                   /* the player waited in this throttle */
+    int64_t throttle_us;        /* start of the throttle */
+    io_arbiter_stats_t stats;
+};
+
+/* Guards everything in the arbiter, only held for a few assignments */
+static portMUX_TYPE arbiter_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct io_arbiter *arbiter;
+
+/* With the lock held */
+static bool held_back(struct io_arbiter *a, int64_t now)
+{
+    bool playing = a->audio_size > 0 && now - a->audio_us < a->cfg.idle_ms * 1000LL;
+    return a->audio_pending > 0 || (a->throttled && playing);
+}
+
+esp_err_t io_arbiter_init(const io_arbiter_cfg_t *config)
+{
+    if (arbiter) {
+        return ESP_OK;
+    }
+    if (config->low_percent >= config->high_percent) {
+        ESP_LOGE(TAG, "Low watermark %d%% not below high %d%%", config->low_percent, config->high_percent);
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct io_arbiter *a = calloc(1, sizeof(struct io_arbiter));
+    if (a == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    a->wake = xSemaphoreCreateBinary();
+    if (a->wake == NULL) {
+        free(a);
+        return ESP_ERR_NO_MEM;
+    }
+    a->cfg = *config;
+    a->stats.since_us = esp_timer_get_time();
+    portENTER_CRITICAL(&arbiter_lock);
+    arbiter = a;
+    portEXIT_CRITICAL(&arbiter_lock);
+    return ESP_OK;
+}
+
+void io_arbiter_deinit(void)
+{
+    portENTER_CRITICAL(&arbiter_lock);
+    struct io_arbiter *a = arbiter;
+    arbiter = NULL;
+    portEXIT_CRITICAL(&arbiter_lock);
+    if (a) {
+        vSemaphoreDelete(a->wake);
+        free(a);
+    }
+}
+
+int64_t io_arbiter_begin(io_arbiter_client_t client)
+{
+    struct io_arbiter *a = arbiter;
+    int64_t start = esp_timer_get_time();
+    if (a == NULL) {
+        return start;
+    }
+    portENTER_CRITICAL(&arbiter_lock);
+    if (client == IO_ARBITER_AUDIO) {
+        a->audio_pending++;
+        portEXIT_CRITICAL(&arbiter_lock);
+        return start;
+    }
+    bool held = held_back(a, start);
+    portEXIT_CRITICAL(&arbiter_lock);
+    if (!held) {
+        return start;
+    }
+
+    int64_t deadline = start + a->cfg.max_hold_ms * 1000LL;
+    int64_t now = start;
+    while (held && now < deadline) {
+        xSemaphoreTake(a->wake, pdMS_TO_TICKS(IO_ARBITER_POLL_MS));
+        now = esp_timer_get_time();
+        portENTER_CRITICAL(&arbiter_lock);
+        held = held_back(a, now);
+        a->held = a->held || a->throttled;
+        portEXIT_CRITICAL(&arbiter_lock);
+    }
+    if (!held) {
+        /* Pass the wake-up on to the next held transfer */
+        xSemaphoreGive(a->wake);
+    }
+    portENTER_CRITICAL(&arbiter_lock);
+    a->stats.clients[client].held++;
+    a->stats.clients[client].held_us += now - start;
+    portEXIT_CRITICAL(&arbiter_lock);
+    return now;
+}
+
+void io_arbiter_end(io_arbiter_client_t client, int64_t start, size_t bytes)
+{
+    struct io_arbiter *a = arbiter;
+    if (a == NULL) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    bool wake = false;
+    portENTER_CRITICAL(&arbiter_lock);
+    io_arbiter_client_stats_t *c = &a->stats.clients[client];
+    c->ops++;
+    c->bytes += bytes;
+    c->io_us += now - start;
+    if (client == IO_ARBITER_AUDIO) {
+        a->audio_pending--;
+        wake = !held_back(a, now);
+    }
+    portEXIT_CRITICAL(&arbiter_lock);
+    if (wake) {
+        xSemaphoreGive(a->wake);
+    }
+}
+
+void io_arbiter_audio_level(int filled, int size)
+{
+    struct io_arbiter *a = arbiter;
+    if (a == NULL) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    bool wake = false;
+    portENTER_CRITICAL(&arbiter_lock);
+    a->audio_size = size;
+    a->audio_us = now;
+    if (size == 0) {
+        /* A throttle cut short by a stop or the end of the file counts neither way */
+        wake = a->throttled;
+        a->throttled = false;
+    } else if (!a->throttled && filled < (int64_t)size * a->cfg.low_percent / 100) {
+        a->throttled = true;
+        a->held = false;
+        a->dry = false;
+        a->throttle_us = now;
+    } else if (a->throttled && filled >= (int64_t)size * a->cfg.high_percent / 100) {
+        a->throttled = false;
+        if (a->held) {
+            a->stats.throttles++;
+            a->stats.throttled_us += now - a->throttle_us;
+            if (a->dry) {
+                a->stats.dry++;
+            } else {
+                a->stats.prevented++;
+            }
+        }
+        wake = true;
+    }
+    portEXIT_CRITICAL(&arbiter_lock);
+    if (wake) {
+        xSemaphoreGive(a->wake);
+    }
+}
+
+void io_arbiter_audio_dry(void)
+{
+    struct io_arbiter *a = arbiter;
+    if (a == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&arbiter_lock);
+    a->stats.audio_dry++;
+    a->dry = a->dry || a->throttled;
+    portEXIT_CRITICAL(&arbiter_lock);
+}
+
+void io_arbiter_get_stats(io_arbiter_stats_t *stats)
+{
+    struct io_arbiter *a = arbiter;
+    if (a == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    portENTER_CRITICAL(&arbiter_lock);
+    *stats = a->stats;
+    portEXIT_CRITICAL(&arbiter_lock);
+}
+
+void io_arbiter_reset_stats(void)
+{
+    struct io_arbiter *a = arbiter;
+    if (a == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&arbiter_lock);
+    memset(&a->stats, 0, sizeof(a->stats));
+    a->stats.since_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&arbiter_lock);
+}
+
+size_t io_arbiter_format(char *buf, size_t size)
+{
+    io_arbiter_stats_t stats;
+    io_arbiter_get_stats(&stats);
+    double seconds = (esp_timer_get_time() - stats.since_us) / 1e6;
+    size_t len = snprintf(buf, size, "%-9s %10s %8s %8s %10s %6s %9s\n", "client", "KB",
+                    "KB/s", "ops", "card ms", "held", "held ms");
+    len = MIN(len, size - 1);
+    for (int i = 0; i < IO_ARBITER_CLIENTS; i++) {
+        const io_arbiter_client_stats_t *c = &stats.clients[i];
+        len += snprintf(buf + len, size - len, "%-9s %10llu %8.1f %8u %10lld %6u %9lld\n",
+                        client_names[i], (unsigned long long)(c->bytes / 1024),
+                        seconds > 0 ? c->bytes / 1024.0 / seconds : 0.0, (unsigned)c->ops,
+                        (long long)(c->io_us / 1000), (unsigned)c->held, (long long)(c->held_us / 1000));
+        len = MIN(len, size - 1);
+    }
+    len += snprintf(buf + len, size - len,
+                    "throttles %u, prevented %u, dry %u, throttled %lld ms, player waited %u times in %.0f s\n",
+                    (unsigned)stats.throttles, (unsigned)stats.prevented, (unsigned)stats.dry,
+                    (long long)(stats.throttled_us / 1000), (unsigned)stats.audio_dry, seconds);
+    return MIN(len, size - 1);
+}
+
+#endif
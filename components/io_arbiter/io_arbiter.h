@@ -0,0 +1,126 @@
+#pragma once
+
+/*  Playback-aware scheduling of the SD card between the player and the
+    file server.
+
+    The card sits on one 1-line SD bus. FATFS serializes the accesses, in
+    whatever order the tasks come, so a burst of upload writes can keep
+    the read-ahead of the playing track waiting until its ring runs dry.
+    The arbiter gives the player's reads priority: every transfer of the
+    file server asks before it touches the card and is held back
+      - while a read of the player waits for the card or is on it, and
+      - once the read-ahead ring dropped below the low watermark, until
+        the player refilled it above the high watermark.
+    A transfer is held for max_hold_ms at most, so the file server keeps
+    crawling along on a card too slow for both. The watermarks only count
+    while the player is reading the card; a paused player, or one playing
+    the tail of a file already in the ring, holds back nothing.
+
+    Every access is counted per client, so the report gives the bandwidth
+    each of them got, how long transfers were held, and how many times a
+    throttled ring was refilled without running dry ("prevented"), or ran
+    dry anyway. The file server serves the report at /io.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Users of the card. Values index io_arbiter_stats_t::clients.
+typedef enum {
+    IO_ARBITER_AUDIO,           /*!< Reads of the player, never held back */
+    IO_ARBITER_UPLOAD,          /*!< Uploads, resumable chunks and batches */
+    IO_ARBITER_DOWNLOAD,        /*!< Downloads */
+    IO_ARBITER_SYNC,            /*!< Files read for the CRC-32 of the manifest */
+    IO_ARBITER_CLIENTS
+} io_arbiter_client_t;
+
+typedef struct {
+    int low_percent;            /*!< Hold transfers once the ring is below this share */
+    int high_percent;           /*!< until it is back above this one */
+    int max_hold_ms;            /*!< Let a held transfer go after this long */
+    int idle_ms;                /*!< The player stopped reading if it didn't report for this long */
+} io_arbiter_cfg_t;
+
+typedef struct {
+    uint64_t bytes;
+    uint32_t ops;               /*!< Card accesses */
+    int64_t io_us;              /*!< Time on the card, waiting for FATFS included */
+    uint32_t held;              /*!< Accesses held back by the arbiter */
+    int64_t held_us;
+} io_arbiter_client_stats_t;
+
+/// Counters since io_arbiter_init() or the last io_arbiter_reset_stats()
+typedef struct {
+    int64_t since_us;
+    io_arbiter_client_stats_t clients[IO_ARBITER_CLIENTS];
+    uint32_t throttles;         /*!< Times transfers were held for a ring below the low watermark */
+    uint32_t prevented;         /*!< of them, the ring got back above the high watermark without running dry */
+    uint32_t dry;               /*!< of them, the player waited for the card anyway */
+    int64_t throttled_us;       /*!< Sum over the throttles, low to high watermark */
+    uint32_t audio_dry;         /*!< Times the player waited for the card, throttled or not */
+} io_arbiter_stats_t;
+
+#ifdef CONFIG_IO_ARBITER
+
+#define IO_ARBITER_CFG_DEFAULT() {                      \
+    .low_percent = CONFIG_IO_ARBITER_LOW_PERCENT,       \
+    .high_percent = CONFIG_IO_ARBITER_HIGH_PERCENT,     \
+    .max_hold_ms = CONFIG_IO_ARBITER_MAX_HOLD_MS,       \
+    .idle_ms = CONFIG_IO_ARBITER_IDLE_MS,               \
+}
+
+/// Start arbitrating. The hooks below are no-ops before.
+esp_err_t io_arbiter_init(const io_arbiter_cfg_t *config);
+
+/// Stop arbitrating, while nothing is between begin and end
+void io_arbiter_deinit(void);
+
+/// Before @p client accesses the card. Waits while the client is held
+/// back, returns esp_timer_get_time() once it may go on.
+int64_t io_arbiter_begin(io_arbiter_client_t client);
+
+/// After the access that began at @p start moved @p bytes
+void io_arbiter_end(io_arbiter_client_t client, int64_t start, size_t bytes);
+
+/// The read-ahead ring of the player holds @p filled of @p size bytes.
+/// @p size 0 when the player doesn't need the card: stopped, or the rest
+/// of the file is in the ring.
+void io_arbiter_audio_level(int filled, int size);
+
+/// The player found the ring empty and waits for the card
+void io_arbiter_audio_dry(void);
+
+void io_arbiter_get_stats(io_arbiter_stats_t *stats);
+void io_arbiter_reset_stats(void);
+
+/// The counters as text into @p buf of @p size, one line per client with
+/// its KB/s, and a line with the throttles. Returns the length, cut off
+/// at @p size - 1.
+size_t io_arbiter_format(char *buf, size_t size);
+
+#else
+
+#define io_arbiter_init(config)                     (ESP_OK)
+#define io_arbiter_deinit()
+#define io_arbiter_begin(client)                    (esp_timer_get_time())
+#define io_arbiter_end(client, start, bytes)
+#define io_arbiter_audio_level(filled, size)
+#define io_arbiter_audio_dry()
+#define io_arbiter_get_stats(stats)                 memset((stats), 0, sizeof(io_arbiter_stats_t))
+#define io_arbiter_reset_stats()
+#define io_arbiter_format(buf, size)                ((buf)[0] = '\0', (size_t)0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
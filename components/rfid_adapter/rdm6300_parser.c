@@ -0,0 +1,170 @@
+/*  RDM6300 frame parser, see rdm6300_parser.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdbool.h>
+#include <string.h>
+
+#include "rdm6300_parser.h"
+
+void rdm6300_parser_init(rdm6300_parser_t *parser, int confirm_frames)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->pos = -1;
+    parser->confirm_frames = confirm_frames > 0 ? confirm_frames : 1;
+    parser->lost_us = RDM6300_LOST_TIMEOUT_US;
+}
+
+void rdm6300_parser_set_windows(rdm6300_parser_t *parser, int64_t confirm_us, int64_t lost_us)
+{
+    parser->confirm_us = confirm_us;
+    parser->lost_us = lost_us;
+}
+
+void rdm6300_parser_resync(rdm6300_parser_t *parser)
+{
+    parser->pos = -1;
+}
+
+static int hex_value(uint8_t c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/// Serial of a complete frame, 0 if the checksum does not match.
+/// The serial keeps the checksum as its lowest byte, the same number the
+/// playlists on the SD card are named after.
+static uint64_t frame_serial(const uint8_t *hex)
+{
+    uint64_t serial = 0;
+    uint8_t checksum = 0;
+    for(int i = 0; i < RDM6300_FRAME_HEX_CHARS; i += 2)
+    {
+        uint8_t byte = (hex_value(hex[i]) << 4) | hex_value(hex[i + 1]);
+        serial = (serial << 8) | byte;
+        checksum ^= byte;
+    }
+    // XOR over the data bytes and the checksum byte is 0 for a good frame
+    return checksum == 0 ? serial : 0;
+}
+
+/// A valid frame of @p serial arrived, returns true if it makes it the reported tag
+static bool frame_received(rdm6300_parser_t *parser, uint64_t serial, int64_t now_us)
+{
+    if(serial == parser->last_seen_serial)
+    {
+        parser->time_serial_last_seen = now_us;
+        parser->candidate = 0;
+        parser->candidate_frames = 0;
+        return false;
+    }
+    // A candidate that went silent for longer than a tag may has to start over
+    if(serial != parser->candidate || now_us - parser->candidate_last > parser->lost_us)
+    {
+        parser->stats.unconfirmed += parser->candidate_frames;
+        parser->candidate = serial;
+        parser->candidate_frames = 0;
+        parser->candidate_since = now_us;
+    }
+    parser->candidate_last = now_us;
+    if(++parser->candidate_frames < parser->confirm_frames
+       || now_us - parser->candidate_since < parser->confirm_us)
+    {
+        return false;
+    }
+    parser->candidate = 0;
+    parser->candidate_frames = 0;
+    parser->last_seen_serial = serial;
+    parser->time_serial_last_seen = now_us;
+    return true;
+}
+
+size_t rdm6300_parser_feed(rdm6300_parser_t *parser, const uint8_t *data, size_t length, int64_t now_us,
+                           enum rdm6300_sense_result *result, uint64_t *serial)
+{
+    *result = RDM6300_SENSE_NO_CHANGE;
+    for(size_t i = 0; i < length; i++)
+    {
+        uint8_t byte = data[i];
+        if(byte == RDM6300_FRAME_STX)
+        {
+            if(parser->pos >= 0)
+            {
+                parser->stats.framing_errors++;
+            }
+            parser->pos = 0;
+            continue;
+        }
+        if(parser->pos < 0)
+        {
+            continue;
+        }
+        if(parser->pos < RDM6300_FRAME_HEX_CHARS)
+        {
+            if(hex_value(byte) < 0)
+            {
+                parser->stats.framing_errors++;
+                parser->pos = -1;
+                continue;
+            }
+            parser->hex[parser->pos++] = byte;
+            continue;
+        }
+        // All hex characters are in, only ETX may follow
+        parser->pos = -1;
+        if(byte != RDM6300_FRAME_ETX)
+        {
+            parser->stats.framing_errors++;
+            continue;
+        }
+        uint64_t frame = frame_serial(parser->hex);
+        if(frame == 0)
+        {
+            parser->stats.checksum_errors++;
+            continue;
+        }
+        parser->stats.frames++;
+        if(frame_received(parser, frame, now_us))
+        {
+            *result = RDM6300_SENSE_NEW_TAG;
+            *serial = frame;
+            return i + 1;
+        }
+    }
+    return length;
+}
+
+enum rdm6300_sense_result rdm6300_parser_check_lost(rdm6300_parser_t *parser, int64_t now_us, uint64_t *serial)
+{
+    if((parser->last_seen_serial != 0) && (now_us - parser->time_serial_last_seen > parser->lost_us))
+    {
+        *serial = parser->last_seen_serial;
+        parser->last_seen_serial = 0;
+        return RDM6300_SENSE_TAG_LOST;
+    }
+    return RDM6300_SENSE_NO_CHANGE;
+}
+
+int64_t rdm6300_parser_lost_deadline(const rdm6300_parser_t *parser)
+{
+    if(parser->last_seen_serial == 0)
+    {
+        return -1;
+    }
+    // check_lost needs strictly more than the timeout
+    return parser->time_serial_last_seen + parser->lost_us + 1;
+}
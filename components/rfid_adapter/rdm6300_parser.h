@@ -0,0 +1,89 @@
+#pragma once
+
+/*  Streaming RDM6300 frame parser without any driver dependency.
+
+    A frame is STX, 10 ASCII hex data characters, 2 ASCII hex checksum
+    characters and ETX. The checksum is the XOR of the five data bytes.
+    Frames may arrive cut into pieces or several per read; anything that
+    does not fit the format is dropped and the parser resynchronises on the
+    next STX. A tag is only reported after confirm_frames valid frames in a
+    row carried its serial over at least confirm_us, and it is lost once no
+    frame came for lost_us. Debouncing the lost tag for the player is done
+    one level up, in rdm6300_presence.h.
+
+    Bytes are pushed in as they come from the UART together with the time
+    they were received, so the same code runs on the device and in the host
+    tools (host/rfid_replay.cpp, host/rfid_parser_bench.cpp,
+    host/rfid_parser_fuzz.cpp).
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Default for how long a tag may go without a frame before it is lost
+#define RDM6300_LOST_TIMEOUT_US     (200000)
+
+#define RDM6300_FRAME_STX           (0x02)
+#define RDM6300_FRAME_ETX           (0x03)
+#define RDM6300_FRAME_HEX_CHARS     (12)
+#define RDM6300_FRAME_LEN           (RDM6300_FRAME_HEX_CHARS + 2)
+
+enum rdm6300_sense_result
+{
+    RDM6300_SENSE_NEW_TAG,
+    RDM6300_SENSE_TAG_LOST,
+    RDM6300_SENSE_NO_CHANGE,
+};
+
+typedef struct {
+    uint32_t frames;            ///< frames with a valid checksum
+    uint32_t checksum_errors;   ///< well formed frames with a wrong checksum
+    uint32_t framing_errors;    ///< frames cut short by an unexpected byte
+    uint32_t unconfirmed;       ///< valid frames of a tag that never got confirmed
+} rdm6300_parser_stats_t;
+
+typedef struct {
+    uint8_t hex[RDM6300_FRAME_HEX_CHARS];
+    int pos;                    ///< -1 while waiting for STX
+    int confirm_frames;
+    int64_t confirm_us;
+    int64_t lost_us;
+    uint64_t candidate;         ///< serial seen in the last frames, not reported yet
+    int candidate_frames;
+    int64_t candidate_since;
+    int64_t candidate_last;
+    uint64_t last_seen_serial;  ///< reported tag, 0 if none
+    int64_t time_serial_last_seen;
+    rdm6300_parser_stats_t stats;
+} rdm6300_parser_t;
+
+/// @p confirm_frames consecutive frames with the same serial report a tag, at least 1
+void rdm6300_parser_init(rdm6300_parser_t *parser, int confirm_frames);
+
+/// Also require the confirming frames to span @p confirm_us, and lose a tag
+/// after @p lost_us without a frame (RDM6300_LOST_TIMEOUT_US by default).
+void rdm6300_parser_set_windows(rdm6300_parser_t *parser, int64_t confirm_us, int64_t lost_us);
+
+/// Parse up to @p length bytes received at @p now_us. Stops right after a
+/// frame that reports a new tag, so the caller sees every change.
+/// returns the number of bytes consumed, sets @p result to
+/// RDM6300_SENSE_NEW_TAG and @p serial if a new tag was detected
+size_t rdm6300_parser_feed(rdm6300_parser_t *parser, const uint8_t *data, size_t length, int64_t now_us,
+                           enum rdm6300_sense_result *result, uint64_t *serial);
+
+/// returns RDM6300_SENSE_TAG_LOST and sets @p serial if the present tag timed out at @p now_us
+enum rdm6300_sense_result rdm6300_parser_check_lost(rdm6300_parser_t *parser, int64_t now_us, uint64_t *serial);
+
+/// Time at which the present tag will be declared lost, -1 if no tag is present.
+int64_t rdm6300_parser_lost_deadline(const rdm6300_parser_t *parser);
+
+/// Drop a partly received frame, e.g. after the UART dropped bytes.
+void rdm6300_parser_resync(rdm6300_parser_t *parser);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,69 @@
+/*  Debounced RDM6300 tag presence, see rdm6300_presence.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <string.h>
+
+#include "rdm6300_presence.h"
+
+void rdm6300_presence_init(rdm6300_presence_t *presence, const rdm6300_presence_cfg_t *config)
+{
+    memset(presence, 0, sizeof(*presence));
+    rdm6300_parser_init(&presence->parser, config->confirm_frames);
+    rdm6300_parser_set_windows(&presence->parser, config->confirm_us, config->lost_us);
+    presence->grace_us = config->grace_us;
+    presence->missing_since = -1;
+}
+
+size_t rdm6300_presence_feed(rdm6300_presence_t *presence, const uint8_t *data, size_t length, int64_t now_us,
+                             enum rdm6300_sense_result *result, uint64_t *serial)
+{
+    size_t consumed = rdm6300_parser_feed(&presence->parser, data, length, now_us, result, serial);
+    if(*result != RDM6300_SENSE_NEW_TAG)
+    {
+        return consumed;
+    }
+    if(presence->missing_since >= 0 && *serial == presence->present)
+    {
+        // Back before the grace period ran out, the player never noticed
+        presence->missing_since = -1;
+        presence->stats.suppressed_flaps++;
+        *result = RDM6300_SENSE_NO_CHANGE;
+        return consumed;
+    }
+    // A different tag replaces a missing one without a TAG_LOST in between
+    presence->present = *serial;
+    presence->missing_since = -1;
+    presence->stats.tags++;
+    return consumed;
+}
+
+enum rdm6300_sense_result rdm6300_presence_poll(rdm6300_presence_t *presence, int64_t now_us, uint64_t *serial)
+{
+    uint64_t lost;
+    if(rdm6300_parser_check_lost(&presence->parser, now_us, &lost) == RDM6300_SENSE_TAG_LOST)
+    {
+        presence->missing_since = now_us;
+        presence->stats.missing++;
+    }
+    if(presence->missing_since < 0 || now_us - presence->missing_since < presence->grace_us)
+    {
+        return RDM6300_SENSE_NO_CHANGE;
+    }
+    *serial = presence->present;
+    presence->present = 0;
+    presence->missing_since = -1;
+    presence->stats.lost++;
+    return RDM6300_SENSE_TAG_LOST;
+}
+
+int64_t rdm6300_presence_deadline(const rdm6300_presence_t *presence)
+{
+    if(presence->missing_since >= 0)
+    {
+        return presence->missing_since + presence->grace_us;
+    }
+    return rdm6300_parser_lost_deadline(&presence->parser);
+}
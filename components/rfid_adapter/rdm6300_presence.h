@@ -0,0 +1,70 @@
+#pragma once
+
+/*  Debounced tag presence on top of the RDM6300 frame parser.
+
+    The parser decides when a tag shows up (confirm window) and when its
+    frames stopped (lost window). A lost tag is not reported right away:
+    during the grace period the player keeps going, and if the same tag
+    comes back in time nothing is reported at all. Such a suppressed flap
+    saves a pause/resume cycle, or a full stop/start, in the player. A
+    different tag ends the grace period at once.
+
+    Like the parser this has no driver dependency, the caller passes the
+    time of every call.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rdm6300_parser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int confirm_frames;     ///< consecutive valid frames needed for a new tag
+    int64_t confirm_us;     ///< time those frames have to span
+    int64_t lost_us;        ///< time without a frame until a tag is missing
+    int64_t grace_us;       ///< time a missing tag keeps playing before TAG_LOST
+} rdm6300_presence_cfg_t;
+
+#define RDM6300_PRESENCE_CFG_DEFAULT() {        \
+    .confirm_frames = 2,                        \
+    .confirm_us = 0,                            \
+    .lost_us = RDM6300_LOST_TIMEOUT_US,         \
+    .grace_us = 0,                              \
+}
+
+typedef struct {
+    uint32_t tags;              ///< NEW_TAG reported
+    uint32_t lost;              ///< TAG_LOST reported
+    uint32_t suppressed_flaps;  ///< tag came back during the grace period
+    uint32_t missing;           ///< times the present tag stopped sending frames
+} rdm6300_presence_stats_t;
+
+typedef struct {
+    rdm6300_parser_t parser;
+    int64_t grace_us;
+    uint64_t present;           ///< tag the player was told about, 0 if none
+    int64_t missing_since;      ///< -1 while the present tag sends frames
+    rdm6300_presence_stats_t stats;
+} rdm6300_presence_t;
+
+void rdm6300_presence_init(rdm6300_presence_t *presence, const rdm6300_presence_cfg_t *config);
+
+/// Parse up to @p length bytes received at @p now_us, see rdm6300_parser_feed().
+/// Only reports RDM6300_SENSE_NEW_TAG, a returning tag within the grace
+/// period is not reported again.
+size_t rdm6300_presence_feed(rdm6300_presence_t *presence, const uint8_t *data, size_t length, int64_t now_us,
+                             enum rdm6300_sense_result *result, uint64_t *serial);
+
+/// Advance the timers to @p now_us.
+/// returns RDM6300_SENSE_TAG_LOST and sets @p serial once the grace period of a missing tag ran out
+enum rdm6300_sense_result rdm6300_presence_poll(rdm6300_presence_t *presence, int64_t now_us, uint64_t *serial);
+
+/// Next time rdm6300_presence_poll() has something to do, -1 if nothing is pending.
+int64_t rdm6300_presence_deadline(const rdm6300_presence_t *presence);
+
+#ifdef __cplusplus
+}
+#endif
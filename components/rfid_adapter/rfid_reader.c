@@ -6,10 +6,13 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 
 static const char *TAG = "RFID_READER";
@@ -21,7 +24,7 @@ static const char *TAG = "RFID_READER";
 /// lots of things hard-coded and unnecessarily huge buffers
 rdm6300_handle_t rdm6300_init(int pin)
 {
-    const uart_port_t uart_num = UART_NUM_2;
+    const uart_port_t uart_num = RDM6300_UART_NUM;
     uart_config_t uart_config = {
         .baud_rate = 9600,
         .data_bits = UART_DATA_8_BITS,
@@ -32,15 +35,20 @@ rdm6300_handle_t rdm6300_init(int pin)
     };
     // Configure UART parameters
     ESP_ERROR_CHECK(uart_param_config(uart_num, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(UART_NUM_2, UART_PIN_NO_CHANGE, pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    ESP_ERROR_CHECK(uart_set_pin(uart_num, UART_PIN_NO_CHANGE, pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
     // Setup UART buffered IO with event queue
     const int uart_buffer_size = (1024 * 2);
-    //QueueHandle_t uart_queue;
-    rdm6300_handle_t handle = {.state = 0, .pos = 0, .last_seen_serial = 0, .time_serial_last_seen = 0};
+    rdm6300_handle_t handle = {.uart_queue = NULL, .task = NULL, .on_event = NULL, .ctx = NULL};
+    rdm6300_presence_cfg_t presence_cfg = RDM6300_PRESENCE_CFG_DEFAULT();
+    presence_cfg.confirm_frames = CONFIG_RFID_CONFIRM_FRAMES;
+    presence_cfg.confirm_us = CONFIG_RFID_CONFIRM_MS * 1000LL;
+    presence_cfg.lost_us = CONFIG_RFID_LOST_MS * 1000LL;
+    presence_cfg.grace_us = CONFIG_RFID_GRACE_MS * 1000LL;
+    rdm6300_presence_init(&handle.presence, &presence_cfg);
     // Install UART driver using an event queue here
     ESP_ERROR_CHECK(
         uart_driver_install(
-        UART_NUM_2,
+        uart_num,
         uart_buffer_size,
         uart_buffer_size,
         10,
@@ -51,66 +59,142 @@ rdm6300_handle_t rdm6300_init(int pin)
     return handle;
 }
 
+#ifdef CONFIG_RFID_CAPTURE
+/// Dump received bytes in the format host/rfid_replay reads
+static void rdm6300_capture(const uint8_t *data, int length, int64_t now_us)
+{
+    printf("RFID_CAPTURE %lld", (long long)now_us);
+    for(int i = 0; i < length; i++)
+    {
+        printf(" %02x", data[i]);
+    }
+    printf("\n");
+}
+#else
+#define rdm6300_capture(data, length, now_us)
+#endif
+
 /// receives data from the rdm6300 and returns the serial number of the tag if present
 /// returns RDM6300_SENSE_NEW_TAG if a new tag was detected
 /// returns RDM6300_SENSE_TAG_LOST if a tag was lost
 /// returns RDM6300_SENSE_NO_CHANGE if no change was sensed since last call. NOTE: this could either mean tag is still present or no tag is present, depending on last returned sense result.
 enum rdm6300_sense_result rdm630_sense(rdm6300_handle_t * handle, uint64_t * serial)
 {
-    enum rdm6300_sense_result result = RDM6300_SENSE_NO_CHANGE;
-    const uart_port_t uart_num = UART_NUM_2;
     uint8_t data[128];
-    int length = 128;
-    //ESP_LOGI(TAG, " start rx: %" PRIu64, esp_timer_get_time());
-    //length = uart_read_bytes(uart_num, data, length, 100);
-    length = uart_read_bytes(uart_num, data, length, 1);
-    //ESP_LOGI(TAG, " end rx: %" PRIu64, esp_timer_get_time());
-    for(int i = 0; i < length; i++)
+    int length = uart_read_bytes(RDM6300_UART_NUM, data, sizeof(data), 1);
+    int64_t now = esp_timer_get_time();
+    enum rdm6300_sense_result result = RDM6300_SENSE_NO_CHANGE;
+    if(length > 0)
     {
-        uint8_t byte = data[i];
-        switch(handle->state)
+        rdm6300_capture(data, length, now);
+    }
+    // Only the latest new tag of this read is reported
+    for(int done = 0; done < length; )
+    {
+        enum rdm6300_sense_result frame_result;
+        done += rdm6300_presence_feed(&handle->presence, data + done, length - done, now, &frame_result, serial);
+        if(frame_result == RDM6300_SENSE_NEW_TAG)
         {
-            case 0: // wait for start
-                if(byte == 0x02)
-                {
-                    handle->state = 1;
-                }
-                break;
-            case 1: // reading data
-                // FIXME: only works when we receive one message per call...
-                if(byte == 0x03) // end received
-                {
-                    handle->serial[handle->pos] = '\0';
-                    uint64_t intserial = strtoull(handle->serial, NULL, 16);
-                    if(handle->last_seen_serial != intserial)
-                    {
-                        result = RDM6300_SENSE_NEW_TAG;
-                        *serial = intserial;
-                        handle->last_seen_serial = intserial;
-                    }
-                    handle->time_serial_last_seen = esp_timer_get_time();
+            result = RDM6300_SENSE_NEW_TAG;
+        }
+    }
+    if(rdm6300_presence_poll(&handle->presence, now, serial) == RDM6300_SENSE_TAG_LOST)
+    {
+        result = RDM6300_SENSE_TAG_LOST;
+    }
+    return result;
+}
 
-                    //ESP_LOGI(TAG, "serial: %s", handle->serial);
+/// Ticks until the present tag goes missing or its grace period ends,
+/// portMAX_DELAY without a tag so the task does not wake up at all while
+/// the reader is empty.
+static TickType_t rdm6300_wait_ticks(rdm6300_handle_t * handle)
+{
+    int64_t deadline = rdm6300_presence_deadline(&handle->presence);
+    if(deadline < 0)
+    {
+        return portMAX_DELAY;
+    }
+    int64_t remaining = deadline - esp_timer_get_time();
+    if(remaining <= 0)
+    {
+        return 0;
+    }
+    return pdMS_TO_TICKS((remaining + 999) / 1000) + 1;
+}
+
+static void rdm6300_read_pending(rdm6300_handle_t * handle, size_t pending)
+{
+    uint8_t data[128];
+    while(pending > 0)
+    {
+        int length = uart_read_bytes(RDM6300_UART_NUM, data, pending < sizeof(data) ? pending : sizeof(data), 0);
+        if(length <= 0)
+        {
+            break;
+        }
+        pending -= length;
+        int64_t now = esp_timer_get_time();
+        rdm6300_capture(data, length, now);
+        for(int done = 0; done < length; )
+        {
+            enum rdm6300_sense_result result;
+            uint64_t serial = 0;
+            done += rdm6300_presence_feed(&handle->presence, data + done, length - done, now, &result, &serial);
+            if(result == RDM6300_SENSE_NEW_TAG)
+            {
+                handle->on_event(RDM6300_SENSE_NEW_TAG, serial, handle->ctx);
+            }
+        }
+    }
+}
 
-                    handle->state = 0;
-                    handle->pos = 0;
+static void rdm6300_task(void *arg)
+{
+    rdm6300_handle_t * handle = (rdm6300_handle_t *)arg;
+    uart_event_t event;
+    while(1)
+    {
+        if(xQueueReceive(handle->uart_queue, &event, rdm6300_wait_ticks(handle)) == pdTRUE)
+        {
+            switch(event.type)
+            {
+                case UART_DATA:
+                    rdm6300_read_pending(handle, event.size);
                     break;
-                }
-                if(handle->pos + 1 > 128)
-                {
-                    handle->state = 0;
-                    handle->pos = 0;
+                case UART_FIFO_OVF:
+                case UART_BUFFER_FULL:
+                    // Nobody read for too long, whatever is buffered is stale
+                    ESP_LOGW(TAG, "UART overflow, flushing");
+                    uart_flush_input(RDM6300_UART_NUM);
+                    xQueueReset(handle->uart_queue);
+                    rdm6300_parser_resync(&handle->presence.parser);
                     break;
-                }
-                handle->serial[handle->pos++] = byte;
-                break;
+                default:
+                    break;
+            }
+        }
+        uint64_t serial = 0;
+        if(rdm6300_presence_poll(&handle->presence, esp_timer_get_time(), &serial) == RDM6300_SENSE_TAG_LOST)
+        {
+            ESP_LOGI(TAG, "Tag lost, %u flaps suppressed so far", handle->presence.stats.suppressed_flaps);
+            handle->on_event(RDM6300_SENSE_TAG_LOST, serial, handle->ctx);
         }
     }
-    if((handle->last_seen_serial != 0) && (esp_timer_get_time() - handle->time_serial_last_seen > 200000))
+}
+
+esp_err_t rdm6300_start_task(rdm6300_handle_t * handle, rdm6300_event_cb on_event, void * ctx)
+{
+    handle->on_event = on_event;
+    handle->ctx = ctx;
+    // Drop whatever piled up before, it would be parsed with a wrong timestamp
+    uart_flush_input(RDM6300_UART_NUM);
+    xQueueReset(handle->uart_queue);
+    if(xTaskCreatePinnedToCore(rdm6300_task, "rfid_reader", RDM6300_TASK_STACK, handle,
+                               RDM6300_TASK_PRIO, &handle->task, RDM6300_TASK_CORE) != pdPASS)
     {
-        *serial = handle->last_seen_serial;
-        result = RDM6300_SENSE_TAG_LOST;
-        handle->last_seen_serial = 0;
+        ESP_LOGE(TAG, "Failed to create reader task");
+        return ESP_FAIL;
     }
-    return result;
+    return ESP_OK;
 }
@@ -2,33 +2,41 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "driver/uart.h"
+#include "rdm6300_presence.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define RDM6300_UART_NUM        UART_NUM_2
+#define RDM6300_TASK_STACK      (4 * 1024)
+#define RDM6300_TASK_PRIO       (10)
+#define RDM6300_TASK_CORE       (0)
+
+/// Called from the reader task for every NEW_TAG and TAG_LOST
+typedef void (*rdm6300_event_cb)(enum rdm6300_sense_result result, uint64_t serial, void *ctx);
 
 typedef struct {
-    char serial[129];
-    size_t pos;
-    int state;
-    uint64_t last_seen_serial;
-    uint64_t time_serial_last_seen;
+    rdm6300_presence_t presence;
     QueueHandle_t uart_queue;
+    TaskHandle_t task;
+    rdm6300_event_cb on_event;
+    void *ctx;
 } rdm6300_handle_t;
 
-enum rdm6300_sense_result
-{
-    RDM6300_SENSE_NEW_TAG,
-    RDM6300_SENSE_TAG_LOST,
-    RDM6300_SENSE_NO_CHANGE,
-};
-
 rdm6300_handle_t rdm6300_init(int pin);
 
+/// Polling mode: parse whatever the UART received since the last call.
 enum rdm6300_sense_result rdm630_sense(rdm6300_handle_t * handle, uint64_t * serial);
 
+/// Event-driven mode: start a task that sleeps on the UART event queue and
+/// calls @p on_event on every change. @p handle must outlive the task, do not
+/// call rdm630_sense() once it runs.
+esp_err_t rdm6300_start_task(rdm6300_handle_t * handle, rdm6300_event_cb on_event, void * ctx);
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,105 @@
+/*  Binary trace of the player, see trace_ring.h
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "trace_ring.h"
+
+#ifdef CONFIG_TRACE_RING
+
+static const char *TAG = "TRACE_RING";
+
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+static trace_record_t *trace_records;
+static uint32_t trace_size;
+/* Sequence number of the next record, the slot is seq % trace_size */
+static uint32_t trace_next;
+
+esp_err_t trace_ring_init(int records)
+{
+    if (trace_records) {
+        return ESP_OK;
+    }
+    trace_record_t *ring = calloc(records, sizeof(trace_record_t));
+    if (ring == NULL) {
+        ESP_LOGE(TAG, "No memory for %d records", records);
+        return ESP_ERR_NO_MEM;
+    }
+    portENTER_CRITICAL(&trace_lock);
+    trace_size = records;
+    trace_records = ring;
+    portEXIT_CRITICAL(&trace_lock);
+    return ESP_OK;
+}
+
+void trace_ring_record(trace_event_t event, uint8_t arg8, uint16_t arg16, uint32_t arg)
+{
+    if (trace_records == NULL) {
+        return;
+    }
+    trace_record_t record = {
+        .time_us = esp_timer_get_time(),
+        .arg = arg,
+        .arg16 = arg16,
+        .event = event,
+        .arg8 = arg8,
+    };
+    portENTER_CRITICAL(&trace_lock);
+    trace_records[trace_next % trace_size] = record;
+    trace_next++;
+    portEXIT_CRITICAL(&trace_lock);
+}
+
+int trace_ring_read(uint32_t *seq, trace_record_t *records, int max)
+{
+    if (trace_records == NULL) {
+        return 0;
+    }
+    int n = 0;
+    while (n < max) {
+        portENTER_CRITICAL(&trace_lock);
+        if (trace_next - *seq > trace_size) {
+            /* Overwritten in the meantime */
+            *seq = trace_next - trace_size;
+        }
+        int batch = 0;
+        while (n < max && batch < TRACE_RING_READ_BATCH && *seq != trace_next) {
+            records[n++] = trace_records[*seq % trace_size];
+            (*seq)++;
+            batch++;
+        }
+        bool done = *seq == trace_next;
+        portEXIT_CRITICAL(&trace_lock);
+        if (done) {
+            break;
+        }
+    }
+    return n;
+}
+
+void trace_ring_print(FILE *out, uint32_t *seq)
+{
+    trace_record_t records[TRACE_RING_READ_BATCH];
+    while (true) {
+        int n = trace_ring_read(seq, records, TRACE_RING_READ_BATCH);
+        if (n == 0) {
+            break;
+        }
+        /* Overwritten records leave a gap in the numbers */
+        uint32_t first = *seq - n;
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "TRACE %u %lld %u %u %u %u\n", (unsigned)(first + i), (long long)records[i].time_us,
+                    records[i].event, records[i].arg8, records[i].arg16, (unsigned)records[i].arg);
+        }
+    }
+}
+
+#endif
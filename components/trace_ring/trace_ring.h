@@ -0,0 +1,90 @@
+#pragma once
+
+/*  Binary trace of the player, for timing analysis.
+
+    Fixed-size records with an esp_timer timestamp go into one ring buffer
+    in RAM, allocated once by trace_ring_init(). Recording takes a spinlock
+    for the copy of 16 bytes, it does not format, allocate or touch the
+    UART, so it can stay on in every loop. When the ring is full the oldest
+    records are overwritten.
+
+    trace_ring_print() writes records as text lines
+        TRACE <seq> <time us> <event> <arg8> <arg16> <arg>
+    to the console or any other stream, the file server serves the same at
+    /trace. host/trace_to_json turns them into a Chrome trace / Perfetto
+    timeline, an idf.py monitor log can be fed to it as is.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Recorded events. Values are part of the dump format, only append.
+typedef enum {
+    TRACE_NONE = 0,
+    TRACE_TAG_NEW,              /*!< arg16:arg the 48 bit serial */
+    TRACE_TAG_LOST,             /*!< arg16:arg the 48 bit serial */
+    TRACE_COMMAND_SENT,         /*!< arg8 PlayerCommand::Type, arg the low 32 bits of the tag */
+    TRACE_COMMAND_DISPATCHED,   /*!< arg8 PlayerCommand::Type, arg us since it was sent */
+    TRACE_PLAYLIST_LOAD,        /*!< arg8 source (trace_playlist_source_t), arg16 tracks, arg us spent */
+    TRACE_PIPELINE_LINK,        /*!< arg8 decoder ElementPool::Element, arg16 1 with resampler, arg us spent */
+    TRACE_PIPELINE_RUN,         /*!< arg us spent in audio_pipeline_run() */
+    TRACE_PIPELINE_STOP,        /*!< arg us spent stopping, terminating and resetting */
+    TRACE_ELEMENT_STATUS,       /*!< arg8 ElementPool::Element, arg16 audio_element_status_t */
+    TRACE_MUSIC_INFO,           /*!< arg8 element, the decoder found the stream format */
+    TRACE_FIRST_FRAME,          /*!< arg us since start(tag) */
+    TRACE_TRACK_CHAINED,        /*!< arg16 playlist index */
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef enum {
+    TRACE_PLAYLIST_CACHE,
+    TRACE_PLAYLIST_INDEX,
+    TRACE_PLAYLIST_TEXT,
+} trace_playlist_source_t;
+
+typedef struct {
+    int64_t time_us;
+    uint32_t arg;
+    uint16_t arg16;
+    uint8_t event;          /*!< trace_event_t */
+    uint8_t arg8;
+} trace_record_t;
+
+/// Records copied per turn of the spinlock while reading
+#define TRACE_RING_READ_BATCH   16
+
+#ifdef CONFIG_TRACE_RING
+
+/// Allocate a ring of @p records. Recording before is a no-op.
+esp_err_t trace_ring_init(int records);
+
+void trace_ring_record(trace_event_t event, uint8_t arg8, uint16_t arg16, uint32_t arg);
+
+/// Copy up to @p max records, starting at sequence number @p *seq or the
+/// oldest one still in the ring if that was overwritten. Advances @p *seq
+/// past the copied records and returns how many there were. Up to
+/// TRACE_RING_READ_BATCH records have consecutive numbers, the last one
+/// @p *seq - 1; more may span a gap left by overwritten ones.
+int trace_ring_read(uint32_t *seq, trace_record_t *records, int max);
+
+/// Print the records from @p *seq on to @p out, see trace_ring_read()
+void trace_ring_print(FILE *out, uint32_t *seq);
+
+#else
+
+#define trace_ring_init(records)                        (ESP_OK)
+#define trace_ring_record(event, arg8, arg16, arg)
+#define trace_ring_read(seq, records, max)              (0)
+#define trace_ring_print(out, seq)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,199 @@
+/*  Enqueue -> dispatch latency of player commands under contention.
+
+    A producer thread sends bursts of start(tag) commands, like a figure
+    wiggled on the reader, while a noise thread floods the player's event
+    interface with element status reports. The consumer spends a simulated
+    pipeline restart on every start it dispatches. Compares
+      event    a malloc'd copy of the tag sent with audio_event_iface_sendout
+               and freed by the consumer, as the player did before
+      channel  CommandChannel + one data-less wake-up event, pending starts
+               coalesced into the last one
+    and reports the latency from sending the last start of a burst until it
+    is dispatched, and how many restarts a burst costs.
+
+    Usage: command_channel_bench [bursts] [starts per burst]
+*/
+#include "command_channel.hpp"
+
+extern "C" {
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_RESTART_US        5000    ///< stop + start of the pipeline per dispatched start
+#define BENCH_STATUS_US         50      ///< handling an element report
+#define BENCH_STATUS_PERIOD_US  200     ///< element reports arrive this often
+#define BENCH_SWAP_GAP_US       300     ///< between two starts of a burst
+#define BENCH_BURST_GAP_MS      20
+
+#define CMD_EVENT_ID            100
+#define STATUS_EVENT_ID         8
+
+static void busy(int64_t us)
+{
+    int64_t end = esp_timer_get_time() + us;
+    while (esp_timer_get_time() < end) {
+    }
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return NAN;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)std::ceil(p * values.size());
+    return values[idx > 0 ? idx - 1 : 0];
+}
+
+struct Result {
+    std::vector<double> last_us;
+    unsigned restarts = 0;
+};
+
+/// Sets up the event interfaces the way FlexiblePipeline does and runs the
+/// producer, the noise and the consumer. @p send queues a start, @p receive
+/// handles a command event and calls its second argument for every start.
+template <typename Send, typename Receive>
+static Result run(int bursts, int per_burst, Send &&send, Receive &&receive,
+                  audio_event_iface_handle_t evt, audio_event_iface_handle_t evt_cmd)
+{
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    audio_event_iface_handle_t evt_status = audio_event_iface_init(&evt_cfg);
+    audio_event_iface_set_listener(evt_status, evt);
+
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> started{0};
+    std::atomic<int64_t> started_us{0};
+    Result result;
+
+    std::thread consumer([&] {
+        audio_event_iface_msg_t msg;
+        while (!done) {
+            if (audio_event_iface_listen(evt, &msg, 10) != ESP_OK) {
+                continue;
+            }
+            if (msg.cmd == STATUS_EVENT_ID) {
+                busy(BENCH_STATUS_US);
+                continue;
+            }
+            receive(msg, [&](uint64_t tag) {
+                int64_t dispatched_us = esp_timer_get_time();
+                busy(BENCH_RESTART_US);
+                result.restarts++;
+                started_us = dispatched_us;
+                started = tag;
+            });
+        }
+    });
+    std::thread noise([&] {
+        audio_event_iface_msg_t msg = {};
+        msg.cmd = STATUS_EVENT_ID;
+        msg.source_type = AUDIO_ELEMENT_TYPE_ELEMENT;
+        while (!done) {
+            audio_event_iface_sendout(evt_status, &msg);
+            std::this_thread::sleep_for(std::chrono::microseconds(BENCH_STATUS_PERIOD_US));
+        }
+    });
+
+    uint64_t tag = 1;
+    for (int b = 0; b < bursts; b++) {
+        int64_t sent_us = 0;
+        for (int i = 0; i < per_burst; i++, tag++) {
+            sent_us = esp_timer_get_time();
+            send(tag);
+            std::this_thread::sleep_for(std::chrono::microseconds(BENCH_SWAP_GAP_US));
+        }
+        uint64_t last = tag - 1;
+        while (started != last) {
+            std::this_thread::yield();
+        }
+        result.last_us.push_back(started_us - sent_us);
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_BURST_GAP_MS));
+    }
+    done = true;
+    consumer.join();
+    noise.join();
+    audio_event_iface_remove_listener(evt, evt_status);
+    return result;
+}
+
+static void print(const char *name, const Result &result, int bursts)
+{
+    printf("%-8s %12.0f %12.0f %14.1f\n", name, percentile(result.last_us, 0.5),
+           percentile(result.last_us, 0.99), (double)result.restarts / bursts);
+}
+
+int main(int argc, char **argv)
+{
+    int bursts = argc > 1 ? atoi(argv[1]) : 50;
+    int per_burst = argc > 2 ? atoi(argv[2]) : 8;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+
+    audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    audio_event_iface_handle_t evt_cmd = audio_event_iface_init(&evt_cfg);
+    audio_event_iface_set_listener(evt_cmd, evt);
+    Result event = run(bursts, per_burst,
+        [&](uint64_t tag) {
+            std::string name = std::to_string(tag);
+            char *data = (char *)malloc(name.size() + 1);
+            strcpy(data, name.c_str());
+            audio_event_iface_msg_t msg = {};
+            msg.cmd = CMD_EVENT_ID;
+            msg.data = data;
+            msg.data_len = name.size() + 1;
+            msg.need_free_data = true;
+            audio_event_iface_sendout(evt_cmd, &msg);
+        },
+        [&](audio_event_iface_msg_t &msg, auto &&start) {
+            uint64_t tag = strtoull((char *)msg.data, NULL, 10);
+            free(msg.data);
+            start(tag);
+        }, evt, evt_cmd);
+
+    CommandChannel commands;
+    std::array<PlayerCommand, CommandChannel::CAPACITY> pending;
+    evt = audio_event_iface_init(&evt_cfg);
+    evt_cmd = audio_event_iface_init(&evt_cfg);
+    audio_event_iface_set_listener(evt_cmd, evt);
+    Result channel = run(bursts, per_burst,
+        [&](uint64_t tag) {
+            PlayerCommand command = {PlayerCommand::START, tag, 0, esp_timer_get_time()};
+            if (commands.push(command) && commands.wake()) {
+                audio_event_iface_msg_t msg = {};
+                msg.cmd = CMD_EVENT_ID;
+                audio_event_iface_sendout(evt_cmd, &msg);
+            }
+        },
+        [&](audio_event_iface_msg_t &msg, auto &&start) {
+            size_t count = commands.take(pending);
+            for (size_t i = 0; i < count; i++) {
+                start(pending[i].tag);
+            }
+        }, evt, evt_cmd);
+
+    CommandChannel::Stats stats = commands.stats();
+    printf("%d bursts of %d starts, %d us restart, element report every %d us\n", bursts, per_burst,
+           BENCH_RESTART_US, BENCH_STATUS_PERIOD_US);
+    printf("%-8s %12s %12s %14s\n", "path", "p50 [us]", "p99 [us]", "restarts/burst");
+    print("event", event, bursts);
+    print("channel", channel, bursts);
+    printf("channel: %u pushed, %u dispatched, %u coalesced, %u rejected\n", stats.pushed, stats.dispatched,
+           stats.coalesced, stats.full);
+    return 0;
+}
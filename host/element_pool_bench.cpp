@@ -0,0 +1,156 @@
+/*  Heap allocations of a decoder switch, ElementPool against the old linking.
+
+    Switches the pipeline between the mp3, aac and wav branches, with and
+    without the resampler, the way FlexiblePipeline does between two tracks:
+    stop, reset the ring buffers and elements, link the next branch. Reports
+    per switch the time and heap allocations of
+      map      std::map<std::string, handle> + a std::vector of tags built
+               per switch, as the player did before the pool, without
+               linking the branches up front
+      pool     ElementPool::link() after ElementPool::prime()
+    The fake pipeline creates an element's output ring buffer on its first
+    link, like esp-adf, so the first use of a branch shows up as well.
+
+    Usage: element_pool_bench [switches]
+*/
+#include "element_pool.hpp"
+#include "flexible_pipeline.hpp"
+#include "fake_adf.h"
+
+extern "C" {
+#include "esp_log.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> s_allocations{0};
+
+void *operator new(size_t size)
+{
+    s_allocations++;
+    if (void *p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static const ElementPool::Element decoders[] = {
+    ElementPool::MP3_DECODER, ElementPool::AAC_DECODER, ElementPool::WAV_DECODER,
+};
+
+static audio_element_handle_t create(ElementPool::Element element)
+{
+    switch (element) {
+        case ElementPool::READER:
+            return FlexiblePipeline::create_playlist_stream(NULL, NULL, NULL, NULL);
+        case ElementPool::MP3_DECODER:
+            return FlexiblePipeline::create_mp3_decoder();
+        case ElementPool::AAC_DECODER:
+            return FlexiblePipeline::create_aac_decoder();
+        case ElementPool::WAV_DECODER:
+            return FlexiblePipeline::create_wav_decoder();
+        case ElementPool::FILTER:
+            return FlexiblePipeline::create_filter_upsample(44100, 2, 48000, 2);
+        default:
+            return FlexiblePipeline::create_i2s_stream_writer(48000, 16, 2, AUDIO_STREAM_WRITER);
+    }
+}
+
+/// What stop_pipeline() does before the next branch is linked
+static void stop(audio_pipeline_handle_t pipeline)
+{
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_terminate(pipeline);
+    audio_pipeline_reset_ringbuffer(pipeline);
+    audio_pipeline_reset_elements(pipeline);
+}
+
+template <typename F>
+static void measure(const char *name, int switches, F &&f)
+{
+    size_t allocations = s_allocations;
+    size_t first = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < switches; i++) {
+        f(decoders[i % 3], (i / 3) % 2 == 0);
+        if (i == 5) {
+            // Every branch was used once
+            first = s_allocations - allocations;
+        }
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-6s %10.2f us %10.2f allocations, %zu in the first 6 switches\n", name, s * 1e6 / switches,
+           (double)(s_allocations - allocations) / switches, first);
+}
+
+int main(int argc, char **argv)
+{
+    int switches = argc > 1 ? atoi(argv[1]) : 600;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    // Only the bookkeeping is timed, not the simulated task teardown
+    fake_adf::costs().relink_us = 0;
+    fake_adf::costs().element_stop_us = 0;
+
+    {
+        audio_pipeline_cfg_t cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+        audio_pipeline_handle_t pipeline = audio_pipeline_init(&cfg);
+        std::map<const std::string, audio_element_handle_t> handle_elements;
+        for (int e = 0; e < ElementPool::ELEMENT_COUNT; e++) {
+            auto element = static_cast<ElementPool::Element>(e);
+            handle_elements[ElementPool::tag(element)] = create(element);
+            audio_pipeline_register(pipeline, handle_elements[ElementPool::tag(element)], ElementPool::tag(element));
+        }
+        std::vector<const char *> link_tags{"file_reader", "mp3_decoder", "filter", "i2s_writer"};
+        audio_pipeline_link(pipeline, link_tags.data(), link_tags.size());
+        measure("map", switches, [&](ElementPool::Element decoder, bool resample) {
+            stop(pipeline);
+            std::vector<const char *> tags{"file_reader"};
+            tags.push_back(ElementPool::tag(decoder));
+            if (resample) {
+                tags.push_back("filter");
+            }
+            tags.push_back("i2s_writer");
+            if (tags != link_tags) {
+                audio_pipeline_breakup_elements(pipeline, handle_elements[link_tags[1]]);
+                audio_pipeline_relink(pipeline, tags.data(), tags.size());
+                link_tags = tags;
+            } else {
+                audio_pipeline_link(pipeline, link_tags.data(), link_tags.size());
+            }
+        });
+    }
+
+    {
+        audio_pipeline_cfg_t cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+        audio_pipeline_handle_t pipeline = audio_pipeline_init(&cfg);
+        ElementPool elements;
+        elements.attach(pipeline);
+        for (int e = 0; e < ElementPool::ELEMENT_COUNT; e++) {
+            elements.add(static_cast<ElementPool::Element>(e), create(static_cast<ElementPool::Element>(e)));
+        }
+        elements.prime(ElementPool::MP3_DECODER);
+        measure("pool", switches, [&](ElementPool::Element decoder, bool resample) {
+            stop(pipeline);
+            elements.link(decoder, resample);
+        });
+    }
+    return 0;
+}
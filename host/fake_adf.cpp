@@ -0,0 +1,1357 @@
+/*  Host stand-in for the parts of esp-adf used by FlexiblePipeline.
+
+    See fake_adf.h for the execution model. Status reporting follows esp-adf:
+    every element reports RUNNING on run, FINISHED in link order when the
+    reader hits end of file, STOPPED when stopped before finishing, and the
+    pipeline has to be stopped and terminated before it can run again.
+*/
+#include "fake_adf.h"
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "audio_pipeline.h"
+#include "fatfs_stream.h"
+#include "i2s_stream.h"
+#include "mp3_decoder.h"
+#include "aac_decoder.h"
+#include "wav_decoder.h"
+#include "filter_resample.h"
+#include "audio_mutex.h"
+#include "format_probe.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *TAG = "FAKE_ADF";
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    if (strcmp(tag, "*") == 0) {
+        host_log_level = level;
+    }
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return fake_adf::now_us();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t period_us = 0;         ///< 0 while stopped
+    bool quit = false;
+    std::thread thread;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!quit) {
+            if (period_us == 0) {
+                cv.wait(lock);
+                continue;
+            }
+            uint64_t period = period_us;
+            if (cv.wait_for(lock, std::chrono::microseconds(period)) == std::cv_status::no_timeout) {
+                continue;
+            }
+            lock.unlock();
+            args.callback(args.arg);
+            lock.lock();
+        }
+    }
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    auto *timer = new esp_timer;
+    timer->args = *create_args;
+    timer->thread = std::thread([timer] { timer->run(); });
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        timer->period_us = period;
+    }
+    timer->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    return esp_timer_start_periodic(timer, 0);
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        timer->quit = true;
+    }
+    timer->cv.notify_all();
+    timer->thread.join();
+    delete timer;
+    return ESP_OK;
+}
+
+namespace fake_adf {
+
+static FakeAdfCosts s_costs;
+static std::mutex s_i2s_mutex;
+static std::condition_variable s_i2s_cv;
+static FakeI2sStats s_i2s;
+static std::mutex s_cpu_mutex;
+static FakeCpuStats s_cpu;
+static std::mutex s_card_mutex;
+static FakeCardStats s_card;
+/// End of the audio already handed to the DMA, -1 while the clock is stopped
+static int64_t s_clock_end_us = -1;
+/// End of the audio queued to the "DMA", unlike the play clock not reset by mark()
+static int64_t s_queued_end_us = -1;
+
+FakeAdfCosts &costs()
+{
+    return s_costs;
+}
+
+static std::atomic<int64_t> s_clock_offset_us{0};
+
+int64_t now_us()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count() + s_clock_offset_us;
+}
+
+void advance_clock(int64_t us)
+{
+    s_clock_offset_us += us;
+}
+
+static void spend(int64_t us)
+{
+    if (us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+void mark()
+{
+    std::lock_guard<std::mutex> lock(s_i2s_mutex);
+    bool active = s_i2s.active;
+    bool paused = s_i2s.paused;
+    int rate = s_i2s.rate;
+    s_i2s = FakeI2sStats{};
+    s_i2s.active = active;
+    s_i2s.paused = paused;
+    s_i2s.rate = rate;
+    s_clock_end_us = -1;
+    std::lock_guard<std::mutex> cpu_lock(s_cpu_mutex);
+    s_cpu = FakeCpuStats{};
+    std::lock_guard<std::mutex> card_lock(s_card_mutex);
+    s_card = FakeCardStats{};
+}
+
+FakeCardStats card_stats()
+{
+    std::lock_guard<std::mutex> lock(s_card_mutex);
+    return s_card;
+}
+
+static void count_open(int64_t us)
+{
+    std::lock_guard<std::mutex> lock(s_card_mutex);
+    s_card.opens++;
+    s_card.open_us += us;
+}
+
+static void count_stat(int64_t us)
+{
+    std::lock_guard<std::mutex> lock(s_card_mutex);
+    s_card.stats++;
+    s_card.stat_us += us;
+}
+
+static void count_read(size_t bytes, int64_t us)
+{
+    std::lock_guard<std::mutex> lock(s_card_mutex);
+    s_card.reads++;
+    s_card.bytes += bytes;
+    s_card.read_us += us;
+}
+
+static void count_write(size_t bytes, int64_t us)
+{
+    std::lock_guard<std::mutex> lock(s_card_mutex);
+    s_card.writes++;
+    s_card.write_bytes += bytes;
+    s_card.write_us += us;
+}
+
+FakeCpuStats cpu_stats()
+{
+    std::lock_guard<std::mutex> lock(s_cpu_mutex);
+    return s_cpu;
+}
+
+/// Spend @p us of CPU time in a decoder or resampler
+static void compute(int64_t FakeCpuStats::*counter, int64_t us)
+{
+    {
+        std::lock_guard<std::mutex> lock(s_cpu_mutex);
+        s_cpu.*counter += us;
+    }
+    spend(us);
+}
+
+FakeI2sStats i2s_stats()
+{
+    std::lock_guard<std::mutex> lock(s_i2s_mutex);
+    return s_i2s;
+}
+
+bool wait_i2s(const std::function<bool(const FakeI2sStats &)> &pred, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(s_i2s_mutex);
+    return s_i2s_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return pred(s_i2s); });
+}
+
+template <typename F>
+static void update_i2s(F &&f)
+{
+    {
+        std::lock_guard<std::mutex> lock(s_i2s_mutex);
+        f(s_i2s);
+    }
+    s_i2s_cv.notify_all();
+}
+
+/// Hand @p frames to the "DMA" and block while the writer is ahead of the play clock.
+static void i2s_play(int frames, int rate)
+{
+    int64_t sleep_until = 0;
+    update_i2s([&](FakeI2sStats &st) {
+        int64_t now = now_us();
+        if (s_clock_end_us < 0) {
+            s_clock_end_us = now;
+        } else if (now > s_clock_end_us) {
+            int64_t gap = now - s_clock_end_us;
+            st.gaps_us.push_back(gap);
+            st.underrun_frames += gap * rate / 1000000;
+            s_clock_end_us = now;
+        }
+        if (st.first_frame_us < 0) {
+            st.first_frame_us = now;
+        }
+        if (st.track_first_frame_us < 0) {
+            st.track_first_frame_us = now;
+        }
+        st.last_frame_us = now;
+        st.frames += frames;
+        st.rate = rate;
+        s_clock_end_us += (int64_t)frames * 1000000 / rate;
+        s_queued_end_us = s_clock_end_us;
+        sleep_until = s_clock_end_us - s_costs.dma_buffer_us;
+    });
+    spend(sleep_until - now_us());
+}
+
+/// How far the writer is ahead of the play clock, 0 when starved
+static int64_t i2s_lead_us()
+{
+    std::lock_guard<std::mutex> lock(s_i2s_mutex);
+    int64_t lead = s_queued_end_us - now_us();
+    return lead < 0 ? 0 : lead;
+}
+
+} // namespace fake_adf
+
+using fake_adf::spend;
+
+/* ------------------------------------------------------------ sd card */
+
+/* fopen/fread/fwrite are wrapped at link time (-Wl,--wrap) so every reader
+ * and writer, fake or real, pays the same SD card costs. */
+
+/// Wait out the window in which the card is held by someone else, if @p now is in it
+static void wait_card_busy(const FakeAdfCosts &costs, int64_t now)
+{
+    if (costs.card_busy_us > 0 && costs.card_busy_period_ms > 0) {
+        // Busy once per period, the window start is a hash of the period number
+        int64_t period = (int64_t)costs.card_busy_period_ms * 1000;
+        int64_t k = now / period;
+        uint64_t hash = (uint64_t)(k + 1) * 0x9e3779b97f4a7c15ULL >> 33;
+        int64_t start = k * period + (int64_t)(hash % std::max<int64_t>(period - costs.card_busy_us, 1));
+        if (now >= start && now < start + costs.card_busy_us) {
+            spend(start + costs.card_busy_us - now);
+        }
+    }
+}
+
+/// One card on one SD host, accesses from different threads take turns
+static std::mutex s_sd_host_mutex;
+
+extern "C" {
+FILE *__real_fopen(const char *path, const char *mode);
+size_t __real_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+size_t __real_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+int __real_stat(const char *path, struct stat *st);
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+    std::unique_lock<std::mutex> card(s_sd_host_mutex);
+    int64_t now = fake_adf::now_us();
+    spend(fake_adf::costs().file_open_us);
+    FILE *file = __real_fopen(path, mode);
+    card.unlock();
+    fake_adf::count_open(fake_adf::now_us() - now);
+    return file;
+}
+
+int __wrap_stat(const char *path, struct stat *st)
+{
+    std::unique_lock<std::mutex> card(s_sd_host_mutex);
+    int64_t now = fake_adf::now_us();
+    spend(fake_adf::costs().stat_us);
+    int ret = __real_stat(path, st);
+    card.unlock();
+    fake_adf::count_stat(fake_adf::now_us() - now);
+    return ret;
+}
+
+size_t __wrap_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    const FakeAdfCosts &costs = fake_adf::costs();
+    std::unique_lock<std::mutex> card(s_sd_host_mutex);
+    int64_t now = fake_adf::now_us();
+    wait_card_busy(costs, now);
+    size_t n = __real_fread(ptr, size, nmemb, stream);
+    int64_t jitter = 0;
+    if (costs.read_jitter_us > 0) {
+        static thread_local std::minstd_rand rng(1);
+        jitter = rng() % (costs.read_jitter_us + 1);
+    }
+    spend(costs.read_call_us + jitter + (int64_t)(n * size) * costs.read_us_per_kb / 1024);
+    card.unlock();
+    fake_adf::count_read(n * size, fake_adf::now_us() - now);
+    return n;
+}
+
+size_t __wrap_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    const FakeAdfCosts &costs = fake_adf::costs();
+    std::unique_lock<std::mutex> card(s_sd_host_mutex);
+    int64_t now = fake_adf::now_us();
+    wait_card_busy(costs, now);
+    size_t n = __real_fwrite(ptr, size, nmemb, stream);
+    int64_t bytes = (int64_t)(n * size);
+    // The card stalls once in every allocation unit it crosses
+    uint64_t written;
+    {
+        static std::mutex mutex;
+        static uint64_t total;
+        std::lock_guard<std::mutex> lock(mutex);
+        written = total;
+        total += bytes;
+    }
+    int64_t stalls = costs.write_stall_every_kb > 0
+        ? (int64_t)((written + bytes) / (costs.write_stall_every_kb * 1024ULL) - written / (costs.write_stall_every_kb * 1024ULL))
+        : 0;
+    spend(costs.write_call_us + bytes * costs.write_us_per_kb / 1024 + stalls * costs.write_stall_us);
+    card.unlock();
+    fake_adf::count_write(bytes, fake_adf::now_us() - now);
+    return n;
+}
+}
+
+/* ------------------------------------------------------------- freertos */
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    std::thread(fn, arg).detach();
+    if (handle) {
+        *handle = NULL;
+    }
+    return pdPASS;
+}
+
+static std::mutex s_critical_mutex;
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    s_critical_mutex.lock();
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    s_critical_mutex.unlock();
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // Tasks never return on target, the host thread simply ends
+    pthread_exit(NULL);
+}
+
+struct fake_semaphore {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool given = false;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return new fake_semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    auto *sem = new fake_semaphore;
+    sem->given = true;
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks)
+{
+    auto *sem = (fake_semaphore *)handle;
+    std::unique_lock<std::mutex> lock(sem->mutex);
+    auto given = [sem] { return sem->given; };
+    if (ticks == portMAX_DELAY) {
+        sem->cv.wait(lock, given);
+    } else if (!sem->cv.wait_for(lock, std::chrono::milliseconds(ticks), given)) {
+        return pdFALSE;
+    }
+    sem->given = false;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    auto *sem = (fake_semaphore *)handle;
+    {
+        std::lock_guard<std::mutex> lock(sem->mutex);
+        if (sem->given) {
+            return pdFALSE;
+        }
+        sem->given = true;
+        // Under the lock, the woken task may delete the semaphore right away
+        sem->cv.notify_one();
+    }
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle)
+{
+    delete (fake_semaphore *)handle;
+}
+
+struct fake_queue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    auto *queue = new fake_queue;
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t ticks)
+{
+    auto *queue = (fake_queue *)handle;
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    auto room = [queue] { return queue->items.size() < queue->length; };
+    if (ticks == portMAX_DELAY) {
+        queue->cv.wait(lock, room);
+    } else if (!queue->cv.wait_for(lock, std::chrono::milliseconds(ticks), room)) {
+        return pdFALSE;
+    }
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks)
+{
+    auto *queue = (fake_queue *)handle;
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    auto waiting = [queue] { return !queue->items.empty(); };
+    if (ticks == portMAX_DELAY) {
+        queue->cv.wait(lock, waiting);
+    } else if (!queue->cv.wait_for(lock, std::chrono::milliseconds(ticks), waiting)) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+    auto *queue = (fake_queue *)handle;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->items.size();
+}
+
+void vQueueDelete(QueueHandle_t handle)
+{
+    delete (fake_queue *)handle;
+}
+
+void *mutex_create(void)
+{
+    return new std::mutex;
+}
+
+int mutex_destroy(void *mutex)
+{
+    delete (std::mutex *)mutex;
+    return 0;
+}
+
+int mutex_lock(void *mutex)
+{
+    ((std::mutex *)mutex)->lock();
+    return 0;
+}
+
+int mutex_unlock(void *mutex)
+{
+    ((std::mutex *)mutex)->unlock();
+    return 0;
+}
+
+/* ---------------------------------------------------------------- events */
+
+struct audio_event_iface {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<audio_event_iface_msg_t> queue;
+    std::vector<audio_event_iface *> listeners;
+
+    void push(const audio_event_iface_msg_t &msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(msg);
+        }
+        cv.notify_one();
+    }
+};
+
+audio_event_iface_handle_t audio_event_iface_init(audio_event_iface_cfg_t *config)
+{
+    return new audio_event_iface;
+}
+
+esp_err_t audio_event_iface_destroy(audio_event_iface_handle_t evt)
+{
+    delete evt;
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_set_listener(audio_event_iface_handle_t evt, audio_event_iface_handle_t listener)
+{
+    std::lock_guard<std::mutex> lock(evt->mutex);
+    evt->listeners.push_back(listener);
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_remove_listener(audio_event_iface_handle_t listen, audio_event_iface_handle_t evt)
+{
+    std::lock_guard<std::mutex> lock(evt->mutex);
+    for (auto it = evt->listeners.begin(); it != evt->listeners.end(); ++it) {
+        if (*it == listen) {
+            evt->listeners.erase(it);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t audio_event_iface_sendout(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg)
+{
+    std::vector<audio_event_iface *> listeners;
+    {
+        std::lock_guard<std::mutex> lock(evt->mutex);
+        listeners = evt->listeners;
+    }
+    for (auto *l : listeners) {
+        l->push(*msg);
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_listen(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg, TickType_t wait_time)
+{
+    std::unique_lock<std::mutex> lock(evt->mutex);
+    auto ready = [evt] { return !evt->queue.empty(); };
+    if (wait_time == portMAX_DELAY) {
+        evt->cv.wait(lock, ready);
+    } else if (!evt->cv.wait_for(lock, std::chrono::milliseconds(wait_time), ready)) {
+        return ESP_FAIL;
+    }
+    *msg = evt->queue.front();
+    evt->queue.pop_front();
+    return ESP_OK;
+}
+
+/* -------------------------------------------------------------- elements */
+
+enum class FakeKind {
+    CUSTOM,
+    FATFS_READER,
+    DECODER,
+    RESAMPLER,
+    I2S_WRITER,
+};
+
+/* Chunks go from element to element directly, nothing waits in between.
+ * Only the ring in front of the i2s writer reports a fill: what the writer
+ * has queued ahead of the play clock. */
+struct ringbuf {
+    audio_element *writer;
+};
+
+struct audio_element {
+    audio_element_cfg_t cfg;
+    FakeKind kind = FakeKind::CUSTOM;
+    std::string tag;
+    std::string uri;
+    audio_element_info_t info = {};
+    audio_element_state_t state = AEL_STATE_INIT;
+    audio_event_iface_handle_t listener = NULL;
+
+    audio_element *next = NULL;         ///< downstream element while linked
+    audio_element *prev = NULL;         ///< upstream element while linked
+    ringbuf out_rb = {this};
+    const char *in_buf = NULL;          ///< data pushed by the upstream element
+    int in_len = 0;
+    std::vector<char> work;             ///< process buffer
+
+    FILE *file = NULL;                  ///< FATFS_READER only
+    int dest_rate = 0;                  ///< RESAMPLER only
+    int dest_ch = 0;
+    bool info_reported = false;         ///< DECODER only
+};
+
+static void report(audio_element_handle_t el, int cmd, void *data)
+{
+    if (el->listener == NULL) {
+        return;
+    }
+    audio_event_iface_msg_t msg = {
+        .cmd = cmd,
+        .data = data,
+        .data_len = 0,
+        .source = (void *)el,
+        .source_type = AUDIO_ELEMENT_TYPE_ELEMENT,
+        .need_free_data = false,
+    };
+    el->listener->push(msg);
+}
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t *config)
+{
+    auto *el = new audio_element;
+    el->cfg = *config;
+    el->tag = config->tag ? config->tag : "unknown";
+    el->work.resize(config->buffer_len > 0 ? config->buffer_len : DEFAULT_ELEMENT_BUFFER_LENGTH);
+    el->info.sample_rates = 44100;
+    el->info.channels = 2;
+    el->info.bits = 16;
+    return el;
+}
+
+esp_err_t audio_element_deinit(audio_element_handle_t el)
+{
+    if (el->cfg.destroy) {
+        el->cfg.destroy(el);
+    }
+    delete el;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_setdata(audio_element_handle_t el, void *data)
+{
+    el->cfg.data = data;
+    return ESP_OK;
+}
+
+void *audio_element_getdata(audio_element_handle_t el)
+{
+    return el->cfg.data;
+}
+
+esp_err_t audio_element_set_tag(audio_element_handle_t el, const char *tag)
+{
+    el->tag = tag;
+    return ESP_OK;
+}
+
+char *audio_element_get_tag(audio_element_handle_t el)
+{
+    return (char *)el->tag.c_str();
+}
+
+esp_err_t audio_element_setinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    el->info = *info;
+    el->info.uri = NULL;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_getinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    *info = el->info;
+    info->uri = (char *)el->uri.c_str();
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_music_info(audio_element_handle_t el, int sample_rates, int channels, int bits)
+{
+    el->info.sample_rates = sample_rates;
+    el->info.channels = channels;
+    el->info.bits = bits;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_uri(audio_element_handle_t el, const char *uri)
+{
+    el->uri = uri ? uri : "";
+    return ESP_OK;
+}
+
+char *audio_element_get_uri(audio_element_handle_t el)
+{
+    return (char *)el->uri.c_str();
+}
+
+esp_err_t audio_element_set_byte_pos(audio_element_handle_t el, int64_t byte_pos)
+{
+    el->info.byte_pos = byte_pos;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_update_byte_pos(audio_element_handle_t el, int pos)
+{
+    el->info.byte_pos += pos;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_total_bytes(audio_element_handle_t el, int64_t total_bytes)
+{
+    el->info.total_bytes = total_bytes;
+    return ESP_OK;
+}
+
+audio_element_state_t audio_element_get_state(audio_element_handle_t el)
+{
+    return el->state;
+}
+
+esp_err_t audio_element_reset_state(audio_element_handle_t el)
+{
+    el->state = AEL_STATE_INIT;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_report_status(audio_element_handle_t el, audio_element_status_t status)
+{
+    report(el, AEL_MSG_CMD_REPORT_STATUS, (void *)(intptr_t)status);
+    return ESP_OK;
+}
+
+ringbuf_handle_t audio_element_get_input_ringbuf(audio_element_handle_t el)
+{
+    return el->prev ? &el->prev->out_rb : NULL;
+}
+
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el)
+{
+    return el->next ? &el->out_rb : NULL;
+}
+
+int rb_get_size(ringbuf_handle_t rb)
+{
+    return rb->writer->cfg.out_rb_size;
+}
+
+int rb_bytes_filled(ringbuf_handle_t rb)
+{
+    audio_element *i2s = rb->writer->next;
+    if (i2s == NULL || i2s->kind != FakeKind::I2S_WRITER) {
+        return 0;
+    }
+    int64_t bytes = fake_adf::i2s_lead_us() * i2s->info.sample_rates / 1000000 * i2s->info.channels * i2s->info.bits / 8;
+    return bytes < rb_get_size(rb) ? (int)bytes : rb_get_size(rb);
+}
+
+esp_err_t audio_element_report_info(audio_element_handle_t el)
+{
+    report(el, AEL_MSG_CMD_REPORT_MUSIC_INFO, NULL);
+    return ESP_OK;
+}
+
+audio_element_err_t audio_element_input(audio_element_handle_t el, char *buffer, int wanted_size)
+{
+    if (el->cfg.read) {
+        return el->cfg.read(el, buffer, wanted_size, portMAX_DELAY, NULL);
+    }
+    int n = wanted_size < el->in_len ? wanted_size : el->in_len;
+    memcpy(buffer, el->in_buf, n);
+    el->in_buf += n;
+    el->in_len -= n;
+    return (audio_element_err_t)n;
+}
+
+audio_element_err_t audio_element_output(audio_element_handle_t el, char *buffer, int write_size)
+{
+    if (el->cfg.write) {
+        return el->cfg.write(el, buffer, write_size, portMAX_DELAY, NULL);
+    }
+    audio_element *next = el->next;
+    if (next == NULL) {
+        return (audio_element_err_t)write_size;
+    }
+    next->in_buf = buffer;
+    next->in_len = write_size;
+    while (next->in_len > 0) {
+        int r = next->cfg.process(next, next->work.data(), next->work.size());
+        if (r <= 0) {
+            return (audio_element_err_t)r;
+        }
+    }
+    return (audio_element_err_t)write_size;
+}
+
+/* Generic stream process, the same shape as the esp-adf stream elements. */
+static audio_element_err_t fake_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r > 0) {
+        return audio_element_output(self, in_buffer, r);
+    }
+    return r == 0 ? AEL_IO_DONE : (audio_element_err_t)r;
+}
+
+static esp_err_t fatfs_open(audio_element_handle_t self)
+{
+    self->file = fopen(self->uri.c_str(), "rb");
+    if (self->file == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s", self->uri.c_str());
+        return ESP_FAIL;
+    }
+    fseek(self->file, 0, SEEK_END);
+    self->info.total_bytes = ftell(self->file);
+    if (self->info.byte_pos > 0) {
+        fseek(self->file, self->info.byte_pos, SEEK_SET);
+    } else {
+        fseek(self->file, 0, SEEK_SET);
+    }
+    return ESP_OK;
+}
+
+static audio_element_err_t fatfs_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    int n = fread(buffer, 1, len, self->file);
+    self->info.byte_pos += n;
+    return (audio_element_err_t)n;
+}
+
+static esp_err_t fatfs_close(audio_element_handle_t self)
+{
+    if (self->file) {
+        fclose(self->file);
+        self->file = NULL;
+    }
+    self->info.byte_pos = 0;
+    return ESP_OK;
+}
+
+static audio_element_err_t decoder_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0) {
+        return (audio_element_err_t)r;
+    }
+    fake_adf::compute(&FakeCpuStats::decode_us, (int64_t)r * fake_adf::costs().decode_us_per_kb / 1024);
+    if (!self->info_reported) {
+        // Like the real decoders, learn the format from the first frame
+        format_probe_info_t format;
+        if (format_probe_buffer((const uint8_t *)in_buffer, r, &format) != FORMAT_PROBE_UNKNOWN
+            && format.sample_rate > 0 && format.channels > 0) {
+            audio_element_set_music_info(self, format.sample_rate, format.channels, format.bits);
+        }
+        self->info_reported = true;
+        audio_element_report_info(self);
+    }
+    return audio_element_output(self, in_buffer, r);
+}
+
+static esp_err_t decoder_open(audio_element_handle_t self)
+{
+    spend(fake_adf::costs().decoder_open_us);
+    self->info_reported = false;
+    return ESP_OK;
+}
+
+static audio_element_err_t resampler_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0) {
+        return (audio_element_err_t)r;
+    }
+    fake_adf::compute(&FakeCpuStats::resample_us, (int64_t)r * fake_adf::costs().resample_us_per_kb / 1024);
+    int64_t out = (int64_t)r * self->dest_rate * self->dest_ch / self->info.sample_rates / self->info.channels;
+    out -= out % 4;
+    static thread_local std::vector<char> scaled;
+    scaled.assign(out, 0);
+    return audio_element_output(self, scaled.data(), out) > 0 ? (audio_element_err_t)r : AEL_IO_FAIL;
+}
+
+static audio_element_err_t i2s_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r = audio_element_input(self, in_buffer, in_len);
+    if (r <= 0) {
+        return (audio_element_err_t)r;
+    }
+    int frame_bytes = self->info.channels * self->info.bits / 8;
+    fake_adf::i2s_play(r / frame_bytes, self->info.sample_rates);
+    return (audio_element_err_t)r;
+}
+
+static audio_element_handle_t fake_element(FakeKind kind, const char *tag, int buffer_len,
+                                           int out_rb_size = DEFAULT_ELEMENT_RINGBUF_SIZE)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.tag = tag;
+    cfg.buffer_len = buffer_len;
+    cfg.out_rb_size = out_rb_size;
+    switch (kind) {
+        case FakeKind::FATFS_READER:
+            cfg.open = fatfs_open;
+            cfg.read = fatfs_read;
+            cfg.close = fatfs_close;
+            cfg.process = fake_process;
+            break;
+        case FakeKind::DECODER:
+            cfg.open = decoder_open;
+            cfg.process = decoder_process;
+            break;
+        case FakeKind::RESAMPLER:
+            cfg.process = resampler_process;
+            break;
+        case FakeKind::I2S_WRITER:
+            cfg.process = i2s_process;
+            break;
+        case FakeKind::CUSTOM:
+            break;
+    }
+    audio_element_handle_t el = audio_element_init(&cfg);
+    el->kind = kind;
+    return el;
+}
+
+audio_element_handle_t fatfs_stream_init(fatfs_stream_cfg_t *config)
+{
+    return fake_element(FakeKind::FATFS_READER, "file", config->buf_sz, config->out_rb_size);
+}
+
+audio_element_handle_t mp3_decoder_init(mp3_decoder_cfg_t *config)
+{
+    return fake_element(FakeKind::DECODER, "mp3", 2 * 1024, config->out_rb_size);
+}
+
+audio_element_handle_t aac_decoder_init(aac_decoder_cfg_t *config)
+{
+    return fake_element(FakeKind::DECODER, "aac", 2 * 1024, config->out_rb_size);
+}
+
+audio_element_handle_t wav_decoder_init(wav_decoder_cfg_t *config)
+{
+    return fake_element(FakeKind::DECODER, "wav", 2 * 1024, config->out_rb_size);
+}
+
+audio_element_handle_t rsp_filter_init(rsp_filter_cfg_t *config)
+{
+    audio_element_handle_t el = fake_element(FakeKind::RESAMPLER, "filter", config->max_indata_bytes, config->out_rb_size);
+    el->info.sample_rates = config->src_rate;
+    el->info.channels = config->src_ch;
+    el->dest_rate = config->dest_rate;
+    el->dest_ch = config->dest_ch;
+    return el;
+}
+
+esp_err_t rsp_filter_set_src_info(audio_element_handle_t self, int src_rate, int src_ch)
+{
+    self->info.sample_rates = src_rate;
+    self->info.channels = src_ch;
+    return ESP_OK;
+}
+
+audio_element_handle_t i2s_stream_init(i2s_stream_cfg_t *config)
+{
+    return fake_element(FakeKind::I2S_WRITER, "iis", config->buffer_len);
+}
+
+esp_err_t i2s_stream_set_clk(audio_element_handle_t i2s_stream, int rate, int bits, int ch)
+{
+    return audio_element_set_music_info(i2s_stream, rate, ch, bits);
+}
+
+/* -------------------------------------------------------------- pipeline */
+
+struct audio_pipeline {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::string, audio_element *> registered;
+    std::vector<audio_element *> linked;
+    /// Output ring buffer of every element that was ever linked. As in
+    /// esp-adf it is created on the first link and reused by every relink.
+    std::map<audio_element *, std::vector<char>> ringbufs;
+    audio_event_iface_handle_t listener = NULL;
+    audio_element_state_t state = AEL_STATE_INIT;
+
+    bool run_requested = false;
+    bool stop_requested = false;
+    bool pause_requested = false;
+    bool busy = false;
+    bool parked = false;
+    std::thread worker;
+
+    void work();
+    void play(const std::vector<audio_element *> &chain);
+};
+
+static void set_active(bool active)
+{
+    fake_adf::update_i2s([&](FakeI2sStats &st) {
+        st.active = active;
+        // As audio_pipeline_reset_ringbuffer() does after a stop
+        fake_adf::s_queued_end_us = -1;
+        if (active) {
+            st.tracks_started++;
+            st.track_first_frame_us = -1;
+        }
+    });
+}
+
+void audio_pipeline::play(const std::vector<audio_element *> &chain)
+{
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain[i]->next = (i + 1 < chain.size()) ? chain[i + 1] : NULL;
+        chain[i]->state = AEL_STATE_RUNNING;
+        if (chain[i]->cfg.open && chain[i]->cfg.open(chain[i]) != ESP_OK) {
+            audio_element_report_status(chain[i], AEL_STATUS_ERROR_OPEN);
+            for (auto *el : chain) {
+                el->state = AEL_STATE_ERROR;
+            }
+            return;
+        }
+        audio_element_report_status(chain[i], AEL_STATUS_STATE_RUNNING);
+    }
+    set_active(true);
+
+    audio_element *reader = chain.front();
+    bool stopped = false;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (pause_requested && !stop_requested) {
+                parked = true;
+                fake_adf::update_i2s([](FakeI2sStats &st) {
+                    // Pausing drains the DMA on purpose, that is not an underrun
+                    st.paused = true;
+                    st.paused_us = fake_adf::now_us();
+                    fake_adf::s_clock_end_us = -1;
+                    fake_adf::s_queued_end_us = -1;
+                });
+                cv.notify_all();
+                cv.wait(lock, [this] { return !pause_requested || stop_requested; });
+                parked = false;
+                fake_adf::update_i2s([](FakeI2sStats &st) { st.paused = false; });
+            }
+            if (stop_requested) {
+                stopped = true;
+                break;
+            }
+        }
+        int r = reader->cfg.process(reader, reader->work.data(), reader->work.size());
+        if (r <= 0) {
+            break;
+        }
+    }
+
+    for (auto *el : chain) {
+        if (el->cfg.close) {
+            el->cfg.close(el);
+        }
+        if (stopped) {
+            el->state = AEL_STATE_STOPPED;
+            audio_element_report_status(el, AEL_STATUS_STATE_STOPPED);
+        } else {
+            el->state = AEL_STATE_FINISHED;
+            audio_element_report_status(el, AEL_STATUS_STATE_FINISHED);
+        }
+    }
+    set_active(false);
+}
+
+void audio_pipeline::work()
+{
+    while (true) {
+        std::vector<audio_element *> chain;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return run_requested; });
+            run_requested = false;
+            chain = linked;
+        }
+        if (!chain.empty()) {
+            play(chain);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = false;
+        }
+        cv.notify_all();
+    }
+}
+
+audio_pipeline_handle_t audio_pipeline_init(audio_pipeline_cfg_t *config)
+{
+    auto *pipeline = new audio_pipeline;
+    pipeline->worker = std::thread([pipeline] { pipeline->work(); });
+    pipeline->worker.detach();
+    return pipeline;
+}
+
+esp_err_t audio_pipeline_deinit(audio_pipeline_handle_t pipeline)
+{
+    // The worker thread is detached and parked; it is reclaimed at exit.
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_register(audio_pipeline_handle_t pipeline, audio_element_handle_t el, const char *name)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    el->tag = name;
+    pipeline->registered[name] = el;
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_unregister(audio_pipeline_handle_t pipeline, audio_element_handle_t el)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    pipeline->registered.erase(el->tag);
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_link(audio_pipeline_handle_t pipeline, const char *link_tag[], int link_num)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    if (!pipeline->linked.empty()) {
+        ESP_LOGD(TAG, "Pipeline already linked");
+        return ESP_OK;
+    }
+    for (int i = 0; i < link_num; i++) {
+        auto it = pipeline->registered.find(link_tag[i]);
+        if (it == pipeline->registered.end()) {
+            ESP_LOGE(TAG, "There is 1 link_tag invalid: %s", link_tag[i]);
+            pipeline->linked.clear();
+            return ESP_FAIL;
+        }
+        audio_element *el = it->second;
+        el->prev = i > 0 ? pipeline->linked.back() : NULL;
+        el->next = NULL;
+        if (el->prev) {
+            el->prev->next = el;
+        }
+        pipeline->linked.push_back(el);
+        if (i + 1 < link_num && pipeline->ringbufs.find(it->second) == pipeline->ringbufs.end()) {
+            pipeline->ringbufs[it->second].resize(it->second->cfg.out_rb_size);
+        }
+    }
+    spend(fake_adf::costs().relink_us);
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_unlink(audio_pipeline_handle_t pipeline)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    pipeline->linked.clear();
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_breakup_elements(audio_pipeline_handle_t pipeline, audio_element_handle_t kept_ctx_el)
+{
+    return audio_pipeline_unlink(pipeline);
+}
+
+esp_err_t audio_pipeline_relink(audio_pipeline_handle_t pipeline, const char *link_tag[], int link_num)
+{
+    audio_pipeline_unlink(pipeline);
+    return audio_pipeline_link(pipeline, link_tag, link_num);
+}
+
+esp_err_t audio_pipeline_run(audio_pipeline_handle_t pipeline)
+{
+    size_t n;
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        if (pipeline->state != AEL_STATE_INIT) {
+            ESP_LOGW(TAG, "Pipeline already started, state:%d", pipeline->state);
+            return ESP_OK;
+        }
+        n = pipeline->linked.size();
+    }
+    // Element tasks are created synchronously by the caller, as on target
+    spend((int64_t)n * fake_adf::costs().element_start_us);
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        pipeline->state = AEL_STATE_RUNNING;
+        pipeline->stop_requested = false;
+        pipeline->pause_requested = false;
+        pipeline->run_requested = true;
+        pipeline->busy = true;
+    }
+    pipeline->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_stop(audio_pipeline_handle_t pipeline)
+{
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        pipeline->stop_requested = true;
+    }
+    pipeline->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_wait_for_stop(audio_pipeline_handle_t pipeline)
+{
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    pipeline->cv.wait(lock, [pipeline] { return !pipeline->busy; });
+    pipeline->state = AEL_STATE_INIT;
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_terminate(audio_pipeline_handle_t pipeline)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    // Element tasks are deleted here and recreated by the next run
+    spend((int64_t)pipeline->linked.size() * fake_adf::costs().element_stop_us);
+    pipeline->state = AEL_STATE_INIT;
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_pause(audio_pipeline_handle_t pipeline)
+{
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    if (pipeline->state != AEL_STATE_RUNNING) {
+        return ESP_OK;
+    }
+    pipeline->pause_requested = true;
+    pipeline->state = AEL_STATE_PAUSED;
+    pipeline->cv.notify_all();
+    pipeline->cv.wait(lock, [pipeline] { return pipeline->parked || !pipeline->busy; });
+    for (auto *el : pipeline->linked) {
+        el->state = AEL_STATE_PAUSED;
+        audio_element_report_status(el, AEL_STATUS_STATE_PAUSED);
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_resume(audio_pipeline_handle_t pipeline)
+{
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        if (pipeline->state != AEL_STATE_PAUSED) {
+            return ESP_OK;
+        }
+        pipeline->pause_requested = false;
+        pipeline->state = AEL_STATE_RUNNING;
+        for (auto *el : pipeline->linked) {
+            el->state = AEL_STATE_RUNNING;
+            audio_element_report_status(el, AEL_STATUS_STATE_RUNNING);
+        }
+    }
+    pipeline->cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_reset_ringbuffer(audio_pipeline_handle_t pipeline)
+{
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_reset_elements(audio_pipeline_handle_t pipeline)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    for (auto &it : pipeline->registered) {
+        it.second->state = AEL_STATE_INIT;
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_set_listener(audio_pipeline_handle_t pipeline, audio_event_iface_handle_t evt)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    pipeline->listener = evt;
+    for (auto &it : pipeline->registered) {
+        it.second->listener = evt;
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_pipeline_remove_listener(audio_pipeline_handle_t pipeline)
+{
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    pipeline->listener = NULL;
+    for (auto &it : pipeline->registered) {
+        it.second->listener = NULL;
+    }
+    return ESP_OK;
+}
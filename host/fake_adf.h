@@ -0,0 +1,101 @@
+#pragma once
+
+/* Host-only knobs and probes for the fake esp-adf in fake_adf.cpp.
+
+   The fake runs every linked pipeline on one worker thread and pushes each
+   chunk synchronously through reader -> decoder -> filter -> i2s writer.
+   Elements are timed: they sleep for the configured costs so the host
+   numbers keep the shape of the ESP32 ones. Fake decoders take the music
+   info from the frame headers with the player's own format probe. The i2s
+   writer paces itself against a play clock and counts the frames of
+   silence it would have played whenever it is starved. SD card costs are charged by fopen/fread/fwrite,
+   which are wrapped at link time, so real readers and writers pay them
+   too. An access that falls into a window where the card is busy waits
+   for its end, accesses from different threads take turns.
+   FreeRTOS tasks are detached threads, binary semaphores sit on a
+   condition variable, periodic esp_timers tick on a thread each. Of the
+   ring buffers only the one in front of the i2s writer has a fill level,
+   the audio the writer queued ahead of the play clock. */
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+/// Costs charged by the fake elements, in microseconds.
+/// Defaults are rough ESP32-LyraT figures.
+struct FakeAdfCosts {
+    int element_start_us = 4000;    ///< task spawn + open, per element on run
+    int element_stop_us = 3000;     ///< task teardown, per element on stop
+    int file_open_us = 12000;       ///< FAT lookup + open on the SD card
+    int stat_us = 0;                ///< FAT lookup for stat, not modeled unless a bench sets it
+    int decoder_open_us = 15000;    ///< decoder init + first frame sync
+    int read_us_per_kb = 120;       ///< SD read throughput (1-line mode)
+    int read_call_us = 0;           ///< per fread on top of the throughput: command, FAT lookup
+    int read_jitter_us = 0;         ///< random extra per fread, up to this much
+    int card_busy_us = 0;           ///< the card is held by someone else for this long,
+    int card_busy_period_ms = 0;    ///< at a random point once in every period, 0 never
+    int write_us_per_kb = 250;      ///< SD write throughput
+    int write_call_us = 300;        ///< per fwrite on top of the throughput
+    int write_stall_us = 0;         ///< the card stalls this long (erase, FAT update)
+    int write_stall_every_kb = 0;   ///< once in every this many kB written, 0 never
+    int decode_us_per_kb = 350;     ///< decoder, per kB of PCM produced
+    int resample_us_per_kb = 220;   ///< resampler, per kB of PCM consumed
+    int relink_us = 400;            ///< audio_pipeline_relink / link
+    int dma_buffer_us = 20000;      ///< how far the i2s writer may run ahead
+};
+
+struct FakeI2sStats {
+    uint64_t frames = 0;            ///< frames written since the last mark
+    uint64_t underrun_frames = 0;   ///< frames of silence caused by starvation
+    std::vector<int64_t> gaps_us;   ///< every starvation gap since the mark
+    int64_t first_frame_us = -1;    ///< first write since the mark, -1 if none
+    int64_t last_frame_us = -1;
+    int64_t track_first_frame_us = -1; ///< first write of the latest track
+    int64_t paused_us = -1;         ///< when the writer parked for a pause
+    bool paused = false;
+    bool active = false;            ///< pipeline worker is playing a track
+    int tracks_started = 0;         ///< runs since the mark that produced audio
+    int rate = 0;                   ///< current i2s clock
+};
+
+/// Time the fake elements spent computing, the CPU share of a real ESP32.
+/// Reading and the i2s writer wait for DMA and are not counted.
+struct FakeCpuStats {
+    int64_t decode_us = 0;
+    int64_t resample_us = 0;
+};
+
+/// SD card opens, stats, reads and writes through the wrapped fopen/stat/fread/fwrite, from every task
+struct FakeCardStats {
+    uint64_t opens = 0;
+    int64_t open_us = 0;            ///< time spent in fopen
+    uint64_t stats = 0;
+    int64_t stat_us = 0;            ///< time spent in stat
+    uint64_t reads = 0;
+    uint64_t bytes = 0;
+    int64_t read_us = 0;            ///< time spent in fread, busy windows included
+    uint64_t writes = 0;
+    uint64_t write_bytes = 0;
+    int64_t write_us = 0;           ///< time spent in fwrite, busy windows and stalls included
+};
+
+namespace fake_adf {
+
+FakeAdfCosts &costs();
+int64_t now_us();
+/// Move esp_timer_get_time() forward, for simulating hours of playback.
+/// Only while no pipeline is running, the i2s pacing uses the same clock.
+void advance_clock(int64_t us);
+
+/// Reset the i2s probe. Timing measurements start from here.
+void mark();
+FakeI2sStats i2s_stats();
+/// Decoder and resampler time since the last mark()
+FakeCpuStats cpu_stats();
+/// SD card reads and writes since the last mark()
+FakeCardStats card_stats();
+
+/// Block until @p pred holds for the i2s probe or @p timeout_ms elapses.
+bool wait_i2s(const std::function<bool(const FakeI2sStats &)> &pred, int timeout_ms);
+
+} // namespace fake_adf
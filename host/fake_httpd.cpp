@@ -0,0 +1,518 @@
+/*  Host stand-in for esp_http_server, see fake_httpd.h for the model.
+*/
+#include "fake_httpd.h"
+#include "fake_adf.h"
+
+extern "C" {
+#include <string.h>
+#include <strings.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+/* The EMBED_FILES of the file server component, as the IDF build links them */
+asm(".section .rodata\n"
+    ".global _binary_favicon_ico_start\n"
+    "_binary_favicon_ico_start:\n"
+    ".incbin \"" FILE_SERVING_DIR "/favicon.ico\"\n"
+    ".global _binary_favicon_ico_end\n"
+    "_binary_favicon_ico_end:\n"
+    ".global _binary_upload_script_html_start\n"
+    "_binary_upload_script_html_start:\n"
+    ".incbin \"" FILE_SERVING_DIR "/upload_script.html\"\n"
+    ".global _binary_upload_script_html_end\n"
+    "_binary_upload_script_html_end:\n"
+    ".previous\n");
+
+/* newlib has it, glibc only from 2.38 on */
+extern "C" __attribute__((weak)) size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = std::min(len, size - 1);
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+namespace {
+
+struct Handler {
+    std::string uri;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t *r);
+    void *user_ctx;
+};
+
+struct Server {
+    httpd_config_t config;
+    std::vector<Handler> handlers;
+};
+
+/// A request being served, httpd_req_t first so the handle casts back
+struct Exchange {
+    httpd_req_t req;
+    const FakeHttpRequest *in;
+    FakeHttpResponse *out;
+    std::vector<std::pair<const char *, const char *>> resp_headers;
+    bool headers_sent = false;
+    uint64_t total = 0;             ///< body bytes the sender gets out
+    uint64_t delivered = 0;         ///< arrived at the box, read or not
+    int64_t link_us = 0;            ///< the link is caught up to this time
+    uint64_t tx_in_flight = 0;      ///< sent by the handler, not yet over the link
+    int64_t tx_link_us = 0;
+    bool raw = false;               ///< the handler writes the response itself
+    std::string raw_head;           ///< status line and headers, until parsed
+};
+
+std::mutex s_mutex;
+std::vector<Server *> s_servers;
+FakeLinkCosts s_costs;
+
+Exchange *exchange(httpd_req_t *r)
+{
+    return reinterpret_cast<Exchange *>(r);
+}
+
+void sleep_until(int64_t us)
+{
+    int64_t now = fake_adf::now_us();
+    if (us > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us - now));
+    }
+}
+
+/// Let the link deliver what it could since the last call, up to the window
+void catch_up(Exchange *ex, int64_t now)
+{
+    double bytes_per_us = s_costs.recv_kb_per_s * 1024.0 / 1000000;
+    uint64_t can = (uint64_t)((now - ex->link_us) * bytes_per_us);
+    uint64_t in_flight = ex->delivered - ex->out->received;
+    uint64_t room = in_flight < (uint64_t)s_costs.window ? s_costs.window - in_flight : 0;
+    uint64_t n = std::min({can, room, ex->total - ex->delivered});
+    ex->delivered += n;
+    // A full window stalls the sender, that time is lost to the link
+    ex->link_us = n < can ? now : ex->link_us + (int64_t)(n / bytes_per_us);
+}
+
+/// Let the link carry away what it could of the sent data since the last call
+void tx_catch_up(Exchange *ex, int64_t now)
+{
+    double bytes_per_us = s_costs.send_kb_per_s * 1024.0 / 1000000;
+    uint64_t can = (uint64_t)((now - ex->tx_link_us) * bytes_per_us);
+    uint64_t n = std::min(can, ex->tx_in_flight);
+    ex->tx_in_flight -= n;
+    // An empty send buffer leaves the link idle, that time is lost
+    ex->tx_link_us = n < can ? now : ex->tx_link_us + (int64_t)(n / bytes_per_us);
+}
+
+/// One socket send of @p len bytes, returns once they fit into the send buffer
+void socket_send(Exchange *ex, size_t len)
+{
+    ex->out->sends++;
+    std::this_thread::sleep_for(std::chrono::microseconds(s_costs.send_call_us));
+    double bytes_per_us = s_costs.send_kb_per_s * 1024.0 / 1000000;
+    while (true) {
+        tx_catch_up(ex, fake_adf::now_us());
+        uint64_t room = ex->tx_in_flight < (uint64_t)s_costs.send_window ? s_costs.send_window - ex->tx_in_flight : 0;
+        uint64_t n = std::min<uint64_t>(room, len);
+        ex->tx_in_flight += n;
+        len -= n;
+        if (len == 0) {
+            return;
+        }
+        // Wait for the next segment to be acked
+        uint64_t segment = std::min<uint64_t>(1436, ex->tx_in_flight);
+        sleep_until(ex->tx_link_us + (int64_t)(segment / bytes_per_us) + 1);
+    }
+}
+
+/// Wait until the last sent byte went over the link
+void drain(Exchange *ex)
+{
+    double bytes_per_us = s_costs.send_kb_per_s * 1024.0 / 1000000;
+    tx_catch_up(ex, fake_adf::now_us());
+    sleep_until(ex->tx_link_us + (int64_t)(ex->tx_in_flight / bytes_per_us));
+    tx_catch_up(ex, fake_adf::now_us());
+}
+
+/// Body bytes the client still takes before it hangs up
+uint64_t client_room(Exchange *ex)
+{
+    uint64_t limit = ex->in->close_after;
+    return ex->out->body.size() < limit ? limit - ex->out->body.size() : 0;
+}
+
+void send_headers(Exchange *ex)
+{
+    if (ex->headers_sent) {
+        return;
+    }
+    ex->headers_sent = true;
+    socket_send(ex, 128 + 48 * ex->resp_headers.size());
+    for (auto &header : ex->resp_headers) {
+        ex->out->headers.emplace_back(header.first, header.second);
+    }
+}
+
+const char *error_status(httpd_err_code_t error)
+{
+    switch (error) {
+    case HTTPD_501_METHOD_NOT_IMPLEMENTED:   return "501 Method Not Implemented";
+    case HTTPD_505_VERSION_NOT_SUPPORTED:    return "505 Version Not Supported";
+    case HTTPD_400_BAD_REQUEST:              return "400 Bad Request";
+    case HTTPD_401_UNAUTHORIZED:             return "401 Unauthorized";
+    case HTTPD_403_FORBIDDEN:                return "403 Forbidden";
+    case HTTPD_404_NOT_FOUND:                return "404 Not Found";
+    case HTTPD_405_METHOD_NOT_ALLOWED:       return "405 Method Not Allowed";
+    case HTTPD_408_REQ_TIMEOUT:              return "408 Request Timeout";
+    case HTTPD_411_LENGTH_REQUIRED:          return "411 Length Required";
+    case HTTPD_414_URI_TOO_LONG:             return "414 URI Too Long";
+    case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE: return "431 Request Header Fields Too Large";
+    default:                                 return "500 Internal Server Error";
+    }
+}
+
+const std::string *find_header(httpd_req_t *r, const char *field)
+{
+    for (auto &header : exchange(r)->in->headers) {
+        if (strcasecmp(header.first.c_str(), field) == 0) {
+            return &header.second;
+        }
+    }
+    return nullptr;
+}
+
+const char *query(httpd_req_t *r)
+{
+    const char *q = strchr(r->uri, '?');
+    return q ? q + 1 : nullptr;
+}
+
+} // namespace
+
+int FakeHttpResponse::code() const
+{
+    return atoi(status.c_str());
+}
+
+std::string FakeHttpResponse::header(const std::string &field) const
+{
+    for (auto &h : headers) {
+        if (strcasecmp(h.first.c_str(), field.c_str()) == 0) {
+            return h.second;
+        }
+    }
+    return "";
+}
+
+namespace fake_httpd {
+
+FakeLinkCosts &costs()
+{
+    return s_costs;
+}
+
+FakeHttpResponse request(const FakeHttpRequest &request)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(s_costs.request_us));
+    FakeHttpResponse response;
+    Exchange ex = {};
+    ex.in = &request;
+    ex.out = &response;
+    ex.req.method = request.method;
+    strlcpy(const_cast<char *>(ex.req.uri), request.uri.c_str(), sizeof(ex.req.uri));
+    uint64_t body = request.body_size ? request.body_size : request.body.size();
+    ex.req.content_len = body;
+    ex.total = std::min(body, request.break_after);
+    ex.link_us = fake_adf::now_us();
+    ex.tx_link_us = ex.link_us;
+
+    size_t match_upto = strcspn(ex.req.uri, "?");
+    const Handler *found = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        for (Server *server : s_servers) {
+            for (const Handler &h : server->handlers) {
+                bool match = server->config.uri_match_fn
+                    ? server->config.uri_match_fn(h.uri.c_str(), ex.req.uri, match_upto)
+                    : h.uri.size() == match_upto && strncmp(h.uri.c_str(), ex.req.uri, match_upto) == 0;
+                if (match && h.method == request.method) {
+                    found = &h;
+                    ex.req.handle = server;
+                    break;
+                }
+            }
+            if (found) {
+                break;
+            }
+        }
+    }
+    if (!found) {
+        httpd_resp_send_err(&ex.req, HTTPD_404_NOT_FOUND, "Nothing matches the given URI");
+        response.result = ESP_FAIL;
+        return response;
+    }
+    ex.req.user_ctx = found->user_ctx;
+    response.result = found->handler(&ex.req);
+    drain(&ex);
+    return response;
+}
+
+} // namespace fake_httpd
+
+/// "/path*" matches everything starting with "/path", other templates
+/// only themselves. The "?" of the real matcher is not used here.
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    size_t len = strlen(uri_template);
+    if (len > 0 && uri_template[len - 1] == '*') {
+        return match_upto >= len - 1 && strncmp(uri_template, uri_to_match, len - 1) == 0;
+    }
+    return match_upto == len && strncmp(uri_template, uri_to_match, len) == 0;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    auto *server = new Server{*config, {}};
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_servers.push_back(server);
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_servers.erase(std::remove(s_servers.begin(), s_servers.end(), (Server *)handle), s_servers.end());
+    delete (Server *)handle;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    auto *server = (Server *)handle;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (server->handlers.size() >= server->config.max_uri_handlers) {
+        return ESP_FAIL;
+    }
+    server->handlers.push_back({uri_handler->uri, uri_handler->method, uri_handler->handler, uri_handler->user_ctx});
+    return ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    Exchange *ex = exchange(r);
+    FakeHttpResponse *out = ex->out;
+    std::this_thread::sleep_for(std::chrono::microseconds(s_costs.recv_call_us));
+    catch_up(ex, fake_adf::now_us());
+    if (ex->delivered == out->received) {
+        if (ex->delivered == ex->total) {
+            // Everything the sender had, or the connection broke
+            return ex->total < r->content_len ? HTTPD_SOCK_ERR_FAIL : 0;
+        }
+        // Wait for the next segment
+        uint64_t segment = std::min<uint64_t>(1436, ex->total - ex->delivered);
+        sleep_until(ex->link_us + (int64_t)(segment * 1000000 / (s_costs.recv_kb_per_s * 1024.0)) + 1);
+        catch_up(ex, fake_adf::now_us());
+    }
+    size_t n = (size_t)std::min<uint64_t>(buf_len, ex->delivered - out->received);
+    const FakeHttpRequest *in = ex->in;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t offset = out->received + i;
+        buf[i] = in->body_size ? (char)fake_httpd::pattern(in->body_offset + offset) : in->body[offset];
+    }
+    out->received += n;
+    return (int)n;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    const std::string *value = find_header(r, field);
+    return value ? value->size() : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    const std::string *value = find_header(r, field);
+    if (!value) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    strlcpy(val, value->c_str(), val_size);
+    return value->size() < val_size ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *q = query(r);
+    return q ? strlen(q) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    const char *q = query(r);
+    if (!q) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    strlcpy(buf, q, buf_len);
+    return strlen(q) < buf_len ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t key_len = strlen(key);
+    for (const char *p = qry; p && *p; ) {
+        const char *end = strchr(p, '&');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            size_t value_len = len - key_len - 1;
+            size_t n = std::min(value_len, val_size - 1);
+            memcpy(val, p + key_len + 1, n);
+            val[n] = '\0';
+            return value_len < val_size ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+        }
+        p = end ? end + 1 : nullptr;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    exchange(r)->out->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    exchange(r)->out->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    Exchange *ex = exchange(r);
+    if (ex->resp_headers.size() >= ((Server *)r->handle)->config.max_resp_headers) {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    ex->resp_headers.emplace_back(field, value);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    Exchange *ex = exchange(r);
+    if (ex->out->complete || ex->out->chunked) {
+        return ESP_ERR_HTTPD_INVALID_REQ;
+    }
+    send_headers(ex);
+    if (buf && buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = strlen(buf);
+    }
+    if (buf && buf_len > 0) {
+        socket_send(ex, buf_len);
+        ex->out->body.append(buf, std::min<uint64_t>(buf_len, client_room(ex)));
+    }
+    ex->out->complete = true;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    Exchange *ex = exchange(r);
+    if (ex->out->complete) {
+        return ESP_ERR_HTTPD_INVALID_REQ;
+    }
+    send_headers(ex);
+    ex->out->chunked = true;
+    if (buf && buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = strlen(buf);
+    }
+    if (!buf || buf_len == 0) {
+        socket_send(ex, 5);
+        ex->out->complete = true;
+        return ESP_OK;
+    }
+    if (client_room(ex) == 0) {
+        return ESP_FAIL;
+    }
+    // Size line, data and CRLF are three sends, as on the device
+    socket_send(ex, 6);
+    socket_send(ex, buf_len);
+    socket_send(ex, 2);
+    ex->out->body.append(buf, std::min<uint64_t>(buf_len, client_room(ex)));
+    return ESP_OK;
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len)
+{
+    Exchange *ex = exchange(r);
+    FakeHttpResponse *out = ex->out;
+    if (out->complete || out->chunked || ex->headers_sent) {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    if (!ex->raw) {
+        ex->raw = true;
+        out->status.clear();
+    }
+    if (out->status.empty()) {
+        // Collect the head until its blank line, then parse it
+        ex->raw_head.append(buf, buf_len);
+        size_t end = ex->raw_head.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            socket_send(ex, buf_len);
+            return (int)buf_len;
+        }
+        std::string head = ex->raw_head.substr(0, end);
+        std::string rest = ex->raw_head.substr(end + 4);
+        size_t line_end = head.find("\r\n");
+        std::string status_line = head.substr(0, line_end);
+        out->status = status_line.substr(std::min(status_line.find(' ') + 1, status_line.size()));
+        size_t at = line_end;
+        while (at != std::string::npos && at < head.size()) {
+            size_t next = head.find("\r\n", at + 2);
+            std::string line = head.substr(at + 2, next == std::string::npos ? std::string::npos : next - at - 2);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                std::string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(' '));
+                if (strcasecmp(line.substr(0, colon).c_str(), "Content-Type") == 0) {
+                    out->type = value;
+                } else {
+                    out->headers.emplace_back(line.substr(0, colon), value);
+                }
+            }
+            at = next;
+        }
+        socket_send(ex, buf_len);
+        out->body.append(rest, 0, std::min<uint64_t>(rest.size(), client_room(ex)));
+        return (int)buf_len;
+    }
+    if (client_room(ex) == 0) {
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+    socket_send(ex, buf_len);
+    size_t n = (size_t)std::min<uint64_t>(buf_len, client_room(ex));
+    out->body.append(buf, n);
+    std::string length = out->header("Content-Length");
+    out->complete = !length.empty() && out->body.size() == strtoull(length.c_str(), NULL, 10);
+    return (int)n;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg)
+{
+    Exchange *ex = exchange(req);
+    if (ex->out->complete || ex->out->chunked) {
+        // Too late for a status, the client sees a broken response
+        ex->out->complete = false;
+        return ESP_ERR_HTTPD_INVALID_REQ;
+    }
+    ex->out->status = error_status(error);
+    ex->out->type = "text/html";
+    ex->out->body = msg ? msg : "";
+    ex->out->complete = true;
+    return ESP_OK;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+/* Host stand-in for esp_http_server, see fake_httpd.cpp.
+
+   Handlers registered with httpd_register_uri_handler() are called
+   synchronously by fake_httpd::request() on the calling thread, matched
+   the same way as on the device. The request body comes over a fake Wi-Fi
+   link: it arrives at a fixed throughput, but only as far as the TCP
+   window lets the sender get ahead of what the handler read, so a handler
+   that stops reading to write the SD card stalls the sender as well.
+   Responses go back the same way: every socket send is charged, and only
+   a send buffer's worth can be ahead of the link, so a handler that
+   stops sending to read the card leaves the link idle. Responses are
+   collected as they are sent, raw ones from httpd_send() are parsed. */
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "esp_http_server.h"
+}
+
+/// The link between the browser or sync script and the box
+struct FakeLinkCosts {
+    int recv_kb_per_s = 1200;       ///< TCP receive throughput of the station
+    int window = 5744;              ///< CONFIG_LWIP_TCP_WND_DEFAULT, bytes in flight
+    int recv_call_us = 30;          ///< per httpd_req_recv
+    int request_us = 20000;         ///< connecting, headers and the answer, per request
+    int send_kb_per_s = 1500;       ///< TCP send throughput to the station
+    int send_window = 5744;         ///< CONFIG_LWIP_TCP_SND_BUF_DEFAULT, bytes not yet acked
+    int send_call_us = 60;          ///< per socket send
+};
+
+struct FakeHttpRequest {
+    httpd_method_t method = HTTP_GET;
+    std::string uri;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;               ///< sent as is, unless body_size is set
+    uint64_t body_size = 0;         ///< send this many bytes of fake_httpd::pattern()
+    uint64_t body_offset = 0;       ///< starting at this offset of the pattern
+    uint64_t break_after = UINT64_MAX; ///< the connection breaks after this many body bytes
+    uint64_t close_after = UINT64_MAX; ///< the client hangs up after this many response body bytes
+};
+
+struct FakeHttpResponse {
+    esp_err_t result = ESP_OK;      ///< what the handler returned
+    std::string status = "200 OK";
+    std::string type = "text/html";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    bool chunked = false;
+    bool complete = false;          ///< the last chunk or the whole response was sent
+    uint64_t received = 0;          ///< body bytes the handler read
+    int sends = 0;                  ///< socket sends, framing included
+
+    int code() const;
+    /// Value of response header @p field, empty if it was not set
+    std::string header(const std::string &field) const;
+};
+
+namespace fake_httpd {
+
+FakeLinkCosts &costs();
+/// Serve @p request with the handler registered for it, 404 without one
+FakeHttpResponse request(const FakeHttpRequest &request);
+/// Byte @p offset of a generated request body
+inline uint8_t pattern(uint64_t offset)
+{
+    return (uint8_t)((offset * 2654435761u) >> 13);
+}
+
+} // namespace fake_httpd
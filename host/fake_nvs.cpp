@@ -0,0 +1,157 @@
+/*  Host stand-in for NVS, see fake_nvs.h for the model.
+*/
+#include "fake_nvs.h"
+
+extern "C" {
+#include <string.h>
+#include "nvs.h"
+}
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::map<std::string, std::vector<uint8_t>> Blobs;
+
+struct Namespace {
+    Blobs committed;
+    Blobs staged;               ///< set since the last commit
+};
+
+std::mutex s_mutex;
+std::map<std::string, Namespace> s_namespaces;
+std::vector<std::string> s_handles;     ///< namespace of handle i + 1
+FakeNvsStats s_stats;
+
+Namespace *lookup(nvs_handle_t handle)
+{
+    if (handle == 0 || handle > s_handles.size()) {
+        return nullptr;
+    }
+    return &s_namespaces[s_handles[handle - 1]];
+}
+
+} // namespace
+
+namespace fake_nvs {
+
+FakeNvsStats stats()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    return s_stats;
+}
+
+void reset_stats()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_stats = FakeNvsStats();
+}
+
+void reboot()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for (auto &ns : s_namespaces) {
+        ns.second.staged.clear();
+    }
+}
+
+void erase()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_namespaces.clear();
+}
+
+} // namespace fake_nvs
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    (void)open_mode;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_handles.push_back(name);
+    *out_handle = s_handles.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    (void)handle;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Namespace *ns = lookup(handle);
+    if (ns == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto it = ns->staged.find(key);
+    if (it == ns->staged.end()) {
+        it = ns->committed.find(key);
+        if (it == ns->committed.end()) {
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+    }
+    if (out_value == nullptr) {
+        *length = it->second.size();
+        return ESP_OK;
+    }
+    if (*length < it->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, it->second.data(), it->second.size());
+    *length = it->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Namespace *ns = lookup(handle);
+    if (ns == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const uint8_t *bytes = (const uint8_t *)value;
+    std::vector<uint8_t> blob(bytes, bytes + length);
+    auto it = ns->staged.find(key);
+    const std::vector<uint8_t> *current = it != ns->staged.end() ? &it->second : nullptr;
+    if (current == nullptr) {
+        auto committed = ns->committed.find(key);
+        current = committed != ns->committed.end() ? &committed->second : nullptr;
+    }
+    // NVS skips writing a blob identical to the stored one
+    if (current == nullptr || *current != blob) {
+        s_stats.writes++;
+        s_stats.bytes += length;
+    }
+    ns->staged[key] = blob;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Namespace *ns = lookup(handle);
+    if (ns == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t erased = ns->staged.erase(key) + ns->committed.erase(key);
+    return erased > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Namespace *ns = lookup(handle);
+    if (ns == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (auto &blob : ns->staged) {
+        ns->committed[blob.first] = blob.second;
+    }
+    ns->staged.clear();
+    s_stats.commits++;
+    return ESP_OK;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+/* Host-only probes for the fake NVS in fake_nvs.cpp.
+
+   Values live in memory per namespace. Like the real NVS, nvs_set_blob only
+   stages a value and nvs_commit makes it durable: reboot() drops everything
+   that was not committed, as a power cut would. Every set of a blob that
+   differs from the stored one is counted as a flash write. */
+
+#include <stdint.h>
+
+struct FakeNvsStats {
+    uint64_t writes = 0;            ///< blobs that changed, each one a flash entry
+    uint64_t bytes = 0;             ///< payload of those writes
+    uint64_t commits = 0;
+};
+
+namespace fake_nvs {
+
+FakeNvsStats stats();
+/// Zero the counters, keep the contents
+void reset_stats();
+/// Forget uncommitted values, like a power cut
+void reboot();
+/// Erase everything, like a fresh flash
+void erase();
+
+} // namespace fake_nvs
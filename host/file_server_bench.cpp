@@ -0,0 +1,773 @@
+/*  Upload and download throughput of the file server on the host.
+
+    Sends a generated file to the real upload handler through the fake
+    esp_http_server (fake_httpd.h) over a fake Wi-Fi link, onto the fake SD
+    card of fake_adf.h, and checks what arrived. Compares the handler with
+    the one it replaced ("direct"), which wrote every received piece to the
+    card before reading the socket again, on a card that is
+      quiet     only charged per write and per KB
+      player    held by the player's reads for 150 ms once a second
+      stalls    stalling for 40 ms every 256 KB written (erase, FAT update)
+    behind the default lwIP receive window and behind a 16 KB window on a
+    faster link, where the card becomes the bottleneck.
+    Also checks that a broken upload leaves neither the file nor its .part,
+    and compares a plain upload that starts over after every dropped
+    connection with a resumable one in chunks (/resume), which only sends
+    the chunk in flight again, on a link that drops three times.
+    Last, an album of small files goes up one request per file and as one
+    tar stream (/batch), then /manifest lists it: cold, with every file
+    read for its CRC-32, and again from the noted CRC-32s. A resync after
+    three files changed sends only those.
+    Downloads of the file compare the handler with the one it replaced
+    ("chunked"), which read 8 KB into the scratch buffer and sent it as a
+    chunk, three socket sends, before reading on. The link is the same
+    as for uploads the other way round, with lwIP's default send buffer.
+    A range and a client that hangs up half way are checked as well.
+    Last, a folder of a few hundred tracks is listed by the HTML handler as
+    it was ("oldlist"), with a stat and fifteen chunks per entry, by the
+    one that sends rows a transfer buffer at a time from the cached
+    snapshot, cold and cached, and as JSON pages (/list). An upload and a
+    delete must show up in the cached listing without reading the folder.
+    Finally the server is stopped and started again, as the file service
+    does when it goes idle and is asked for again, and must serve as
+    before and count its last request.
+
+    Usage: file_server_bench [MB per upload]
+*/
+#include "fake_adf.h"
+#include "fake_httpd.h"
+#include "library_sync.h"
+
+extern "C" {
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "file_server.h"
+}
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define BENCH_BUSY_US           150000
+#define BENCH_BUSY_PERIOD_MS    1000
+#define BENCH_STALL_US          40000
+#define BENCH_STALL_EVERY_KB    256
+#define DIRECT_BUFSIZE          8192
+#define FAST_LINK_KB_PER_S      3000
+#define FAST_LINK_WINDOW        16384
+#define RESUME_CHUNK            (256 * 1024)
+#define ALBUM_FILES             40
+#define ALBUM_FILE_KB           96
+#define FOLDER_FILES            300
+#define FOLDER_STAT_US          5000
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+/// The upload loop as it was: receive up to 8 KB, write it, repeat
+static esp_err_t direct_upload_handler(httpd_req_t *req)
+{
+    static char buf[DIRECT_BUFSIZE];
+    std::string path = root + (req->uri + sizeof("/direct") - 1);
+    FILE *fd = fopen(path.c_str(), "w");
+    if (!fd) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
+        return ESP_FAIL;
+    }
+    size_t remaining = req->content_len;
+    while (remaining > 0) {
+        int received = httpd_req_recv(req, buf, std::min(remaining, sizeof(buf)));
+        if (received <= 0 || fwrite(buf, 1, received, fd) != (size_t)received) {
+            fclose(fd);
+            unlink(path.c_str());
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
+            return ESP_FAIL;
+        }
+        remaining -= received;
+    }
+    fclose(fd);
+    httpd_resp_set_status(req, "303 See Other");
+    httpd_resp_sendstr(req, "File uploaded successfully");
+    return ESP_OK;
+}
+
+/// The download loop as it was: read 8 KB, send it as a chunk, repeat
+static esp_err_t chunked_download_handler(httpd_req_t *req)
+{
+    static char buf[DIRECT_BUFSIZE];
+    std::string path = root + (req->uri + sizeof("/chunked") - 1);
+    FILE *fd = fopen(path.c_str(), "r");
+    if (!fd) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+        return ESP_FAIL;
+    }
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fd)) > 0) {
+        if (httpd_resp_send_chunk(req, buf, n) != ESP_OK) {
+            fclose(fd);
+            return ESP_FAIL;
+        }
+    }
+    fclose(fd);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+/// The listing as it was: a stat per entry and a chunk per piece of a row
+static esp_err_t oldlist_handler(httpd_req_t *req)
+{
+    std::string dirpath = root + (req->uri + sizeof("/oldlist") - 1);
+    DIR *dir = opendir(dirpath.c_str());
+    if (!dir) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr_chunk(req, "<!DOCTYPE html><html><body><table><tbody>");
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat entry_stat;
+        if (stat((dirpath + entry->d_name).c_str(), &entry_stat) == -1) {
+            continue;
+        }
+        const char *type = entry->d_type == DT_DIR ? "directory" : "file";
+        std::string size = std::to_string(entry_stat.st_size);
+        for (const char *piece : {"<tr><td><a href=\"", (const char *)req->uri, (const char *)entry->d_name, "\">",
+                                  (const char *)entry->d_name, "</a></td><td>", type, "</td><td>", size.c_str(),
+                                  "</td><td>", "<form method=\"post\" action=\"/delete", (const char *)req->uri,
+                                  (const char *)entry->d_name, "\"><button type=\"submit\">Delete</button></form>",
+                                  "</td></tr>\n"}) {
+            httpd_resp_sendstr_chunk(req, piece);
+        }
+    }
+    closedir(dir);
+    httpd_resp_sendstr_chunk(req, "</tbody></table></body></html>");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static bool verify(const std::string &path, uint64_t size)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::vector<char> buf(64 * 1024);
+    uint64_t offset = 0;
+    size_t n;
+    bool ok = true;
+    while (ok && (n = fread(buf.data(), 1, buf.size(), file)) > 0) {
+        for (size_t i = 0; i < n && ok; i++) {
+            ok = (uint8_t)buf[i] == fake_httpd::pattern(offset + i);
+        }
+        offset += n;
+    }
+    fclose(file);
+    return ok && offset == size;
+}
+
+static bool exists(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+struct Result {
+    int code = 0;
+    bool verified = false;
+    double seconds = 0;
+    FakeCardStats card;
+};
+
+static Result upload(const char *prefix, const std::string &name, uint64_t size)
+{
+    std::string path = root + "/" + name;
+    unlink(path.c_str());
+    FakeHttpRequest request;
+    request.method = HTTP_POST;
+    request.uri = std::string(prefix) + "/" + name;
+    request.body_size = size;
+    fake_adf::mark();
+    int64_t t0 = fake_adf::now_us();
+    FakeHttpResponse response = fake_httpd::request(request);
+    Result result;
+    result.seconds = (fake_adf::now_us() - t0) / 1e6;
+    result.card = fake_adf::card_stats();
+    result.code = response.code();
+    result.verified = verify(path, size) && !exists(path + ".part");
+    unlink(path.c_str());
+    return result;
+}
+
+/// The link drops after these fractions of the file went over it, counted
+/// over all attempts
+static const double drops[] = {0.7, 1.2, 2.0};
+
+struct Flaky {
+    uint64_t size;
+    uint64_t sent = 0;              ///< body bytes over the link so far
+    size_t next_drop = 0;
+
+    /// Body bytes a request of @p body gets out before the link drops
+    uint64_t break_after(uint64_t body) const {
+        if (next_drop == sizeof(drops) / sizeof(drops[0])) {
+            return UINT64_MAX;
+        }
+        uint64_t at = (uint64_t)(drops[next_drop] * size);
+        return at - sent < body ? at - sent : UINT64_MAX;
+    }
+    void count(const FakeHttpRequest &request) {
+        if (request.break_after != UINT64_MAX) {
+            sent += request.break_after;
+            next_drop++;
+        } else {
+            sent += request.body_size;
+        }
+    }
+};
+
+struct FlakyResult {
+    bool verified = false;
+    int requests = 0;
+    uint64_t sent = 0;
+    double seconds = 0;
+};
+
+/// Upload the whole file again until it goes through
+static FlakyResult plain_flaky(const std::string &name, uint64_t size)
+{
+    std::string path = root + "/" + name;
+    Flaky flaky = {size};
+    FlakyResult result;
+    int64_t t0 = fake_adf::now_us();
+    while (true) {
+        FakeHttpRequest request;
+        request.method = HTTP_POST;
+        request.uri = "/upload/" + name;
+        request.body_size = size;
+        request.break_after = flaky.break_after(size);
+        flaky.count(request);
+        result.requests++;
+        if (fake_httpd::request(request).code() == 303) {
+            break;
+        }
+    }
+    result.seconds = (fake_adf::now_us() - t0) / 1e6;
+    result.sent = flaky.sent;
+    result.verified = verify(path, size) && !exists(path + ".part");
+    unlink(path.c_str());
+    return result;
+}
+
+static uint32_t pattern_crc(uint64_t offset, uint64_t len)
+{
+    uint8_t buf[4096];
+    uint32_t crc = 0;
+    while (len > 0) {
+        size_t n = std::min<uint64_t>(len, sizeof(buf));
+        for (size_t i = 0; i < n; i++) {
+            buf[i] = fake_httpd::pattern(offset + i);
+        }
+        crc = esp_rom_crc32_le(crc, buf, n);
+        offset += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static std::string hex(uint32_t value)
+{
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08x", (unsigned)value);
+    return buf;
+}
+
+/// Ask for the offset, send the rest chunk by chunk, finish
+static FlakyResult resume_flaky(const std::string &name, uint64_t size)
+{
+    std::string path = root + "/" + name;
+    Flaky flaky = {size};
+    FlakyResult result;
+    int64_t t0 = fake_adf::now_us();
+    uint64_t offset = UINT64_MAX;
+    while (true) {
+        if (offset == UINT64_MAX) {
+            FakeHttpRequest query;
+            query.uri = "/resume/" + name;
+            offset = strtoull(fake_httpd::request(query).header("Upload-Offset").c_str(), NULL, 10);
+            result.requests++;
+        }
+        if (offset == size) {
+            break;
+        }
+        FakeHttpRequest chunk;
+        chunk.method = HTTP_PUT;
+        chunk.body_size = std::min<uint64_t>(RESUME_CHUNK, size - offset);
+        chunk.body_offset = offset;
+        chunk.uri = "/resume/" + name + "?offset=" + std::to_string(offset) + "&crc32=" +
+                    hex(pattern_crc(offset, chunk.body_size));
+        chunk.break_after = flaky.break_after(chunk.body_size);
+        flaky.count(chunk);
+        result.requests++;
+        FakeHttpResponse response = fake_httpd::request(chunk);
+        // After a drop the answer is lost, ask again
+        offset = response.code() == 204 ? strtoull(response.header("Upload-Offset").c_str(), NULL, 10) : UINT64_MAX;
+    }
+    FakeHttpRequest finish;
+    finish.method = HTTP_POST;
+    finish.uri = "/resume/" + name + "?size=" + std::to_string(size) + "&crc32=" + hex(pattern_crc(0, size));
+    result.requests++;
+    bool finished = fake_httpd::request(finish).code() == 200;
+    result.seconds = (fake_adf::now_us() - t0) / 1e6;
+    result.sent = flaky.sent;
+    result.verified = finished && verify(path, size) && !exists(path + ".part");
+    unlink(path.c_str());
+    return result;
+}
+
+struct AlbumFile {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static std::vector<AlbumFile> album()
+{
+    std::vector<AlbumFile> files;
+    for (int i = 0; i < ALBUM_FILES; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/album/%02d.mp3", i + 1);
+        // Sizes differ by a few bytes, as tags do
+        files.push_back({path, (uint64_t)ALBUM_FILE_KB * 1024 + i * 37, 1700000000 + i * 60});
+    }
+    return files;
+}
+
+static bool verify_album(const std::vector<AlbumFile> &files)
+{
+    bool ok = true;
+    for (const AlbumFile &f : files) {
+        ok = ok && verify(root + f.path, f.size);
+    }
+    return ok;
+}
+
+static void print_sync(const char *name, int requests, uint64_t sent, double seconds, const char *content)
+{
+    printf("%-16s %8d %8.2f %8.2f %8s\n", name, requests, sent / 1048576.0, seconds, content);
+}
+
+static void library_sync()
+{
+    std::filesystem::remove_all(root + "/album");
+    unlink((root + "/.manifest").c_str());
+    mkdir((root + "/album").c_str(), 0755);
+    std::vector<AlbumFile> files = album();
+    uint64_t album_bytes = 0;
+    for (const AlbumFile &f : files) {
+        album_bytes += f.size;
+    }
+    printf("\nalbum of %d x %d KB, %d ms per request\n", ALBUM_FILES, ALBUM_FILE_KB,
+           fake_httpd::costs().request_us / 1000);
+    printf("%-16s %8s %8s %8s %8s\n", "sync", "requests", "sent MB", "s", "content");
+
+    double seconds;
+    int64_t t0 = fake_adf::now_us();
+    for (const AlbumFile &f : files) {
+        FakeHttpRequest request;
+        request.method = HTTP_POST;
+        request.uri = "/upload" + f.path;
+        request.body_size = f.size;
+        fake_httpd::request(request);
+    }
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("file by file", ALBUM_FILES, album_bytes, seconds,
+               verify_album(files) ? "ok" : "BAD");
+
+    // Nothing noted for these, every file is read
+    FakeHttpRequest query;
+    query.uri = "/manifest/album";
+    t0 = fake_adf::now_us();
+    Manifest manifest = parse_manifest(fake_httpd::request(query).body);
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("manifest cold", 1, 0, seconds,
+               manifest.size() == files.size() && manifest.begin()->second.hashed ? "ok" : "BAD");
+    t0 = fake_adf::now_us();
+    Manifest again = parse_manifest(fake_httpd::request(query).body);
+    bool same = again.size() == manifest.size();
+    for (auto &entry : manifest) {
+        same = same && again[entry.first].crc == entry.second.crc;
+    }
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("manifest cached", 1, 0, seconds, same ? "ok" : "BAD");
+
+    std::filesystem::remove_all(root + "/album");
+    unlink((root + "/.manifest").c_str());
+    auto batch = [](const std::vector<AlbumFile> &files, uint64_t &sent) {
+        FakeHttpRequest request;
+        request.body.reserve(files.size() * (ALBUM_FILE_KB + 2) * 1024);
+        request.method = HTTP_POST;
+        request.uri = "/batch";
+        sent = 0;
+        for (const AlbumFile &f : files) {
+            request.body += tar_header(f.path.substr(1), f.size, f.mtime);
+            for (uint64_t i = 0; i < f.size; i++) {
+                request.body += (char)fake_httpd::pattern(i);
+            }
+            request.body += std::string(tar_padding(f.size), '\0');
+            sent += f.size;
+        }
+        request.body += std::string(TAR_END_SIZE, '\0');
+        return request;
+    };
+    uint64_t sent;
+    FakeHttpRequest request = batch(files, sent);
+    t0 = fake_adf::now_us();
+    FakeHttpResponse response = fake_httpd::request(request);
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("batch", 1, sent, seconds,
+               response.code() == 200 && verify_album(files) ? "ok" : "BAD");
+    t0 = fake_adf::now_us();
+    manifest = parse_manifest(fake_httpd::request(query).body);
+    bool times = manifest.size() == files.size();
+    for (const AlbumFile &f : files) {
+        times = times && sync_check(manifest, f.path, f.size, f.mtime) == SyncCheck::SAME;
+    }
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("manifest noted", 1, 0, seconds, times ? "ok" : "BAD");
+
+    // Three files retagged, the tool sends what the manifest says differs
+    for (int i : {3, 17, 29}) {
+        files[i].size += 512;
+        files[i].mtime += 86400;
+    }
+    std::vector<AlbumFile> changed;
+    for (const AlbumFile &f : files) {
+        if (sync_check(manifest, f.path, f.size, f.mtime) != SyncCheck::SAME) {
+            changed.push_back(f);
+        }
+    }
+    request = batch(changed, sent);
+    t0 = fake_adf::now_us();
+    parse_manifest(fake_httpd::request(query).body);
+    response = fake_httpd::request(request);
+    seconds = (fake_adf::now_us() - t0) / 1e6;
+    print_sync("resync", 2, sent, seconds,
+               response.code() == 200 && changed.size() == 3 && verify_album(files) ? "ok" : "BAD");
+    std::filesystem::remove_all(root + "/album");
+    unlink((root + "/.manifest").c_str());
+}
+
+static bool is_pattern(const std::string &body, uint64_t offset)
+{
+    for (size_t i = 0; i < body.size(); i++) {
+        if ((uint8_t)body[i] != fake_httpd::pattern(offset + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void downloads(uint64_t size)
+{
+    std::string path = root + "/bench_download.mp3";
+    FILE *file = fopen(path.c_str(), "wb");
+    std::vector<char> buf(64 * 1024);
+    for (uint64_t offset = 0; offset < size; offset += buf.size()) {
+        for (size_t i = 0; i < buf.size(); i++) {
+            buf[i] = fake_httpd::pattern(offset + i);
+        }
+        fwrite(buf.data(), 1, std::min<uint64_t>(buf.size(), size - offset), file);
+    }
+    fclose(file);
+
+    FakeAdfCosts &costs = fake_adf::costs();
+    FakeLinkCosts &link = fake_httpd::costs();
+    const FakeLinkCosts wifi = link;
+    printf("\n%llu MB downloads, card %d us/KB, buffers 2 x %d KB\n", (unsigned long long)(size >> 20),
+           costs.read_us_per_kb, CONFIG_FILE_SERVER_DOWNLOAD_BUFFER_KB);
+    printf("%-16s %-8s %-8s %6s %8s %8s %8s %8s %8s\n", "link", "card", "handler", "status", "KB/s", "sends",
+           "reads", "read ms", "content");
+    for (bool fast : {false, true}) {
+        link.send_kb_per_s = fast ? FAST_LINK_KB_PER_S : wifi.send_kb_per_s;
+        link.send_window = fast ? FAST_LINK_WINDOW : wifi.send_window;
+        std::string link_name = std::to_string(link.send_kb_per_s) + " KB/s " +
+                                std::to_string(link.send_window / 1024) + "K";
+        for (int card = 0; card < 2; card++) {
+            costs.card_busy_us = card == 1 ? BENCH_BUSY_US : 0;
+            costs.card_busy_period_ms = card == 1 ? BENCH_BUSY_PERIOD_MS : 0;
+            for (const char *handler : {"/chunked", ""}) {
+                FakeHttpRequest request;
+                request.uri = std::string(handler) + "/bench_download.mp3";
+                fake_adf::mark();
+                int64_t t0 = fake_adf::now_us();
+                FakeHttpResponse r = fake_httpd::request(request);
+                double seconds = (fake_adf::now_us() - t0) / 1e6;
+                FakeCardStats card_stats = fake_adf::card_stats();
+                printf("%-16s %-8s %-8s %6d %8.0f %8d %8llu %8.0f %8s\n", link_name.c_str(),
+                       card == 0 ? "quiet" : "player", *handler ? handler + 1 : "download", r.code(),
+                       size / 1024.0 / seconds, r.sends, (unsigned long long)card_stats.reads,
+                       card_stats.read_us / 1000.0, r.body.size() == size && is_pattern(r.body, 0) ? "ok" : "BAD");
+            }
+        }
+    }
+    link = wifi;
+    costs.card_busy_us = 0;
+    costs.card_busy_period_ms = 0;
+
+    FakeHttpRequest range;
+    range.uri = "/bench_download.mp3";
+    range.headers = {{"Range", "bytes=100000-"}};
+    FakeHttpResponse r = fake_httpd::request(range);
+    bool ok = r.code() == 206 && r.body.size() == size - 100000 && is_pattern(r.body, 100000) &&
+              r.header("Content-Length") == std::to_string(size - 100000);
+    printf("range from 100000: status %d, %s\n", r.code(), ok ? "ok" : "BAD");
+
+    FakeHttpRequest gone;
+    gone.uri = "/bench_download.mp3";
+    gone.close_after = size / 2;
+    r = fake_httpd::request(gone);
+    // The buffers must be back in the pool for the next one
+    int64_t t0 = fake_adf::now_us();
+    FakeHttpResponse next = fake_httpd::request(range);
+    double seconds = (fake_adf::now_us() - t0) / 1e6;
+    printf("client gone half way: handler %s, next download %.0f KB/s %s\n", r.result == ESP_OK ? "ok" : "failed",
+           (size - 100000) / 1024.0 / seconds, next.body.size() == size - 100000 ? "ok" : "BAD");
+    unlink(path.c_str());
+}
+
+static size_t count(const std::string &body, const std::string &what)
+{
+    size_t n = 0;
+    for (size_t at = body.find(what); at != std::string::npos; at = body.find(what, at + 1)) {
+        n++;
+    }
+    return n;
+}
+
+/// Value of "key": in a JSON listing, -1 for null or none
+static long json_number(const std::string &body, const std::string &key)
+{
+    size_t at = body.find("\"" + key + "\":");
+    if (at == std::string::npos || body.compare(at + key.size() + 3, 4, "null") == 0) {
+        return -1;
+    }
+    return atol(body.c_str() + at + key.size() + 3);
+}
+
+static void listings()
+{
+    std::string folder = root + "/folder";
+    std::filesystem::remove_all(folder);
+    mkdir(folder.c_str(), 0755);
+    for (int i = 0; i < FOLDER_FILES; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/%03d - Track number %d.mp3", (i * 7) % FOLDER_FILES, i);
+        std::ofstream(folder + name);
+        std::filesystem::resize_file(folder + name, 3000000 + i);
+    }
+    mkdir((folder + "/Artwork").c_str(), 0755);
+    std::ofstream(folder + "/.hidden");
+
+    FakeAdfCosts &costs = fake_adf::costs();
+    costs.stat_us = FOLDER_STAT_US;
+    printf("\nfolder of %d files, %d ms per stat\n", FOLDER_FILES, FOLDER_STAT_US / 1000);
+    printf("%-16s %8s %8s %8s %8s %8s %8s %8s\n", "listing", "requests", "entries", "sends", "stats", "KB", "s",
+           "content");
+    // JSON pages are requested until next is null
+    auto list = [](const char *name, const std::string &uri, size_t expect) {
+        fake_adf::mark();
+        int64_t t0 = fake_adf::now_us();
+        bool json = uri.compare(0, 5, "/list") == 0;
+        int requests = 0;
+        int sends = 0;
+        size_t bytes = 0;
+        size_t entries = 0;
+        bool ok = true;
+        for (long next = 0; next >= 0; requests++) {
+            FakeHttpRequest request;
+            request.uri = uri + (next > 0 ? "&offset=" + std::to_string(next) : "");
+            FakeHttpResponse r = fake_httpd::request(request);
+            sends += r.sends;
+            bytes += r.body.size();
+            entries += count(r.body, json ? "{\"name\":" : "<td><a href");
+            ok = ok && r.code() == 200 && (!json || json_number(r.body, "total") == (long)expect);
+            next = json ? json_number(r.body, "next") : -1;
+        }
+        double seconds = (fake_adf::now_us() - t0) / 1e6;
+        printf("%-16s %8d %8zu %8d %8llu %8.1f %8.2f %8s\n", name, requests, entries, sends,
+               (unsigned long long)fake_adf::card_stats().stats, bytes / 1024.0, seconds,
+               ok && entries == expect ? "ok" : "BAD");
+    };
+    // The old one lists everything readdir returns, "." and ".." included on the host
+    list("oldlist", "/oldlist/folder/", FOLDER_FILES + 4);
+    list("html cold", "/folder/", FOLDER_FILES + 1);
+    list("html cached", "/folder/", FOLDER_FILES + 1);
+    list("json pages", "/list/folder?limit=100", FOLDER_FILES + 1);
+    list("json filtered", "/list/folder/?filter=number+1&type=file&limit=1000", 111);
+
+    // Changes made through the server are noted, the folder isn't read again
+    FakeHttpRequest upload;
+    upload.method = HTTP_POST;
+    upload.uri = "/upload/folder/New track.mp3";
+    upload.body_size = 100000;
+    fake_httpd::request(upload);
+    FakeHttpRequest query;
+    query.uri = "/list/folder?filter=new";
+    fake_adf::mark();
+    FakeHttpResponse added = fake_httpd::request(query);
+    FakeHttpRequest remove;
+    remove.method = HTTP_POST;
+    remove.uri = "/delete/folder/New track.mp3";
+    fake_httpd::request(remove);
+    FakeHttpResponse removed = fake_httpd::request(query);
+    bool noted = json_number(added.body, "total") == 1 && json_number(added.body, "size") == 100000 &&
+                 json_number(removed.body, "total") == 0 && fake_adf::card_stats().stats <= 2;
+    printf("upload and delete noted: %s\n", noted ? "ok" : "BAD");
+
+    costs.stat_us = 0;
+    std::filesystem::remove_all(folder);
+}
+
+/// Root files named like a route of the server still download
+static void shadowing()
+{
+    bool served = true;
+    for (const char *name : {"manifest_notes.txt", "listening.mp3", "list.m3u"}) {
+        std::string path = root + "/" + name;
+        FILE *fd = fopen(path.c_str(), "w");
+        fputs(name, fd);
+        fclose(fd);
+        FakeHttpRequest request;
+        request.uri = std::string("/") + name;
+        FakeHttpResponse response = fake_httpd::request(request);
+        served = served && response.code() == 200 && response.body == name;
+        unlink(path.c_str());
+    }
+    printf("root files named like routes: %s\n", served ? "ok" : "BAD");
+}
+
+/// Stop and start the server as the file service does
+static void restart()
+{
+    FakeHttpRequest request;
+    request.uri = "/list/";
+    int64_t before = fake_adf::now_us();
+    bool served = fake_httpd::request(request).code() == 200;
+    bool active = example_file_server_last_active_us() >= before;
+    bool stopped = example_stop_file_server() == ESP_OK && example_file_server_last_active_us() == 0 &&
+                   fake_httpd::request(request).code() == 404 && example_stop_file_server() == ESP_ERR_INVALID_STATE;
+    bool started = example_start_file_server(root.c_str()) == ESP_OK && fake_httpd::request(request).code() == 200;
+    printf("\nrestart: %s\n", served && active && stopped && started ? "ok" : "BAD");
+}
+
+int main(int argc, char **argv)
+{
+    int mb = argc > 1 ? atoi(argv[1]) : 4;
+    uint64_t size = (uint64_t)mb * 1024 * 1024;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    mkdir(root.c_str(), 0755);
+
+    // Started first so its handlers win over the file server's "/*"
+    httpd_handle_t direct_server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    httpd_start(&direct_server, &config);
+    httpd_uri_t direct = {
+        .uri = "/direct/*",
+        .method = HTTP_POST,
+        .handler = direct_upload_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(direct_server, &direct);
+    httpd_uri_t chunked = {
+        .uri = "/chunked/*",
+        .method = HTTP_GET,
+        .handler = chunked_download_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(direct_server, &chunked);
+    httpd_uri_t oldlist = {
+        .uri = "/oldlist/*",
+        .method = HTTP_GET,
+        .handler = oldlist_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(direct_server, &oldlist);
+    example_start_file_server(root.c_str());
+
+    FakeAdfCosts &costs = fake_adf::costs();
+    FakeLinkCosts &link = fake_httpd::costs();
+    const FakeLinkCosts wifi = link;
+    printf("%d MB uploads, card %d us/KB + %d us per write, buffers 2 x %d KB\n", mb, costs.write_us_per_kb,
+           costs.write_call_us, CONFIG_FILE_SERVER_UPLOAD_BUFFER_KB);
+    printf("%-16s %-8s %-8s %6s %8s %8s %9s %9s %8s\n", "link", "card", "handler", "status", "KB/s", "writes",
+           "write ms", "card use", "content");
+    for (bool fast : {false, true}) {
+        link.recv_kb_per_s = fast ? FAST_LINK_KB_PER_S : wifi.recv_kb_per_s;
+        link.window = fast ? FAST_LINK_WINDOW : wifi.window;
+        std::string link_name = std::to_string(link.recv_kb_per_s) + " KB/s " + std::to_string(link.window / 1024) + "K";
+        for (int card = 0; card < 3; card++) {
+            costs.card_busy_us = card == 1 ? BENCH_BUSY_US : 0;
+            costs.card_busy_period_ms = card == 1 ? BENCH_BUSY_PERIOD_MS : 0;
+            costs.write_stall_us = card == 2 ? BENCH_STALL_US : 0;
+            costs.write_stall_every_kb = card == 2 ? BENCH_STALL_EVERY_KB : 0;
+            for (const char *handler : {"/direct", "/upload"}) {
+                Result r = upload(handler, "bench_upload.mp3", size);
+                printf("%-16s %-8s %-8s %6d %8.0f %8llu %9.0f %8.1f%% %8s\n", link_name.c_str(),
+                       card == 0 ? "quiet" : card == 1 ? "player" : "stalls", handler + 1, r.code,
+                       size / 1024.0 / r.seconds, (unsigned long long)r.card.writes, r.card.write_us / 1000.0,
+                       r.card.write_us / (r.seconds * 1e4), r.verified ? "ok" : "BAD");
+            }
+        }
+    }
+    link = wifi;
+    costs.write_stall_us = 0;
+    costs.write_stall_every_kb = 0;
+
+    // The connection breaks half way, nothing may be left behind
+    FakeHttpRequest broken;
+    broken.method = HTTP_POST;
+    broken.uri = "/upload/bench_broken.mp3";
+    broken.body_size = 1024 * 1024;
+    broken.break_after = broken.body_size / 2;
+    esp_log_level_set("*", ESP_LOG_NONE);
+    FakeHttpResponse response = fake_httpd::request(broken);
+    bool clean = !exists(root + "/bench_broken.mp3") && !exists(root + "/bench_broken.mp3.part");
+    printf("broken upload: status %d, %s\n", response.code(), clean ? "nothing left behind" : "LEFT FILES BEHIND");
+
+    printf("\nlink drops after %.1f, %.1f and %.1f x the file, %d KB chunks\n", drops[0], drops[1], drops[2],
+           RESUME_CHUNK / 1024);
+    printf("%-8s %8s %8s %8s %8s\n", "upload", "requests", "sent MB", "s", "content");
+    for (bool resumable : {false, true}) {
+        FlakyResult r = resumable ? resume_flaky("bench_flaky.mp3", size) : plain_flaky("bench_flaky.mp3", size);
+        printf("%-8s %8d %8.2f %8.2f %8s\n", resumable ? "resume" : "plain", r.requests, r.sent / 1048576.0,
+               r.seconds, r.verified ? "ok" : "BAD");
+    }
+
+    // A chunk that arrives damaged is cut off again
+    FakeHttpRequest chunk;
+    chunk.method = HTTP_PUT;
+    chunk.body_size = RESUME_CHUNK;
+    chunk.uri = "/resume/bench_crc.mp3?offset=0&crc32=" + hex(pattern_crc(0, RESUME_CHUNK));
+    fake_httpd::request(chunk);
+    chunk.body_offset = RESUME_CHUNK;
+    chunk.uri = "/resume/bench_crc.mp3?offset=" + std::to_string(RESUME_CHUNK) + "&crc32=" +
+                hex(pattern_crc(0, RESUME_CHUNK));
+    response = fake_httpd::request(chunk);
+    bool kept = response.header("Upload-Offset") == std::to_string(RESUME_CHUNK) && verify(root + "/bench_crc.mp3.part", RESUME_CHUNK);
+    printf("damaged chunk: status %d, %s\n", response.code(), kept ? "previous chunks kept" : "PART FILE WRONG");
+    unlink((root + "/bench_crc.mp3.part").c_str());
+
+    library_sync();
+    downloads(size);
+    listings();
+    shadowing();
+    restart();
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*  Many clients at once against the file server on the host.
+
+    The box serves one request at a time, more httpd workers or async
+    handlers would serve several. Here every client is a thread calling
+    the real handlers through the fake esp_http_server (fake_httpd.h) at
+    the same time, onto the one fake SD card of fake_adf.h. Every client
+    has a link of its own, the card is shared, so the aggregate shows what
+    the box could serve rather than what one access point carries.
+    In each round a client
+      uploads a file of its own and downloads it again,
+      downloads a range of a file all clients share,
+      stores three small files as a tar stream (/batch),
+      lists its directory (/manifest/<dir>) and checks the CRC-32s,
+    and client 0 lists the whole card without reading files for their
+    CRC-32 (?hash=0), which rewrites .manifest while the others note
+    their files in it. A 503 is retried after Retry-After.
+    Afterwards every file is checked on the card and in a last manifest.
+    A burst of downloads of the shared file, more than the transfer pool
+    has buffers, shows the back-pressure.
+
+    Usage: file_server_stress [max clients] [rounds]
+*/
+#include "fake_adf.h"
+#include "fake_httpd.h"
+#include "library_sync.h"
+
+extern "C" {
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "file_server.h"
+}
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STRESS_FILE_KB      192
+#define STRESS_BATCH_FILES  3
+#define STRESS_BATCH_KB     24
+#define STRESS_SHARED_KB    1024
+#define STRESS_RANGE_KB     64
+#define STRESS_BURST        20
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+static const std::string dir = "/stress";
+
+/// Content of every file is the pattern from an offset of its own
+struct StressFile {
+    std::string path;               ///< below the card root
+    uint64_t size;
+    uint64_t offset;
+};
+
+static uint32_t pattern_crc(uint64_t offset, uint64_t len)
+{
+    uint8_t buf[4096];
+    uint32_t crc = 0;
+    while (len > 0) {
+        size_t n = std::min<uint64_t>(len, sizeof(buf));
+        for (size_t i = 0; i < n; i++) {
+            buf[i] = fake_httpd::pattern(offset + i);
+        }
+        crc = esp_rom_crc32_le(crc, buf, n);
+        offset += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static bool is_pattern(const std::string &body, uint64_t offset)
+{
+    for (size_t i = 0; i < body.size(); i++) {
+        if ((uint8_t)body[i] != fake_httpd::pattern(offset + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool verify(const StressFile &f)
+{
+    FILE *file = fopen((root + f.path).c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::string content(f.size + 1, '\0');
+    size_t n = fread(&content[0], 1, content.size(), file);
+    fclose(file);
+    content.resize(n);
+    return n == f.size && is_pattern(content, f.offset);
+}
+
+struct Totals {
+    std::atomic<int> requests{0};
+    std::atomic<int> retries{0};       ///< answered 503
+    std::atomic<int> failures{0};      ///< wrong status or content
+    std::atomic<uint64_t> bytes{0};    ///< body bytes up and down
+};
+
+/// Send @p request until it is not turned away, as a client should
+static FakeHttpResponse send(const FakeHttpRequest &request, Totals &totals)
+{
+    while (true) {
+        totals.requests++;
+        FakeHttpResponse response = fake_httpd::request(request);
+        if (response.code() != 503) {
+            totals.bytes += response.received + response.body.size();
+            return response;
+        }
+        totals.retries++;
+        int after = atoi(response.header("Retry-After").c_str());
+        std::this_thread::sleep_for(std::chrono::seconds(std::max(after, 1)));
+    }
+}
+
+static void check(bool ok, const char *what, int client, Totals &totals)
+{
+    if (!ok) {
+        fprintf(stderr, "client %d: %s failed\n", client, what);
+        totals.failures++;
+    }
+}
+
+static void client(int c, int rounds, std::vector<StressFile> &files, Totals &totals)
+{
+    std::string own = dir + "/c" + std::to_string(c);
+    mkdir((root + own).c_str(), 0755);
+    for (int r = 0; r < rounds; r++) {
+        uint64_t base = ((uint64_t)c * 1000 + r) * 1048573;
+
+        StressFile file = {own + "/r" + std::to_string(r) + ".bin", STRESS_FILE_KB * 1024, base};
+        FakeHttpRequest upload;
+        upload.method = HTTP_POST;
+        upload.uri = "/upload" + file.path;
+        upload.body_size = file.size;
+        upload.body_offset = file.offset;
+        check(send(upload, totals).code() == 303, "upload", c, totals);
+        files.push_back(file);
+
+        FakeHttpRequest download;
+        download.uri = file.path;
+        FakeHttpResponse response = send(download, totals);
+        check(response.code() == 200 && response.body.size() == file.size && is_pattern(response.body, file.offset),
+              "download", c, totals);
+
+        uint64_t first = (base / 7) % ((STRESS_SHARED_KB - STRESS_RANGE_KB) * 1024);
+        FakeHttpRequest range;
+        range.uri = dir + "/shared.bin";
+        range.headers = {{"Range", "bytes=" + std::to_string(first) + "-" +
+                                   std::to_string(first + STRESS_RANGE_KB * 1024 - 1)}};
+        response = send(range, totals);
+        check(response.code() == 206 && response.body.size() == STRESS_RANGE_KB * 1024 &&
+              is_pattern(response.body, first), "range", c, totals);
+
+        FakeHttpRequest batch;
+        batch.method = HTTP_POST;
+        batch.uri = "/batch";
+        for (int i = 0; i < STRESS_BATCH_FILES; i++) {
+            StressFile f = {own + "/b" + std::to_string(r) + "_" + std::to_string(i) + ".bin",
+                            (uint64_t)STRESS_BATCH_KB * 1024 + i * 100, base + (i + 1) * 65537};
+            batch.body += tar_header(f.path.substr(1), f.size, 1700000000 + r);
+            for (uint64_t j = 0; j < f.size; j++) {
+                batch.body += (char)fake_httpd::pattern(f.offset + j);
+            }
+            batch.body += std::string(tar_padding(f.size), '\0');
+            files.push_back(f);
+        }
+        batch.body += std::string(TAR_END_SIZE, '\0');
+        check(send(batch, totals).code() == 200, "batch", c, totals);
+
+        FakeHttpRequest query;
+        query.uri = c == 0 ? "/manifest?hash=0" : "/manifest" + own;
+        Manifest manifest = parse_manifest(send(query, totals).body);
+        bool listed = true;
+        for (const StressFile &f : files) {
+            auto it = manifest.find(f.path);
+            listed = listed && it != manifest.end() && it->second.size == f.size &&
+                     (!it->second.hashed || it->second.crc == pattern_crc(f.offset, f.size));
+        }
+        check(listed, "manifest", c, totals);
+    }
+}
+
+struct Run {
+    double seconds = 0;
+    FakeCardStats card;
+};
+
+static Run run_clients(int clients, int rounds, std::vector<std::vector<StressFile>> &files, Totals &totals)
+{
+    files.assign(clients, {});
+    std::vector<std::thread> threads;
+    fake_adf::mark();
+    int64_t t0 = fake_adf::now_us();
+    for (int c = 0; c < clients; c++) {
+        threads.emplace_back(client, c, rounds, std::ref(files[c]), std::ref(totals));
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    Run run;
+    run.seconds = (fake_adf::now_us() - t0) / 1e6;
+    run.card = fake_adf::card_stats();
+    return run;
+}
+
+/// Every file on the card and in a fresh manifest, with its CRC-32
+static bool verify_all(const std::vector<std::vector<StressFile>> &files)
+{
+    FakeHttpRequest query;
+    query.uri = "/manifest" + dir;
+    Manifest manifest = parse_manifest(fake_httpd::request(query).body);
+    bool ok = true;
+    for (const std::vector<StressFile> &own : files) {
+        for (const StressFile &f : own) {
+            auto it = manifest.find(f.path);
+            ok = ok && verify(f) && it != manifest.end() && it->second.hashed &&
+                 it->second.crc == pattern_crc(f.offset, f.size);
+        }
+    }
+    return ok;
+}
+
+static void write_shared()
+{
+    FILE *file = fopen((root + dir + "/shared.bin").c_str(), "wb");
+    std::vector<char> buf(STRESS_SHARED_KB * 1024);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = fake_httpd::pattern(i);
+    }
+    fwrite(buf.data(), 1, buf.size(), file);
+    fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+    int max_clients = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    example_start_file_server(root.c_str());
+
+    printf("%d rounds per client, transfer pool %d x %d KB, download pool %d x %d KB\n", rounds,
+           CONFIG_FILE_SERVER_TRANSFER_BUFFERS, CONFIG_FILE_SERVER_TRANSFER_BUFFER_KB,
+           CONFIG_FILE_SERVER_DOWNLOAD_BUFFERS, CONFIG_FILE_SERVER_DOWNLOAD_BUFFER_KB);
+    printf("%-8s %8s %8s %8s %8s %8s %9s %8s\n", "clients", "requests", "503", "MB", "s", "MB/s", "card use",
+           "content");
+    for (int clients = 1; clients <= max_clients; clients *= 2) {
+        std::filesystem::remove_all(root + dir);
+        unlink((root + "/.manifest").c_str());
+        mkdir((root + dir).c_str(), 0755);
+        write_shared();
+
+        Totals totals;
+        std::vector<std::vector<StressFile>> files;
+        Run run = run_clients(clients, rounds, files, totals);
+        bool ok = totals.failures == 0 && verify_all(files);
+        printf("%-8d %8d %8d %8.2f %8.2f %8.2f %8.1f%% %8s\n", clients, totals.requests.load(),
+               totals.retries.load(), totals.bytes / 1048576.0, run.seconds, totals.bytes / 1048576.0 / run.seconds,
+               (run.card.open_us + run.card.read_us + run.card.write_us) / (run.seconds * 1e4), ok ? "ok" : "BAD");
+    }
+
+    // More downloads at once than there are transfer buffers
+    Totals totals;
+    std::vector<std::thread> threads;
+    int64_t t0 = fake_adf::now_us();
+    for (int i = 0; i < STRESS_BURST; i++) {
+        threads.emplace_back([&totals, i] {
+            FakeHttpRequest download;
+            download.uri = dir + "/shared.bin";
+            FakeHttpResponse response = send(download, totals);
+            check(response.code() == 200 && response.body.size() == STRESS_SHARED_KB * 1024 &&
+                  is_pattern(response.body, 0), "burst download", i, totals);
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double seconds = (fake_adf::now_us() - t0) / 1e6;
+    printf("burst of %d downloads: %d requests, %d turned away, %.2f s, %s\n", STRESS_BURST,
+           totals.requests.load(), totals.retries.load(), seconds, totals.failures == 0 ? "ok" : "BAD");
+
+    std::filesystem::remove_all(root + dir);
+    unlink((root + "/.manifest").c_str());
+    return 0;
+}
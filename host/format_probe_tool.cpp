@@ -0,0 +1,55 @@
+/*  Runs the player's format probe over files, e.g. a copy of the SD card.
+
+    Prints what the probe makes of every file and flags the ones whose
+    extension does not match, which the player would otherwise have sent
+    through the wrong decoder.
+
+    Usage: format_probe_tool file ...
+*/
+#include "format_probe.h"
+
+extern "C" {
+#include "esp_log.h"
+}
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+esp_log_level_t host_log_level = ESP_LOG_ERROR;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    host_log_level = level;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file ...\n", argv[0]);
+        return 1;
+    }
+    int unknown = 0;
+    int mislabelled = 0;
+    double total_us = 0;
+    for (int i = 1; i < argc; i++) {
+        format_probe_info_t info;
+        auto t0 = std::chrono::steady_clock::now();
+        esp_err_t ret = format_probe_file(argv[i], &info);
+        total_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        const char *name = format_probe_codec_name(info.codec);
+        const char *ext = strrchr(argv[i], '.');
+        bool matches = ext != NULL && strcasecmp(ext + 1, name) == 0;
+        if (ret != ESP_OK) {
+            unknown++;
+        } else if (!matches) {
+            mislabelled++;
+        }
+        printf("%-8s %6d Hz %d ch %2d bit  %s%s\n", name, info.sample_rate, info.channels, info.bits,
+               argv[i], ret == ESP_OK && !matches ? "  (extension does not match)" : "");
+    }
+    printf("%d files, %d unknown, %d mislabelled, %.1f us per probe\n",
+           argc - 1, unknown, mislabelled, total_us / (argc - 1));
+    return unknown > 0 || mislabelled > 0;
+}
@@ -0,0 +1,257 @@
+/*  The player and the file server on one slow SD card, with and without
+    the I/O arbiter.
+
+    Plays a 48 kHz stereo WAV file through playlist_stream -> wav decoder ->
+    i2s writer with the read-ahead, while clients upload and download
+    through the real file server handlers (fake_httpd.h) on fast links of
+    their own, so the card is the bottleneck. The card of fake_adf.h is the
+    shared storage: one access at a time, in whatever order the threads
+    come, slow per call and per KB, and stalling now and then on writes as
+    cheap cards do. Every run is played
+      alone     no clients, the baseline
+      off       with the clients, no arbiter
+      on        with the clients, the arbiter holding them back
+    Reports the silence the i2s writer played, the read-ahead underruns,
+    the KB/s every client got, and for "on" the report of the arbiter with
+    its throttles and prevented stalls.
+
+    Usage: io_arbiter_bench [seconds] [uploaders] [downloaders]
+*/
+#include "fake_adf.h"
+#include "fake_httpd.h"
+#include "playlist_stream.h"
+
+extern "C" {
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "audio_pipeline.h"
+#include "i2s_stream.h"
+#include "wav_decoder.h"
+#include "file_server.h"
+#include "io_arbiter.h"
+}
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_RATE              48000
+#define BENCH_CHANNELS          2
+#define BENCH_READ_US_PER_KB    1000
+#define BENCH_READ_CALL_US      1500
+#define BENCH_WRITE_US_PER_KB   700
+#define BENCH_WRITE_CALL_US     1000
+#define BENCH_STALL_US          250000
+#define BENCH_STALL_EVERY_KB    512
+#define BENCH_LINK_KB_PER_S     4000
+#define BENCH_LINK_WINDOW       65536
+#define BENCH_UPLOAD_KB         256
+#define BENCH_DOWNLOAD_KB       512
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+static void put_le(std::ofstream &file, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        file.put((char)(value >> (8 * i)));
+    }
+}
+
+static void write_wav(const std::string &path, int seconds)
+{
+    uint32_t byte_rate = BENCH_RATE * BENCH_CHANNELS * 2;
+    uint32_t data_size = byte_rate * seconds;
+    std::ofstream file(path, std::ios::binary);
+    file.write("RIFF", 4);
+    put_le(file, 36 + data_size, 4);
+    file.write("WAVEfmt ", 8);
+    put_le(file, 16, 4);
+    put_le(file, 1, 2);
+    put_le(file, BENCH_CHANNELS, 2);
+    put_le(file, BENCH_RATE, 4);
+    put_le(file, byte_rate, 4);
+    put_le(file, BENCH_CHANNELS * 2, 2);
+    put_le(file, 16, 2);
+    file.write("data", 4);
+    put_le(file, data_size, 4);
+    std::vector<char> second(byte_rate, 0);
+    for (int i = 0; i < seconds; i++) {
+        file.write(second.data(), second.size());
+    }
+}
+
+static void write_download(const std::string &path)
+{
+    std::ofstream file(path, std::ios::binary);
+    std::vector<char> buf(BENCH_DOWNLOAD_KB * 1024);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = fake_httpd::pattern(i);
+    }
+    file.write(buf.data(), buf.size());
+}
+
+struct Client {
+    bool upload;
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int> requests{0};
+    std::atomic<int> failures{0};
+};
+
+/// Upload or download until @p stop, one request after the other
+static void client(Client &c, int id, const std::atomic<bool> &stop)
+{
+    for (int i = 0; !stop; i++) {
+        FakeHttpRequest request;
+        if (c.upload) {
+            request.method = HTTP_POST;
+            request.uri = "/upload/arbiter/c" + std::to_string(id) + "_" + std::to_string(i) + ".bin";
+            request.body_size = BENCH_UPLOAD_KB * 1024;
+        } else {
+            request.uri = "/arbiter/download.bin";
+        }
+        FakeHttpResponse r = fake_httpd::request(request);
+        bool ok = c.upload ? r.code() == 303 : r.code() == 200 && r.body.size() == BENCH_DOWNLOAD_KB * 1024;
+        c.failures += ok ? 0 : 1;
+        c.requests++;
+        c.bytes += c.upload ? r.received : r.body.size();
+        if (c.upload) {
+            unlink((root + request.uri.substr(sizeof("/upload") - 1)).c_str());
+        }
+    }
+}
+
+struct Result {
+    FakeI2sStats i2s;
+    read_ahead_stats_t read_ahead = {};
+    std::vector<double> kb_per_s;   ///< per client
+    int failures = 0;
+    char report[1024] = "";         ///< of the arbiter
+};
+
+static Result play(const std::string &path, int seconds, int uploaders, int downloaders)
+{
+    playlist_stream_cfg_t reader_cfg = PLAYLIST_STREAM_CFG_DEFAULT();
+    reader_cfg.read_ahead_block = CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE;
+    reader_cfg.read_ahead_size = CONFIG_PLAYLIST_READ_AHEAD_KB * 1024;
+    reader_cfg.read_ahead_refill = reader_cfg.read_ahead_size * CONFIG_PLAYLIST_READ_AHEAD_REFILL_PERCENT / 100;
+    audio_element_handle_t reader = playlist_stream_init(&reader_cfg);
+    wav_decoder_cfg_t wav_cfg = DEFAULT_WAV_DECODER_CONFIG();
+    audio_element_handle_t decoder = wav_decoder_init(&wav_cfg);
+    i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
+    audio_element_handle_t i2s = i2s_stream_init(&i2s_cfg);
+    i2s_stream_set_clk(i2s, BENCH_RATE, 16, BENCH_CHANNELS);
+
+    audio_pipeline_cfg_t cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    audio_pipeline_handle_t pipeline = audio_pipeline_init(&cfg);
+    audio_pipeline_register(pipeline, reader, "file");
+    audio_pipeline_register(pipeline, decoder, "wav");
+    audio_pipeline_register(pipeline, i2s, "i2s");
+    const char *link[] = {"file", "wav", "i2s"};
+    audio_pipeline_link(pipeline, link, 3);
+    audio_element_set_uri(reader, path.c_str());
+
+    fake_adf::mark();
+    io_arbiter_reset_stats();
+    audio_pipeline_run(pipeline);
+    // The clients start once the ring had a moment to fill, as a sync would
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::atomic<bool> stop{false};
+    std::vector<Client> clients(uploaders + downloaders);
+    std::vector<std::thread> threads;
+    int64_t t0 = fake_adf::now_us();
+    for (int i = 0; i < (int)clients.size(); i++) {
+        clients[i].upload = i < uploaders;
+        threads.emplace_back(client, std::ref(clients[i]), i, std::cref(stop));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    // The requests in flight are finished, and counted
+    stop = true;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    Result result;
+    double elapsed = (fake_adf::now_us() - t0) / 1e6;
+    result.i2s = fake_adf::i2s_stats();
+    playlist_stream_get_read_stats(reader, &result.read_ahead);
+    io_arbiter_format(result.report, sizeof(result.report));
+    for (Client &c : clients) {
+        result.kb_per_s.push_back(c.bytes / 1024.0 / elapsed);
+        result.failures += c.failures;
+    }
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_terminate(pipeline);
+    audio_pipeline_unlink(pipeline);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    int uploaders = argc > 2 ? atoi(argv[2]) : 4;
+    int downloaders = argc > 3 ? atoi(argv[3]) : 4;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    mkdir(root.c_str(), 0755);
+    mkdir((root + "/arbiter").c_str(), 0755);
+    std::string path = root + "/arbiter/track.wav";
+    write_wav(path, seconds + 10);
+    write_download(root + "/arbiter/download.bin");
+    example_start_file_server(root.c_str());
+
+    FakeAdfCosts &costs = fake_adf::costs();
+    costs.read_us_per_kb = BENCH_READ_US_PER_KB;
+    costs.read_call_us = BENCH_READ_CALL_US;
+    costs.write_us_per_kb = BENCH_WRITE_US_PER_KB;
+    costs.write_call_us = BENCH_WRITE_CALL_US;
+    costs.write_stall_us = BENCH_STALL_US;
+    costs.write_stall_every_kb = BENCH_STALL_EVERY_KB;
+    FakeLinkCosts &link = fake_httpd::costs();
+    link.recv_kb_per_s = BENCH_LINK_KB_PER_S;
+    link.send_kb_per_s = BENCH_LINK_KB_PER_S;
+    link.window = BENCH_LINK_WINDOW;
+    link.send_window = BENCH_LINK_WINDOW;
+
+    printf("%d s of 48 kHz stereo WAV, read-ahead %d KB, %d uploaders, %d downloaders\n", seconds,
+           CONFIG_PLAYLIST_READ_AHEAD_KB, uploaders, downloaders);
+    printf("card %d us/KB + %d us per read, %d us/KB + %d us per write, %d ms stall every %d KB written\n",
+           costs.read_us_per_kb, costs.read_call_us, costs.write_us_per_kb, costs.write_call_us,
+           BENCH_STALL_US / 1000, BENCH_STALL_EVERY_KB);
+    printf("arbiter holds transfers below %d%% of the ring until %d%%, %d ms at most\n",
+           CONFIG_IO_ARBITER_LOW_PERCENT, CONFIG_IO_ARBITER_HIGH_PERCENT, CONFIG_IO_ARBITER_MAX_HOLD_MS);
+    printf("%-8s %5s %11s %8s %9s %10s %12s %8s\n", "arbiter", "gaps", "silence ms", "max ms", "underruns",
+           "upload KB/s", "download KB/s", "content");
+    io_arbiter_cfg_t arbiter_cfg = IO_ARBITER_CFG_DEFAULT();
+    for (const char *mode : {"alone", "off", "on"}) {
+        bool on = mode[1] == 'n';
+        if (on) {
+            io_arbiter_init(&arbiter_cfg);
+        }
+        bool alone = mode[0] == 'a';
+        Result r = play(path, seconds, alone ? 0 : uploaders, alone ? 0 : downloaders);
+        int64_t max_gap = 0;
+        for (int64_t gap : r.i2s.gaps_us) {
+            max_gap = gap > max_gap ? gap : max_gap;
+        }
+        double up = 0;
+        double down = 0;
+        for (size_t i = 0; i < r.kb_per_s.size(); i++) {
+            (i < (size_t)uploaders ? up : down) += r.kb_per_s[i];
+        }
+        printf("%-8s %5zu %11.1f %8.1f %9u %10.0f %12.0f %8s\n", mode, r.i2s.gaps_us.size(),
+               r.i2s.underrun_frames * 1000.0 / BENCH_RATE, max_gap / 1000.0, r.read_ahead.underruns, up, down,
+               r.failures == 0 ? "ok" : "BAD");
+        if (on) {
+            printf("%s", r.report);
+            io_arbiter_deinit();
+        }
+    }
+    return 0;
+}
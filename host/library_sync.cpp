@@ -0,0 +1,321 @@
+/*  Pushes a music library to the box, only what changed.
+
+    Fetches the manifest of the box (GET /manifest?hash=0), compares it
+    with the files below the local directory and sends the ones that are
+    missing or differ in one tar stream (POST /batch). Files of the same
+    size with another mtime are checked by CRC-32 once the box knows it,
+    without it they are sent. Afterwards the manifest is fetched again
+    and the CRC-32 of every sent file compared with what was read here.
+    Files only on the box are listed, not deleted.
+
+    Usage: library_sync [-n] <music dir> <box>[:port]   (-n: only list)
+*/
+extern "C" {
+#include "esp_rom_crc.h"
+}
+#include "library_sync.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct LocalFile {
+    std::string path;               ///< "/album/01.mp3"
+    fs::path file;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static int connect_to(const std::string &host, const std::string &port)
+{
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int sock = -1;
+    for (addrinfo *ai = res; ai && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+static bool send_all(int sock, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/// Decoded body of a chunked response, false while it is incomplete
+static bool dechunk(const std::string &chunked, std::string &body)
+{
+    body.clear();
+    size_t at = 0;
+    while (true) {
+        size_t line_end = chunked.find("\r\n", at);
+        if (line_end == std::string::npos) {
+            return false;
+        }
+        size_t len = strtoul(chunked.c_str() + at, NULL, 16);
+        if (len == 0) {
+            return true;
+        }
+        if (line_end + 2 + len + 2 > chunked.size()) {
+            return false;
+        }
+        body.append(chunked, line_end + 2, len);
+        at = line_end + 2 + len + 2;
+    }
+}
+
+/// Read one response, returns the status. The httpd of the box keeps
+/// the connection open, so the body ends by its length
+static int read_response(int sock, std::string &body)
+{
+    std::string raw;
+    std::string head;
+    size_t body_at = std::string::npos;
+    long long length = -1;
+    bool chunked = false;
+    char buf[4096];
+    while (true) {
+        if (body_at != std::string::npos) {
+            std::string rest = raw.substr(body_at);
+            if (chunked ? dechunk(rest, body) : length >= 0 && (long long)rest.size() >= length) {
+                if (!chunked) {
+                    body = rest.substr(0, length);
+                }
+                break;
+            }
+        }
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            if (body_at == std::string::npos) {
+                return 0;
+            }
+            // Closed: whatever came is the body
+            body = raw.substr(body_at);
+            break;
+        }
+        raw.append(buf, n);
+        if (body_at == std::string::npos && (body_at = raw.find("\r\n\r\n")) != std::string::npos) {
+            head = raw.substr(0, body_at);
+            body_at += 4;
+            for (char &c : head) {
+                c = tolower(c);
+            }
+            chunked = head.find("transfer-encoding: chunked") != std::string::npos;
+            size_t at = head.find("content-length:");
+            if (at != std::string::npos) {
+                length = atoll(head.c_str() + at + strlen("content-length:"));
+            }
+        }
+    }
+    int status = 0;
+    sscanf(head.c_str(), "http/%*s %d", &status);
+    return status;
+}
+
+static int http_get(const std::string &host, const std::string &port, const std::string &uri, std::string &body)
+{
+    int sock = connect_to(host, port);
+    if (sock < 0) {
+        return -1;
+    }
+    std::string request = "GET " + uri + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+    int status = send_all(sock, request.data(), request.size()) ? read_response(sock, body) : 0;
+    close(sock);
+    return status;
+}
+
+static uint32_t file_crc(const fs::path &file)
+{
+    FILE *f = fopen(file.c_str(), "rb");
+    uint32_t crc = 0;
+    if (!f) {
+        return crc;
+    }
+    std::vector<uint8_t> buf(64 * 1024);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), f)) > 0) {
+        crc = esp_rom_crc32_le(crc, buf.data(), n);
+    }
+    fclose(f);
+    return crc;
+}
+
+/// Send @p files as one tar stream, their CRC-32 as read go to @p crcs
+static int post_batch(const std::string &host, const std::string &port, const std::vector<LocalFile> &files,
+                      std::map<std::string, uint32_t> &crcs, std::string &body)
+{
+    uint64_t length = TAR_END_SIZE;
+    for (const LocalFile &f : files) {
+        length += tar_header(f.path.substr(1), f.size, f.mtime).size() + f.size + tar_padding(f.size);
+    }
+    int sock = connect_to(host, port);
+    if (sock < 0) {
+        return -1;
+    }
+    std::string request = "POST /batch HTTP/1.1\r\nHost: " + host + "\r\nContent-Type: application/x-tar\r\n"
+                          "Content-Length: " + std::to_string(length) + "\r\nConnection: close\r\n\r\n";
+    bool ok = send_all(sock, request.data(), request.size());
+    std::vector<char> buf(64 * 1024);
+    for (const LocalFile &f : files) {
+        if (!ok) {
+            break;
+        }
+        std::string header = tar_header(f.path.substr(1), f.size, f.mtime);
+        ok = send_all(sock, header.data(), header.size());
+        FILE *in = fopen(f.file.c_str(), "rb");
+        uint64_t left = f.size;
+        uint32_t crc = 0;
+        while (ok && in && left > 0) {
+            size_t n = fread(buf.data(), 1, std::min<uint64_t>(left, buf.size()), in);
+            if (n == 0) {
+                break;
+            }
+            crc = esp_rom_crc32_le(crc, (const uint8_t *)buf.data(), n);
+            ok = send_all(sock, buf.data(), n);
+            left -= n;
+        }
+        if (in) {
+            fclose(in);
+        }
+        if (left > 0) {
+            // The file shrank or vanished, the stream can't be fixed up
+            fprintf(stderr, "%s: read failed\n", f.file.c_str());
+            ok = false;
+            break;
+        }
+        crcs[f.path] = crc;
+        std::string padding(tar_padding(f.size), '\0');
+        ok = ok && send_all(sock, padding.data(), padding.size());
+    }
+    std::string end(TAR_END_SIZE, '\0');
+    ok = ok && send_all(sock, end.data(), end.size());
+    shutdown(sock, SHUT_WR);
+    // The box answers errors early, read them even if sending broke off
+    int status = read_response(sock, body);
+    close(sock);
+    return ok || status ? status : -1;
+}
+
+int main(int argc, char **argv)
+{
+    bool dry_run = argc > 1 && strcmp(argv[1], "-n") == 0;
+    if (argc != 3 + dry_run) {
+        fprintf(stderr, "Usage: %s [-n] <music dir> <box>[:port]\n", argv[0]);
+        return 1;
+    }
+    fs::path dir = argv[1 + dry_run];
+    std::string host = argv[2 + dry_run];
+    std::string port = "80";
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos) {
+        port = host.substr(colon + 1);
+        host.resize(colon);
+    }
+
+    std::string text;
+    int status = http_get(host, port, "/manifest?hash=0", text);
+    if (status != 200) {
+        fprintf(stderr, "%s: manifest failed (%d)\n", host.c_str(), status);
+        return 1;
+    }
+    Manifest manifest = parse_manifest(text);
+
+    std::vector<LocalFile> send;
+    std::set<std::string> local;
+    uint64_t send_bytes = 0;
+    int same = 0;
+    for (auto it = fs::recursive_directory_iterator(dir); it != fs::recursive_directory_iterator(); ++it) {
+        std::string name = it->path().filename().string();
+        if (name[0] == '.') {
+            if (it->is_directory()) {
+                it.disable_recursion_pending();
+            }
+            continue;
+        }
+        struct stat st;
+        if (!it->is_regular_file() || stat(it->path().c_str(), &st) != 0 ||
+                (name.size() > 5 && name.compare(name.size() - 5, 5, ".part") == 0)) {
+            continue;
+        }
+        LocalFile f = {"/" + it->path().lexically_relative(dir).generic_string(), it->path(), (uint64_t)st.st_size,
+                       (int64_t)st.st_mtime};
+        local.insert(f.path);
+        SyncCheck check = sync_check(manifest, f.path, f.size, f.mtime);
+        if (check == SyncCheck::SAME || (check == SyncCheck::HASH && file_crc(f.file) == manifest[f.path].crc)) {
+            same++;
+            continue;
+        }
+        if (dry_run) {
+            printf("send %s (%llu bytes)\n", f.path.c_str(), (unsigned long long)f.size);
+        }
+        send_bytes += f.size;
+        send.push_back(f);
+    }
+    int box_only = 0;
+    for (auto &entry : manifest) {
+        if (!local.count(entry.first)) {
+            printf("only on the box: %s\n", entry.first.c_str());
+            box_only++;
+        }
+    }
+    printf("%zu files on the box, %d unchanged, %zu to send (%.1f MB), %d only on the box\n", manifest.size(), same,
+           send.size(), send_bytes / 1048576.0, box_only);
+    if (dry_run || send.empty()) {
+        return 0;
+    }
+
+    std::map<std::string, uint32_t> crcs;
+    std::string answer;
+    auto t0 = std::chrono::steady_clock::now();
+    status = post_batch(host, port, send, crcs, answer);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("batch: %d %s", status, answer.c_str());
+    if (status != 200) {
+        return 1;
+    }
+    printf("%.1f s, %.0f KB/s\n", seconds, send_bytes / 1024.0 / seconds);
+
+    // The box noted the CRC-32 of what it wrote, no file is read again
+    if (http_get(host, port, "/manifest?hash=0", text) != 200) {
+        fprintf(stderr, "%s: manifest failed\n", host.c_str());
+        return 1;
+    }
+    manifest = parse_manifest(text);
+    int bad = 0;
+    for (auto &sent : crcs) {
+        auto it = manifest.find(sent.first);
+        if (it == manifest.end() || !it->second.hashed || it->second.crc != sent.second) {
+            printf("MISMATCH %s\n", sent.first.c_str());
+            bad++;
+        }
+    }
+    printf("%zu files checked, %d mismatches\n", crcs.size(), bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+/* Host side of the file server's library sync, shared by library_sync
+   and file_server_bench: the lines of GET /manifest
+       <crc32 or -> <size> <mtime> <path>
+   which files of a library differ from them, and the tar stream
+   POST /batch takes. Names longer than ustar holds go into a pax header. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <string>
+
+#define TAR_BLOCK       512
+/// Two zero blocks end the archive
+#define TAR_END_SIZE    (2 * TAR_BLOCK)
+/// FAT keeps modification times in 2 s steps
+#define SYNC_MTIME_SLACK 2
+
+struct ManifestEntry {
+    bool hashed = false;
+    uint32_t crc = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+};
+
+using Manifest = std::map<std::string, ManifestEntry>;
+
+inline Manifest parse_manifest(const std::string &text)
+{
+    Manifest manifest;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string crc;
+        ManifestEntry entry;
+        long long mtime;
+        if (!(fields >> crc >> entry.size >> mtime)) {
+            continue;
+        }
+        std::string path;
+        std::getline(fields >> std::ws, path);
+        entry.mtime = mtime;
+        entry.hashed = crc != "-";
+        entry.crc = entry.hashed ? (uint32_t)strtoul(crc.c_str(), NULL, 16) : 0;
+        manifest[path] = entry;
+    }
+    return manifest;
+}
+
+enum class SyncCheck {
+    SAME,               ///< size and mtime match
+    SEND,               ///< missing or a different size
+    HASH,               ///< same size, other mtime: send unless the CRC-32 matches
+};
+
+inline SyncCheck sync_check(const Manifest &manifest, const std::string &path, uint64_t size, int64_t mtime)
+{
+    auto it = manifest.find(path);
+    if (it == manifest.end() || it->second.size != size) {
+        return SyncCheck::SEND;
+    }
+    int64_t diff = it->second.mtime - mtime;
+    if (diff <= SYNC_MTIME_SLACK && diff >= -SYNC_MTIME_SLACK) {
+        return SyncCheck::SAME;
+    }
+    return it->second.hashed ? SyncCheck::HASH : SyncCheck::SEND;
+}
+
+inline size_t tar_padding(uint64_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+inline std::string tar_block(const std::string &name, uint64_t size, int64_t mtime, char type)
+{
+    std::string block(TAR_BLOCK, '\0');
+    char *b = &block[0];
+    memcpy(b, name.data(), std::min<size_t>(name.size(), 100));
+    snprintf(b + 100, 8, "%07o", 0644);
+    snprintf(b + 108, 8, "%07o", 0);
+    snprintf(b + 116, 8, "%07o", 0);
+    snprintf(b + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf(b + 136, 12, "%011llo", (unsigned long long)mtime);
+    b[156] = type;
+    memcpy(b + 257, "ustar", 6);
+    memcpy(b + 263, "00", 2);
+    memset(b + 148, ' ', 8);
+    unsigned sum = 0;
+    for (char c : block) {
+        sum += (unsigned char)c;
+    }
+    snprintf(b + 148, 8, "%06o", sum);
+    return block;
+}
+
+/// Header blocks of a file, followed by its data and tar_padding()
+inline std::string tar_header(const std::string &name, uint64_t size, int64_t mtime)
+{
+    if (name.size() <= 100) {
+        return tar_block(name, size, mtime, '0');
+    }
+    // "<length> path=<name>\n", the length counts its own digits
+    std::string record = " path=" + name + "\n";
+    size_t len = record.size() + 1;
+    while (std::to_string(len).size() + record.size() != len) {
+        len++;
+    }
+    record = std::to_string(len) + record;
+    return tar_block("PaxHeader", record.size(), mtime, 'x') + record + std::string(tar_padding(record.size()), '\0') +
+           tar_block(name.substr(0, 100), size, mtime, '0');
+}
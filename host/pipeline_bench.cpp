@@ -0,0 +1,285 @@
+/*  Latency benchmark for FlexiblePipeline on the host.
+
+    Drives the real FlexiblePipeline the same way app_main does and reports
+    p50/p99 for:
+      start         stop() + start(<new tag>)  -> first i2s frame
+      warm start    the same for a tag held in the tag cache
+      pause         pause()                    -> i2s writer parked
+      resume        resume()                   -> first i2s frame
+      track change  end of track N             -> first i2s frame of track N+1,
+                    once restarting the pipeline and once gapless
+    and the decoder and resampler CPU load for tracks of several sample
+    formats, with and without the resampler bypass. The trace ring of the
+    whole run goes to pipeline_trace.txt, for trace_to_json.
+
+    Usage: pipeline_bench [iterations]
+*/
+#include "fake_adf.h"
+#include "flexible_pipeline.hpp"
+#include "esp_log.h"
+#include "trace_ring.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_PLAYBACK_RATE     48000
+#define BENCH_TIMEOUT_MS        5000
+#define SHORT_TRACK_MS          250
+#define BENCH_CPU_WINDOW_MS     500
+
+#define TAG_LONG_TRACK          1000
+#define TAG_START_BASE          2000
+#define TAG_SHORT_TRACKS        3000
+#define TAG_WARM_A              4000
+#define TAG_WARM_B              4001
+#define TAG_FORMAT_BASE         5000
+
+/// MPEG audio sources for the CPU load table, all 128 kbit/s layer III
+struct BenchFormat {
+    const char *name;
+    int rate;
+    int channels;
+    unsigned char header[4];
+    size_t frame_bytes;
+};
+
+static const BenchFormat formats[] = {
+    {"44.1k stereo", 44100, 2, {0xff, 0xfb, 0x90, 0x00}, 417},
+    {"48k stereo",   48000, 2, {0xff, 0xfb, 0x94, 0x00}, 384},
+    {"32k stereo",   32000, 2, {0xff, 0xfb, 0x98, 0x00}, 576},
+    {"22.05k mono",  22050, 1, {0xff, 0xf3, 0x80, 0xc0}, 208},   // MPEG 2, 64 kbit/s
+};
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+static void write_track(const std::string &name, int duration_ms, const BenchFormat &format = formats[0])
+{
+    std::vector<char> pcm((size_t)format.rate * duration_ms / 1000 * format.channels * 2, 0);
+    // The fake decoder passes bytes through as PCM, but the format probe and
+    // the decoder's music info want to see two MPEG frame headers
+    for (size_t at : {(size_t)0, format.frame_bytes}) {
+        std::copy(format.header, format.header + sizeof(format.header), pcm.begin() + at);
+    }
+    std::ofstream(root + "/" + name, std::ios::binary).write(pcm.data(), pcm.size());
+}
+
+static void write_playlist(int serial, const std::vector<std::string> &tracks)
+{
+    std::ofstream playlist(root + "/" + std::to_string(serial) + ".txt");
+    for (auto &track : tracks) {
+        playlist << track << "\n";
+    }
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return NAN;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)std::ceil(p * values.size());
+    return values[idx > 0 ? idx - 1 : 0];
+}
+
+static void print_row(const char *name, const std::vector<double> &ms)
+{
+    printf("%-14s %10.2f %10.2f %8zu\n", name, percentile(ms, 0.5), percentile(ms, 0.99), ms.size());
+}
+
+static bool wait_first_frame()
+{
+    return fake_adf::wait_i2s([](const FakeI2sStats &st) { return st.first_frame_us >= 0; }, BENCH_TIMEOUT_MS);
+}
+
+static void stop_and_wait(FlexiblePipeline &pipeline)
+{
+    pipeline.stop();
+    fake_adf::wait_i2s([](const FakeI2sStats &st) { return !st.active; }, BENCH_TIMEOUT_MS);
+}
+
+static double ms_since(int64_t t0, int64_t t1)
+{
+    return (t1 - t0) / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 30;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    trace_ring_init(CONFIG_TRACE_RING_RECORDS);
+
+    mkdir(root.c_str(), 0755);
+    write_track("long.mp3", 60 * 1000);
+    std::vector<std::string> short_tracks;
+    for (int i = 0; i <= iterations; i++) {
+        short_tracks.push_back("short_" + std::to_string(i) + ".mp3");
+        write_track(short_tracks.back(), SHORT_TRACK_MS);
+    }
+    write_playlist(TAG_LONG_TRACK, {"long.mp3"});
+    write_playlist(TAG_SHORT_TRACKS, short_tracks);
+    for (int i = 0; i < iterations; i++) {
+        write_playlist(TAG_START_BASE + i, {"long.mp3"});
+    }
+    write_playlist(TAG_WARM_A, {"long.mp3"});
+    write_playlist(TAG_WARM_B, {"long.mp3"});
+    const size_t format_count = sizeof(formats) / sizeof(formats[0]);
+    for (size_t i = 0; i < format_count; i++) {
+        std::string name = "format_" + std::to_string(formats[i].rate) + "_" + std::to_string(formats[i].channels) + ".mp3";
+        write_track(name, 10 * 1000, formats[i]);
+        write_playlist(TAG_FORMAT_BASE + i, {name});
+    }
+
+    auto *pipeline = new FlexiblePipeline();
+    // Every start plays from the beginning, resume_bench covers the rest
+    pipeline->set_resume(false);
+    std::thread([pipeline] { pipeline->loop(); }).detach();
+
+    std::vector<double> start_ms, warm_start_ms, pause_ms, resume_ms;
+    std::vector<double> change_ms, change_samples, gapless_ms, gapless_samples;
+
+    auto timed_start = [&](int tag, std::vector<double> &ms) {
+        fake_adf::mark();
+        int64_t t0 = fake_adf::now_us();
+        pipeline->stop();
+        pipeline->start(tag);
+        if (fake_adf::wait_i2s([](const FakeI2sStats &st) {
+                return st.tracks_started > 0 && st.track_first_frame_us >= 0;
+            }, BENCH_TIMEOUT_MS)) {
+            ms.push_back(ms_since(t0, fake_adf::i2s_stats().track_first_frame_us));
+        }
+    };
+    for (int i = 0; i < iterations; i++) {
+        timed_start(TAG_START_BASE + i, start_ms);
+    }
+    TagCache::Stats cold = pipeline->tag_cache_stats();
+
+    // Two figures taking turns on the box, both stay in the tag cache. Play
+    // each once first, long enough for the reader to hand the opening bytes
+    // of the track to the cache.
+    std::vector<double> warmup;
+    for (int tag : {TAG_WARM_A, TAG_WARM_B}) {
+        timed_start(tag, warmup);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    for (int i = 0; i < iterations; i++) {
+        timed_start(i % 2 ? TAG_WARM_B : TAG_WARM_A, warm_start_ms);
+    }
+    TagCache::Stats warm = pipeline->tag_cache_stats();
+
+    stop_and_wait(*pipeline);
+    fake_adf::mark();
+    pipeline->start(TAG_LONG_TRACK);
+    wait_first_frame();
+    for (int i = 0; i < iterations; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        fake_adf::mark();
+        int64_t t0 = fake_adf::now_us();
+        pipeline->pause();
+        if (fake_adf::wait_i2s([](const FakeI2sStats &st) { return st.paused; }, BENCH_TIMEOUT_MS)) {
+            pause_ms.push_back(ms_since(t0, fake_adf::i2s_stats().paused_us));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        fake_adf::mark();
+        t0 = fake_adf::now_us();
+        pipeline->resume();
+        if (wait_first_frame()) {
+            resume_ms.push_back(ms_since(t0, fake_adf::i2s_stats().first_frame_us));
+        }
+    }
+
+    for (bool gapless : {false, true}) {
+        pipeline->set_gapless(gapless);
+        stop_and_wait(*pipeline);
+        fake_adf::mark();
+        pipeline->start(TAG_SHORT_TRACKS);
+        // Half way into the last track every transition has happened
+        uint64_t frames = (uint64_t)BENCH_PLAYBACK_RATE * SHORT_TRACK_MS / 1000 * iterations
+                          + BENCH_PLAYBACK_RATE * SHORT_TRACK_MS / 2000;
+        fake_adf::wait_i2s([&](const FakeI2sStats &st) { return st.frames >= frames; },
+                           BENCH_TIMEOUT_MS + iterations * 1000);
+        FakeI2sStats st = fake_adf::i2s_stats();
+        // Starvation only happens at track boundaries, the rest were seamless
+        std::vector<double> &ms = gapless ? gapless_ms : change_ms;
+        std::vector<double> &samples = gapless ? gapless_samples : change_samples;
+        for (int i = 0; i < iterations; i++) {
+            int64_t gap = i < (int)st.gaps_us.size() ? st.gaps_us[i] : 0;
+            ms.push_back(gap / 1000.0);
+            samples.push_back((double)gap * BENCH_PLAYBACK_RATE / 1000000);
+        }
+    }
+
+    struct CpuRow {
+        const char *name;
+        bool bypass;
+        double decode, resample;
+        int rate;
+    };
+    std::vector<CpuRow> cpu_rows;
+    pipeline->set_gapless(false);
+    for (bool bypass : {false, true}) {
+        pipeline->set_resample_bypass(bypass);
+        for (size_t i = 0; i < format_count; i++) {
+            stop_and_wait(*pipeline);
+            fake_adf::mark();
+            pipeline->start(TAG_FORMAT_BASE + i);
+            wait_first_frame();
+            // Past the start-up burst that fills the DMA buffers
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            fake_adf::mark();
+            int64_t t0 = fake_adf::now_us();
+            std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_CPU_WINDOW_MS));
+            FakeCpuStats cpu = fake_adf::cpu_stats();
+            double elapsed = fake_adf::now_us() - t0;
+            cpu_rows.push_back({formats[i].name, bypass, 100.0 * cpu.decode_us / elapsed,
+                                100.0 * cpu.resample_us / elapsed, fake_adf::i2s_stats().rate});
+        }
+    }
+    stop_and_wait(*pipeline);
+
+    printf("FlexiblePipeline host benchmark, %d iterations\n", iterations);
+    printf("%-14s %10s %10s %8s\n", "operation", "p50 [ms]", "p99 [ms]", "n");
+    print_row("start", start_ms);
+    print_row("warm start", warm_start_ms);
+    print_row("pause", pause_ms);
+    print_row("resume", resume_ms);
+    print_row("track change", change_ms);
+    print_row("gapless change", gapless_ms);
+    printf("inter-track silence [samples]: restart p50 %.0f p99 %.0f, gapless p50 %.0f p99 %.0f\n",
+           percentile(change_samples, 0.5), percentile(change_samples, 0.99),
+           percentile(gapless_samples, 0.5), percentile(gapless_samples, 0.99));
+    unsigned lookups = warm.hits + warm.misses;
+    printf("tag cache: %u hits / %u lookups (%.0f%%), cold starts %u hits, warm starts %u hits\n",
+           warm.hits, lookups, lookups ? 100.0 * warm.hits / lookups : 0.0,
+           cold.hits, warm.hits - cold.hits);
+    printf("%-14s %7s %10s %10s %10s %9s\n", "source", "bypass", "decode", "resample", "cpu", "i2s [Hz]");
+    for (auto &row : cpu_rows) {
+        printf("%-14s %7s %9.1f%% %9.1f%% %9.1f%% %9d\n", row.name, row.bypass ? "on" : "off",
+               row.decode, row.resample, row.decode + row.resample, row.rate);
+    }
+    PipelineHealth::Snapshot health = pipeline->health();
+    const PipelineHealth::Summary &out = health.histograms[PipelineHealth::OUTPUT_FILL];
+    const PipelineHealth::Summary &backlog = health.histograms[PipelineHealth::EVENT_BACKLOG];
+    const PipelineHealth::Summary &start = health.histograms[PipelineHealth::START_MS];
+    printf("health: %u events, %u tracks, %u underruns, i2s ring fill p1 %u%% p50 %u%% (%u samples), "
+           "event backlog p99 %u max %u, start p50 %u ms p99 %u ms\n",
+           health.counters[PipelineHealth::EVENTS], health.counters[PipelineHealth::TRACKS],
+           health.counters[PipelineHealth::UNDERRUNS], out.p99, out.p50, out.count, backlog.p99, backlog.max,
+           start.p50, start.p99);
+    FILE *trace = fopen("pipeline_trace.txt", "w");
+    if (trace) {
+        uint32_t seq = 0;
+        trace_ring_print(trace, &seq);
+        fclose(trace);
+        printf("trace: last %u records in pipeline_trace.txt\n", seq < CONFIG_TRACE_RING_RECORDS ? seq : CONFIG_TRACE_RING_RECORDS);
+    }
+    fflush(stdout);
+    // The player loop never returns, leave it parked and exit
+    std::_Exit(0);
+}
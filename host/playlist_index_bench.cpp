@@ -0,0 +1,140 @@
+/*  Benchmark for the binary playlist index against parsing the text playlists.
+
+    Builds a library of tags with a few tracks each in a scratch directory and
+    reports per tag swap the time and heap allocations of
+      text     std::ifstream + getline + path concatenation, as the player
+               did before the index
+      index    PlaylistIndex::lookup()
+    plus the cost of a full build, a refresh after one playlist changed and
+    a refresh with nothing to do.
+
+    Usage: playlist_index_bench [tags] [tracks per tag]
+*/
+#include "playlist_index.hpp"
+
+extern "C" {
+#include "esp_log.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+esp_log_level_t host_log_level = ESP_LOG_ERROR;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    host_log_level = level;
+}
+
+static std::atomic<size_t> s_allocations{0};
+
+void *operator new(size_t size)
+{
+    s_allocations++;
+    if (void *p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static const std::string root = PLAYLIST_INDEX_BENCH_DIR;
+
+static void write_playlist(uint64_t serial, int tracks, int variant)
+{
+    std::ofstream playlist(root + "/" + std::to_string(serial) + ".txt");
+    for (int i = 0; i < tracks; i++) {
+        playlist << "hoerspiele/folge_" << serial % 1000 << "/kapitel_" << i + variant << ".mp3\n";
+    }
+}
+
+static std::vector<std::string> read_text(const std::string &tag)
+{
+    std::vector<std::string> playlist;
+    std::string line;
+    std::ifstream file(root + "/" + tag + ".txt");
+    while (getline(file, line)) {
+        playlist.push_back(root + "/" + line);
+    }
+    return playlist;
+}
+
+template <typename F>
+static void measure(const char *name, int runs, F &&f)
+{
+    size_t allocations = s_allocations;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+        f(i);
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-18s %10.2f us %10.1f allocations\n", name, s * 1e6 / runs,
+           (double)(s_allocations - allocations) / runs);
+}
+
+int main(int argc, char **argv)
+{
+    int tags = argc > 1 ? atoi(argv[1]) : 500;
+    int tracks = argc > 2 ? atoi(argv[2]) : 20;
+    const uint64_t base = 100000000000ULL;
+    mkdir(root.c_str(), 0755);
+    // Start from an empty card, whatever an earlier run left is indexed too
+    if (DIR *dir = opendir(root.c_str())) {
+        while (struct dirent *entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                unlink((root + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    for (int i = 0; i < tags; i++) {
+        write_playlist(base + i, tracks, 0);
+    }
+    printf("Playlist index, %d tags with %d tracks\n", tags, tracks);
+    printf("%-18s %13s %21s\n", "operation", "time", "heap");
+
+    measure("full build", 1, [&](int) {
+        PlaylistIndex index(root, root + "/playlists.idx");
+        index.refresh();
+    });
+    PlaylistIndex index(root, root + "/playlists.idx");
+    measure("load, no change", 1, [&](int) { index.refresh(); });
+    // Modification times have a resolution of a second on FAT
+    sleep(1);
+    write_playlist(base, tracks, 1);
+    measure("load, 1 changed", 1, [&](int) { index.refresh(); });
+
+    size_t entries = 0;
+    measure("text lookup", tags, [&](int i) {
+        entries += read_text(std::to_string(base + i)).size();
+    });
+    std::vector<std::string> playlist;
+    std::vector<format_probe_info_t> formats;
+    measure("index lookup", tags, [&](int i) {
+        index.lookup(std::to_string(base + i), playlist, formats);
+        entries += playlist.size();
+    });
+    struct stat st;
+    stat((root + "/playlists.idx").c_str(), &st);
+    printf("index file %lld bytes, %zu entries looked up\n", (long long)st.st_size, entries);
+    return 0;
+}
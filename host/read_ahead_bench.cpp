@@ -0,0 +1,166 @@
+/*  Underruns with and without the SD card read-ahead.
+
+    Plays a 48 kHz stereo WAV file through playlist_stream -> wav decoder ->
+    i2s writer on a slow and jittery fake SD card:
+      quiet     every read pays a command overhead and up to 2 ms jitter
+      busy      on top, the card is held by someone else (file server,
+                upload) for 150 ms at a random point of every second
+    The reader either reads 2 KB per fread on its own task, as before, or
+    takes the bytes from the read-ahead ring (CONFIG_PLAYLIST_READ_AHEAD_*),
+    which its task fills in aligned blocks. Reports the silence the i2s
+    writer played, the underruns PipelineHealth counted from its ring
+    samples (dry), the time spent on the card and the read-ahead counters.
+
+    Usage: read_ahead_bench [seconds]
+*/
+#include "fake_adf.h"
+#include "playlist_stream.h"
+#include "pipeline_health.hpp"
+
+extern "C" {
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "audio_pipeline.h"
+#include "i2s_stream.h"
+#include "wav_decoder.h"
+}
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_RATE          48000
+#define BENCH_CHANNELS      2
+#define BENCH_READ_CALL_US  800
+#define BENCH_JITTER_US     2000
+#define BENCH_BUSY_US       150000
+#define BENCH_BUSY_PERIOD   1000
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+static void put_le(std::ofstream &file, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        file.put((char)(value >> (8 * i)));
+    }
+}
+
+static void write_wav(const std::string &path, int seconds)
+{
+    uint32_t byte_rate = BENCH_RATE * BENCH_CHANNELS * 2;
+    uint32_t data_size = byte_rate * seconds;
+    std::ofstream file(path, std::ios::binary);
+    file.write("RIFF", 4);
+    put_le(file, 36 + data_size, 4);
+    file.write("WAVEfmt ", 8);
+    put_le(file, 16, 4);
+    put_le(file, 1, 2);
+    put_le(file, BENCH_CHANNELS, 2);
+    put_le(file, BENCH_RATE, 4);
+    put_le(file, byte_rate, 4);
+    put_le(file, BENCH_CHANNELS * 2, 2);
+    put_le(file, 16, 2);
+    file.write("data", 4);
+    put_le(file, data_size, 4);
+    std::vector<char> second(byte_rate, 0);
+    for (int i = 0; i < seconds; i++) {
+        file.write(second.data(), second.size());
+    }
+}
+
+struct Result {
+    FakeI2sStats i2s;
+    FakeCardStats card;
+    read_ahead_stats_t read_ahead = {};
+    uint32_t dry = 0;               ///< underruns as the pipeline health sees them
+};
+
+static Result play(const std::string &path, bool read_ahead, int seconds)
+{
+    playlist_stream_cfg_t reader_cfg = PLAYLIST_STREAM_CFG_DEFAULT();
+    if (read_ahead) {
+        reader_cfg.read_ahead_block = CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE;
+        reader_cfg.read_ahead_size = CONFIG_PLAYLIST_READ_AHEAD_KB * 1024;
+        reader_cfg.read_ahead_refill = reader_cfg.read_ahead_size * CONFIG_PLAYLIST_READ_AHEAD_REFILL_PERCENT / 100;
+    }
+    audio_element_handle_t reader = playlist_stream_init(&reader_cfg);
+    wav_decoder_cfg_t wav_cfg = DEFAULT_WAV_DECODER_CONFIG();
+    audio_element_handle_t decoder = wav_decoder_init(&wav_cfg);
+    i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
+    audio_element_handle_t i2s = i2s_stream_init(&i2s_cfg);
+    i2s_stream_set_clk(i2s, BENCH_RATE, 16, BENCH_CHANNELS);
+
+    audio_pipeline_cfg_t cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    audio_pipeline_handle_t pipeline = audio_pipeline_init(&cfg);
+    audio_pipeline_register(pipeline, reader, "file");
+    audio_pipeline_register(pipeline, decoder, "wav");
+    audio_pipeline_register(pipeline, i2s, "i2s");
+    const char *link[] = {"file", "wav", "i2s"};
+    audio_pipeline_link(pipeline, link, 3);
+    audio_element_set_uri(reader, path.c_str());
+
+    PipelineHealth health(CONFIG_PIPELINE_HEALTH_SAMPLE_MS, 0);
+    health.link(reader, decoder, i2s);
+    fake_adf::mark();
+    audio_pipeline_run(pipeline);
+    health.set_active(true);
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    health.set_active(false);
+    Result result;
+    result.dry = health.snapshot().counters[PipelineHealth::UNDERRUNS];
+    result.i2s = fake_adf::i2s_stats();
+    result.card = fake_adf::card_stats();
+    playlist_stream_get_read_stats(reader, &result.read_ahead);
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_terminate(pipeline);
+    audio_pipeline_unlink(pipeline);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    mkdir(root.c_str(), 0755);
+    std::string path = root + "/read_ahead.wav";
+    write_wav(path, seconds + 5);
+
+    FakeAdfCosts &costs = fake_adf::costs();
+    costs.read_call_us = BENCH_READ_CALL_US;
+    costs.read_jitter_us = BENCH_JITTER_US;
+
+    printf("%d s of 48 kHz stereo WAV, read-ahead %d KB in %d KB blocks, refill below %d%%\n", seconds,
+           CONFIG_PLAYLIST_READ_AHEAD_KB, CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE / 1024,
+           CONFIG_PLAYLIST_READ_AHEAD_REFILL_PERCENT);
+    printf("%-6s %-10s %5s %4s %11s %8s %8s %9s %7s %8s %10s %10s %9s\n", "card", "reader", "gaps", "dry",
+           "silence ms", "max ms", "reads/s", "card busy", "kB/s", "refills", "refill ms", "refill max", "underruns");
+    for (int busy = 0; busy < 2; busy++) {
+        costs.card_busy_us = busy ? BENCH_BUSY_US : 0;
+        costs.card_busy_period_ms = busy ? BENCH_BUSY_PERIOD : 0;
+        for (int read_ahead = 0; read_ahead < 2; read_ahead++) {
+            Result r = play(path, read_ahead, seconds);
+            int64_t max_gap = 0;
+            for (int64_t gap : r.i2s.gaps_us) {
+                max_gap = gap > max_gap ? gap : max_gap;
+            }
+            printf("%-6s %-10s %5zu %4u %11.1f %8.1f %8.0f %8.1f%% %7.0f", busy ? "busy" : "quiet",
+                   read_ahead ? "read-ahead" : "direct", r.i2s.gaps_us.size(), r.dry,
+                   r.i2s.underrun_frames * 1000.0 / BENCH_RATE, max_gap / 1000.0, (double)r.card.reads / seconds,
+                   r.card.read_us / (seconds * 1e4), r.card.read_us ? r.card.bytes * 1e6 / 1024 / r.card.read_us : 0.0);
+            if (read_ahead) {
+                printf(" %8u %10.1f %10.1f %9u\n", r.read_ahead.refills,
+                       r.read_ahead.refills ? r.read_ahead.refill_us / 1000.0 / r.read_ahead.refills : 0.0,
+                       r.read_ahead.refill_max_us / 1000.0, r.read_ahead.underruns);
+            } else {
+                printf(" %8s %10s %10s %9s\n", "-", "-", "-", "-");
+            }
+        }
+    }
+    return 0;
+}
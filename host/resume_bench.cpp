@@ -0,0 +1,172 @@
+/*  Flash wear and restore of the per tag resume positions.
+
+    wear     an hour of listening with the position checkpointed every
+             second and another tag placed every ten minutes. Compares
+             saving every checkpoint to NVS with the batched ResumeStore at
+             several save intervals: NVS writes and commits per hour and
+             how much progress a power cut loses at worst.
+    restore  the real FlexiblePipeline on the fake NVS. A tag plays for a
+             while and is swapped for another one, which plays until the
+             next save. The fake NVS drops what was not committed as a
+             power cut would, and the position is read back by a fresh
+             ResumeStore. Placing the tag again has to continue from there
+             instead of the start of the track.
+
+    Usage: resume_bench [hours]
+*/
+#include "fake_adf.h"
+#include "fake_nvs.h"
+#include "flexible_pipeline.hpp"
+#include "resume_store.hpp"
+#include "esp_log.h"
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_NAMESPACE         "resume_bench"
+#define BENCH_TIMEOUT_MS        5000
+#define CHECKPOINT_S            1
+#define SWAP_EVERY_S            600
+#define BYTES_PER_S             16000   ///< 128 kbit/s MP3
+#define RESUME_NAMESPACE        "resume"    ///< the one FlexiblePipeline uses
+
+#define TAG_RESUME              6000
+#define TAG_OTHER               6001
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+static void write_track(const std::string &name, int duration_ms)
+{
+    // 44.1 kHz stereo MPEG headers, the fake decoder passes the rest through
+    static const unsigned char header[4] = {0xff, 0xfb, 0x90, 0x00};
+    std::vector<char> pcm((size_t)44100 * duration_ms / 1000 * 4, 0);
+    for (size_t at : {(size_t)0, (size_t)417}) {
+        std::copy(header, header + sizeof(header), pcm.begin() + at);
+    }
+    std::ofstream(root + "/" + name, std::ios::binary).write(pcm.data(), pcm.size());
+}
+
+static void write_playlist(int serial, const std::vector<std::string> &tracks)
+{
+    std::ofstream playlist(root + "/" + std::to_string(serial) + ".txt");
+    for (auto &track : tracks) {
+        playlist << track << "\n";
+    }
+}
+
+static bool wait_first_frame()
+{
+    return fake_adf::wait_i2s([](const FakeI2sStats &st) { return st.first_frame_us >= 0; }, BENCH_TIMEOUT_MS);
+}
+
+/// Simulated listening, @p interval_s 0 saves every checkpoint
+static void wear(int hours, int interval_s)
+{
+    fake_nvs::erase();
+    fake_nvs::reset_stats();
+    int64_t worst_lost_s = 0;
+    {
+        ResumeStore store(BENCH_NAMESPACE, 8, (int64_t)interval_s * 1000000);
+        uint64_t tag = 1;
+        ResumePosition position = {0, 0, 0};
+        int64_t saved_at_s = 0;
+        for (int64_t s = 1; s <= (int64_t)hours * 3600; s += CHECKPOINT_S) {
+            fake_adf::advance_clock(CHECKPOINT_S * 1000000LL);
+            position.byte_pos += BYTES_PER_S * CHECKPOINT_S;
+            store.checkpoint(tag, position);
+            if (store.flush() > 0) {
+                saved_at_s = s;
+            }
+            worst_lost_s = std::max(worst_lost_s, s - saved_at_s);
+            if (s % SWAP_EVERY_S == 0) {
+                // The swapped tag waits in RAM for the next save
+                tag = tag % 4 + 1;
+                position = {0, 0, 0};
+            }
+        }
+    }
+    FakeNvsStats stats = fake_nvs::stats();
+    char name[32];
+    snprintf(name, sizeof(name), interval_s == 0 ? "every checkpoint" : "every %d s", interval_s);
+    printf("%-18s %12.0f %12.0f %12.0f %10lld\n", name, (double)stats.writes / hours, (double)stats.commits / hours,
+           (double)stats.bytes / hours, (long long)worst_lost_s);
+}
+
+/// Let the save interval pass, the player saves on its next wake-up
+static void save_interval_passes()
+{
+    fake_adf::advance_clock(CONFIG_RESUME_SAVE_INTERVAL_S * 1000000LL);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+}
+
+static bool saved_position(uint64_t tag, ResumePosition &position)
+{
+    ResumeStore store(RESUME_NAMESPACE, 1, 0);
+    return store.lookup(tag, position);
+}
+
+int main(int argc, char **argv)
+{
+    int hours = argc > 1 ? atoi(argv[1]) : 10;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    printf("wear: %d h of listening, checkpoint every %d s, another tag every %d s\n", hours, CHECKPOINT_S,
+           SWAP_EVERY_S);
+    printf("%-18s %12s %12s %12s %10s\n", "save", "writes/h", "commits/h", "bytes/h", "lost [s]");
+    for (int interval_s : {0, 10, 60, 300}) {
+        wear(hours, interval_s);
+    }
+
+    mkdir(root.c_str(), 0755);
+    write_track("resume_a.mp3", 2000);
+    write_track("resume_b.mp3", 60 * 1000);
+    write_track("resume_other.mp3", 60 * 1000);
+    write_playlist(TAG_RESUME, {"resume_a.mp3", "resume_b.mp3"});
+    write_playlist(TAG_OTHER, {"resume_other.mp3"});
+    fake_nvs::erase();
+
+    auto *pipeline = new FlexiblePipeline();
+    std::thread([pipeline] { pipeline->loop(); }).detach();
+
+    // Into the second track, then swap the tag
+    fake_adf::mark();
+    pipeline->start(TAG_RESUME);
+    wait_first_frame();
+    std::this_thread::sleep_for(std::chrono::milliseconds(3500));
+    fake_adf::mark();
+    pipeline->start(TAG_OTHER);
+    wait_first_frame();
+    save_interval_passes();
+
+    fake_nvs::reboot();
+    ResumePosition before = {};
+    bool found = saved_position(TAG_RESUME, before);
+    printf("\nrestore: after the swap, a save and a power cut, %s track %u at byte %lld\n", found ? "saved" : "NOT saved",
+           before.track, (long long)before.byte_pos);
+
+    // Placed again it has to continue, its position only moves forward
+    fake_adf::mark();
+    int64_t t0 = fake_adf::now_us();
+    pipeline->start(TAG_RESUME);
+    wait_first_frame();
+    double start_ms = (fake_adf::i2s_stats().first_frame_us - t0) / 1000.0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    fake_adf::mark();
+    pipeline->start(TAG_OTHER);
+    wait_first_frame();
+    save_interval_passes();
+    ResumePosition after = {};
+    saved_position(TAG_RESUME, after);
+    bool resumed = found && after.track == before.track && after.byte_pos > before.byte_pos;
+    printf("restore: placed again, first frame after %.1f ms, now track %u at byte %lld, %s\n", start_ms,
+           after.track, (long long)after.byte_pos, resumed ? "resumed" : "NOT resumed");
+
+    ResumeStore::Stats stats = pipeline->resume_stats();
+    printf("restore: %u checkpoints, %u NVS writes, %u commits\n", stats.checkpoints, stats.writes, stats.commits);
+    return resumed ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+/* Reader for RFID_CAPTURE lines, as printed by the firmware with
+   CONFIG_RFID_CAPTURE:
+       RFID_CAPTURE <time us> <hex byte> <hex byte> ...
+   Anything before RFID_CAPTURE on a line, and lines without it, are
+   ignored, so an idf.py monitor log can be used as is. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define RFID_CAPTURE_MARKER "RFID_CAPTURE"
+
+struct RfidChunk {
+    int64_t time_us = 0;
+    std::vector<uint8_t> bytes;
+};
+
+inline std::vector<RfidChunk> read_rfid_capture(std::istream &input)
+{
+    std::vector<RfidChunk> chunks;
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t at = line.find(RFID_CAPTURE_MARKER);
+        if (at == std::string::npos) {
+            continue;
+        }
+        std::istringstream in(line.substr(at + strlen(RFID_CAPTURE_MARKER)));
+        long long t;
+        if (!(in >> t)) {
+            continue;
+        }
+        RfidChunk chunk;
+        chunk.time_us = t;
+        std::string hex;
+        while (in >> hex) {
+            chunk.bytes.push_back((uint8_t)strtoul(hex.c_str(), NULL, 16));
+        }
+        chunks.push_back(std::move(chunk));
+    }
+    return chunks;
+}
@@ -0,0 +1,91 @@
+/*  Throughput benchmark for the RDM6300 frame parser.
+
+    Feeds synthetic streams through rdm6300_parser_feed() in UART sized
+    chunks and reports MB/s and ns per byte:
+      clean   back to back frames of a few tags
+      noisy   the same with a quarter of random garbage and corrupted
+              checksums mixed in
+
+    Usage: rfid_parser_bench [megabytes]
+*/
+#include "rdm6300_parser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static void append_frame(std::vector<uint8_t> &out, uint64_t data40, bool corrupt)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t checksum = 0;
+    for (int i = 0; i < 5; i++) {
+        checksum ^= (data40 >> (8 * i)) & 0xff;
+    }
+    if (corrupt) {
+        checksum ^= 0x5a;
+    }
+    uint64_t value = (data40 << 8) | checksum;
+    out.push_back(RDM6300_FRAME_STX);
+    for (int i = RDM6300_FRAME_HEX_CHARS - 1; i >= 0; i--) {
+        out.push_back(digits[(value >> (4 * i)) & 0xf]);
+    }
+    out.push_back(RDM6300_FRAME_ETX);
+}
+
+static std::vector<uint8_t> make_stream(size_t bytes, bool noisy)
+{
+    std::mt19937 rng(42);
+    const uint64_t tags[] = {0x0A00123456, 0x1B00ABCDEF, 0x3C00F00D42};
+    std::vector<uint8_t> out;
+    out.reserve(bytes + RDM6300_FRAME_LEN);
+    while (out.size() < bytes) {
+        // Runs of the same tag, as when a figure sits on the box
+        uint64_t tag = tags[rng() % 3];
+        for (int i = 0; i < 8 && out.size() < bytes; i++) {
+            append_frame(out, tag, noisy && rng() % 8 == 0);
+            if (noisy && rng() % 4 == 0) {
+                for (int n = rng() % 16; n > 0; n--) {
+                    out.push_back(rng() & 0xff);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+static void run(const char *name, const std::vector<uint8_t> &stream, size_t chunk)
+{
+    rdm6300_parser_t parser;
+    rdm6300_parser_init(&parser, 2);
+    int new_tags = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t at = 0; at < stream.size(); at += chunk) {
+        size_t len = stream.size() - at < chunk ? stream.size() - at : chunk;
+        for (size_t done = 0; done < len; ) {
+            enum rdm6300_sense_result result;
+            uint64_t serial;
+            done += rdm6300_parser_feed(&parser, stream.data() + at + done, len - done, at, &result, &serial);
+            new_tags += result == RDM6300_SENSE_NEW_TAG;
+        }
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-6s chunk %4zu  %8.1f MB/s  %6.2f ns/byte  %10u frames  %7d new tags  %8u bad checksums\n",
+           name, chunk, stream.size() / s / 1e6, s * 1e9 / stream.size(),
+           parser.stats.frames, new_tags, parser.stats.checksum_errors);
+}
+
+int main(int argc, char **argv)
+{
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    auto clean = make_stream(megabytes << 20, false);
+    auto noisy = make_stream(megabytes << 20, true);
+    printf("RDM6300 parser throughput, %zu MB per stream\n", megabytes);
+    // 14 bytes is one frame per UART event, 120 bytes the UART RX FIFO threshold
+    for (size_t chunk : {14, 120, 1024}) {
+        run("clean", clean, chunk);
+        run("noisy", noisy, chunk);
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*  Fuzz target for the RDM6300 frame parser.
+
+    LLVMFuzzerTestOneInput() feeds one input in varying chunk sizes and
+    checks that the parser
+      - always makes progress and never reads past a chunk
+      - only reports serials with a valid checksum
+      - never reports the present tag twice
+      - still picks up a clean tag right after whatever garbage came before
+    Build with -DRFID_FUZZ_LIBFUZZER=ON (clang) to run it under libFuzzer.
+    Otherwise main() drives it with random streams and with mutations of
+    recorded captures:
+
+    Usage: rfid_parser_fuzz [iterations] [capture ...]
+*/
+#include "rdm6300_parser.h"
+#include "rfid_capture.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#define FUZZ_PROBE_TAG      0x7E00C0FFEEULL
+
+#define FUZZ_CHECK(cond) do {                                           \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+static void append_frame(std::vector<uint8_t> &out, uint64_t data40, bool corrupt)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t checksum = 0;
+    for (int i = 0; i < 5; i++) {
+        checksum ^= (data40 >> (8 * i)) & 0xff;
+    }
+    if (corrupt) {
+        checksum ^= 0x01;
+    }
+    uint64_t value = (data40 << 8) | checksum;
+    out.push_back(RDM6300_FRAME_STX);
+    for (int i = RDM6300_FRAME_HEX_CHARS - 1; i >= 0; i--) {
+        out.push_back(digits[(value >> (4 * i)) & 0xf]);
+    }
+    out.push_back(RDM6300_FRAME_ETX);
+}
+
+static bool checksum_ok(uint64_t serial)
+{
+    uint8_t x = 0;
+    for (int i = 0; i < 6; i++) {
+        x ^= (serial >> (8 * i)) & 0xff;
+    }
+    return x == 0;
+}
+
+/// Feed @p data in chunks, returns the serials reported as new tags
+static std::vector<uint64_t> feed_checked(rdm6300_parser_t &parser, const uint8_t *data, size_t size, uint32_t seed)
+{
+    std::vector<uint64_t> reported;
+    size_t at = 0;
+    while (at < size) {
+        seed = seed * 1103515245 + 12345;
+        size_t chunk = 1 + (seed >> 16) % 40;
+        if (chunk > size - at) {
+            chunk = size - at;
+        }
+        size_t done = 0;
+        while (done < chunk) {
+            uint64_t before = parser.last_seen_serial;
+            enum rdm6300_sense_result result = RDM6300_SENSE_TAG_LOST;
+            uint64_t serial = 0;
+            size_t n = rdm6300_parser_feed(&parser, data + at + done, chunk - done, at, &result, &serial);
+            FUZZ_CHECK(n > 0 && n <= chunk - done);
+            FUZZ_CHECK(parser.pos >= -1 && parser.pos <= RDM6300_FRAME_HEX_CHARS);
+            FUZZ_CHECK(result == RDM6300_SENSE_NEW_TAG || result == RDM6300_SENSE_NO_CHANGE);
+            if (result == RDM6300_SENSE_NEW_TAG) {
+                FUZZ_CHECK(serial != 0 && serial != before);
+                FUZZ_CHECK(checksum_ok(serial));
+                FUZZ_CHECK(parser.last_seen_serial == serial);
+                reported.push_back(serial);
+            } else {
+                FUZZ_CHECK(n == chunk - done);
+            }
+            done += n;
+        }
+        at += chunk;
+    }
+    return reported;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    rdm6300_parser_t parser;
+    int confirm_frames = 1 + data[0] % 4;
+    rdm6300_parser_init(&parser, confirm_frames);
+    feed_checked(parser, data + 1, size - 1, size);
+    FUZZ_CHECK(parser.stats.frames <= size / RDM6300_FRAME_LEN);
+
+    // Whatever came before, clean frames of another tag have to get through
+    std::vector<uint8_t> probe;
+    for (int i = 0; i < confirm_frames; i++) {
+        append_frame(probe, FUZZ_PROBE_TAG, false);
+    }
+    uint64_t expected = (FUZZ_PROBE_TAG << 8);
+    for (int i = 0; i < 5; i++) {
+        expected ^= (FUZZ_PROBE_TAG >> (8 * i)) & 0xff;
+    }
+    if (parser.last_seen_serial == expected) {
+        return 0;
+    }
+    auto reported = feed_checked(parser, probe.data(), probe.size(), ~size);
+    FUZZ_CHECK(reported.size() == 1 && reported[0] == expected);
+    return 0;
+}
+
+#ifndef RFID_FUZZ_LIBFUZZER
+
+/// Valid, corrupted and cut frames of a few tags with garbage in between
+static std::vector<uint8_t> random_stream(std::mt19937 &rng)
+{
+    const uint64_t tags[] = {0x0A00123456, 0x1B00ABCDEF, 0x0000000001};
+    std::vector<uint8_t> out;
+    out.push_back(rng() & 0xff);
+    for (int n = rng() % 32; n > 0; n--) {
+        switch (rng() % 6) {
+            case 0:
+                for (int i = rng() % 20; i > 0; i--) {
+                    out.push_back(rng() & 0xff);
+                }
+                break;
+            case 1:
+                append_frame(out, tags[rng() % 3], true);
+                break;
+            case 2: {
+                std::vector<uint8_t> frame;
+                append_frame(frame, tags[rng() % 3], false);
+                out.insert(out.end(), frame.begin(), frame.begin() + rng() % frame.size());
+                break;
+            }
+            default:
+                append_frame(out, tags[rng() % 3], false);
+                break;
+        }
+    }
+    return out;
+}
+
+static std::vector<uint8_t> mutate(std::vector<uint8_t> data, std::mt19937 &rng)
+{
+    if (data.empty()) {
+        data.push_back(0);
+    }
+    for (int n = 1 + rng() % 8; n > 0; n--) {
+        size_t at = rng() % data.size();
+        switch (rng() % 4) {
+            case 0:
+                data[at] ^= 1 << (rng() % 8);
+                break;
+            case 1:
+                if (data.size() > 1) {
+                    data.erase(data.begin() + at);
+                }
+                break;
+            case 2:
+                data.insert(data.begin() + at, data[rng() % data.size()]);
+                break;
+            default:
+                data[at] = rng() & 0xff;
+                break;
+        }
+    }
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    std::vector<std::vector<uint8_t>> recorded;
+    for (int i = 2; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        if (!file.is_open()) {
+            fprintf(stderr, "Unable to open %s\n", argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> bytes(1, 0);
+        for (auto &chunk : read_rfid_capture(file)) {
+            bytes.insert(bytes.end(), chunk.bytes.begin(), chunk.bytes.end());
+        }
+        recorded.push_back(std::move(bytes));
+    }
+
+    std::mt19937 rng(1);
+    size_t bytes = 0;
+    for (int i = 0; i < iterations; i++) {
+        std::vector<uint8_t> input = random_stream(rng);
+        if (!recorded.empty() && i % 2) {
+            input = mutate(recorded[rng() % recorded.size()], rng);
+        } else if (i % 3 == 0) {
+            input = mutate(input, rng);
+        }
+        bytes += input.size();
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    printf("%d inputs, %zu bytes, %zu recorded streams, no failures\n", iterations, bytes, recorded.size());
+    return 0;
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*  Replays captured RDM6300 byte streams through the RFID presence tracker.
+
+    Reads RFID_CAPTURE lines (see rfid_capture.h), an idf.py monitor log can
+    be replayed as is. Timeouts fire at the tracker deadline, the same as
+    the reader task wakes up on the device.
+
+    Usage: rfid_replay [-c confirm_frames] [-C confirm_ms] [-l lost_ms] [-g grace_ms] [capture ...]
+           (stdin without captures)
+    The windows default to the menuconfig defaults the reader task uses.
+*/
+#include "rdm6300_presence.h"
+#include "rfid_capture.h"
+#include "sdkconfig.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct ReplayStats {
+    size_t bytes = 0;
+    size_t chunks = 0;
+    int new_tags = 0;
+    int lost_tags = 0;
+    rdm6300_parser_stats_t parser = {};
+    rdm6300_presence_stats_t presence = {};
+};
+
+static void print_event(enum rdm6300_sense_result result, int64_t now_us, uint64_t serial, ReplayStats &stats)
+{
+    if (result == RDM6300_SENSE_NEW_TAG) {
+        stats.new_tags++;
+        printf("%10.3f ms  NEW_TAG   %" PRIu64 "\n", now_us / 1000.0, serial);
+    } else if (result == RDM6300_SENSE_TAG_LOST) {
+        stats.lost_tags++;
+        printf("%10.3f ms  TAG_LOST  %" PRIu64 "\n", now_us / 1000.0, serial);
+    }
+}
+
+/// Fire the timeouts that expire before @p until_us, -1 for "whenever they expire"
+static void expire(rdm6300_presence_t &presence, int64_t until_us, ReplayStats &stats)
+{
+    int64_t deadline;
+    while ((deadline = rdm6300_presence_deadline(&presence)) >= 0 && (until_us < 0 || deadline <= until_us)) {
+        uint64_t serial = 0;
+        enum rdm6300_sense_result result = rdm6300_presence_poll(&presence, deadline, &serial);
+        print_event(result, deadline, serial, stats);
+    }
+}
+
+static ReplayStats replay(std::istream &input, const rdm6300_presence_cfg_t &config)
+{
+    rdm6300_presence_t presence;
+    rdm6300_presence_init(&presence, &config);
+    ReplayStats stats;
+    for (auto &chunk : read_rfid_capture(input)) {
+        expire(presence, chunk.time_us, stats);
+        stats.bytes += chunk.bytes.size();
+        stats.chunks++;
+        for (size_t done = 0; done < chunk.bytes.size(); ) {
+            enum rdm6300_sense_result result;
+            uint64_t serial = 0;
+            done += rdm6300_presence_feed(&presence, chunk.bytes.data() + done, chunk.bytes.size() - done,
+                                          chunk.time_us, &result, &serial);
+            print_event(result, chunk.time_us, serial, stats);
+        }
+    }
+    expire(presence, -1, stats);
+    stats.parser = presence.parser.stats;
+    stats.presence = presence.stats;
+    return stats;
+}
+
+static void print_summary(const char *name, const ReplayStats &stats)
+{
+    printf("%s: %zu bytes in %zu chunks, %d NEW_TAG, %d TAG_LOST\n",
+           name, stats.bytes, stats.chunks, stats.new_tags, stats.lost_tags);
+    printf("  frames %u, checksum errors %u, framing errors %u, unconfirmed %u\n",
+           stats.parser.frames, stats.parser.checksum_errors, stats.parser.framing_errors,
+           stats.parser.unconfirmed);
+    printf("  tag went missing %u times, %u flaps suppressed\n",
+           stats.presence.missing, stats.presence.suppressed_flaps);
+}
+
+int main(int argc, char **argv)
+{
+    rdm6300_presence_cfg_t config = RDM6300_PRESENCE_CFG_DEFAULT();
+    config.confirm_frames = CONFIG_RFID_CONFIRM_FRAMES;
+    config.confirm_us = CONFIG_RFID_CONFIRM_MS * 1000LL;
+    config.lost_us = CONFIG_RFID_LOST_MS * 1000LL;
+    config.grace_us = CONFIG_RFID_GRACE_MS * 1000LL;
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        int value = atoi(argv[first + 1]);
+        if (strcmp(argv[first], "-c") == 0) {
+            config.confirm_frames = value;
+        } else if (strcmp(argv[first], "-C") == 0) {
+            config.confirm_us = value * 1000LL;
+        } else if (strcmp(argv[first], "-l") == 0) {
+            config.lost_us = value * 1000LL;
+        } else if (strcmp(argv[first], "-g") == 0) {
+            config.grace_us = value * 1000LL;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[first]);
+            return 1;
+        }
+    }
+    if (first >= argc) {
+        print_summary("stdin", replay(std::cin, config));
+        return 0;
+    }
+    for (int i = first; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        if (!file.is_open()) {
+            fprintf(stderr, "Unable to open %s\n", argv[i]);
+            return 1;
+        }
+        printf("== %s\n", argv[i]);
+        print_summary(argv[i], replay(file, config));
+    }
+    return 0;
+}
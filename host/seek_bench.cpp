@@ -0,0 +1,141 @@
+/*  Seek latency against track length.
+
+    Plays MP3 files of several lengths through the real FlexiblePipeline and
+    seeks near their end, measuring from seek() to the first i2s frame at
+    the new position:
+      scan     no .idx next to the file, the seek table only covers the few
+               seconds played so far and the rest is scanned up to the target
+      indexed  <file>.idx was written before, the first seek loads it
+      in RAM   later seeks into the same file
+    Also reports how long building the whole table takes.
+
+    Usage: seek_bench [seeks]
+*/
+#include "fake_adf.h"
+#include "flexible_pipeline.hpp"
+#include "frame_index.hpp"
+#include "esp_log.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_TIMEOUT_MS        20000
+#define BENCH_PLAY_MS           300     ///< before seeking
+#define TAG_SCAN_BASE           7000
+#define TAG_INDEXED_BASE        7100
+
+/// 128 kbit/s 44.1 kHz stereo MPEG 1 layer III, 1152 samples per frame
+static const unsigned char frame_header[4] = {0xff, 0xfb, 0x90, 0x00};
+#define FRAME_BYTES             417
+#define FRAME_SAMPLES           1152
+#define FRAME_RATE              44100
+
+static const std::string root = CONFIG_PLAYLIST_MOUNT_POINT;
+
+static void write_track(const std::string &path, int minutes)
+{
+    size_t frames = (size_t)minutes * 60 * FRAME_RATE / FRAME_SAMPLES;
+    std::vector<char> frame(FRAME_BYTES, 0);
+    std::copy(frame_header, frame_header + sizeof(frame_header), frame.begin());
+    std::ofstream file(path, std::ios::binary);
+    for (size_t i = 0; i < frames; i++) {
+        file.write(frame.data(), frame.size());
+    }
+}
+
+static void write_playlist(int serial, const std::string &track)
+{
+    std::ofstream(root + "/" + std::to_string(serial) + ".txt") << track << "\n";
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return NAN;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)std::ceil(p * values.size());
+    return values[idx > 0 ? idx - 1 : 0];
+}
+
+static bool wait_first_frame()
+{
+    return fake_adf::wait_i2s([](const FakeI2sStats &st) { return st.first_frame_us >= 0; }, BENCH_TIMEOUT_MS);
+}
+
+/// Start @p tag, play a bit and seek to @p position_ms. returns ms until the first frame
+static double seek_once(FlexiblePipeline &pipeline, int tag, int64_t position_ms)
+{
+    fake_adf::mark();
+    pipeline.start(tag);
+    wait_first_frame();
+    std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PLAY_MS));
+    fake_adf::mark();
+    int64_t t0 = fake_adf::now_us();
+    pipeline.seek(position_ms);
+    if (!wait_first_frame()) {
+        return NAN;
+    }
+    return (fake_adf::i2s_stats().first_frame_us - t0) / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    int seeks = argc > 1 ? atoi(argv[1]) : 10;
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    const int lengths_min[] = {1, 10, 40};
+
+    mkdir(root.c_str(), 0755);
+    printf("%8s %10s %10s\n", "length", "MB", "build [ms]");
+    for (int minutes : lengths_min) {
+        std::string scan = "seek_scan_" + std::to_string(minutes) + ".mp3";
+        std::string indexed = "seek_indexed_" + std::to_string(minutes) + ".mp3";
+        write_track(root + "/" + scan, minutes);
+        write_track(root + "/" + indexed, minutes);
+        remove((root + "/" + scan + ".idx").c_str());
+        write_playlist(TAG_SCAN_BASE + minutes, scan);
+        write_playlist(TAG_INDEXED_BASE + minutes, indexed);
+
+        // A seek past the end scans the whole file, then the table is saved
+        FrameIndex builder(1, true);
+        format_probe_info_t format;
+        format_probe_file((root + "/" + indexed).c_str(), &format);
+        builder.track(root + "/" + indexed, format);
+        int64_t landed_ms;
+        int64_t t0 = fake_adf::now_us();
+        builder.seek(root + "/" + indexed, (int64_t)minutes * 60 * 1000, landed_ms);
+        builder.save();
+        struct stat st;
+        stat((root + "/" + indexed).c_str(), &st);
+        printf("%6d min %10.1f %10.0f\n", minutes, st.st_size / 1e6, (fake_adf::now_us() - t0) / 1000.0);
+    }
+
+    auto *pipeline = new FlexiblePipeline();
+    pipeline->set_resume(false);
+    std::thread([pipeline] { pipeline->loop(); }).detach();
+
+    printf("\nseek to 30 s before the end, ms until the first frame there\n");
+    printf("%8s %10s %10s %12s %12s\n", "length", "scan", "indexed", "in RAM p50", "in RAM p99");
+    for (int minutes : lengths_min) {
+        int64_t target_ms = (int64_t)minutes * 60 * 1000 - 30 * 1000;
+        double scan_ms = seek_once(*pipeline, TAG_SCAN_BASE + minutes, target_ms);
+        double indexed_ms = seek_once(*pipeline, TAG_INDEXED_BASE + minutes, target_ms);
+        std::vector<double> ram_ms;
+        for (int i = 0; i < seeks; i++) {
+            ram_ms.push_back(seek_once(*pipeline, TAG_INDEXED_BASE + minutes, target_ms - i * 1000));
+        }
+        printf("%6d min %10.1f %10.1f %12.1f %12.1f\n", minutes, scan_ms, indexed_ms, percentile(ram_ms, 0.5),
+               percentile(ram_ms, 0.99));
+    }
+    FrameIndex::Stats stats = pipeline->frame_index_stats();
+    printf("frame index: %u seeks, %u tables loaded, %u saved, %.1f MB scanned\n", stats.seeks, stats.loaded,
+           stats.saved, stats.scanned_bytes / 1e6);
+    return 0;
+}
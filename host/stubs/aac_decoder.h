@@ -0,0 +1,36 @@
+/* Host stand-in for aac_decoder.h. The host decoder is a timed fake that
+ * passes PCM through, see host/fake_adf.cpp. */
+#pragma once
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+    bool stack_in_ext;
+} aac_decoder_cfg_t;
+
+#define AAC_DECODER_TASK_STACK_SIZE     (5 * 1024)
+#define AAC_DECODER_TASK_CORE           (0)
+#define AAC_DECODER_TASK_PRIO           (5)
+#define AAC_DECODER_RINGBUFFER_SIZE     (8 * 1024)
+
+#define DEFAULT_AAC_DECODER_CONFIG() {                  \
+    .out_rb_size        = AAC_DECODER_RINGBUFFER_SIZE,  \
+    .task_stack         = AAC_DECODER_TASK_STACK_SIZE,  \
+    .task_core          = AAC_DECODER_TASK_CORE,        \
+    .task_prio          = AAC_DECODER_TASK_PRIO,        \
+    .stack_in_ext       = true,                         \
+}
+
+audio_element_handle_t aac_decoder_init(aac_decoder_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
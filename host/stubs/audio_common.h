@@ -0,0 +1,22 @@
+/* Host stand-in for audio_common.h. */
+#pragma once
+
+#define AUDIO_ELEMENT_TYPE_UNKNOW       (0x01 << 24)
+#define AUDIO_ELEMENT_TYPE_ELEMENT      (0x01 << 25)
+#define AUDIO_ELEMENT_TYPE_PLAYER       (0x01 << 26)
+#define AUDIO_ELEMENT_TYPE_SERVICE      (0x01 << 27)
+#define AUDIO_ELEMENT_TYPE_PERIPH       (0x01 << 28)
+
+typedef enum {
+    AUDIO_STREAM_NONE = 0,
+    AUDIO_STREAM_READER,
+    AUDIO_STREAM_WRITER
+} audio_stream_type_t;
+
+typedef enum {
+    ESP_CODEC_TYPE_UNKNOW = 0,
+    ESP_CODEC_TYPE_RAW,
+    ESP_CODEC_TYPE_WAV,
+    ESP_CODEC_TYPE_MP3,
+    ESP_CODEC_TYPE_AAC,
+} esp_codec_type_t;
@@ -0,0 +1,14 @@
+/* Host stand-in for audio_error.h. */
+#pragma once
+
+#include "esp_log.h"
+
+#define AUDIO_MEM_CHECK(tag, a, action) if (!(a)) {                               \
+        ESP_LOGE(tag, "%s:%d (%s): %s", __FILE__, __LINE__, __FUNCTION__, "Memory exhausted"); \
+        action;                                                                 \
+    }
+
+#define AUDIO_NULL_CHECK(tag, a, action) if (!(a)) {                              \
+        ESP_LOGE(tag, "%s:%d (%s): %s", __FILE__, __LINE__, __FUNCTION__, "Got NULL Pointer"); \
+        action;                                                                 \
+    }
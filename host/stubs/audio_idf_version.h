@@ -0,0 +1,5 @@
+/* Host stand-in for audio_idf_version.h, pinned to the IDF the firmware uses. */
+#pragma once
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(4, 4, 4)
@@ -0,0 +1,13 @@
+/* Host stand-in for audio_mem.h. */
+#pragma once
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define audio_malloc(size)      malloc(size)
+#define audio_calloc(n, size)   calloc(n, size)
+#define audio_realloc(p, size)  realloc(p, size)
+#define audio_free(p)           free(p)
+#define audio_strdup(s)         strdup(s)
+#define mem_assert(x)           assert(x)
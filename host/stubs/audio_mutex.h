@@ -0,0 +1,15 @@
+/* Host stand-in for audio_mutex.h, implemented on std::mutex in fake_adf.cpp. */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *mutex_create(void);
+int mutex_destroy(void *mutex);
+int mutex_lock(void *mutex);
+int mutex_unlock(void *mutex);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,15 @@
+/* Host stand-in for the BSD string functions newlib declares in string.h,
+ * glibc only has them from 2.38 on. Force-included, see CMakeLists.txt. */
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
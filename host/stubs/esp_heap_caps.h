@@ -0,0 +1,15 @@
+/* Host stand-in for esp_heap_caps.h, every capability is plain malloc. */
+#pragma once
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA          (1 << 3)
+#define MALLOC_CAP_8BIT         (1 << 2)
+#define MALLOC_CAP_SPIRAM       (1 << 10)
+#define MALLOC_CAP_INTERNAL     (1 << 11)
+
+#define heap_caps_malloc(size, caps)    malloc(size)
+#define heap_caps_free(p)               free(p)
+/// The host has no heap regions to report
+#define heap_caps_get_free_size(caps)           ((size_t)0)
+#define heap_caps_get_minimum_free_size(caps)   ((size_t)0)
@@ -0,0 +1,6 @@
+/* Host stand-in for esp_peripherals.h. */
+#pragma once
+
+#include "esp_err.h"
+#include "audio_common.h"
+#include "audio_event_iface.h"
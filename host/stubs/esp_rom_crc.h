@@ -0,0 +1,25 @@
+/* Host stand-in for esp_rom_crc.h, the ROM CRC-32 in C.
+   esp_rom_crc32_le(0, buf, len) is the CRC-32 of zlib and of Python's
+   zlib.crc32(), a running CRC is passed back in as is. */
+#pragma once
+
+#include <stdint.h>
+
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,5 @@
+/* Host stand-in for esp_vfs.h, paths are plain host paths. */
+#pragma once
+
+/// Longer than on the device, the host SD card sits in the build directory
+#define ESP_VFS_PATH_MAX 128
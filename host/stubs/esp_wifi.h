@@ -0,0 +1,2 @@
+/* Host stand-in: nothing from esp_wifi.h is used by the host build. */
+#pragma once
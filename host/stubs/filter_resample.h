@@ -0,0 +1,63 @@
+/* Host stand-in for filter_resample.h. The host resampler is a timed fake
+ * that scales the byte count, see host/fake_adf.cpp. */
+#pragma once
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    RESAMPLE_DECODE_MODE = 0,
+    RESAMPLE_ENCODE_MODE = 1,
+    RESAMPLE_UNCROSS_MODE = 2,
+} resample_mode_t;
+
+typedef enum {
+    ESP_RESAMPLE_TYPE_AUTO = -1,
+    ESP_RESAMPLE_TYPE_DECIMATE = 0,
+    ESP_RESAMPLE_TYPE_INTERP = 1,
+    ESP_RESAMPLE_TYPE_RESAMPLE = 2,
+    ESP_RESAMPLE_TYPE_BYPASS = 3,
+} esp_resample_type_t;
+
+typedef enum {
+    ESP_RSP_PREFER_TYPE_NONE = 0,
+    ESP_RSP_PREFER_TYPE_SPEED = 1,
+    ESP_RSP_PREFER_TYPE_MEMORY = 2,
+} esp_rsp_prefer_type_t;
+
+typedef struct {
+    int src_rate;
+    int src_ch;
+    int dest_rate;
+    int dest_bits;
+    int dest_ch;
+    int src_bits;
+    resample_mode_t mode;
+    int max_indata_bytes;
+    int out_len_bytes;
+    esp_resample_type_t type;
+    int complexity;
+    int down_ch_idx;
+    esp_rsp_prefer_type_t prefer_flag;
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+    bool stack_in_ext;
+} rsp_filter_cfg_t;
+
+#define RSP_FILTER_BUFFER_BYTE              (512)
+#define RSP_FILTER_TASK_STACK               (4 * 1024)
+#define RSP_FILTER_TASK_CORE                (0)
+#define RSP_FILTER_TASK_PRIO                (5)
+#define RSP_FILTER_RINGBUFFER_SIZE          (2 * 1024)
+
+audio_element_handle_t rsp_filter_init(rsp_filter_cfg_t *config);
+esp_err_t rsp_filter_set_src_info(audio_element_handle_t self, int src_rate, int src_ch);
+
+#ifdef __cplusplus
+}
+#endif
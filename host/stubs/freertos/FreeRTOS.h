@@ -0,0 +1,37 @@
+/* Host stand-in for FreeRTOS.h. One tick is one millisecond on the host. */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *QueueHandle_t;
+
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS  ((TickType_t)1)
+#define portTICK_RATE_MS    portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+
+/// Spinlocks are one process-wide mutex on the host, see fake_adf.cpp
+typedef struct {
+    int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+#ifdef __cplusplus
+}
+#endif
+
+#define portENTER_CRITICAL(mux)         vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)          vPortExitCritical(mux)
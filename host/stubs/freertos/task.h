@@ -0,0 +1,23 @@
+/* Host stand-in for freertos/task.h. Tasks are detached threads, see fake_adf.cpp. */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define tskNO_AFFINITY      0x7FFFFFFF
+
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core);
+/// Only for the calling task (NULL), ends its thread
+void vTaskDelete(TaskHandle_t task);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,2 @@
+/* Host stand-in: software timers are not used by the host build. */
+#pragma once
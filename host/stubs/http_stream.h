@@ -0,0 +1,2 @@
+/* Host stand-in: nothing from http_stream.h is used by the host build. */
+#pragma once
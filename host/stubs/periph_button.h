@@ -0,0 +1,2 @@
+/* Host stand-in: nothing from periph_button.h is used by the host build. */
+#pragma once
@@ -0,0 +1,17 @@
+/* Host stand-in for the esp-adf ringbuf.h. The fake pipeline hands chunks
+ * from element to element directly, its rings only report a fill level, see
+ * fake_adf.cpp. */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ringbuf *ringbuf_handle_t;
+
+int rb_bytes_filled(ringbuf_handle_t rb);
+int rb_get_size(ringbuf_handle_t rb);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,48 @@
+/* Host stand-in for the generated sdkconfig.h. Only the options the host
+ * build actually reads are listed here. */
+#pragma once
+
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_PLAYLIST_READ_AHEAD 1
+#define CONFIG_PLAYLIST_READ_AHEAD_KB 128
+#define CONFIG_PLAYLIST_READ_AHEAD_BLOCK_SIZE 16384
+#define CONFIG_PLAYLIST_READ_AHEAD_REFILL_PERCENT 50
+#define CONFIG_FLEXIBLE_PIPELINE_GAPLESS 1
+#define CONFIG_FLEXIBLE_PIPELINE_RESAMPLE_BYPASS 1
+#define CONFIG_PLAYER_COMMAND_QUEUE_LEN 16
+#define CONFIG_FRAME_INDEX_SAVE 1
+#define CONFIG_RESUME_POSITION 1
+#define CONFIG_RESUME_SAVE_INTERVAL_S 60
+#define CONFIG_RESUME_TAGS 32
+#define CONFIG_TAG_CACHE_ENTRIES 8
+#define CONFIG_TAG_CACHE_HEAD_SIZE 16384
+#define CONFIG_PLAYLIST_INDEX 1
+#define CONFIG_PIPELINE_HEALTH_SAMPLE_MS 20
+#define CONFIG_PIPELINE_HEALTH_DUMP_S 60
+#define CONFIG_TRACE_RING 1
+#define CONFIG_TRACE_RING_RECORDS 1024
+#define CONFIG_IO_ARBITER 1
+#define CONFIG_IO_ARBITER_LOW_PERCENT 25
+#define CONFIG_IO_ARBITER_HIGH_PERCENT 75
+#define CONFIG_IO_ARBITER_MAX_HOLD_MS 1000
+#define CONFIG_IO_ARBITER_IDLE_MS 300
+#define CONFIG_FILE_SERVER_UPLOAD_BUFFER_KB 16
+#define CONFIG_FILE_SERVER_DOWNLOAD_BUFFER_KB 16
+#define CONFIG_FILE_SERVER_DOWNLOAD_BUFFERS 2
+#define CONFIG_FILE_SERVER_TRANSFER_BUFFERS 4
+#define CONFIG_FILE_SERVER_TRANSFER_BUFFER_KB 8
+#define CONFIG_FILE_SERVER_TRANSFER_WAIT_MS 2000
+#define CONFIG_FILE_SERVER_LIST_CACHE_DIRS 4
+#define CONFIG_FILE_SERVER_LIST_MAX_AGE_S 300
+#define CONFIG_FILE_SERVER_TASK_CORE 1
+#define CONFIG_HTTPD_MAX_URI_LEN 512
+#define CONFIG_HTTPD_MAX_REQ_HDR_LEN 512
+#define CONFIG_SPIFFS_OBJ_NAME_LEN 32
+#define CONFIG_RFID_CONFIRM_FRAMES 2
+#define CONFIG_RFID_CONFIRM_MS 0
+#define CONFIG_RFID_LOST_MS 200
+#define CONFIG_RFID_GRACE_MS 500
+
+#ifndef CONFIG_PLAYLIST_MOUNT_POINT
+#define CONFIG_PLAYLIST_MOUNT_POINT "/sdcard"
+#endif
@@ -0,0 +1,36 @@
+/* Host stand-in for wav_decoder.h. The host decoder is a timed fake that
+ * passes PCM through, see host/fake_adf.cpp. */
+#pragma once
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_core;
+    int task_prio;
+    bool stack_in_ext;
+} wav_decoder_cfg_t;
+
+#define WAV_DECODER_TASK_STACK_SIZE     (5 * 1024)
+#define WAV_DECODER_TASK_CORE           (0)
+#define WAV_DECODER_TASK_PRIO           (5)
+#define WAV_DECODER_RINGBUFFER_SIZE     (8 * 1024)
+
+#define DEFAULT_WAV_DECODER_CONFIG() {                  \
+    .out_rb_size        = WAV_DECODER_RINGBUFFER_SIZE,  \
+    .task_stack         = WAV_DECODER_TASK_STACK_SIZE,  \
+    .task_core          = WAV_DECODER_TASK_CORE,        \
+    .task_prio          = WAV_DECODER_TASK_PRIO,        \
+    .stack_in_ext       = true,                         \
+}
+
+audio_element_handle_t wav_decoder_init(wav_decoder_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
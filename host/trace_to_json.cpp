@@ -0,0 +1,279 @@
+/*  Turns a trace ring dump into a Chrome trace / Perfetto timeline.
+
+    Reads TRACE lines (see trace_ring.h) from a serial log, the /trace page
+    of the file server or pipeline_bench, anything before TRACE on a line
+    and lines without it are ignored. Writes the JSON trace event format,
+    open it in ui.perfetto.dev or chrome://tracing. One track each for the
+    RFID tags, the command channel, the player loop, the start latency and
+    every pipeline element; records that carry a duration become slices
+    ending at their timestamp, element states become slices from one state
+    report to the next.
+
+    Usage: trace_to_json [-o trace.json] [dump ...]   (stdin without dumps)
+*/
+#include "trace_ring.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define TRACE_MARKER    "TRACE"
+
+enum Track {
+    TRACK_RFID = 1,
+    TRACK_COMMANDS,
+    TRACK_PLAYER,
+    TRACK_LATENCY,
+    TRACK_ELEMENTS = 10,
+};
+
+/// ElementPool::Element order
+static const char *element_names[] = {
+    "file_reader", "mp3_decoder", "aac_decoder", "wav_decoder", "filter", "i2s_writer",
+};
+/// PlayerCommand::Type order
+static const char *command_names[] = {
+    "start", "pause", "resume", "stop", "next", "prev", "seek",
+};
+static const char *playlist_sources[] = {
+    "tag cache", "playlist index", "playlist text",
+};
+/// audio_element_status_t order
+static const char *status_names[] = {
+    "none", "error open", "error input", "error process", "error output", "error close", "error timeout",
+    "error unknown", "input done", "input buffering", "output done", "output buffering", "running",
+    "paused", "stopped", "finished", "mounted", "unmounted",
+};
+/// AEL_STATUS_STATE_RUNNING .. AEL_STATUS_STATE_FINISHED
+#define STATUS_STATE_FIRST  12
+#define STATUS_STATE_LAST   15
+
+#define NAME(names, i)  ((size_t)(i) < sizeof(names) / sizeof(names[0]) ? names[i] : "?")
+
+struct Record {
+    uint32_t seq;
+    trace_record_t r;
+};
+
+static std::vector<Record> read_trace(std::istream &input)
+{
+    std::vector<Record> records;
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t at = line.find(TRACE_MARKER " ");
+        if (at == std::string::npos) {
+            continue;
+        }
+        std::istringstream in(line.substr(at + strlen(TRACE_MARKER)));
+        unsigned long long seq, event, arg8, arg16, arg;
+        long long time_us;
+        if (!(in >> seq >> time_us >> event >> arg8 >> arg16 >> arg)) {
+            continue;
+        }
+        Record record = {};
+        record.seq = (uint32_t)seq;
+        record.r.time_us = time_us;
+        record.r.event = (uint8_t)event;
+        record.r.arg8 = (uint8_t)arg8;
+        record.r.arg16 = (uint16_t)arg16;
+        record.r.arg = (uint32_t)arg;
+        records.push_back(record);
+    }
+    return records;
+}
+
+class JsonTrace
+{
+  public:
+    explicit JsonTrace(FILE *out) : out(out) {
+        fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (auto track : {std::make_pair(TRACK_RFID, "rfid"), std::make_pair(TRACK_COMMANDS, "commands"),
+                           std::make_pair(TRACK_PLAYER, "player loop"), std::make_pair(TRACK_LATENCY, "start latency")}) {
+            thread_name(track.first, track.second);
+        }
+        for (size_t i = 0; i < sizeof(element_names) / sizeof(element_names[0]); i++) {
+            thread_name(TRACK_ELEMENTS + i, element_names[i]);
+        }
+    }
+    ~JsonTrace() {
+        fprintf(out, "\n]}\n");
+    }
+
+    void slice(int tid, const std::string &name, int64_t start_us, int64_t end_us, const std::string &args = "") {
+        begin();
+        fprintf(out, "{\"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"name\": \"%s\", \"ts\": %lld, \"dur\": %lld%s}",
+                tid, name.c_str(), (long long)start_us, (long long)(end_us - start_us), format(args).c_str());
+    }
+    void instant(int tid, const std::string &name, int64_t time_us, const std::string &args = "") {
+        begin();
+        fprintf(out, "{\"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %d, \"name\": \"%s\", \"ts\": %lld%s}",
+                tid, name.c_str(), (long long)time_us, format(args).c_str());
+    }
+
+  private:
+    void thread_name(int tid, const char *name) {
+        begin();
+        fprintf(out, "{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+                tid, name);
+        begin();
+        fprintf(out, "{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"name\": \"thread_sort_index\", \"args\": {\"sort_index\": %d}}",
+                tid, tid);
+    }
+    void begin() {
+        fprintf(out, first ? "" : ",\n");
+        first = false;
+    }
+    static std::string format(const std::string &args) {
+        return args.empty() ? "" : ", \"args\": {" + args + "}";
+    }
+
+    FILE *out;
+    bool first = true;
+};
+
+/// An element state or a present tag, shown up to the next one
+struct Open {
+    std::string name;
+    int64_t since_us;
+    std::string args;
+};
+
+static void convert(const std::vector<Record> &records, JsonTrace &json)
+{
+    std::map<int, Open> open;
+    int64_t last_us = 0;
+    char args[96];
+    for (const Record &record : records) {
+        const trace_record_t &r = record.r;
+        int64_t t = r.time_us;
+        last_us = t;
+        switch (r.event) {
+        case TRACE_TAG_NEW: {
+            uint64_t serial = (uint64_t)r.arg16 << 32 | r.arg;
+            snprintf(args, sizeof(args), "\"serial\": %" PRIu64, serial);
+            json.instant(TRACK_RFID, "new tag", t, args);
+            open[TRACK_RFID] = {"tag " + std::to_string(serial), t, args};
+            break;
+        }
+        case TRACE_TAG_LOST: {
+            uint64_t serial = (uint64_t)r.arg16 << 32 | r.arg;
+            auto tag = open.find(TRACK_RFID);
+            if (tag != open.end()) {
+                json.slice(TRACK_RFID, tag->second.name, tag->second.since_us, t, tag->second.args);
+                open.erase(tag);
+            }
+            snprintf(args, sizeof(args), "\"serial\": %" PRIu64, serial);
+            json.instant(TRACK_RFID, "tag lost", t, args);
+            break;
+        }
+        case TRACE_COMMAND_SENT:
+            snprintf(args, sizeof(args), "\"tag\": %u", (unsigned)r.arg);
+            json.instant(TRACK_COMMANDS, std::string("send ") + NAME(command_names, r.arg8), t,
+                         r.arg8 == 0 ? args : "");
+            break;
+        case TRACE_COMMAND_DISPATCHED:
+            json.slice(TRACK_COMMANDS, std::string("queued ") + NAME(command_names, r.arg8), t - r.arg, t);
+            break;
+        case TRACE_PLAYLIST_LOAD:
+            snprintf(args, sizeof(args), "\"source\": \"%s\", \"tracks\": %u", NAME(playlist_sources, r.arg8), r.arg16);
+            json.slice(TRACK_PLAYER, "playlist load", t - r.arg, t, args);
+            break;
+        case TRACE_PIPELINE_LINK:
+            snprintf(args, sizeof(args), "\"decoder\": \"%s\", \"resampler\": %s", NAME(element_names, r.arg8),
+                     r.arg16 ? "true" : "false");
+            json.slice(TRACK_PLAYER, "link", t - r.arg, t, args);
+            break;
+        case TRACE_PIPELINE_RUN:
+            json.slice(TRACK_PLAYER, "run", t - r.arg, t);
+            break;
+        case TRACE_PIPELINE_STOP:
+            json.slice(TRACK_PLAYER, "stop", t - r.arg, t);
+            break;
+        case TRACE_ELEMENT_STATUS: {
+            int tid = TRACK_ELEMENTS + r.arg8;
+            const char *status = NAME(status_names, r.arg16);
+            if (r.arg16 < STATUS_STATE_FIRST || r.arg16 > STATUS_STATE_LAST) {
+                json.instant(tid, status, t);
+                break;
+            }
+            auto state = open.find(tid);
+            if (state != open.end()) {
+                json.slice(tid, state->second.name, state->second.since_us, t);
+            }
+            open[tid] = {status, t, ""};
+            break;
+        }
+        case TRACE_MUSIC_INFO:
+            json.instant(TRACK_ELEMENTS + r.arg8, "music info", t);
+            break;
+        case TRACE_FIRST_FRAME:
+            json.slice(TRACK_LATENCY, "start to first frame", t - r.arg, t);
+            break;
+        case TRACE_TRACK_CHAINED:
+            snprintf(args, sizeof(args), "\"index\": %u", r.arg16);
+            json.instant(TRACK_PLAYER, "track chained", t, args);
+            break;
+        default:
+            fprintf(stderr, "record %u: unknown event %u\n", record.seq, r.event);
+            break;
+        }
+    }
+    // Whatever is still open lasts to the end of the dump
+    for (auto &state : open) {
+        json.slice(state.first, state.second.name, state.second.since_us, last_us, state.second.args);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL;
+    std::vector<const char *> dumps;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            dumps.push_back(argv[i]);
+        }
+    }
+    std::vector<Record> records;
+    if (dumps.empty()) {
+        records = read_trace(std::cin);
+    }
+    for (const char *path : dumps) {
+        std::ifstream file(path);
+        if (!file) {
+            fprintf(stderr, "%s: cannot open\n", path);
+            return 1;
+        }
+        std::vector<Record> more = read_trace(file);
+        records.insert(records.end(), more.begin(), more.end());
+    }
+    uint32_t missing = 0;
+    for (size_t i = 1; i < records.size(); i++) {
+        if (records[i].seq > records[i - 1].seq + 1) {
+            missing += records[i].seq - records[i - 1].seq - 1;
+        }
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "%s: cannot create\n", output);
+        return 1;
+    }
+    {
+        JsonTrace json(out);
+        convert(records, json);
+    }
+    if (output) {
+        fclose(out);
+    }
+    fprintf(stderr, "%zu records, %u overwritten between reads\n", records.size(), missing);
+    return 0;
+}
@@ -9,6 +9,7 @@
 
 extern "C" {
 #include <string.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
@@ -29,8 +30,9 @@ extern "C" {
 
 #include "audio_idf_version.h"
 #include "rfid_reader.h"
-#include "file_server.h"
-#include "protocol_common.h"
+#include "trace_ring.h"
+#include "io_arbiter.h"
+#include "file_service.h"
 
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0))
 #include "esp_netif.h"
@@ -62,6 +64,68 @@ esp_pthread_cfg_t create_config(const char *name, int core_id, int stack, int pr
     return cfg;
 }
 
+/// Turns reader events into player commands
+struct TagDispatcher
+{
+    FlexiblePipeline &pipeline;
+    uint64_t old_serial = 0;
+    /// Starts the file service instead of playing, 0 none
+    uint64_t admin_serial = 0;
+
+    static void on_rfid_event(enum rdm6300_sense_result result, uint64_t serial, void *ctx)
+    {
+        auto self = static_cast<TagDispatcher *>(ctx);
+        if(self->admin_serial != 0 && serial == self->admin_serial)
+        {
+            if(result == RDM6300_SENSE_NEW_TAG)
+            {
+                ESP_LOGI(TAG, "ADMIN TAG: %" PRIu64, serial);
+                file_service_request();
+            }
+            return;
+        }
+        if(result == RDM6300_SENSE_NEW_TAG)
+        {
+            ESP_LOGI(TAG, "NEW TAG: %" PRIu64, serial);
+            trace_ring_record(TRACE_TAG_NEW, 0, serial >> 32, (uint32_t)serial);
+            if (self->old_serial != serial) {
+                // Stops the current track, a swap still pending is dropped
+                self->pipeline.start(serial);
+                self->old_serial = serial;
+            } else{
+                self->pipeline.resume();
+            }
+        }
+        else if(result == RDM6300_SENSE_TAG_LOST)
+        {
+            ESP_LOGI(TAG, "TAG LOST: %" PRIu64, serial);
+            trace_ring_record(TRACE_TAG_LOST, 0, serial >> 32, (uint32_t)serial);
+            self->pipeline.pause();
+        }
+    }
+};
+
+#ifdef CONFIG_FILE_SERVICE
+/// Logs how the player fared while the file service was down and up
+struct ServiceReport
+{
+    FlexiblePipeline &pipeline;
+    PipelineHealth::Snapshot last{};
+
+    static void on_change(bool up, void *ctx)
+    {
+        auto self = static_cast<ServiceReport *>(ctx);
+        PipelineHealth::Snapshot now = self->pipeline.health();
+        ESP_LOGI(TAG, "Service %s for %lld s: %u underruns, %u tracks, internal RAM %u KB free, %u KB at least",
+                 up ? "was down" : "was up", (long long)(now.uptime_us - self->last.uptime_us) / 1000000,
+                 (unsigned)(now.counters[PipelineHealth::UNDERRUNS] - self->last.counters[PipelineHealth::UNDERRUNS]),
+                 (unsigned)(now.counters[PipelineHealth::TRACKS] - self->last.counters[PipelineHealth::TRACKS]),
+                 (unsigned)(now.internal_free / 1024), (unsigned)(now.internal_min_free / 1024));
+        self->last = now;
+    }
+};
+#endif
+
 esp_err_t sdcard_init(esp_periph_set_handle_t set, periph_sdcard_mode_t mode)
 {
 
@@ -96,7 +160,11 @@ extern "C" void app_main(void)
     esp_pthread_set_cfg(&cfg);
 
     esp_log_level_set("*", ESP_LOG_INFO);
-    esp_log_level_set("AUDIO_ELEMENT", ESP_LOG_DEBUG);
+    trace_ring_init(CONFIG_TRACE_RING_RECORDS);
+#ifdef CONFIG_IO_ARBITER
+    io_arbiter_cfg_t arbiter_cfg = IO_ARBITER_CFG_DEFAULT();
+    io_arbiter_init(&arbiter_cfg);
+#endif
 
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES) {
@@ -134,42 +202,43 @@ extern "C" void app_main(void)
     rdm6300_handle_t rdm6300_handle = rdm6300_init(13);
     FlexiblePipeline flexible_pipeline{};
     std::thread any_core([&](){flexible_pipeline.loop();});
-    //std::thread wifi([&]{
-
-    //    esp_event_loop_create_default();
-    //    ESP_ERROR_CHECK(example_connect());
-    //    while(1)
-    //    {   
-    //        vTaskDelay(1000 / portTICK_PERIOD_MS);
-    //    }
-    //});
-
-    //std::thread file_server([&]{
-    //    example_start_file_server("/sdcard");});
+    TagDispatcher dispatcher{flexible_pipeline};
+#ifdef CONFIG_FILE_SERVICE
+    // Wi-Fi and the file server run on the other core, only on demand
+    ServiceReport service_report{flexible_pipeline};
+    file_service_cfg_t service_cfg = FILE_SERVICE_CFG_DEFAULT();
+    service_cfg.on_change = &ServiceReport::on_change;
+    service_cfg.ctx = &service_report;
+    dispatcher.admin_serial = strtoull(CONFIG_FILE_SERVICE_TAG, NULL, 10);
+#ifdef CONFIG_FILE_SERVICE_ALWAYS_ON
+    service_cfg.idle_s = 0;
+#endif
+    ESP_ERROR_CHECK(file_service_init(&service_cfg));
+#ifdef CONFIG_FILE_SERVICE_ALWAYS_ON
+    file_service_request();
+#else
+    if (dispatcher.admin_serial == 0) {
+        ESP_LOGW(TAG, "No admin tag configured, Wi-Fi and the file server stay off");
+    }
+#endif
+#endif
     ESP_LOGI(TAG, "LOOP");
-    uint64_t old_serial = 0;
+#ifdef CONFIG_RFID_EVENT_DRIVEN
+    ESP_ERROR_CHECK(rdm6300_start_task(&rdm6300_handle, &TagDispatcher::on_rfid_event, &dispatcher));
+    while(1)
+    {
+        // Everything happens on the RFID task and the player loop
+        vTaskDelay(portMAX_DELAY);
+    }
+#else
     while(1)
     {
         uint64_t serial = 0;
         enum rdm6300_sense_result sense_result = rdm630_sense(&rdm6300_handle, &serial);
-        if(sense_result == RDM6300_SENSE_NEW_TAG)
-        {
-            ESP_LOGI(TAG, "NEW TAG: %" PRIu64, serial);
-            if (old_serial != serial) {
-                flexible_pipeline.stop();
-                flexible_pipeline.start(std::to_string(serial));
-                old_serial = serial;
-            } else{
-                flexible_pipeline.resume();
-            }
-        }
-        else if(sense_result == RDM6300_SENSE_TAG_LOST)
-        {
-            ESP_LOGI(TAG, "TAG LOST: %" PRIu64, serial);
-            flexible_pipeline.pause();
-        }
+        TagDispatcher::on_rfid_event(sense_result, serial, &dispatcher);
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+#endif
 
     esp_periph_set_stop_all(set);
     esp_periph_set_destroy(set);